@@ -0,0 +1,305 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bit-plane transposition of logic samples.
+ *
+ * Logic samples are stored interleaved, 'unitsize' bytes per sample, so a
+ * probe's samples are spread out over every sample's bytes. Transposed
+ * into bit planes, every probe's samples are consecutive bits, and a
+ * probe which hardly toggles is a long run of identical bytes, which a
+ * general purpose compressor handles far better. A probe which doesn't
+ * toggle at all isn't stored.
+ *
+ * Encoded format, all little endian:
+ *   - number of samples (8 bytes)
+ *   - a type byte for each of the unitsize * 8 probes, see PLANE_*
+ *   - the bits of every PLANE_BITS probe, one per sample, the first sample
+ *     in the least significant bit, padded to whole bytes
+ */
+
+#include <string.h>
+#include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* A plane which is all 0, all 1, or stored. */
+#define PLANE_ZEROS 0
+#define PLANE_ONES  1
+#define PLANE_BITS  2
+
+#define HEADER_SIZE 8
+
+/*
+ * Transpose an 8x8 bit matrix, with byte r as row r and bit c as column
+ * c: byte k of the result holds bit k of every byte of x. The transpose
+ * is its own inverse.
+ */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+
+	return x;
+}
+
+/**
+ * Get the size of the buffer sr_bitplane_encode() may need.
+ *
+ * @param num_samples The number of samples.
+ * @param unitsize The number of bytes per sample.
+ *
+ * @return The size of the buffer.
+ */
+SR_PRIV uint64_t sr_bitplane_bound(uint64_t num_samples, int unitsize)
+{
+	return HEADER_SIZE + unitsize * 8 * (1 + (num_samples + 7) / 8);
+}
+
+/*
+ * Transpose one byte of every sample into eight planes of plane_len
+ * bytes each, starting at 'planes'.
+ */
+static void encode_lane(const uint8_t *samples, uint64_t num_samples,
+			int unitsize, int lane, uint8_t *planes,
+			uint64_t plane_len)
+{
+	const uint8_t *s;
+	uint64_t x, i, g;
+	int j, k;
+#ifdef __SSE2__
+	uint8_t gather[16];
+	__m128i v;
+	int mask;
+#endif
+
+	s = samples + lane;
+	g = 0;
+
+#ifdef __SSE2__
+	/* 16 samples at a time: each movemask yields one probe's bits. */
+	for (; g + 2 <= num_samples / 8; g += 2) {
+		if (unitsize == 1) {
+			v = _mm_loadu_si128((const __m128i *)s);
+		} else {
+			for (j = 0; j < 16; j++)
+				gather[j] = s[j * unitsize];
+			v = _mm_loadu_si128((const __m128i *)gather);
+		}
+		for (k = 7; k >= 0; k--) {
+			mask = _mm_movemask_epi8(v);
+			planes[k * plane_len + g] = mask & 0xff;
+			planes[k * plane_len + g + 1] = mask >> 8;
+			v = _mm_slli_epi64(v, 1);
+		}
+		s += 16 * unitsize;
+	}
+#endif
+
+	/* 8 samples at a time. */
+	for (; g < num_samples / 8; g++) {
+		x = 0;
+		for (j = 7; j >= 0; j--)
+			x = (x << 8) | s[j * unitsize];
+		x = transpose8(x);
+		for (k = 0; k < 8; k++, x >>= 8)
+			planes[k * plane_len + g] = x & 0xff;
+		s += 8 * unitsize;
+	}
+
+	/* The rest, padded with zeros. */
+	if (num_samples % 8) {
+		x = 0;
+		for (i = num_samples % 8; i > 0; i--)
+			x = (x << 8) | s[(i - 1) * unitsize];
+		x = transpose8(x);
+		for (k = 0; k < 8; k++, x >>= 8)
+			planes[k * plane_len + g] = x & 0xff;
+	}
+}
+
+static int plane_type(const uint8_t *plane, uint64_t num_samples)
+{
+	uint64_t i, full;
+	uint8_t last;
+
+	full = num_samples / 8;
+	last = (1 << (num_samples % 8)) - 1;
+
+	if (plane[0] == 0) {
+		for (i = 1; i < full; i++)
+			if (plane[i])
+				return PLANE_BITS;
+		if (last && plane[full])
+			return PLANE_BITS;
+		return PLANE_ZEROS;
+	}
+
+	if (plane[0] == 0xff || full == 0) {
+		for (i = 0; i < full; i++)
+			if (plane[i] != 0xff)
+				return PLANE_BITS;
+		if (last && plane[full] != last)
+			return PLANE_BITS;
+		return PLANE_ONES;
+	}
+
+	return PLANE_BITS;
+}
+
+/**
+ * Transpose logic samples into bit planes.
+ *
+ * @param samples The samples. Must not be NULL.
+ * @param num_samples The number of samples.
+ * @param unitsize The number of bytes per sample. Must be >= 1.
+ * @param out The buffer for the encoded planes, which must be at least
+ *            sr_bitplane_bound() bytes. Must not be NULL.
+ * @param out_len Pointer to a variable which will hold the length of the
+ *                encoded planes. Must not be NULL.
+ */
+SR_PRIV void sr_bitplane_encode(const uint8_t *samples, uint64_t num_samples,
+				int unitsize, uint8_t *out, uint64_t *out_len)
+{
+	uint8_t *types, *planes, *dst;
+	uint64_t plane_len, n;
+	int num_planes, lane, p, i;
+
+	num_planes = unitsize * 8;
+	plane_len = (num_samples + 7) / 8;
+
+	for (i = 0, n = num_samples; i < HEADER_SIZE; i++, n >>= 8)
+		out[i] = n & 0xff;
+	types = out + HEADER_SIZE;
+
+	/* Transpose all planes, then drop the constant ones. */
+	planes = types + num_planes;
+	for (lane = 0; lane < unitsize; lane++)
+		encode_lane(samples, num_samples, unitsize, lane,
+			    planes + lane * 8 * plane_len, plane_len);
+
+	dst = planes;
+	for (p = 0; p < num_planes; p++) {
+		if (num_samples == 0)
+			types[p] = PLANE_ZEROS;
+		else
+			types[p] = plane_type(planes + p * plane_len,
+					      num_samples);
+		if (types[p] != PLANE_BITS)
+			continue;
+		if (dst != planes + p * plane_len)
+			memmove(dst, planes + p * plane_len, plane_len);
+		dst += plane_len;
+	}
+
+	*out_len = dst - out;
+}
+
+/**
+ * Transpose bit planes back into logic samples.
+ *
+ * @param in The encoded planes, from sr_bitplane_encode(). Must not be
+ *           NULL.
+ * @param in_len The length of the encoded planes.
+ * @param unitsize The number of bytes per sample. Must be >= 1.
+ * @param samples The buffer for the samples. Must not be NULL.
+ * @param max_samples The number of samples the buffer has room for.
+ * @param num_samples Pointer to a variable which will hold the number of
+ *                    samples. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR if the encoded planes are corrupt or
+ *         don't fit into the buffer.
+ */
+SR_PRIV int sr_bitplane_decode(const uint8_t *in, uint64_t in_len,
+			       int unitsize, uint8_t *samples,
+			       uint64_t max_samples, uint64_t *num_samples)
+{
+	static const uint8_t fill[2] = { 0x00, 0xff };
+	const uint8_t *types, *src, *plane[SR_MAX_NUM_PROBES];
+	uint64_t plane_len, n, x, g, stride[SR_MAX_NUM_PROBES];
+	uint8_t *s;
+	int num_planes, lane, p, i, j, k;
+
+	num_planes = unitsize * 8;
+	if (num_planes > SR_MAX_NUM_PROBES || in_len < HEADER_SIZE
+	    + (uint64_t)num_planes) {
+		sr_err("bitplane: %s: invalid planes", __func__);
+		return SR_ERR;
+	}
+
+	for (i = HEADER_SIZE - 1, n = 0; i >= 0; i--)
+		n = (n << 8) | in[i];
+	if (n > max_samples) {
+		sr_err("bitplane: %s: %" PRIu64 " samples don't fit into %"
+		       PRIu64, __func__, n, max_samples);
+		return SR_ERR;
+	}
+	plane_len = (n + 7) / 8;
+
+	/* Constant planes read the same byte over and over. */
+	types = in + HEADER_SIZE;
+	src = types + num_planes;
+	for (p = 0; p < num_planes; p++) {
+		if (types[p] == PLANE_BITS) {
+			if (src + plane_len > in + in_len) {
+				sr_err("bitplane: %s: planes truncated",
+				       __func__);
+				return SR_ERR;
+			}
+			plane[p] = src;
+			stride[p] = 1;
+			src += plane_len;
+		} else if (types[p] == PLANE_ZEROS || types[p] == PLANE_ONES) {
+			plane[p] = &fill[types[p]];
+			stride[p] = 0;
+		} else {
+			sr_err("bitplane: %s: invalid plane type %d",
+			       __func__, types[p]);
+			return SR_ERR;
+		}
+	}
+
+	for (lane = 0; lane < unitsize; lane++) {
+		s = samples + lane;
+		for (g = 0; g < plane_len; g++) {
+			x = 0;
+			for (k = 7; k >= 0; k--) {
+				p = lane * 8 + k;
+				x = (x << 8) | plane[p][g * stride[p]];
+			}
+			x = transpose8(x);
+			for (j = 0; j < 8 && g * 8 + j < n; j++, x >>= 8)
+				s[j * unitsize] = x & 0xff;
+			s += 8 * unitsize;
+		}
+	}
+
+	*num_samples = n;
+
+	return SR_OK;
+}
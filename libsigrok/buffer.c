@@ -0,0 +1,248 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Buffers are handed out by a driver's pool, and go back to it when the
+ * last reference is dropped, which may happen in another thread (e.g. a
+ * consumer thread of a threaded session). The pool itself is freed once
+ * it has been destroyed by its owner and all of its buffers are back.
+ */
+struct sr_buffer_pool {
+	GStaticMutex mutex;
+	uint64_t bufsize;
+	unsigned int max_free;
+	GSList *free_list;
+	unsigned int num_free;
+	unsigned int outstanding;
+	gboolean destroyed;
+};
+
+static void pool_free(struct sr_buffer_pool *pool)
+{
+	GSList *l;
+
+	for (l = pool->free_list; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(pool->free_list);
+	g_static_mutex_free(&pool->mutex);
+	g_free(pool);
+}
+
+/**
+ * Create a new pool of sample buffers.
+ *
+ * @param bufsize The size of each buffer in the pool, in bytes.
+ *                Must be larger than 0.
+ * @param max_free The maximum number of released buffers the pool keeps
+ *                 around for reuse. Buffers released beyond that are freed.
+ * @param pool Pointer to a variable which will hold the newly created
+ *             pool. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_pool_new(uint64_t bufsize, unsigned int max_free,
+			      struct sr_buffer_pool **pool)
+{
+	if (bufsize == 0) {
+		sr_err("buffer: %s: bufsize was 0", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!pool) {
+		sr_err("buffer: %s: pool was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*pool = g_try_malloc0(sizeof(struct sr_buffer_pool)))) {
+		sr_err("buffer: %s: pool malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	g_static_mutex_init(&(*pool)->mutex);
+	(*pool)->bufsize = bufsize;
+	(*pool)->max_free = max_free;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a pool of sample buffers.
+ *
+ * Buffers which are still referenced (e.g. by a frontend which kept a
+ * packet's data) stay valid; the pool's memory is released when the last
+ * of them is released.
+ *
+ * @param pool The pool to destroy. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_pool_destroy(struct sr_buffer_pool *pool)
+{
+	gboolean idle;
+
+	if (!pool) {
+		sr_err("buffer: %s: pool was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_static_mutex_lock(&pool->mutex);
+	pool->destroyed = TRUE;
+	idle = (pool->outstanding == 0);
+	g_static_mutex_unlock(&pool->mutex);
+
+	if (idle)
+		pool_free(pool);
+
+	return SR_OK;
+}
+
+/**
+ * Get a buffer from a pool.
+ *
+ * The buffer is returned with a reference count of 1, owned by the
+ * caller. Its contents are undefined.
+ *
+ * @param pool The pool to get the buffer from. Must not be NULL.
+ * @param buf Pointer to a variable which will hold the buffer.
+ *            Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_new(struct sr_buffer_pool *pool, struct sr_buffer **buf)
+{
+	if (!pool || !buf) {
+		sr_err("buffer: %s: pool or buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_static_mutex_lock(&pool->mutex);
+	if ((*buf = g_slist_nth_data(pool->free_list, 0))) {
+		pool->free_list = g_slist_delete_link(pool->free_list,
+						      pool->free_list);
+		pool->num_free--;
+	}
+	pool->outstanding++;
+	g_static_mutex_unlock(&pool->mutex);
+
+	if (!*buf) {
+		/* The sample data follows the buffer header. */
+		if (!(*buf = g_try_malloc(sizeof(struct sr_buffer)
+					  + pool->bufsize))) {
+			sr_err("buffer: %s: buf malloc failed", __func__);
+			g_static_mutex_lock(&pool->mutex);
+			pool->outstanding--;
+			g_static_mutex_unlock(&pool->mutex);
+			return SR_ERR_MALLOC;
+		}
+		(*buf)->pool = pool;
+		(*buf)->size = pool->bufsize;
+		(*buf)->data = (uint8_t *)(*buf + 1);
+	}
+	(*buf)->refcount = 1;
+
+	return SR_OK;
+}
+
+/**
+ * Take an additional reference to a buffer.
+ *
+ * A datafeed callback which wants to keep the data of an SR_DF_LOGIC
+ * packet past the end of the callback can do so without copying, by
+ * taking a reference to the packet's buffer (if it has one).
+ *
+ * @param buf The buffer. Must not be NULL.
+ *
+ * @return The buffer.
+ */
+SR_API struct sr_buffer *sr_buffer_ref(struct sr_buffer *buf)
+{
+	g_atomic_int_inc(&buf->refcount);
+
+	return buf;
+}
+
+/**
+ * Release a reference to a buffer.
+ *
+ * When the last reference is released, the buffer returns to its pool.
+ *
+ * @param buf The buffer. Must not be NULL.
+ */
+SR_API void sr_buffer_unref(struct sr_buffer *buf)
+{
+	struct sr_buffer_pool *pool;
+	gboolean keep, idle;
+
+	if (!g_atomic_int_dec_and_test(&buf->refcount))
+		return;
+
+	pool = buf->pool;
+	g_static_mutex_lock(&pool->mutex);
+	keep = !pool->destroyed && pool->num_free < pool->max_free;
+	if (keep) {
+		pool->free_list = g_slist_prepend(pool->free_list, buf);
+		pool->num_free++;
+	}
+	pool->outstanding--;
+	idle = pool->destroyed && pool->outstanding == 0;
+	g_static_mutex_unlock(&pool->mutex);
+
+	if (!keep)
+		g_free(buf);
+	if (idle)
+		pool_free(pool);
+}
+
+/**
+ * Make sure the caller holds the only reference to a buffer, so it can be
+ * written to again.
+ *
+ * If anyone else still holds a reference, the caller's reference is
+ * released and replaced by a fresh buffer from the same pool. Drivers
+ * call this before reusing a buffer they sent in a packet, e.g. before
+ * resubmitting a USB transfer.
+ *
+ * @param buf Pointer to the caller's buffer; it may be replaced.
+ *            Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors
+ *         (in which case the caller keeps its reference to the old buffer).
+ */
+SR_API int sr_buffer_reclaim(struct sr_buffer **buf)
+{
+	struct sr_buffer *newbuf;
+	int ret;
+
+	if (g_atomic_int_get(&(*buf)->refcount) == 1)
+		return SR_OK;
+
+	if ((ret = sr_buffer_new((*buf)->pool, &newbuf)) != SR_OK)
+		return ret;
+
+	sr_buffer_unref(*buf);
+	*buf = newbuf;
+
+	return SR_OK;
+}
@@ -20,11 +20,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
-static gpointer new_chunk(struct sr_datastore **ds);
+static uint8_t *map_chunk(struct sr_datastore *ds);
+static uint8_t *new_chunk(struct sr_datastore *ds);
 
 /**
  * Create a new datastore with the specified unit size.
@@ -68,16 +74,87 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 
 	(*ds)->ds_unitsize = unitsize;
 	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	(*ds)->chunks = NULL;
+	(*ds)->num_chunks = 0;
+	(*ds)->chunks_allocated = 0;
+	(*ds)->tail = NULL;
+	(*ds)->tail_fill = 0;
+	(*ds)->fd = -1;
+	(*ds)->first_mapped = 0;
+	(*ds)->max_mapped = 0;
 
 	return SR_OK;
 }
 
+/**
+ * Create a new disk-backed datastore with the specified unit size.
+ *
+ * This works like sr_datastore_new(), but the chunks are stored in an
+ * (unlinked, sparse) temporary file and memory-mapped on demand, so the
+ * datastore can hold more data than fits into RAM. At most 'max_resident'
+ * bytes worth of chunks are kept mapped at any time; older chunks are
+ * unmapped and left to the kernel to write back, and are read back from
+ * the file by sr_datastore_get() when needed.
+ *
+ * @param unitsize The unit size (>= 1) to be used for this datastore.
+ * @param max_resident The maximum number of bytes of sample data to keep
+ *                     mapped. At least one chunk is always mapped, even
+ *                     if this is smaller than the size of a chunk.
+ * @param ds Pointer to a variable which will hold the newly created
+ *           datastore structure.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR_ARG upon invalid arguments, or SR_ERR if the temporary
+ *         file could not be created or disk-backed datastores are not
+ *         supported on this platform. If something other than SR_OK is
+ *         returned, the value of 'ds' is undefined.
+ */
+SR_API int sr_datastore_new_mapped(int unitsize, uint64_t max_resident,
+				   struct sr_datastore **ds)
+{
+#ifdef HAVE_SYS_MMAN_H
+	GError *error;
+	uint64_t chunk_bytes;
+	char *tmpname;
+	int ret, fd;
+
+	if ((ret = sr_datastore_new(unitsize, ds)) != SR_OK)
+		return ret;
+
+	error = NULL;
+	if ((fd = g_file_open_tmp("sigrok-ds-XXXXXX", &tmpname, &error)) == -1) {
+		sr_err("ds: %s: failed to create temporary file: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		g_free(*ds);
+		return SR_ERR;
+	}
+
+	/* Nobody else needs to see the file, it's gone once we close it. */
+	unlink(tmpname);
+	g_free(tmpname);
+
+	chunk_bytes = DATASTORE_CHUNKSIZE * unitsize;
+	(*ds)->fd = fd;
+	(*ds)->max_mapped = MAX(max_resident / chunk_bytes, 1);
+
+	return SR_OK;
+#else
+	(void)unitsize;
+	(void)max_resident;
+	(void)ds;
+
+	sr_err("ds: %s: disk-backed datastores are not supported on this "
+	       "platform", __func__);
+	return SR_ERR;
+#endif
+}
+
 /**
  * Destroy the specified datastore and free the memory used by it.
  *
- * This will free the memory used by the data in the datastore's 'chunklist',
- * by the chunklist data structure itself, and by the datastore struct.
+ * This will free the memory used by the data in the datastore's chunks,
+ * by the chunk array itself, and by the datastore struct.
  *
  * @param ds The datastore to destroy.
  *
@@ -85,16 +162,24 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
  */
 SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 {
-	GSList *chunk;
+	unsigned int i;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+	if (ds->fd == -1) {
+		for (i = 0; i < ds->num_chunks; i++)
+			g_free(ds->chunks[i]);
+	} else {
+#ifdef HAVE_SYS_MMAN_H
+		for (i = ds->first_mapped; i < ds->num_chunks; i++)
+			munmap(ds->chunks[i], DATASTORE_CHUNKSIZE * ds->ds_unitsize);
+		close(ds->fd);
+#endif
+	}
+	g_free(ds->chunks);
 	g_free(ds);
 	ds = NULL;
 
@@ -104,7 +189,10 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 /**
  * Append some data to the specified datastore.
  *
- * TODO: More elaborate function description.
+ * The data is copied into the last chunk of the datastore, and new chunks
+ * are allocated as needed. The datastore keeps track of the last chunk and
+ * how much of it is in use, so appending takes constant time regardless of
+ * how much data the datastore already holds.
  *
  * TODO: This function should use the (not yet available) 'chunksize' field
  *       of struct sr_datastore (instead of hardcoding DATASTORE_CHUNKSIZE).
@@ -130,9 +218,7 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		unsigned int length, int in_unitsize, const int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
-	gpointer chunk;
+	unsigned int stored, size, chunk_bytes, chunk_bytes_free;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
@@ -161,44 +247,28 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		return SR_ERR_ARG;
 	}
 
-	/* Get the last chunk in the list, or create a new one if needed. */
-	if (ds->chunklist == NULL) {
-		if (!(chunk = new_chunk(&ds))) {
-			sr_err("ds: %s: couldn't allocate new chunk", __func__);
-			return SR_ERR_MALLOC;
-		}
-	} else {
-		chunk = g_slist_last(ds->chunklist)->data;
-	}
-
-	/* Get/calculate number of chunks, free space, etc. */
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
+	chunk_bytes = DATASTORE_CHUNKSIZE * ds->ds_unitsize;
 
 	stored = 0;
 	while (stored < length) {
-		/* No more free space left, allocate a new chunk. */
-		if (chunk_bytes_free == 0) {
-			if (!(chunk = new_chunk(&ds))) {
+		/* No chunk yet, or no more free space left: allocate one. */
+		if (!ds->tail || ds->tail_fill == chunk_bytes) {
+			if (!new_chunk(ds)) {
 				sr_err("ds: %s: couldn't allocate new chunk",
 				       __func__);
 				return SR_ERR_MALLOC;
 			}
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
-			chunk_offset = 0;
 		}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
+		chunk_bytes_free = chunk_bytes - ds->tail_fill;
+		if (length - stored > chunk_bytes_free)
 			size = chunk_bytes_free;
 		else
 			/* Last part, won't fill up this chunk. */
 			size = length - stored;
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
+		memcpy(ds->tail + ds->tail_fill, (uint8_t *)data + stored, size);
+		ds->tail_fill += size;
 		stored += size;
 	}
 
@@ -208,10 +278,224 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 }
 
 /**
- * Allocate a new memory chunk, append it to the datastore's chunklist.
+ * Append run-length encoded samples to the specified datastore.
  *
- * The newly allocated chunk is added to the datastore's chunklist by this
- * function, and the return value additionally points to the new chunk.
+ * The runs are expanded straight into the datastore's chunks, without an
+ * intermediate buffer.
+ *
+ * @param ds Pointer to the datastore which shall receive the data.
+ *           Must not be NULL.
+ * @param rle The samples to add. Their unit size must be the datastore's
+ *            unit size. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the value/state of 'ds' is undefined.
+ */
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+				const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t run, run_offset, chunk_bytes, length;
+	int ret;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!rle) {
+		sr_err("ds: %s: rle was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle->unitsize != ds->ds_unitsize) {
+		sr_err("ds: %s: unitsize was %d, but the datastore's is %d",
+		       __func__, rle->unitsize, ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	chunk_bytes = DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+
+	run = run_offset = 0;
+	while (run < rle->num_runs) {
+		/* No chunk yet, or no more free space left: allocate one. */
+		if (!ds->tail || ds->tail_fill == chunk_bytes) {
+			if (!new_chunk(ds)) {
+				sr_err("ds: %s: couldn't allocate new chunk",
+				       __func__);
+				return SR_ERR_MALLOC;
+			}
+		}
+
+		ret = sr_logic_rle_expand(rle, &run, &run_offset,
+					  ds->tail + ds->tail_fill,
+					  chunk_bytes - ds->tail_fill, &length);
+		if (ret != SR_OK)
+			return ret;
+		ds->tail_fill += length;
+		ds->num_units += length / ds->ds_unitsize;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Read units of a chunk which is currently not mapped from the backing
+ * file of a disk-backed datastore.
+ *
+ * @return SR_OK upon success, or SR_ERR upon read errors.
+ */
+static int read_unmapped(const struct sr_datastore *ds, uint64_t chunk,
+			 uint64_t offset, uint64_t count, uint8_t *buf)
+{
+#ifdef HAVE_SYS_MMAN_H
+	off_t pos;
+	size_t len;
+	ssize_t ret;
+
+	pos = (chunk * DATASTORE_CHUNKSIZE + offset) * ds->ds_unitsize;
+	len = count * ds->ds_unitsize;
+	while (len > 0) {
+		if ((ret = pread(ds->fd, buf, len, pos)) <= 0) {
+			if (ret == -1 && errno == EINTR)
+				continue;
+			sr_err("ds: %s: failed to read chunk %" PRIu64 ": %s",
+			       __func__, chunk, ret ? g_strerror(errno)
+			       : "unexpected end of file");
+			return SR_ERR;
+		}
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+
+	return SR_OK;
+#else
+	(void)ds;
+	(void)chunk;
+	(void)offset;
+	(void)count;
+	(void)buf;
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Copy a range of units out of the specified datastore.
+ *
+ * Since every chunk holds exactly DATASTORE_CHUNKSIZE units, the chunk
+ * containing any unit can be found directly, so reading from the middle
+ * of a large datastore costs no more than reading from its start.
+ *
+ * @param ds Pointer to the datastore to read from. Must not be NULL.
+ * @param first_unit The number of the first unit to copy (0-based).
+ * @param count The number of units to copy. The range must lie completely
+ *              within the units stored in the datastore.
+ * @param buf Pointer to a buffer of at least count * ds_unitsize bytes,
+ *            which will receive the data. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the data of a disk-backed datastore could not be read back.
+ */
+SR_API int sr_datastore_get(const struct sr_datastore *ds, uint64_t first_unit,
+			    uint64_t count, void *buf)
+{
+	uint64_t chunk, offset, size, chunk_units;
+	uint8_t *dst;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!buf) {
+		sr_err("ds: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (first_unit > ds->num_units || count > ds->num_units - first_unit) {
+		sr_err("ds: %s: units %" PRIu64 "-%" PRIu64 " out of range "
+		       "(%" PRIu64 " units stored)", __func__, first_unit,
+		       first_unit + count, ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	dst = buf;
+	chunk = first_unit / DATASTORE_CHUNKSIZE;
+	offset = first_unit % DATASTORE_CHUNKSIZE;
+	while (count > 0) {
+		chunk_units = DATASTORE_CHUNKSIZE - offset;
+		size = (count < chunk_units) ? count : chunk_units;
+		if (ds->chunks[chunk]) {
+			memcpy(dst, ds->chunks[chunk] + offset * ds->ds_unitsize,
+			       size * ds->ds_unitsize);
+		} else if (read_unmapped(ds, chunk, offset, size, dst) != SR_OK) {
+			return SR_ERR;
+		}
+		dst += size * ds->ds_unitsize;
+		count -= size;
+		offset = 0;
+		chunk++;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Extend the backing file of a disk-backed datastore by one chunk, and map
+ * the new chunk into memory.
+ *
+ * If this exceeds the datastore's budget of mapped chunks, the oldest
+ * mapped chunk is unmapped. Since the datastore is only ever appended to,
+ * the mapped chunks always form a window ending at the tail chunk.
+ *
+ * @return Pointer to the newly mapped chunk, or NULL upon failure.
+ */
+static uint8_t *map_chunk(struct sr_datastore *ds)
+{
+#ifdef HAVE_SYS_MMAN_H
+	uint8_t *chunk;
+	size_t chunk_bytes;
+	off_t pos;
+
+	chunk_bytes = DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+	pos = (off_t)ds->num_chunks * chunk_bytes;
+
+	/* The file stays sparse, so the new chunk reads back as zeroes. */
+	if (ftruncate(ds->fd, pos + chunk_bytes) == -1) {
+		sr_err("ds: %s: failed to extend backing file: %s",
+		       __func__, g_strerror(errno));
+		return NULL;
+	}
+
+	chunk = mmap(NULL, chunk_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     ds->fd, pos);
+	if (chunk == MAP_FAILED) {
+		sr_err("ds: %s: failed to map chunk: %s",
+		       __func__, g_strerror(errno));
+		return NULL;
+	}
+
+	while (ds->num_chunks - ds->first_mapped >= ds->max_mapped) {
+		munmap(ds->chunks[ds->first_mapped], chunk_bytes);
+		ds->chunks[ds->first_mapped++] = NULL;
+	}
+
+	return chunk;
+#else
+	(void)ds;
+
+	return NULL;
+#endif
+}
+
+/**
+ * Allocate a new memory chunk, append it to the datastore's chunk array.
+ *
+ * The newly allocated chunk becomes the datastore's tail chunk, and the
+ * return value additionally points to the new chunk. The chunk array is
+ * grown by doubling its size, so this takes amortized constant time.
  *
  * The allocated memory is guaranteed to be cleared.
  *
@@ -219,25 +503,43 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
  *       of hardcoding DATASTORE_CHUNKSIZE.
  * TODO: Return int, so we can return SR_OK / SR_ERR_ARG / SR_ERR_MALLOC?
  *
- * @param ds Pointer to a variable which holds the datastore structure.
- *           Must not be NULL. The contents of 'ds' are modified in-place.
+ * @param ds Pointer to the datastore structure. Must not be NULL.
+ *           The contents of 'ds' are modified in-place.
  *
  * @return Pointer to the newly allocated chunk, or NULL upon failure.
  */
-static gpointer new_chunk(struct sr_datastore **ds)
+static uint8_t *new_chunk(struct sr_datastore *ds)
 {
-	gpointer chunk;
+	uint8_t *chunk, **chunks;
+	unsigned int allocated;
 
 	/* Note: Caller checked that ds != NULL. */
 
-	chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize);
-	if (!chunk) {
-		sr_err("ds: %s: chunk malloc failed (ds_unitsize was %u)",
-		       __func__, (*ds)->ds_unitsize);
-		return NULL; /* TODO: SR_ERR_MALLOC later? */
+	if (ds->num_chunks == ds->chunks_allocated) {
+		allocated = ds->chunks_allocated ? ds->chunks_allocated * 2 : 16;
+		chunks = g_try_realloc(ds->chunks, allocated * sizeof(uint8_t *));
+		if (!chunks) {
+			sr_err("ds: %s: chunk array realloc failed", __func__);
+			return NULL;
+		}
+		ds->chunks = chunks;
+		ds->chunks_allocated = allocated;
+	}
+
+	if (ds->fd == -1) {
+		chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * ds->ds_unitsize);
+		if (!chunk) {
+			sr_err("ds: %s: chunk malloc failed (ds_unitsize was %u)",
+			       __func__, ds->ds_unitsize);
+			return NULL; /* TODO: SR_ERR_MALLOC later? */
+		}
+	} else if (!(chunk = map_chunk(ds))) {
+		return NULL;
 	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	ds->chunks[ds->num_chunks++] = chunk;
+	ds->tail = chunk;
+	ds->tail_fill = 0;
 
 	return chunk; /* TODO: SR_OK later? */
 }
@@ -18,10 +18,511 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#ifdef HAVE_BMI2_PEXT
+#include <immintrin.h>
+#endif
+
+typedef void (*filter_kernel_t)(const struct sr_filter *filter,
+				const uint8_t *data_in, uint64_t num_samples,
+				uint8_t *data_out);
+
+/*
+ * A probe filter, compiled from a probe list by sr_filter_new().
+ *
+ * Depending on which probes are selected, one of the kernels below is
+ * picked to do the actual work:
+ *
+ *  - identity: All probes are selected, in order. The data is copied.
+ *  - bytes: The selected probes form whole input bytes, in order (e.g.
+ *    probes 9-16 of a 16-probe device). Those bytes are copied.
+ *  - pext: The selected probes are in ascending order, span more than one
+ *    input byte, and the CPU has a fast parallel bit extract instruction
+ *    (x86 BMI2, checked for at runtime). One instruction per sample.
+ *  - lut: Everything else. Every input byte with selected probes in it
+ *    gets a 256-entry lookup table of the output bits it contributes.
+ */
+struct sr_filter {
+	int in_unitsize;
+	int out_unitsize;
+	int num_probes;
+	filter_kernel_t kernel;
+	/* bytes: Input byte offset of each output byte. */
+	int byte_map[8];
+	int num_bytes;
+	/* pext: Mask of the selected input bits. */
+	uint64_t mask;
+	/*
+	 * lut: Input byte offset and lookup table of each used input byte.
+	 * Only the first num_luts tables are initialized, so the (big) lut
+	 * array must stay the last member.
+	 */
+	int lut_byte[8];
+	int num_luts;
+	uint64_t lut[8][256];
+};
+
+static void kernel_identity(const struct sr_filter *filter,
+			    const uint8_t *data_in, uint64_t num_samples,
+			    uint8_t *data_out)
+{
+	memmove(data_out, data_in, num_samples * filter->in_unitsize);
+}
+
+static void kernel_bytes(const struct sr_filter *filter,
+			 const uint8_t *data_in, uint64_t num_samples,
+			 uint8_t *data_out)
+{
+	uint64_t i;
+	uint8_t sample[8];
+	int j;
+
+	/* Gather into 'sample' first, the output may overlap the input. */
+	memset(sample, 0, sizeof(sample));
+	for (i = 0; i < num_samples; i++) {
+		for (j = 0; j < filter->num_bytes; j++)
+			sample[j] = data_in[filter->byte_map[j]];
+		memcpy(data_out, sample, filter->out_unitsize);
+		data_in += filter->in_unitsize;
+		data_out += filter->out_unitsize;
+	}
+}
+
+/*
+ * Samples are loaded and stored through these, so the common unit sizes
+ * get a single fixed size access instead of a call to memcpy().
+ */
+static inline uint64_t sample_load(const uint8_t *p, int unitsize)
+{
+	uint16_t s16;
+	uint32_t s32;
+	uint64_t s;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		memcpy(&s16, p, 2);
+		return s16;
+	case 4:
+		memcpy(&s32, p, 4);
+		return s32;
+	case 8:
+		memcpy(&s, p, 8);
+		return s;
+	default:
+		s = 0;
+		memcpy(&s, p, unitsize);
+		return s;
+	}
+}
+
+static inline void sample_store(uint8_t *p, uint64_t s, int unitsize)
+{
+	uint16_t s16;
+	uint32_t s32;
+
+	switch (unitsize) {
+	case 1:
+		p[0] = s;
+		break;
+	case 2:
+		s16 = s;
+		memcpy(p, &s16, 2);
+		break;
+	case 4:
+		s32 = s;
+		memcpy(p, &s32, 4);
+		break;
+	default:
+		memcpy(p, &s, unitsize);
+		break;
+	}
+}
+
+#ifdef HAVE_BMI2_PEXT
+__attribute__((target("bmi2")))
+static void kernel_pext(const struct sr_filter *filter,
+			const uint8_t *data_in, uint64_t num_samples,
+			uint8_t *data_out)
+{
+	uint64_t i, mask;
+	int in_unitsize, out_unitsize;
+
+	mask = filter->mask;
+	in_unitsize = filter->in_unitsize;
+	out_unitsize = filter->out_unitsize;
+	for (i = 0; i < num_samples; i++) {
+		sample_store(data_out, _pext_u64(sample_load(data_in,
+				in_unitsize), mask), out_unitsize);
+		data_in += in_unitsize;
+		data_out += out_unitsize;
+	}
+}
+#endif
+
+#ifdef HAVE_BMI2_PEXT
+/*
+ * AMD family 17h (Zen, Zen 2) implements PEXT in microcode, where it takes
+ * hundreds of cycles, so the LUT kernel is used there instead.
+ */
+static gboolean pext_is_fast(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("amdfam17h");
+}
+#endif
+
+static void kernel_lut(const struct sr_filter *filter,
+		       const uint8_t *data_in, uint64_t num_samples,
+		       uint8_t *data_out)
+{
+	uint64_t i, sample_out;
+	int j;
+
+	/* The common case of 8 or fewer probes out of a single byte. */
+	if (filter->num_luts == 1 && filter->out_unitsize == 1) {
+		data_in += filter->lut_byte[0];
+		for (i = 0; i < num_samples; i++) {
+			data_out[i] = filter->lut[0][*data_in];
+			data_in += filter->in_unitsize;
+		}
+		return;
+	}
+
+	for (i = 0; i < num_samples; i++) {
+		sample_out = 0;
+		for (j = 0; j < filter->num_luts; j++)
+			sample_out |= filter->lut[j][data_in[filter->lut_byte[j]]];
+		sample_store(data_out, sample_out, filter->out_unitsize);
+		data_in += filter->in_unitsize;
+		data_out += filter->out_unitsize;
+	}
+}
+
+/* Check whether the probes form whole, aligned input bytes, in order. */
+static gboolean probes_are_bytes(struct sr_filter *filter,
+				 const int *probelist)
+{
+	int i, bit;
+
+	if (filter->num_probes % 8)
+		return FALSE;
+
+	for (i = 0; i < filter->num_probes; i++) {
+		bit = probelist[i] - 1;
+		if (i % 8 == 0) {
+			if (bit % 8)
+				return FALSE;
+			filter->byte_map[i / 8] = bit / 8;
+		} else if (bit != probelist[i - 1]) {
+			return FALSE;
+		}
+	}
+	filter->num_bytes = filter->num_probes / 8;
+
+	return TRUE;
+}
+
+static void build_luts(struct sr_filter *filter, const int *probelist)
+{
+	int byte, bit, value, i, j;
+	uint64_t used, bits[8];
+
+	used = 0;
+	for (i = 0; i < filter->num_probes; i++)
+		used |= 1ULL << (probelist[i] - 1);
+
+	filter->num_luts = 0;
+	for (byte = 0; byte < filter->in_unitsize; byte++)
+		if ((used >> (byte * 8)) & 0xff)
+			filter->lut_byte[filter->num_luts++] = byte;
+
+	for (j = 0; j < filter->num_luts; j++) {
+		/* The output bits each bit of this input byte maps to. */
+		memset(bits, 0, sizeof(bits));
+		for (i = 0; i < filter->num_probes; i++) {
+			bit = probelist[i] - 1;
+			if (bit / 8 == filter->lut_byte[j])
+				bits[bit % 8] |= 1ULL << i;
+		}
+
+		/* Every entry is a smaller one plus its highest bit. */
+		filter->lut[j][0] = 0;
+		for (bit = 0; bit < 8; bit++)
+			for (value = 1 << bit; value < 2 << bit; value++)
+				filter->lut[j][value] =
+				    filter->lut[j][value - (1 << bit)] | bits[bit];
+	}
+}
+
+#ifdef HAVE_BMI2_PEXT
+/* A single input byte to a single output byte is one table lookup. */
+static gboolean single_byte_lut(const struct sr_filter *filter)
+{
+	int byte, num_bytes;
+
+	num_bytes = 0;
+	for (byte = 0; byte < filter->in_unitsize; byte++)
+		if ((filter->mask >> (byte * 8)) & 0xff)
+			num_bytes++;
+
+	return num_bytes == 1 && filter->out_unitsize == 1;
+}
+#endif
+
+/* Analyze the probe list and set up 'filter' accordingly. */
+static int filter_init(struct sr_filter *filter, int in_unitsize,
+		       int out_unitsize, const int *probelist)
+{
+	int i;
+
+	if (!probelist) {
+		sr_err("filter: %s: probelist was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (in_unitsize < 1 || in_unitsize > 8
+	    || out_unitsize < 1 || out_unitsize > 8) {
+		sr_err("filter: %s: invalid unit sizes (%d, %d)", __func__,
+		       in_unitsize, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	/* The lookup tables are set up by build_luts(), if needed at all. */
+	memset(filter, 0, offsetof(struct sr_filter, lut));
+	filter->in_unitsize = in_unitsize;
+	filter->out_unitsize = out_unitsize;
+
+	for (i = 0; probelist[i]; i++) {
+		if (probelist[i] < 1 || probelist[i] > in_unitsize * 8) {
+			sr_err("filter: %s: probe %d out of range for unit "
+			       "size %d", __func__, probelist[i], in_unitsize);
+			return SR_ERR_ARG;
+		}
+		filter->mask |= 1ULL << (probelist[i] - 1);
+		filter->num_probes++;
+	}
+
+	/* Are there more probes than the target unit size supports? */
+	if (filter->num_probes > out_unitsize * 8) {
+		sr_err("filter: %s: too many probes (%d) for the target unit "
+		       "size (%d)", __func__, filter->num_probes, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (probes_are_bytes(filter, probelist)) {
+		filter->kernel = kernel_bytes;
+		if (filter->num_bytes != in_unitsize
+		    || filter->num_bytes != out_unitsize)
+			return SR_OK;
+		for (i = 0; i < filter->num_bytes; i++)
+			if (filter->byte_map[i] != i)
+				return SR_OK;
+		filter->kernel = kernel_identity;
+		return SR_OK;
+	}
+
+#ifdef HAVE_BMI2_PEXT
+	for (i = 1; probelist[i]; i++)
+		if (probelist[i] <= probelist[i - 1])
+			break;
+	if (!probelist[i] && !single_byte_lut(filter) && pext_is_fast()) {
+		filter->kernel = kernel_pext;
+		return SR_OK;
+	}
+#endif
+
+	build_luts(filter, probelist);
+	filter->kernel = kernel_lut;
+
+	return SR_OK;
+}
+
+/**
+ * Compile a probe list into a filter which can be run on many packets.
+ *
+ * This does all the work of analyzing the probe list up front (usually
+ * when the SR_DF_META_LOGIC packet is received), and picks the fastest
+ * way of filtering samples for it. See sr_filter_probes() for a
+ * description of the parameters.
+ *
+ * It is the caller's responsibility to free the filter via
+ * sr_filter_destroy(), if no longer needed.
+ *
+ * @param in_unitsize The unit size (>= 1) of the input data.
+ * @param out_unitsize The unit size (>= 1) the output shall have.
+ * @param probelist Pointer to a list of integers (probe numbers). The probe
+ *                  numbers in this list are 1-based. Must not be NULL.
+ * @param filter Pointer to a variable which will hold the newly created
+ *               filter. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than
+ *         SR_OK is returned, the value of 'filter' is undefined.
+ */
+SR_API int sr_filter_new(int in_unitsize, int out_unitsize,
+			 const int *probelist, struct sr_filter **filter)
+{
+	int ret;
+
+	if (!filter) {
+		sr_err("filter: %s: filter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*filter = g_try_malloc(sizeof(struct sr_filter)))) {
+		sr_err("filter: %s: filter malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if ((ret = filter_init(*filter, in_unitsize, out_unitsize,
+			       probelist)) != SR_OK) {
+		g_free(*filter);
+		return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Destroy the specified filter and free the memory used by it.
+ *
+ * @param filter The filter to destroy.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_destroy(struct sr_filter *filter)
+{
+	if (!filter) {
+		sr_err("filter: %s: filter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(filter);
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, using a compiled filter, and write
+ * the result into a caller-provided buffer.
+ *
+ * This does the same as sr_filter_probes_into(), with the probe list and
+ * unit sizes that were passed to sr_filter_new(). No memory is allocated,
+ * so a frontend can filter a whole acquisition using a single buffer.
+ *
+ * @param filter The filter to use. Must not be NULL.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length (>= 1), in number of bytes.
+ * @param data_out Pointer to the output buffer, which must be large enough
+ *                 to hold (length_in / in_unitsize) * out_unitsize bytes.
+ *                 This may be the same as data_in, if out_unitsize is not
+ *                 bigger than in_unitsize, in which case the data is
+ *                 filtered in place. Other than that, the buffers must not
+ *                 overlap. Must not be NULL.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_run_into(const struct sr_filter *filter,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out)
+{
+	uint64_t num_samples;
+
+	if (!filter) {
+		sr_err("filter: %s: filter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_in) {
+		sr_err("filter: %s: data_in was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_out) {
+		sr_err("filter: %s: data_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!length_out) {
+		sr_err("filter: %s: length_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = length_in / filter->in_unitsize;
+
+	if (data_out == data_in && filter->out_unitsize > filter->in_unitsize) {
+		sr_err("filter: %s: can't filter in place from unit size %d "
+		       "to %d", __func__, filter->in_unitsize,
+		       filter->out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	filter->kernel(filter, data_in, num_samples, data_out);
+	*length_out = num_samples * filter->out_unitsize;
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, using a compiled filter.
+ *
+ * This does the same as sr_filter_probes(), with the probe list and unit
+ * sizes that were passed to sr_filter_new().
+ *
+ * @param filter The filter to use. Must not be NULL.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length (>= 1), in number of bytes.
+ * @param data_out Variable which will point to the newly allocated buffer
+ *                 of output data. The caller is responsible for g_free()'ing
+ *                 the buffer when it's no longer needed. Must not be NULL.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_run(const struct sr_filter *filter,
+			 const uint8_t *data_in, uint64_t length_in,
+			 uint8_t **data_out, uint64_t *length_out)
+{
+	int ret;
+
+	if (!filter) {
+		sr_err("filter: %s: filter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_out) {
+		sr_err("filter: %s: data_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*data_out = g_try_malloc(MAX(length_in / filter->in_unitsize
+					   * filter->out_unitsize, 1)))) {
+		sr_err("filter: %s: data_out malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	ret = sr_filter_run_into(filter, data_in, length_in, *data_out,
+				 length_out);
+	if (ret != SR_OK) {
+		g_free(*data_out);
+		*data_out = NULL;
+	}
+
+	return ret;
+}
 
 /**
  * Remove unused probes from samples.
@@ -51,6 +552,10 @@
  * actually allocated for the input data (data_in), as this function does
  * not check that.
  *
+ * This compiles the probe list anew on every call. Callers filtering many
+ * packets with the same probe list should use sr_filter_new() and
+ * sr_filter_run() or sr_filter_run_into() instead.
+ *
  * @param in_unitsize The unit size (>= 1) of the input (data_in).
  * @param out_unitsize The unit size (>= 1) the output shall have (data_out).
  *                     The requested unit size must be big enough to hold as
@@ -78,68 +583,55 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out)
 {
-	unsigned int in_offset, out_offset;
-	int num_enabled_probes, out_bit, i;
-	uint64_t sample_in, sample_out;
-
-	if (!probelist) {
-		sr_err("filter: %s: probelist was NULL", __func__);
-		return SR_ERR_ARG;
-	}
-
-	if (!data_in) {
-		sr_err("filter: %s: data_in was NULL", __func__);
-		return SR_ERR_ARG;
-	}
-
-	if (!data_out) {
-		sr_err("filter: %s: data_out was NULL", __func__);
-		return SR_ERR_ARG;
-	}
-
-	if (!length_out) {
-		sr_err("filter: %s: length_out was NULL", __func__);
-		return SR_ERR_ARG;
-	}
+	struct sr_filter *filter;
+	int ret;
 
-	num_enabled_probes = 0;
-	for (i = 0; probelist[i]; i++)
-		num_enabled_probes++;
+	if ((ret = sr_filter_new(in_unitsize, out_unitsize, probelist,
+				 &filter)) != SR_OK)
+		return ret;
 
-	/* Are there more probes than the target unit size supports? */
-	if (num_enabled_probes > out_unitsize * 8) {
-		sr_err("filter: %s: too many probes (%d) for the target unit "
-		       "size (%d)", num_enabled_probes, out_unitsize, __func__);
-		return SR_ERR_ARG;
-	}
+	ret = sr_filter_run(filter, data_in, length_in, data_out, length_out);
+	sr_filter_destroy(filter);
 
-	if (!(*data_out = g_try_malloc(length_in))) {
-		sr_err("filter: %s: data_out malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+	return ret;
+}
 
-	if (num_enabled_probes == in_unitsize * 8) {
-		/* All probes are used -- no need to compress anything. */
-		memcpy(*data_out, data_in, length_in);
-		*length_out = length_in;
-		return SR_OK;
-	}
+/**
+ * Remove unused probes from samples, writing the result into a
+ * caller-provided buffer.
+ *
+ * This works like sr_filter_probes(), but doesn't allocate any memory.
+ * The data can also be filtered in place, by passing the same buffer
+ * as data_in and data_out.
+ *
+ * @param in_unitsize The unit size (>= 1) of the input (data_in).
+ * @param out_unitsize The unit size (>= 1) the output shall have (data_out).
+ * @param probelist Pointer to a list of integers (probe numbers). The probe
+ *                  numbers in this list are 1-based. Must not be NULL.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length (>= 1), in number of bytes.
+ * @param data_out Pointer to the output buffer, which must be large enough
+ *                 to hold (length_in / in_unitsize) * out_unitsize bytes.
+ *                 This may be the same as data_in if out_unitsize is not
+ *                 bigger than in_unitsize. Must not be NULL.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_probes_into(int in_unitsize, int out_unitsize,
+				 const int *probelist, const uint8_t *data_in,
+				 uint64_t length_in, uint8_t *data_out,
+				 uint64_t *length_out)
+{
+	struct sr_filter filter;
+	int ret;
 
-	/* If we reached this point, not all probes are used, so "compress". */
-	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
-		memcpy(&sample_in, data_in + in_offset, in_unitsize);
-		sample_out = out_bit = 0;
-		for (i = 0; probelist[i]; i++) {
-			if (sample_in & (1 << (probelist[i] - 1)))
-				sample_out |= (1 << out_bit);
-			out_bit++;
-		}
-		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
-		in_offset += in_unitsize;
-		out_offset += out_unitsize;
-	}
-	*length_out = out_offset;
+	if ((ret = filter_init(&filter, in_unitsize, out_unitsize,
+			       probelist)) != SR_OK)
+		return ret;
 
-	return SR_OK;
+	return sr_filter_run_into(&filter, data_in, length_in, data_out,
+				  length_out);
 }
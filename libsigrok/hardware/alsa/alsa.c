@@ -18,34 +18,29 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
-/* Note: This driver doesn't compile, analog support in sigrok is WIP. */
-
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <alsa/asoundlib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
 #define NUM_PROBES 2
 #define SAMPLE_WIDTH 16
+/* The PCM captured from, unless the frontend names another one. */
 #define AUDIO_DEV "plughw:0,0"
 
-struct sr_analog_probe {
-	uint8_t att;
-	uint8_t res;    /* Needs to be a power of 2, FIXME */
-	uint16_t val;   /* Max hardware ADC width is 16bits */
-};
-
-struct sr_analog_sample {
-	uint8_t num_probes; /* Max hardware probes is 256 */
-	struct sr_analog_probe probes[];
-};
+/* Samples are sent a period at a time, ALSA buffers this many periods. */
+#define PERIOD_MS 10
+#define NUM_PERIODS 8
 
 static const int hwcaps[] = {
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_CONTINUOUS,
+	0,
 };
 
 /* TODO: Which probe names/numbers to use? */
@@ -59,11 +54,23 @@ static GSList *dev_insts = NULL;
 
 /* Private, per-device-instance driver context. */
 struct context {
+	char *pcm_name;
 	uint64_t cur_rate;
 	uint64_t limit_samples;
+	uint64_t num_samples;
 	snd_pcm_t *capture_handle;
 	snd_pcm_hw_params_t *hw_params;
+	/* Samples are sent straight from ALSA's buffer, if it can be mapped. */
+	gboolean mmap;
+	snd_pcm_uframes_t period_size;
+	/* Otherwise they are read into this, one period at a time. */
+	int16_t *period_buf;
+	struct pollfd *ufds;
+	int num_ufds;
 	void *session_dev_id;
+	/* Set while receive_data() runs, the frontend may stop from in there. */
+	gboolean in_callback;
+	gboolean stopping;
 };
 
 static int hw_init(const char *devinfo)
@@ -71,14 +78,13 @@ static int hw_init(const char *devinfo)
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
 
-	/* Avoid compiler warnings. */
-	(void)devinfo;
-
 	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
 		sr_err("alsa: %s: ctx malloc failed", __func__);
 		return 0;
 	}
 
+	ctx->pcm_name = g_strdup(devinfo ? devinfo : AUDIO_DEV);
+
 	if (!(sdi = sr_dev_inst_new(0, SR_ST_ACTIVE, "alsa", NULL, NULL))) {
 		sr_err("alsa: %s: sdi was NULL", __func__);
 		goto free_ctx;
@@ -91,6 +97,7 @@ static int hw_init(const char *devinfo)
 	return 1;
 
 free_ctx:
+	g_free(ctx->pcm_name);
 	g_free(ctx);
 	return 0;
 }
@@ -105,10 +112,10 @@ static int hw_dev_open(int dev_index)
 		return SR_ERR;
 	ctx = sdi->priv;
 
-	ret = snd_pcm_open(&ctx->capture_handle, AUDIO_DEV,
+	ret = snd_pcm_open(&ctx->capture_handle, ctx->pcm_name,
 			   SND_PCM_STREAM_CAPTURE, 0);
 	if (ret < 0) {
-		sr_err("alsa: can't open audio device %s (%s)", AUDIO_DEV,
+		sr_err("alsa: can't open audio device %s (%s)", ctx->pcm_name,
 		       snd_strerror(ret));
 		return SR_ERR;
 	}
@@ -148,8 +155,10 @@ static int hw_dev_close(int dev_index)
 	// TODO: Return values of snd_*?
 	if (ctx->hw_params)
 		snd_pcm_hw_params_free(ctx->hw_params);
+	ctx->hw_params = NULL;
 	if (ctx->capture_handle)
 		snd_pcm_close(ctx->capture_handle);
+	ctx->capture_handle = NULL;
 
 	return SR_OK;
 }
@@ -157,13 +166,18 @@ static int hw_dev_close(int dev_index)
 static int hw_cleanup(void)
 {
 	struct sr_dev_inst *sdi;
+	struct context *ctx;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, 0))) {
 		sr_err("alsa: %s: sdi was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
+	if ((ctx = sdi->priv))
+		g_free(ctx->pcm_name);
 	sr_dev_inst_free(sdi);
+	g_slist_free(dev_insts);
+	dev_insts = NULL;
 
 	return SR_OK;
 }
@@ -230,85 +244,184 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	case SR_HWCAP_LIMIT_SAMPLES:
 		ctx->limit_samples = *(const uint64_t *)value;
 		return SR_OK;
+	case SR_HWCAP_CONTINUOUS:
+		/* Without a sample limit, acquisition runs until stopped. */
+		return SR_OK;
 	default:
 		return SR_ERR;
 	}
 }
 
+static void send_frames(struct context *ctx, void *data,
+			snd_pcm_uframes_t frames)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_analog_raw analog;
+	int i;
+
+	/* Full scale is +/-1. */
+	packet.type = SR_DF_ANALOG_RAW;
+	packet.payload = &analog;
+	analog.num_samples = frames;
+	analog.mq = SR_MQ_VOLTAGE;
+	analog.unit = SR_UNIT_VOLT;
+	analog.num_probes = NUM_PROBES;
+	analog.unitsize = SAMPLE_WIDTH / 8;
+	analog.is_signed = TRUE;
+	analog.resolution = SAMPLE_WIDTH;
+	for (i = 0; i < NUM_PROBES; i++) {
+		analog.scale[i] = 1.0 / (1 << (SAMPLE_WIDTH - 1));
+		analog.offset[i] = 0;
+	}
+	analog.data = data;
+	sr_session_send(ctx->session_dev_id, &packet);
+
+	ctx->num_samples += frames;
+}
+
+/* Send up to 'frames' frames straight from the mapped ALSA buffer. */
+static snd_pcm_sframes_t read_mmap(struct context *ctx,
+				   snd_pcm_uframes_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset;
+	snd_pcm_sframes_t ret;
+
+	ret = snd_pcm_mmap_begin(ctx->capture_handle, &areas, &offset, &frames);
+	if (ret < 0)
+		return ret;
+
+	/* Interleaved, so all probes' samples follow the first one's. */
+	send_frames(ctx, (uint8_t *)areas[0].addr
+		    + (areas[0].first + offset * areas[0].step) / 8, frames);
+
+	ret = snd_pcm_mmap_commit(ctx->capture_handle, offset, frames);
+	if (ret >= 0 && (snd_pcm_uframes_t)ret != frames)
+		return -EPIPE;
+
+	return ret;
+}
+
+static snd_pcm_sframes_t read_rw(struct context *ctx,
+				 snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t ret;
+
+	ret = snd_pcm_readi(ctx->capture_handle, ctx->period_buf,
+			    MIN(frames, ctx->period_size));
+	if (ret > 0)
+		send_frames(ctx, ctx->period_buf, ret);
+
+	return ret;
+}
+
+static void stop_acquisition(struct context *ctx)
+{
+	struct sr_datafeed_packet packet;
+	int i;
+
+	for (i = 0; i < ctx->num_ufds; i++)
+		sr_source_remove(ctx->ufds[i].fd);
+	g_free(ctx->ufds);
+	ctx->ufds = NULL;
+	ctx->num_ufds = 0;
+
+	snd_pcm_drop(ctx->capture_handle);
+	g_free(ctx->period_buf);
+	ctx->period_buf = NULL;
+
+	packet.type = SR_DF_END;
+	sr_session_send(ctx->session_dev_id, &packet);
+	ctx->session_dev_id = NULL;
+	ctx->stopping = FALSE;
+}
+
+/*
+ * Send whatever ALSA has captured so far, a period at a time. This never
+ * waits for more, the session loop calls back once there is. At most a
+ * buffer's worth is sent at a time, so a PCM which is always ready can't
+ * keep the session loop from doing anything else.
+ */
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi = cb_data;
 	struct context *ctx = sdi->priv;
-	struct sr_datafeed_packet packet;
-	struct sr_analog_sample *sample;
-	unsigned int sample_size = sizeof(struct sr_analog_sample) +
-		(NUM_PROBES * sizeof(struct sr_analog_probe));
-	char *outb;
-	char inb[4096];
-	int i, x, count;
-
-	fd = fd;
-	revents = revents;
-
-	do {
-		memset(inb, 0, sizeof(inb));
-		count = snd_pcm_readi(ctx->capture_handle, inb,
-			MIN(4096 / 4, ctx->limit_samples));
-		if (count < 1) {
-			sr_err("alsa: Failed to read samples");
-			return FALSE;
-		}
+	snd_pcm_sframes_t avail, ret;
+	snd_pcm_uframes_t frames;
+	int n;
 
-		if (!(outb = g_try_malloc(sample_size * count))) {
-			sr_err("alsa: %s: outb malloc failed", __func__);
-			return FALSE;
+	/* Avoid compiler warnings. */
+	(void)fd;
+	(void)revents;
+
+	if (!ctx->session_dev_id)
+		return TRUE;
+
+	ctx->in_callback = TRUE;
+	for (n = 0; n < NUM_PERIODS && !ctx->stopping; n++) {
+		frames = ctx->period_size;
+		if (ctx->limit_samples)
+			frames = MIN(frames,
+				     ctx->limit_samples - ctx->num_samples);
+
+		if ((avail = snd_pcm_avail_update(ctx->capture_handle)) >= 0) {
+			if ((snd_pcm_uframes_t)avail < frames)
+				break;
+			ret = ctx->mmap ? read_mmap(ctx, frames)
+					: read_rw(ctx, frames);
+		} else {
+			ret = avail;
 		}
 
-		for (i = 0; i < count; i++) {
-			sample = (struct sr_analog_sample *)
-						(outb + (i * sample_size));
-			sample->num_probes = NUM_PROBES;
-
-			for (x = 0; x < NUM_PROBES; x++) {
-				sample->probes[x].val =
-					*(uint16_t *)(inb + (i * 4) + (x * 2));
-				sample->probes[x].val &= ((1 << 16) - 1);
-				sample->probes[x].res = 16;
+		if (ret < 0) {
+			/* Overruns lose samples, but the capture goes on. */
+			sr_warn("alsa: capture error (%s), recovering",
+				snd_strerror(ret));
+			if ((ret = snd_pcm_recover(ctx->capture_handle,
+						   ret, 1)) < 0
+			    || (ret = snd_pcm_start(ctx->capture_handle)) < 0) {
+				sr_err("alsa: can't recover (%s)",
+				       snd_strerror(ret));
+				ctx->stopping = TRUE;
 			}
+			continue;
 		}
 
-		packet.type = SR_DF_ANALOG;
-		packet.length = count * sample_size;
-		packet.unitsize = sample_size;
-		packet.payload = outb;
-		sr_session_send(sdi, &packet);
-		g_free(outb);
-		ctx->limit_samples -= count;
-
-	} while (ctx->limit_samples > 0);
+		if (ctx->limit_samples
+		    && ctx->num_samples >= ctx->limit_samples)
+			ctx->stopping = TRUE;
+	}
+	ctx->in_callback = FALSE;
 
-	packet.type = SR_DF_END;
-	sr_session_send(sdi, &packet);
+	if (ctx->stopping)
+		stop_acquisition(ctx);
 
 	return TRUE;
 }
 
-static int hw_dev_acquisition_start(int dev_index, void *cb_data)
+static int set_params(struct context *ctx)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
-	struct sr_datafeed_packet packet;
-	struct sr_datafeed_header header;
-	struct pollfd *ufds;
-	int count;
+	snd_pcm_uframes_t period_size, buffer_size;
+	unsigned int rate;
 	int ret;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
+	ret = snd_pcm_hw_params_any(ctx->capture_handle, ctx->hw_params);
+	if (ret < 0) {
+		sr_err("alsa: can't initialize hardware parameter structure "
+		       "(%s)", snd_strerror(ret));
 		return SR_ERR;
-	ctx = sdi->priv;
+	}
 
+	ctx->mmap = TRUE;
 	ret = snd_pcm_hw_params_set_access(ctx->capture_handle,
-			ctx->hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+			ctx->hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	if (ret < 0) {
+		sr_dbg("alsa: no mmap access (%s), reading instead",
+		       snd_strerror(ret));
+		ctx->mmap = FALSE;
+		ret = snd_pcm_hw_params_set_access(ctx->capture_handle,
+				ctx->hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	}
 	if (ret < 0) {
 		sr_err("alsa: can't set access type (%s)", snd_strerror(ret));
 		return SR_ERR;
@@ -316,18 +429,20 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 
 	/* FIXME: Hardcoded for 16bits */
 	ret = snd_pcm_hw_params_set_format(ctx->capture_handle,
-			ctx->hw_params, SND_PCM_FORMAT_S16_LE);
+			ctx->hw_params, SND_PCM_FORMAT_S16);
 	if (ret < 0) {
 		sr_err("alsa: can't set sample format (%s)", snd_strerror(ret));
 		return SR_ERR;
 	}
 
+	rate = ctx->cur_rate;
 	ret = snd_pcm_hw_params_set_rate_near(ctx->capture_handle,
-			ctx->hw_params, (unsigned int *)&ctx->cur_rate, 0);
+			ctx->hw_params, &rate, 0);
 	if (ret < 0) {
 		sr_err("alsa: can't set sample rate (%s)", snd_strerror(ret));
 		return SR_ERR;
 	}
+	ctx->cur_rate = rate;
 
 	ret = snd_pcm_hw_params_set_channels(ctx->capture_handle,
 			ctx->hw_params, NUM_PROBES);
@@ -336,63 +451,148 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
+	period_size = MAX(rate * PERIOD_MS / 1000, 1);
+	ret = snd_pcm_hw_params_set_period_size_near(ctx->capture_handle,
+			ctx->hw_params, &period_size, 0);
+	if (ret < 0) {
+		sr_err("alsa: can't set period size (%s)", snd_strerror(ret));
+		return SR_ERR;
+	}
+
+	buffer_size = period_size * NUM_PERIODS;
+	ret = snd_pcm_hw_params_set_buffer_size_near(ctx->capture_handle,
+			ctx->hw_params, &buffer_size);
+	if (ret < 0) {
+		sr_err("alsa: can't set buffer size (%s)", snd_strerror(ret));
+		return SR_ERR;
+	}
+
 	ret = snd_pcm_hw_params(ctx->capture_handle, ctx->hw_params);
 	if (ret < 0) {
 		sr_err("alsa: can't set parameters (%s)", snd_strerror(ret));
 		return SR_ERR;
 	}
 
+	snd_pcm_hw_params_get_period_size(ctx->hw_params, &ctx->period_size, 0);
+	sr_dbg("alsa: %u Hz, %lu frame periods, %lu frame buffer, %s",
+	       rate, ctx->period_size, buffer_size,
+	       ctx->mmap ? "mmap" : "read");
+
+	return SR_OK;
+}
+
+static int hw_dev_acquisition_start(int dev_index, void *cb_data)
+{
+	struct sr_dev_inst *sdi;
+	struct context *ctx;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_analog meta;
+	int count, i;
+	int ret;
+
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
+		return SR_ERR;
+	ctx = sdi->priv;
+
+	if (set_params(ctx) != SR_OK)
+		return SR_ERR;
+
+	if (!ctx->mmap && !(ctx->period_buf = g_try_malloc(ctx->period_size
+					* NUM_PROBES * sizeof(int16_t)))) {
+		sr_err("alsa: %s: period_buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
 	ret = snd_pcm_prepare(ctx->capture_handle);
 	if (ret < 0) {
 		sr_err("alsa: can't prepare audio interface for use (%s)",
 		       snd_strerror(ret));
-		return SR_ERR;
+		goto err_free_buf;
 	}
 
 	count = snd_pcm_poll_descriptors_count(ctx->capture_handle);
 	if (count < 1) {
 		sr_err("alsa: Unable to obtain poll descriptors count");
-		return SR_ERR;
+		goto err_free_buf;
 	}
 
-	if (!(ufds = g_try_malloc(count * sizeof(struct pollfd)))) {
+	if (!(ctx->ufds = g_try_malloc(count * sizeof(struct pollfd)))) {
 		sr_err("alsa: %s: ufds malloc failed", __func__);
+		g_free(ctx->period_buf);
+		ctx->period_buf = NULL;
 		return SR_ERR_MALLOC;
 	}
 
-	ret = snd_pcm_poll_descriptors(ctx->capture_handle, ufds, count);
+	ret = snd_pcm_poll_descriptors(ctx->capture_handle, ctx->ufds, count);
 	if (ret < 0) {
 		sr_err("alsa: Unable to obtain poll descriptors (%s)",
 		       snd_strerror(ret));
-		g_free(ufds);
-		return SR_ERR;
+		g_free(ctx->ufds);
+		ctx->ufds = NULL;
+		goto err_free_buf;
 	}
 
 	ctx->session_dev_id = cb_data;
-	sr_source_add(ufds[0].fd, ufds[0].events, 10, receive_data, sdi);
+	ctx->num_samples = 0;
+	ctx->stopping = FALSE;
+	ctx->num_ufds = count;
+	for (i = 0; i < count; i++)
+		sr_source_add(ctx->ufds[i].fd, ctx->ufds[i].events, PERIOD_MS,
+			      receive_data, sdi);
 
 	packet.type = SR_DF_HEADER;
-	packet.length = sizeof(struct sr_datafeed_header);
-	packet.payload = (unsigned char *)&header;
+	packet.payload = &header;
 	header.feed_version = 1;
 	gettimeofday(&header.starttime, NULL);
-	header.samplerate = ctx->cur_rate;
-	header.num_analog_probes = NUM_PROBES;
-	header.num_logic_probes = 0;
-	header.protocol_id = SR_PROTO_RAW;
 	sr_session_send(cb_data, &packet);
-	g_free(ufds);
+
+	/* Send metadata about the analog packets to come. */
+	packet.type = SR_DF_META_ANALOG;
+	packet.payload = &meta;
+	meta.num_probes = NUM_PROBES;
+	sr_session_send(cb_data, &packet);
+
+	/* Capture with mmap access doesn't start by itself. */
+	ret = snd_pcm_start(ctx->capture_handle);
+	if (ret < 0) {
+		sr_err("alsa: can't start capture (%s)", snd_strerror(ret));
+		stop_acquisition(ctx);
+		return SR_ERR;
+	}
 
 	return SR_OK;
+
+err_free_buf:
+	g_free(ctx->period_buf);
+	ctx->period_buf = NULL;
+	return SR_ERR;
 }
 
 /* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 {
+	struct sr_dev_inst *sdi;
+	struct context *ctx;
+
 	/* Avoid compiler warnings. */
-	(void)dev_index;
 	(void)cb_data;
 
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
+		return SR_ERR;
+	ctx = sdi->priv;
+
+	if (!ctx->session_dev_id)
+		return SR_OK;
+
+	/* Stopped from within receive_data(), which stops once it's done. */
+	if (ctx->in_callback) {
+		ctx->stopping = TRUE;
+		return SR_OK;
+	}
+
+	stop_acquisition(ctx);
+
 	return SR_OK;
 }
 
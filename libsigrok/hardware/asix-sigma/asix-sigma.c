@@ -887,9 +887,12 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 	struct sr_dev_inst *sdi = cb_data;
 	struct context *ctx = sdi->priv;
 	uint16_t tsdiff, ts;
-	uint16_t samples[65536 * ctx->samples_per_event];
+	/* One cluster's worth, at up to 4 samples per event (200MHz). */
+	uint16_t samples[EVENTS_PER_CLUSTER * 4];
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+	struct sr_datafeed_logic_rle logic_rle;
+	uint64_t numpad_run;
 	int i, j, k, l, numpad, tosend;
 	size_t n = 0, sent = 0;
 	int clustersize = EVENTS_PER_CLUSTER * ctx->samples_per_event;
@@ -919,28 +922,20 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 		if (limit_chunk && ts > limit_chunk)
 			return SR_OK;
 
-		/* Pad last sample up to current point. */
+		/*
+		 * Pad last sample up to current point. Nothing changed in
+		 * between, so that's a single run of the last sample.
+		 */
 		numpad = tsdiff * ctx->samples_per_event - clustersize;
 		if (numpad > 0) {
-			for (j = 0; j < numpad; ++j)
-				samples[j] = *lastsample;
-
-			n = numpad;
-		}
-
-		/* Send samples between previous and this timestamp to sigrok. */
-		sent = 0;
-		while (sent < n) {
-			tosend = MIN(2048, n - sent);
-
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = tosend * sizeof(uint16_t);
-			logic.unitsize = 2;
-			logic.data = samples + sent;
+			numpad_run = numpad;
+			packet.type = SR_DF_LOGIC_RLE;
+			packet.payload = &logic_rle;
+			logic_rle.num_runs = 1;
+			logic_rle.unitsize = 2;
+			logic_rle.values = lastsample;
+			logic_rle.lengths = &numpad_run;
 			sr_session_send(ctx->session_dev_id, &packet);
-
-			sent += tosend;
 		}
 		n = 0;
 
@@ -981,6 +976,7 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 				logic.length = tosend * sizeof(uint16_t);
 				logic.unitsize = 2;
 				logic.data = samples;
+				logic.buffer = NULL;
 				sr_session_send(ctx->session_dev_id, &packet);
 
 				sent += tosend;
@@ -1002,6 +998,7 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			logic.length = tosend * sizeof(uint16_t);
 			logic.unitsize = 2;
 			logic.data = samples + sent;
+			logic.buffer = NULL;
 			sr_session_send(ctx->session_dev_id, &packet);
 		}
 
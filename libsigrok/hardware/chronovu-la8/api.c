@@ -61,12 +61,16 @@ static int hw_init(const char *devinfo)
 	ctx->limit_msec = 0;
 	ctx->limit_samples = 0;
 	ctx->session_dev_id = NULL;
-	memset(ctx->mangled_buf, 0, BS);
+	memset(ctx->mangled_buf, 0, sizeof(ctx->mangled_buf));
+	ctx->cur_buf = 0;
+#ifdef HAVE_FTDI_READ_DATA_SUBMIT
+	ctx->read_tc = NULL;
+#endif
 	ctx->final_buf = NULL;
 	ctx->trigger_pattern = 0x00; /* Value irrelevant, see trigger_mask. */
 	ctx->trigger_mask = 0x00; /* All probes are "don't care". */
+	ctx->trigger = NULL;
 	ctx->trigger_timeout = 10; /* Default to 10s trigger timeout. */
-	ctx->trigger_found = 0;
 	ctx->done = 0;
 	ctx->block_counter = 0;
 	ctx->divcount = 0; /* 10ns sample period == 100MHz samplerate */
@@ -238,6 +242,8 @@ static int hw_cleanup(void)
 			ret = SR_ERR_BUG;
 			continue;
 		}
+		if (sdi->priv)
+			sr_trigger_free(((struct context *)sdi->priv)->trigger);
 		sr_dev_inst_free(sdi); /* Returns void. */
 	}
 	g_slist_free(dev_insts); /* Returns void. */
@@ -505,7 +511,8 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->done = (ctx->divcount + 1) * 0.08388608 + time(NULL)
 			+ ctx->trigger_timeout;
 	ctx->block_counter = 0;
-	ctx->trigger_found = 0;
+	ctx->cur_buf = 0;
+	sr_trigger_reset(ctx->trigger);
 
 	/* Hook up a dummy handler to receive data from the LA8. */
 	sr_source_add(-1, G_IO_IN, 0, receive_data, sdi);
@@ -531,6 +538,9 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 		return SR_ERR_BUG;
 	}
 
+	/* Don't leave a read of the next block in flight. */
+	la8_read_block_finish(ctx);
+
 	/* Send end packet to the session bus. */
 	sr_dbg("la8: Sending SR_DF_END.");
 	packet.type = SR_DF_END;
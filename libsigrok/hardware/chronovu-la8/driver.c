@@ -20,6 +20,7 @@
 
 #include <ftdi.h>
 #include <glib.h>
+#include <string.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 #include "driver.h"
@@ -298,6 +299,8 @@ SR_PRIV int la8_reset(struct context *ctx)
 		return SR_ERR_ARG;
 	}
 
+	la8_read_block_finish(ctx);
+
 	sr_dbg("la8: Resetting the device.");
 
 	/*
@@ -328,6 +331,12 @@ SR_PRIV int configure_probes(struct context *ctx, const GSList *probes)
 
 	/* Note: Caller checked that ctx != NULL. */
 
+	/* The samples are searched for the trigger point once downloaded. */
+	sr_trigger_free(ctx->trigger);
+	ctx->trigger = NULL;
+	if (sr_trigger_new(probes, 1, 1, &ctx->trigger) != SR_OK)
+		return SR_ERR;
+
 	ctx->trigger_pattern = 0;
 	ctx->trigger_mask = 0; /* Default to "don't care" for all probes. */
 
@@ -402,29 +411,81 @@ SR_PRIV int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate)
 	return SR_OK;
 }
 
+/**
+ * Wait for the read of the next block, if one is in flight, and drop it.
+ *
+ * @param ctx The struct containing private per-device-instance data. Must not
+ *            be NULL.
+ */
+SR_PRIV void la8_read_block_finish(struct context *ctx)
+{
+#ifdef HAVE_FTDI_READ_DATA_SUBMIT
+	if (ctx->read_tc) {
+		(void) ftdi_transfer_data_done(ctx->read_tc); /* Ignore errors. */
+		ctx->read_tc = NULL;
+	}
+#else
+	(void)ctx;
+#endif
+}
+
+/*
+ * The LA8 SDRAM consists of eight 1MB lanes. Lane m holds bytes 2m and
+ * 2m + 1 of every 16 byte row of samples, so a block is a run of 16 bit
+ * words, which go to every eighth word of the final buffer. The two bytes
+ * of a word are swapped unless the divcount is 0.
+ */
+static void demangle_block(uint8_t *dst, const uint8_t *src, int swap)
+{
+	uint16_t w[8];
+	int i, j;
+
+	for (i = 0; i < BS; i += sizeof(w)) {
+		memcpy(w, src + i, sizeof(w));
+		for (j = 0; j < 8; j++) {
+			if (swap)
+				w[j] = GUINT16_SWAP_LE_BE(w[j]);
+			memcpy(dst + j * 16, &w[j], 2);
+		}
+		dst += 8 * 16;
+	}
+}
+
 /**
  * Get a block of data from the LA8.
  *
+ * Where libftdi supports it, the read of the next block is started before
+ * this one is demangled, so the two overlap.
+ *
  * @param ctx The struct containing private per-device-instance data. Must not
  *            be NULL. ctx->ftdic must not be NULL either.
  * @return SR_OK upon success, or SR_ERR upon errors.
  */
 SR_PRIV int la8_read_block(struct context *ctx)
 {
-	int i, byte_offset, m, mi, p, index, bytes_read;
+	int byte_offset, m, bytes_read;
+	uint8_t *buf;
 	time_t now;
 
 	/* Note: Caller checked that ctx and ctx->ftdic != NULL. */
 
 	sr_spew("la8: Reading block %d.", ctx->block_counter);
 
-	bytes_read = la8_read(ctx, ctx->mangled_buf, BS);
+	buf = ctx->mangled_buf[ctx->cur_buf];
+
+#ifdef HAVE_FTDI_READ_DATA_SUBMIT
+	if (ctx->read_tc) {
+		bytes_read = ftdi_transfer_data_done(ctx->read_tc);
+		ctx->read_tc = NULL;
+	} else
+#endif
+		bytes_read = la8_read(ctx, buf, BS);
 
 	/* If first block read got 0 bytes, retry until success or timeout. */
 	if ((bytes_read == 0) && (ctx->block_counter == 0)) {
 		do {
 			sr_spew("la8: Reading block 0 (again).");
-			bytes_read = la8_read(ctx, ctx->mangled_buf, BS);
+			bytes_read = la8_read(ctx, buf, BS);
 			/* TODO: How to handle read errors here? */
 			now = time(NULL);
 		} while ((ctx->done > now) && (bytes_read == 0));
@@ -437,54 +498,46 @@ SR_PRIV int la8_read_block(struct context *ctx)
 		return SR_ERR;
 	}
 
+	ctx->cur_buf = !ctx->cur_buf;
+
+#ifdef HAVE_FTDI_READ_DATA_SUBMIT
+	/* If this fails, the next block is read synchronously. */
+	if (ctx->block_counter < NUM_BLOCKS - 1)
+		ctx->read_tc = ftdi_read_data_submit(ctx->ftdic,
+				ctx->mangled_buf[ctx->cur_buf], BS);
+#endif
+
 	/* De-mangle the data. */
 	sr_spew("la8: Demangling block %d.", ctx->block_counter);
 	byte_offset = ctx->block_counter * BS;
 	m = byte_offset / (1024 * 1024);
-	mi = m * (1024 * 1024);
-	for (i = 0; i < BS; i++) {
-		p = i & (1 << 0);
-		index = m * 2 + (((byte_offset + i) - mi) / 2) * 16;
-		index += (ctx->divcount == 0) ? p : (1 - p);
-		ctx->final_buf[index] = ctx->mangled_buf[i];
-	}
+	demangle_block(ctx->final_buf + m * 2
+		       + ((byte_offset - m * (1024 * 1024)) / 2) * 16,
+		       buf, ctx->divcount != 0);
 
 	return SR_OK;
 }
 
 SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 {
-	int i;
-	uint8_t sample, expected_sample;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
 	int trigger_point; /* Relative trigger point (in this block). */
+	int64_t ret;
 
 	/* Note: No sanity checks on ctx/block, caller is responsible. */
 
-	/* Check if we can find the trigger condition in this block. */
+	/*
+	 * Check if we can find the trigger condition in this block. If it
+	 * was found previously, or if no trigger conditions were specified
+	 * by the user, we don't want to send an SR_DF_TRIGGER packet.
+	 */
 	trigger_point = -1;
-	expected_sample = ctx->trigger_pattern & ctx->trigger_mask;
-	for (i = 0; i < BS; i++) {
-		/* Don't continue if the trigger was found previously. */
-		if (ctx->trigger_found)
-			break;
-
-		/*
-		 * Also, don't continue if triggers are "don't care", i.e. if
-		 * no trigger conditions were specified by the user. In that
-		 * case we don't want to send an SR_DF_TRIGGER packet at all.
-		 */
-		if (ctx->trigger_mask == 0x00)
-			break;
-
-		sample = *(ctx->final_buf + (block * BS) + i);
-
-		if ((sample & ctx->trigger_mask) == expected_sample) {
-			trigger_point = i;
-			ctx->trigger_found = 1;
-			break;
-		}
+	if (!sr_trigger_fired(ctx->trigger)) {
+		ret = sr_trigger_scan(ctx->trigger,
+				      ctx->final_buf + (block * BS), BS);
+		if (ret >= 0)
+			trigger_point = ret - 1;
 	}
 
 	/* If no trigger was found, send one SR_DF_LOGIC packet. */
@@ -497,6 +550,7 @@ SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 		logic.length = BS;
 		logic.unitsize = 1;
 		logic.data = ctx->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_send(ctx->session_dev_id, &packet);
 		return;
 	}
@@ -520,6 +574,7 @@ SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 		logic.length = trigger_point;
 		logic.unitsize = 1;
 		logic.data = ctx->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_send(ctx->session_dev_id, &packet);
 	}
 
@@ -541,6 +596,7 @@ SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 		logic.length = BS - trigger_point;
 		logic.unitsize = 1;
 		logic.data = ctx->final_buf + (block * BS) + trigger_point;
+		logic.buffer = NULL;
 		sr_session_send(ctx->session_dev_id, &packet);
 	}
 }
@@ -24,6 +24,7 @@
 #include <glib.h>
 #include <ftdi.h>
 #include <stdint.h>
+#include "config.h"
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
@@ -59,10 +60,19 @@ struct context {
 	void *session_dev_id;
 
 	/**
-	 * A buffer containing some (mangled) samples from the device.
+	 * Two buffers containing some (mangled) samples from the device.
+	 * While one block is demangled, the next one is read into the other.
 	 * Format: Pretty mangled-up (due to hardware reasons), see code.
 	 */
-	uint8_t mangled_buf[BS];
+	uint8_t mangled_buf[2][BS];
+
+	/** Index of the mangled_buf[] the next block is read into. */
+	int cur_buf;
+
+#ifdef HAVE_FTDI_READ_DATA_SUBMIT
+	/** The read of the next block, if one is in flight. */
+	struct ftdi_transfer_control *read_tc;
+#endif
 
 	/**
 	 * An 8MB buffer where we'll store the de-mangled samples.
@@ -86,8 +96,11 @@ struct context {
 	/** Time (in seconds) before the trigger times out. */
 	uint64_t trigger_timeout;
 
-	/** Tells us whether an SR_DF_TRIGGER packet was already sent. */
-	int trigger_found;
+	/**
+	 * Software trigger with the same single stage, to find the trigger
+	 * point in the downloaded samples. NULL until probes are configured.
+	 */
+	struct sr_trigger *trigger;
 
 	/** TODO */
 	time_t done;
@@ -117,6 +130,7 @@ SR_PRIV int la8_close_usb_reset_sequencer(struct context *ctx);
 SR_PRIV int la8_reset(struct context *ctx);
 SR_PRIV int configure_probes(struct context *ctx, const GSList *probes);
 SR_PRIV int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate);
+SR_PRIV void la8_read_block_finish(struct context *ctx);
 SR_PRIV int la8_read_block(struct context *ctx);
 SR_PRIV void send_block_to_session_bus(struct context *ctx, int block);
 
@@ -394,6 +394,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 			logic.length = z;
 			logic.unitsize = 1;
 			logic.data = c;
+			logic.buffer = NULL;
 			sr_session_send(ctx->session_dev_id, &packet);
 			samples_received += z;
 		}
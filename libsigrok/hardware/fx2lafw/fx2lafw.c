@@ -85,8 +85,10 @@ static const struct fx2lafw_profile supported_fx2[] = {
 static const int hwcaps[] = {
 	SR_HWCAP_LOGIC_ANALYZER,
 	SR_HWCAP_SAMPLERATE,
+	SR_HWCAP_NUM_TRANSFERS,
 
 	/* These are really implemented in the driver, not the hardware. */
+	SR_HWCAP_CAPTURE_RATIO,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_CONTINUOUS,
 	0,
@@ -147,6 +149,7 @@ static libusb_context *usb_context = NULL;
 
 static int hw_dev_config_set(int dev_index, int hwcap, const void *value);
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data);
+static void update_stats(struct context *ctx);
 
 /**
  * Check the USB configuration to determine if this is an fx2lafw device.
@@ -320,15 +323,7 @@ static int configure_probes(struct context *ctx, GSList *probes)
 {
 	struct sr_probe *probe;
 	GSList *l;
-	int probe_bit, stage, i;
-	char *tc;
 
-	for (i = 0; i < NUM_TRIGGER_STAGES; i++) {
-		ctx->trigger_mask[i] = 0;
-		ctx->trigger_value[i] = 0;
-	}
-
-	stage = -1;
 	for (l = probes; l; l = l->next) {
 		probe = (struct sr_probe *)l->data;
 		if (probe->enabled == FALSE)
@@ -336,32 +331,13 @@ static int configure_probes(struct context *ctx, GSList *probes)
 
 		if (probe->index > 8)
 			ctx->sample_wide = TRUE;
-
-		probe_bit = 1 << (probe->index - 1);
-		if (!(probe->trigger))
-			continue;
-
-		stage = 0;
-		for (tc = probe->trigger; *tc; tc++) {
-			ctx->trigger_mask[stage] |= probe_bit;
-			if (*tc == '1')
-				ctx->trigger_value[stage] |= probe_bit;
-			stage++;
-			if (stage > NUM_TRIGGER_STAGES)
-				return SR_ERR;
-		}
 	}
 
-	if (stage == -1)
-		/*
-		 * We didn't configure any triggers, make sure acquisition
-		 * doesn't wait for any.
-		 */
-		ctx->trigger_stage = TRIGGER_FIRED;
-	else
-		ctx->trigger_stage = 0;
+	sr_trigger_free(ctx->trigger);
+	ctx->trigger = NULL;
 
-	return SR_OK;
+	return sr_trigger_new(probes, ctx->sample_wide ? 2 : 1,
+			      NUM_TRIGGER_STAGES, &ctx->trigger);
 }
 
 static struct context *fx2lafw_dev_new(void)
@@ -373,7 +349,7 @@ static struct context *fx2lafw_dev_new(void)
 		return NULL;
 	}
 
-	ctx->trigger_stage = TRIGGER_FIRED;
+	ctx->max_transfers = NUM_SIMUL_TRANSFERS;
 
 	return ctx;
 }
@@ -568,6 +544,7 @@ static int hw_cleanup(void)
 			continue;
 		}
 		close_dev(sdi);
+		sr_trigger_free(ctx->trigger);
 		sdi = l->data;
 		sr_dev_inst_free(sdi);
 	}
@@ -606,6 +583,9 @@ static const void *hw_dev_info_get(int dev_index, int dev_info_id)
 		return TRIGGER_TYPES;
 	case SR_DI_CUR_SAMPLERATE:
 		return &ctx->cur_samplerate;
+	case SR_DI_TRANSFER_STATS:
+		update_stats(ctx);
+		return &ctx->stats;
 	}
 
 	return NULL;
@@ -645,6 +625,23 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	} else if (hwcap == SR_HWCAP_LIMIT_SAMPLES) {
 		ctx->limit_samples = *(const uint64_t *)value;
 		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_CAPTURE_RATIO) {
+		if (*(const uint64_t *)value > 100) {
+			sr_err("fx2lafw: %s: capture ratio must be 0-100.",
+			       __func__);
+			return SR_ERR_ARG;
+		}
+		ctx->capture_ratio = *(const uint64_t *)value;
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_NUM_TRANSFERS) {
+		if (*(const uint64_t *)value < 1 ||
+		    *(const uint64_t *)value > MAX_SIMUL_TRANSFERS) {
+			sr_err("fx2lafw: %s: number of transfers must be "
+			       "1-%d.", __func__, MAX_SIMUL_TRANSFERS);
+			return SR_ERR_ARG;
+		}
+		ctx->max_transfers = *(const uint64_t *)value;
+		ret = SR_OK;
 	} else {
 		ret = SR_ERR;
 	}
@@ -652,14 +649,73 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
+static unsigned int to_bytes_per_ms(struct context *ctx)
+{
+	return ctx->cur_samplerate / 1000 * (ctx->sample_wide ? 2 : 1);
+}
+
+static size_t get_buffer_size(struct context *ctx, unsigned int ms)
+{
+	size_t s;
+
+	/* The buffer should be large enough to hold ms of data and a multiple
+	 * of 512. */
+	s = ms * to_bytes_per_ms(ctx);
+	return (s + 511) & ~511;
+}
+
+static unsigned int get_number_of_transfers(struct context *ctx)
+{
+	unsigned int n;
+
+	/* Total buffer size should be able to hold about QUEUE_MS of data */
+	n = QUEUE_MS * to_bytes_per_ms(ctx) / get_buffer_size(ctx, TRANSFER_MS);
+
+	return MAX(MIN(n, ctx->max_transfers), 1);
+}
+
+static unsigned int get_timeout(struct context *ctx)
+{
+	size_t total_size;
+	unsigned int timeout;
+
+	/* Transfers may grow up to their full buffer. */
+	total_size = get_buffer_size(ctx, MAX_TRANSFER_MS)
+		     * get_number_of_transfers(ctx);
+	timeout = total_size / to_bytes_per_ms(ctx);
+	return timeout + timeout / 4; /* Leave a headroom of 25% percent */
+}
+
+static void update_stats(struct context *ctx)
+{
+	int64_t elapsed;
+
+	elapsed = (ctx->end_time ? ctx->end_time : g_get_monotonic_time())
+		  - ctx->start_time;
+	if (ctx->start_time && elapsed > 0)
+		ctx->stats.bytes_per_sec = ctx->stats.bytes * 1000000 / elapsed;
+	if (ctx->resubmits)
+		ctx->stats.resubmit_latency_avg =
+			ctx->resubmit_latency_total / ctx->resubmits;
+	ctx->stats.overruns = ctx->latency.overruns;
+	if (ctx->num_transfers) {
+		ctx->stats.num_transfers = ctx->num_transfers;
+		ctx->stats.transfer_size = ctx->latency.transfer_size;
+	}
+}
+
 static int receive_data(int fd, int revents, void *cb_data)
 {
+	struct context *ctx = cb_data;
 	struct timeval tv;
 
 	/* Avoid compiler warnings. */
 	(void)fd;
 	(void)revents;
-	(void)cb_data;
+
+	/* The transfers completing now, the device filled since last time. */
+	latency_event_pass(&ctx->latency, g_get_monotonic_time(),
+			   ctx->pending_transfers);
 
 	tv.tv_sec = tv.tv_usec = 0;
 	libusb_handle_events_timeout(usb_context, &tv);
@@ -684,6 +740,14 @@ static void finish_acquisition(struct context *ctx)
 	struct sr_datafeed_packet packet;
 	int i;
 
+	ctx->end_time = g_get_monotonic_time();
+	update_stats(ctx);
+	sr_info("fx2lafw: %" PRIu64 " bytes at %" PRIu64 " bytes/s, %"
+		PRIu64 " overruns, resubmit latency avg %" PRIu64 "us max %"
+		PRIu64 "us.", ctx->stats.bytes, ctx->stats.bytes_per_sec,
+		ctx->stats.overruns, ctx->stats.resubmit_latency_avg,
+		ctx->stats.resubmit_latency_max);
+
 	/* Terminate session */
 	packet.type = SR_DF_END;
 	sr_session_send(ctx->session_dev_id, &packet);
@@ -697,6 +761,25 @@ static void finish_acquisition(struct context *ctx)
 
 	ctx->num_transfers = 0;
 	g_free(ctx->transfers);
+	g_free(ctx->buffers);
+	ctx->buffers = NULL;
+
+	/* Buffers frontends still hold on to stay valid. */
+	sr_buffer_pool_destroy(ctx->buffer_pool);
+	ctx->buffer_pool = NULL;
+}
+
+static unsigned int transfer_index(struct context *ctx,
+				   struct libusb_transfer *transfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_transfers; i++) {
+		if (ctx->transfers[i] == transfer)
+			break;
+	}
+
+	return i;
 }
 
 static void free_transfer(struct libusb_transfer *transfer)
@@ -704,15 +787,13 @@ static void free_transfer(struct libusb_transfer *transfer)
 	struct context *ctx = transfer->user_data;
 	unsigned int i;
 
-	g_free(transfer->buffer);
 	transfer->buffer = NULL;
 	libusb_free_transfer(transfer);
 
-	for (i = 0; i < ctx->num_transfers; i++) {
-		if (ctx->transfers[i] == transfer) {
-			ctx->transfers[i] = NULL;
-			break;
-		}
+	if ((i = transfer_index(ctx, transfer)) < ctx->num_transfers) {
+		ctx->transfers[i] = NULL;
+		sr_buffer_unref(ctx->buffers[i]);
+		ctx->buffers[i] = NULL;
 	}
 
 	ctx->submitted_transfers--;
@@ -723,12 +804,37 @@ static void free_transfer(struct libusb_transfer *transfer)
 
 static void resubmit_transfer(struct libusb_transfer *transfer)
 {
+	struct context *ctx = transfer->user_data;
+	unsigned int i;
+	uint64_t latency;
+
+	/*
+	 * If a frontend kept a reference to the buffer we sent, read the
+	 * next transfer into a fresh one from the pool.
+	 */
+	i = transfer_index(ctx, transfer);
+	if (sr_buffer_reclaim(&ctx->buffers[i]) != SR_OK) {
+		free_transfer(transfer);
+		sr_err("fx2lafw: %s: buffer malloc failed.", __func__);
+		return;
+	}
+	transfer->buffer = ctx->buffers[i]->data;
+	transfer->length = ctx->latency.transfer_size;
+
 	if (libusb_submit_transfer(transfer) != 0) {
 		free_transfer(transfer);
 		/* TODO: Stop session? */
 		/* TODO: Better error message. */
 		sr_err("fx2lafw: %s: libusb_submit_transfer error.", __func__);
+		return;
 	}
+	ctx->pending_transfers++;
+
+	latency = g_get_monotonic_time() - ctx->completion_time;
+	ctx->resubmit_latency_total += latency;
+	ctx->resubmits++;
+	ctx->stats.resubmit_latency_max =
+		MAX(ctx->stats.resubmit_latency_max, latency);
 }
 
 static void receive_transfer(struct libusb_transfer *transfer)
@@ -737,7 +843,10 @@ static void receive_transfer(struct libusb_transfer *transfer)
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
 	struct context *ctx = transfer->user_data;
-	int trigger_offset, i;
+	int64_t trigger_offset;
+	int num_matched;
+
+	ctx->pending_transfers--;
 
 	/*
 	 * If acquisition has already ended, just free any queued up
@@ -748,6 +857,10 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		return;
 	}
 
+	ctx->completion_time = g_get_monotonic_time();
+	latency_transfer_done(&ctx->latency);
+	ctx->stats.bytes += transfer->actual_length;
+
 	sr_info("fx2lafw: receive_transfer(): status %d received %d bytes.",
 		transfer->status, transfer->actual_length);
 
@@ -771,7 +884,7 @@ static void receive_transfer(struct libusb_transfer *transfer)
 
 	if (transfer->actual_length == 0 || packet_has_error) {
 		ctx->empty_transfer_count++;
-		if (ctx->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
+		if (ctx->empty_transfer_count > 2 * (int)ctx->num_transfers) {
 			/*
 			 * The FX2 gave up. End the acquisition, the frontend
 			 * will work out that the samplecount is short.
@@ -787,64 +900,36 @@ static void receive_transfer(struct libusb_transfer *transfer)
 	}
 
 	trigger_offset = 0;
-	if (ctx->trigger_stage >= 0) {
-		for (i = 0; i < cur_sample_count; i++) {
-
-			const uint16_t cur_sample = ctx->sample_wide ?
-				*((const uint16_t*)cur_buf + i) :
-				*((const uint8_t*)cur_buf + i);
-
-			if ((cur_sample & ctx->trigger_mask[ctx->trigger_stage]) ==
-				ctx->trigger_value[ctx->trigger_stage]) {
-				/* Match on this trigger stage. */
-				ctx->trigger_buffer[ctx->trigger_stage] = cur_sample;
-				ctx->trigger_stage++;
-
-				if (ctx->trigger_stage == NUM_TRIGGER_STAGES ||
-					ctx->trigger_mask[ctx->trigger_stage] == 0) {
-					/* Match on all trigger stages, we're done. */
-					trigger_offset = i + 1;
-
-					/*
-					 * TODO: Send pre-trigger buffer to session bus.
-					 * Tell the frontend we hit the trigger here.
-					 */
-					packet.type = SR_DF_TRIGGER;
-					packet.payload = NULL;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					/*
-					 * Send the samples that triggered it, since we're
-					 * skipping past them.
-					 */
-					packet.type = SR_DF_LOGIC;
-					packet.payload = &logic;
-					logic.unitsize = sizeof(*ctx->trigger_buffer);
-					logic.length = ctx->trigger_stage * logic.unitsize;
-					logic.data = ctx->trigger_buffer;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					ctx->trigger_stage = TRIGGER_FIRED;
-					break;
-				}
-			} else if (ctx->trigger_stage > 0) {
-				/*
-				 * We had a match before, but not in the next sample. However, we may
-				 * have a match on this stage in the next bit -- trigger on 0001 will
-				 * fail on seeing 00001, so we need to go back to stage 0 -- but at
-				 * the next sample from the one that matched originally, which the
-				 * counter increment at the end of the loop takes care of.
-				 */
-				i -= ctx->trigger_stage;
-				if (i < -1)
-					i = -1; /* Oops, went back past this buffer. */
-				/* Reset trigger stage. */
-				ctx->trigger_stage = 0;
-			}
+	if (!sr_trigger_fired(ctx->trigger)) {
+		trigger_offset = sr_trigger_scan(ctx->trigger, cur_buf,
+						 cur_sample_count);
+		if (trigger_offset >= 0) {
+			/* Send what the capture ratio asked for from before. */
+			ctx->num_samples += sr_trigger_send_pretrigger(
+					ctx->trigger, ctx->session_dev_id);
+
+			/* Tell the frontend we hit the trigger here. */
+			packet.type = SR_DF_TRIGGER;
+			packet.payload = NULL;
+			sr_session_send(ctx->session_dev_id, &packet);
+
+			/*
+			 * Send the samples that triggered it, since we're
+			 * skipping past them.
+			 */
+			packet.type = SR_DF_LOGIC;
+			packet.payload = &logic;
+			logic.unitsize = sample_width;
+			logic.data = (void *)sr_trigger_match(ctx->trigger,
+							      &num_matched);
+			logic.length = num_matched * logic.unitsize;
+			logic.buffer = NULL;
+			sr_session_send(ctx->session_dev_id, &packet);
+			ctx->num_samples += num_matched;
 		}
 	}
 
-	if (ctx->trigger_stage == TRIGGER_FIRED) {
+	if (sr_trigger_fired(ctx->trigger)) {
 		/* Send the incoming transfer to the session bus. */
 		const int trigger_offset_bytes = trigger_offset * sample_width;
 		packet.type = SR_DF_LOGIC;
@@ -852,63 +937,21 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		logic.length = transfer->actual_length - trigger_offset_bytes;
 		logic.unitsize = sample_width;
 		logic.data = cur_buf + trigger_offset_bytes;
+		logic.buffer = ctx->buffers[transfer_index(ctx, transfer)];
 		sr_session_send(ctx->session_dev_id, &packet);
 
-		ctx->num_samples += cur_sample_count;
+		ctx->num_samples += cur_sample_count - trigger_offset;
 		if (ctx->limit_samples &&
 			(unsigned int)ctx->num_samples > ctx->limit_samples) {
 			abort_acquisition(ctx);
 			free_transfer(transfer);
 			return;
 		}
-	} else {
-		/*
-		 * TODO: Buffer pre-trigger data in capture
-		 * ratio-sized buffer.
-		 */
 	}
 
 	resubmit_transfer(transfer);
 }
 
-static unsigned int to_bytes_per_ms(unsigned int samplerate)
-{
-	return samplerate / 1000;
-}
-
-static size_t get_buffer_size(struct context *ctx)
-{
-	size_t s;
-
-	/* The buffer should be large enough to hold 10ms of data and a multiple
-	 * of 512. */
-	s = 10 * to_bytes_per_ms(ctx->cur_samplerate);
-	return (s + 511) & ~511;
-}
-
-static unsigned int get_number_of_transfers(struct context *ctx)
-{
-	unsigned int n;
-
-	/* Total buffer size should be able to hold about 500ms of data */
-	n = 500 * to_bytes_per_ms(ctx->cur_samplerate) / get_buffer_size(ctx);
-
-	if (n > NUM_SIMUL_TRANSFERS)
-		return NUM_SIMUL_TRANSFERS;
-
-	return n;
-}
-
-static unsigned int get_timeout(struct context *ctx)
-{
-	size_t total_size;
-	unsigned int timeout;
-
-	total_size = get_buffer_size(ctx) * get_number_of_transfers(ctx);
-	timeout = total_size / to_bytes_per_ms(ctx->cur_samplerate);
-	return timeout + timeout / 4; /* Leave a headroom of 25% percent */
-}
-
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
@@ -920,7 +963,7 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	const struct libusb_pollfd **lupfd;
 	unsigned int i;
 	int ret;
-	unsigned char *buf;
+	struct sr_buffer *buf;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
 		return SR_ERR;
@@ -933,39 +976,77 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->num_samples = 0;
 	ctx->empty_transfer_count = 0;
 
+	/*
+	 * The trigger keeps the pre-trigger samples until it fires. Without
+	 * any stages it fires straight away, and keeps none.
+	 */
+	if (ctx->trigger && sr_trigger_set_pretrigger(ctx->trigger,
+			ctx->limit_samples * ctx->capture_ratio / 100) != SR_OK)
+		return SR_ERR_MALLOC;
+
+	/* Start counting afresh. */
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->pending_transfers = 0;
+	ctx->completion_time = 0;
+	ctx->end_time = 0;
+	ctx->resubmit_latency_total = 0;
+	ctx->resubmits = 0;
+	ctx->start_time = g_get_monotonic_time();
+
 	const unsigned int timeout = get_timeout(ctx);
 	const unsigned int num_transfers = get_number_of_transfers(ctx);
-	const size_t size = get_buffer_size(ctx);
+	const size_t size = get_buffer_size(ctx, MAX_TRANSFER_MS);
+
+	latency_init(&ctx->latency, to_bytes_per_ms(ctx), num_transfers,
+		     get_buffer_size(ctx, TRANSFER_MS),
+		     get_buffer_size(ctx, MIN_TRANSFER_MS), size);
 
 	ctx->transfers = g_try_malloc0(sizeof(*ctx->transfers) * num_transfers);
 	if (!ctx->transfers)
 		return SR_ERR;
 
+	ctx->buffers = g_try_malloc0(sizeof(*ctx->buffers) * num_transfers);
+	if (!ctx->buffers) {
+		g_free(ctx->transfers);
+		return SR_ERR_MALLOC;
+	}
+
+	/* Keep enough buffers around to resubmit every transfer. */
+	if ((ret = sr_buffer_pool_new(size, num_transfers,
+				      &ctx->buffer_pool)) != SR_OK) {
+		g_free(ctx->buffers);
+		g_free(ctx->transfers);
+		return ret;
+	}
+
 	ctx->num_transfers = num_transfers;
 
 	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(size))) {
+		if (sr_buffer_new(ctx->buffer_pool, &buf) != SR_OK) {
 			sr_err("fx2lafw: %s: buf malloc failed.", __func__);
 			return SR_ERR_MALLOC;
 		}
 		transfer = libusb_alloc_transfer(0);
 		libusb_fill_bulk_transfer(transfer, ctx->usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
-				receive_transfer, ctx, timeout);
+				2 | LIBUSB_ENDPOINT_IN, buf->data,
+				ctx->latency.transfer_size, receive_transfer, ctx,
+				timeout);
 		if (libusb_submit_transfer(transfer) != 0) {
 			libusb_free_transfer(transfer);
-			g_free(buf);
+			sr_buffer_unref(buf);
 			abort_acquisition(ctx);
 			return SR_ERR;
 		}
 		ctx->transfers[i] = transfer;
+		ctx->buffers[i] = buf;
 		ctx->submitted_transfers++;
+		ctx->pending_transfers++;
 	}
 
 	lupfd = libusb_get_pollfds(usb_context);
 	for (i = 0; lupfd[i]; i++)
 		sr_source_add(lupfd[i]->fd, lupfd[i]->events,
-			      timeout, receive_data, NULL);
+			      timeout, receive_data, ctx);
 	free(lupfd); /* NOT g_free()! */
 
 	packet.type = SR_DF_HEADER;
@@ -19,6 +19,7 @@
  */
 
 #include <glib.h>
+#include "latency.h"
 
 #ifndef LIBSIGROK_HARDWARE_FX2LAFW_FX2LAFW_H
 #define LIBSIGROK_HARDWARE_FX2LAFW_FX2LAFW_H
@@ -29,8 +30,18 @@
 #define TRIGGER_TYPES		"01"
 
 #define MAX_RENUM_DELAY_MS	3000
-#define NUM_SIMUL_TRANSFERS	32
-#define MAX_EMPTY_TRANSFERS	(NUM_SIMUL_TRANSFERS * 2)
+#define NUM_SIMUL_TRANSFERS	64
+#define MAX_SIMUL_TRANSFERS	256
+
+/*
+ * Transfers start out holding TRANSFER_MS of data, and are resized between
+ * MIN_TRANSFER_MS and MAX_TRANSFER_MS depending on how long the host takes
+ * to get around to completed transfers. The queue holds about QUEUE_MS.
+ */
+#define TRANSFER_MS		8
+#define MIN_TRANSFER_MS		2
+#define MAX_TRANSFER_MS		16
+#define QUEUE_MS		500
 
 #define FX2LAFW_REQUIRED_VERSION_MAJOR	1
 
@@ -40,9 +51,6 @@
 /* 6 delay states of up to 256 clock ticks */
 #define MAX_SAMPLE_DELAY	(6 * 256)
 
-/* Software trigger implementation: positive values indicate trigger stage. */
-#define TRIGGER_FIRED          -1
-
 #define DEV_CAPS_16BIT_POS	0
 
 #define DEV_CAPS_16BIT		(1 << DEV_CAPS_16BIT_POS)
@@ -74,24 +82,41 @@ struct context {
 	/* Device/capture settings */
 	uint64_t cur_samplerate;
 	uint64_t limit_samples;
+	/* Percentage of limit_samples to keep from before the trigger. */
+	uint64_t capture_ratio;
 
 	gboolean sample_wide;
 
-	uint16_t trigger_mask[NUM_TRIGGER_STAGES];
-	uint16_t trigger_value[NUM_TRIGGER_STAGES];
-	int trigger_stage;
-	uint16_t trigger_buffer[NUM_TRIGGER_STAGES];
+	/* Software trigger, NULL until probes are configured. */
+	struct sr_trigger *trigger;
 
 	int num_samples;
 	int submitted_transfers;
 	int empty_transfer_count;
 
+	/* Transfer management */
+	unsigned int max_transfers;
+	/* Transfer sizes, and how late the host gets to completed ones. */
+	struct latency latency;
+	/* Transfers handed to libusb and not completed yet. */
+	unsigned int pending_transfers;
+	int64_t start_time;
+	int64_t end_time;
+	/* When the transfer being handled completed. */
+	int64_t completion_time;
+	uint64_t resubmit_latency_total;
+	uint64_t resubmits;
+	struct sr_transfer_stats stats;
+
 	void *session_dev_id;
 
 	struct sr_usb_dev_inst *usb;
 
 	unsigned int num_transfers;
 	struct libusb_transfer **transfers;
+	/* The pool buffer each transfer reads into, sent zero-copy. */
+	struct sr_buffer_pool *buffer_pool;
+	struct sr_buffer **buffers;
 };
 
 #endif
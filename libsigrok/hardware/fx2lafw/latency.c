@@ -0,0 +1,144 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The driver resubmits a transfer from its completion callback, so
+ * counting the transfers still queued there never says whether the device
+ * ran dry: the ones completed earlier in the same event pass are already
+ * back in the queue. Instead, an event pass tells whether the device was
+ * left without a queued transfer:
+ *
+ * - If every transfer queued when the pass started completed in it, the
+ *   device filled them all before the host got to any of them.
+ * - If the last pass completing any transfers was longer ago than the
+ *   device takes to fill the whole queue, the same thing happened.
+ *
+ * Either counts as one overrun, and grows transfers straight away.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+#include "latency.h"
+
+/**
+ * Start tracking the latency of a new acquisition.
+ *
+ * @param lat The latency tracking state. Must not be NULL.
+ * @param bytes_per_ms The rate at which the device sends data.
+ * @param num_transfers The number of transfers kept queued.
+ * @param transfer_size The size transfers start out with, in bytes.
+ * @param min_transfer_size The smallest transfers get, in bytes.
+ * @param max_transfer_size The largest transfers get, in bytes.
+ */
+SR_PRIV void latency_init(struct latency *lat, unsigned int bytes_per_ms,
+			  unsigned int num_transfers, size_t transfer_size,
+			  size_t min_transfer_size, size_t max_transfer_size)
+{
+	memset(lat, 0, sizeof(*lat));
+	lat->bytes_per_ms = bytes_per_ms;
+	lat->num_transfers = num_transfers;
+	lat->transfer_size = transfer_size;
+	lat->min_transfer_size = min_transfer_size;
+	lat->max_transfer_size = max_transfer_size;
+	lat->pass_pending = num_transfers;
+}
+
+/**
+ * Note the start of an event pass, before libusb hands back the transfers
+ * which completed since the last one.
+ *
+ * @param lat The latency tracking state. Must not be NULL.
+ * @param now The current time, in us.
+ * @param pending The number of transfers submitted and not handed back.
+ */
+SR_PRIV void latency_event_pass(struct latency *lat, int64_t now,
+				unsigned int pending)
+{
+	lat->pass_time = now;
+	lat->pass_pending = pending;
+	lat->pass_completions = 0;
+	lat->pass_overrun = FALSE;
+}
+
+/* How long the device takes to fill the whole queue, in us. */
+static int64_t queue_us(const struct latency *lat)
+{
+	return (int64_t)lat->transfer_size * lat->num_transfers * 1000
+	       / lat->bytes_per_ms;
+}
+
+/*
+ * Reconsider the transfer size once every transfer has come around.
+ * If the host stalled for more than half the time it takes the device
+ * to fill the whole queue, transfers grow, so the queue holds more data.
+ * If it never stalled for more than an eighth of it, they shrink again,
+ * so data reaches the frontend sooner.
+ */
+static void adapt(struct latency *lat, gboolean overrun)
+{
+	int64_t limit;
+	size_t size;
+
+	limit = queue_us(lat);
+	size = lat->transfer_size;
+	if (overrun || lat->max_gap > limit / 2)
+		size = MIN(size * 2, lat->max_transfer_size);
+	else if (lat->max_gap < limit / 8)
+		size = MAX(((size / 2) + 511) & ~511, lat->min_transfer_size);
+
+	if (size != lat->transfer_size) {
+		sr_dbg("fx2lafw: %s: longest stall %" PRIi64 "us%s, transfer "
+		       "size now %zu.", __func__, lat->max_gap,
+		       overrun ? ", overrun" : "", size);
+		lat->transfer_size = size;
+	}
+	lat->adapt_count = 0;
+	lat->max_gap = 0;
+}
+
+/**
+ * Account for a transfer libusb handed back in the current event pass.
+ *
+ * @param lat The latency tracking state. Must not be NULL.
+ */
+SR_PRIV void latency_transfer_done(struct latency *lat)
+{
+	int64_t gap;
+	gboolean overrun;
+
+	overrun = FALSE;
+	if (lat->pass_completions++ == 0) {
+		gap = lat->last_time ? lat->pass_time - lat->last_time : 0;
+		lat->last_time = lat->pass_time;
+		lat->max_gap = MAX(lat->max_gap, gap);
+		overrun = (gap > queue_us(lat));
+	}
+	if (lat->pass_completions >= lat->pass_pending)
+		overrun = TRUE;
+
+	if (overrun && !lat->pass_overrun) {
+		lat->pass_overrun = TRUE;
+		lat->overruns++;
+		adapt(lat, TRUE);
+	} else if (++lat->adapt_count >= lat->num_transfers) {
+		adapt(lat, FALSE);
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBSIGROK_HARDWARE_FX2LAFW_LATENCY_H
+#define LIBSIGROK_HARDWARE_FX2LAFW_LATENCY_H
+
+#include <stdint.h>
+#include <glib.h>
+#include "libsigrok.h"
+
+/*
+ * How late the host gets around to completed transfers, judged from the
+ * device side: which transfers libusb hands back in one event pass, and
+ * how long ago the last pass handing back any was.
+ */
+struct latency {
+	/* Settings, fixed for an acquisition. */
+	unsigned int bytes_per_ms;
+	unsigned int num_transfers;
+	size_t min_transfer_size;
+	size_t max_transfer_size;
+
+	/* The size transfers get when they are (re)submitted. */
+	size_t transfer_size;
+
+	/* The current event pass, and how many transfers were queued then. */
+	int64_t pass_time;
+	unsigned int pass_pending;
+	unsigned int pass_completions;
+	gboolean pass_overrun;
+	/* When the last pass which completed any transfers started. */
+	int64_t last_time;
+
+	/* Completions since the transfer size was last reconsidered. */
+	unsigned int adapt_count;
+	int64_t max_gap;
+
+	/* Number of times the device was left without a queued transfer. */
+	uint64_t overruns;
+};
+
+SR_PRIV void latency_init(struct latency *lat, unsigned int bytes_per_ms,
+			  unsigned int num_transfers, size_t transfer_size,
+			  size_t min_transfer_size, size_t max_transfer_size);
+SR_PRIV void latency_event_pass(struct latency *lat, int64_t now,
+				unsigned int pending);
+SR_PRIV void latency_transfer_done(struct latency *lat);
+
+#endif
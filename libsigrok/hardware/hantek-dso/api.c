@@ -29,6 +29,9 @@
 #include <inttypes.h>
 #include <glib.h>
 #include <libusb.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 #include "config.h"
@@ -553,66 +556,132 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
+/*
+ * Voltage values are encoded as a value 0-255 (0-512 on the 5200*), where
+ * the value is a point in the range represented by the vdiv setting. There
+ * are 8 vertical divs, so e.g. 500mV/div represents 4V peak-to-peak where
+ * 0 = -2V and 255 = +2V.
+ */
+static void update_scale(struct context *ctx)
+{
+	float range;
+	int ch, v;
+
+	for (ch = 0; ch < NUM_PROBES; ch++) {
+		v = (ch == 0) ? ctx->voltage_ch1 : ctx->voltage_ch2;
+		range = ((float)vdivs[v].p / vdivs[v].q) * 8;
+		ctx->scale[ch] = range / 255;
+		/* Value is centered around 0V. */
+		ctx->offset[ch] = -(range / 2);
+	}
+}
+
+/*
+ * The device always sends data for both channels, CH2 in the first byte of
+ * every sample. If a channel is disabled, it contains a copy of the enabled
+ * channel's data. However, we only send the requested channels to the bus,
+ * CH1 first.
+ */
+static void extract_codes(const struct context *ctx,
+		const unsigned char *buf, int num_samples, uint8_t *codes)
+{
+	int i, ch;
+#ifdef __SSE2__
+	__m128i v, w, mask;
+#endif
+
+	i = 0;
+	ch = ctx->ch1_enabled ? 0 : 1;
+
+#ifdef __SSE2__
+	mask = _mm_set1_epi16(0xff);
+	if (ctx->ch1_enabled && ctx->ch2_enabled) {
+		for (; i + 8 <= num_samples; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)(buf + i * 2));
+			v = _mm_or_si128(_mm_srli_epi16(v, 8),
+					 _mm_slli_epi16(v, 8));
+			_mm_storeu_si128((__m128i *)(codes + i * 2), v);
+		}
+	} else {
+		for (; i + 16 <= num_samples; i += 16) {
+			v = _mm_loadu_si128((const __m128i *)(buf + i * 2));
+			w = _mm_loadu_si128((const __m128i *)(buf + i * 2 + 16));
+			if (ch == 0) {
+				v = _mm_srli_epi16(v, 8);
+				w = _mm_srli_epi16(w, 8);
+			} else {
+				v = _mm_and_si128(v, mask);
+				w = _mm_and_si128(w, mask);
+			}
+			_mm_storeu_si128((__m128i *)(codes + i),
+					 _mm_packus_epi16(v, w));
+		}
+	}
+#endif
+
+	/* TODO: support for 5xxx series 9-bit samples */
+	if (ctx->ch1_enabled && ctx->ch2_enabled) {
+		for (; i < num_samples; i++) {
+			codes[i * 2] = buf[i * 2 + 1];
+			codes[i * 2 + 1] = buf[i * 2];
+		}
+	} else {
+		for (; i < num_samples; i++)
+			codes[i] = buf[i * 2 + 1 - ch];
+	}
+}
+
 static void send_chunk(struct context *ctx, unsigned char *buf,
 		int num_samples)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_analog analog;
-	float ch1, ch2, range;
-	int num_probes, data_offset, i;
+	struct sr_datafeed_analog_raw analog;
+	int ch;
 
-	num_probes = (ctx->ch1_enabled && ctx->ch2_enabled) ? 2 : 1;
-	packet.type = SR_DF_ANALOG;
+	/* The ADC codes go out as they are, see sr_analog_raw_convert(). */
+	packet.type = SR_DF_ANALOG_RAW;
 	packet.payload = &analog;
 	/* TODO: support for 5xxx series 9-bit samples */
 	analog.num_samples = num_samples;
 	analog.mq = SR_MQ_VOLTAGE;
 	analog.unit = SR_UNIT_VOLT;
-	analog.data = g_try_malloc(analog.num_samples * sizeof(float) * num_probes);
-	data_offset = 0;
-	for (i = 0; i < analog.num_samples; i++) {
-		/* The device always sends data for both channels. If a channel
-		 * is disabled, it contains a copy of the enabled channel's
-		 * data. However, we only send the requested channels to the bus.
-		 *
-		 * Voltage values are encoded as a value 0-255 (0-512 on the 5200*),
-		 * where the value is a point in the range represented by the vdiv
-		 * setting. There are 8 vertical divs, so e.g. 500mV/div represents
-		 * 4V peak-to-peak where 0 = -2V and 255 = +2V.
-		 */
-		/* TODO: support for 5xxx series 9-bit samples */
-		if (ctx->ch1_enabled) {
-			range = ((float)vdivs[ctx->voltage_ch1].p / vdivs[ctx->voltage_ch1].q) * 8;
-			ch1 = range / 255 * *(buf + i * 2 + 1);
-			/* Value is centered around 0V. */
-			ch1 -= range / 2;
-			analog.data[data_offset++] = ch1;
-		}
-		if (ctx->ch2_enabled) {
-			range = ((float)vdivs[ctx->voltage_ch2].p / vdivs[ctx->voltage_ch2].q) * 8;
-			ch2 = range / 255 * *(buf + i * 2);
-			ch2 -= range / 2;
-			analog.data[data_offset++] = ch2;
-		}
+	analog.num_probes = 0;
+	for (ch = 0; ch < NUM_PROBES; ch++) {
+		if (!(ch == 0 ? ctx->ch1_enabled : ctx->ch2_enabled))
+			continue;
+		analog.scale[analog.num_probes] = ctx->scale[ch];
+		analog.offset[analog.num_probes] = ctx->offset[ch];
+		analog.num_probes++;
 	}
+	analog.unitsize = 1;
+	analog.is_signed = FALSE;
+	analog.resolution = 8;
+	/* The session copies what it queues, so one buffer does. */
+	analog.data = ctx->raw_buf;
+	extract_codes(ctx, buf, num_samples, analog.data);
 	sr_session_send(ctx->cb_data, &packet);
 
 }
 
-/* Called by libusb (as triggered by handle_event()) when a transfer comes in.
- * Only channel data comes in asynchronously, and all transfers for this are
- * queued up beforehand, so this just needs so chuck the incoming data onto
- * the libsigrok session bus.
- */
-static void receive_transfer(struct libusb_transfer *transfer)
+static void free_frame_buffers(struct context *ctx)
+{
+	g_free(ctx->framebuf);
+	g_free(ctx->raw_buf);
+	ctx->framebuf = NULL;
+	ctx->raw_buf = NULL;
+	ctx->framebuf_size = 0;
+}
+
+/* Chuck the data of an incoming transfer onto the libsigrok session bus. */
+static void receive_chunk(struct context *ctx, struct libusb_transfer *transfer)
 {
 	struct sr_datafeed_packet packet;
-	struct context *ctx;
 	int num_samples, pre;
 
-	ctx = transfer->user_data;
-	sr_dbg("hantek-dso: receive_transfer(): status %d received %d bytes",
-			transfer->status, transfer->actual_length);
+	if (ctx->dev_state != FETCH_DATA
+	    || transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		/* Acquisition stopped, drop the data. */
+		return;
 
 	if (transfer->actual_length == 0)
 		/* Nothing to send to the bus. */
@@ -664,10 +733,9 @@ static void receive_transfer(struct libusb_transfer *transfer)
 
 	ctx->samp_received += num_samples;
 
-	/* Everything in this transfer was either copied to the buffer or
-	 * sent to the session bus. */
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+	/* The frontend may have stopped the acquisition. */
+	if (ctx->dev_state != FETCH_DATA)
+		return;
 
 	if (ctx->samp_received >= ctx->framesize) {
 		/* That was the last chunk in this frame. Send the buffered
@@ -679,17 +747,62 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		/* Mark the end of this frame. */
 		packet.type = SR_DF_FRAME_END;
 		sr_session_send(ctx->cb_data, &packet);
+		if (ctx->dev_state != FETCH_DATA)
+			return;
 
 		if (ctx->limit_frames && ++ctx->num_frames == ctx->limit_frames) {
-			/* Terminate session */
-			/* TODO: don't leave pending USB transfers hanging */
+			/* Terminate session, this was the last transfer. */
+			ctx->dev_state = IDLE;
 			packet.type = SR_DF_END;
 			sr_session_send(ctx->cb_data, &packet);
 		} else {
 			ctx->dev_state = NEW_CAPTURE;
 		}
 	}
+}
+
+/* Called by libusb (as triggered by handle_event()) when a transfer comes in.
+ * Only channel data comes in asynchronously, and all transfers for this are
+ * queued up beforehand, so this just needs so chuck the incoming data onto
+ * the libsigrok session bus.
+ */
+static void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct context *ctx;
+
+	ctx = transfer->user_data;
+	sr_dbg("hantek-dso: receive_transfer(): status %d received %d bytes",
+			transfer->status, transfer->actual_length);
+
+	receive_chunk(ctx, transfer);
+
+	/* The transfer goes back to the pool, to be reused for the next frame. */
+	ctx->transfers_pending--;
+
+	/* After a stop, the last transfer to come back frees everything. */
+	if (ctx->dev_state == IDLE && !ctx->transfers_pending) {
+		dso_free_transfers(ctx);
+		free_frame_buffers(ctx);
+	}
+}
 
+/* Frame buffers are kept for the next frame, unless it's bigger. */
+static int alloc_frame_buffers(struct context *ctx)
+{
+	if (ctx->framebuf && ctx->framebuf_size >= ctx->framesize)
+		return SR_OK;
+
+	free_frame_buffers(ctx);
+	ctx->framebuf = g_try_malloc(ctx->framesize * 2);
+	ctx->raw_buf = g_try_malloc(ctx->framesize * NUM_PROBES);
+	if (!ctx->framebuf || !ctx->raw_buf) {
+		sr_err("hantek-dso: %s: frame buffer malloc failed", __func__);
+		free_frame_buffers(ctx);
+		return SR_ERR_MALLOC;
+	}
+	ctx->framebuf_size = ctx->framesize;
+
+	return SR_OK;
 }
 
 static int handle_event(int fd, int revents, void *cb_data)
@@ -697,7 +810,6 @@ static int handle_event(int fd, int revents, void *cb_data)
 	struct sr_datafeed_packet packet;
 	struct timeval tv;
 	struct context *ctx;
-	int num_probes;
 	uint32_t trigger_offset;
 	uint8_t capturestate;
 
@@ -750,8 +862,9 @@ static int handle_event(int fd, int revents, void *cb_data)
 		/* Remember where in the captured frame the trigger is. */
 		ctx->trigger_offset = trigger_offset;
 
-		num_probes = (ctx->ch1_enabled && ctx->ch2_enabled) ? 2 : 1;
-		ctx->framebuf = g_try_malloc(ctx->framesize * num_probes * 2);
+		if (alloc_frame_buffers(ctx) != SR_OK)
+			break;
+		update_scale(ctx);
 		ctx->samp_buffered = ctx->samp_received = 0;
 
 		/* Tell the scope to send us the first frame. */
@@ -829,9 +942,6 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	return SR_OK;
 }
 
-/* TODO: doesn't really cancel pending transfers so they might come in after
- * SR_DF_END is sent.
- */
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 {
 	struct sr_datafeed_packet packet;
@@ -845,8 +955,22 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 		return SR_ERR;
 
 	ctx = sdi->priv;
+	if (ctx->dev_state == IDLE)
+		/* Already stopped, or the frame limit was reached. */
+		return SR_OK;
 	ctx->dev_state = IDLE;
 
+	/*
+	 * This may be called from within receive_transfer(), so only cancel
+	 * the transfers here. The last one to come back frees them, along
+	 * with the frame buffers.
+	 */
+	dso_cancel_transfers(ctx);
+	if (!ctx->transfers_pending) {
+		dso_free_transfers(ctx);
+		free_frame_buffers(ctx);
+	}
+
 	packet.type = SR_DF_END;
 	sr_session_send(cb_data, &packet);
 
@@ -180,6 +180,19 @@ SR_PRIV int dso_open(int dev_index)
 	return SR_OK;
 }
 
+/* Wait for cancelled transfers to come back. Not for use in callbacks. */
+static void reap_transfers(struct context *ctx)
+{
+	struct timeval tv;
+	int tries;
+
+	for (tries = 0; ctx->transfers_pending && tries < 100; tries++) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		libusb_handle_events_timeout(usb_context, &tv);
+	}
+}
+
 SR_PRIV void dso_close(struct sr_dev_inst *sdi)
 {
 	struct context *ctx;
@@ -189,6 +202,10 @@ SR_PRIV void dso_close(struct sr_dev_inst *sdi)
 	if (ctx->usb->devhdl == NULL)
 		return;
 
+	dso_cancel_transfers(ctx);
+	reap_transfers(ctx);
+	dso_free_transfers(ctx);
+
 	sr_info("hantek-dso: closing device %d on %d.%d interface %d", sdi->index,
 		ctx->usb->bus, ctx->usb->address, USB_INTERFACE);
 	libusb_release_interface(ctx->usb->devhdl, USB_INTERFACE);
@@ -700,12 +717,105 @@ SR_PRIV int dso_capture_start(struct context *ctx)
 	return SR_OK;
 }
 
+/*
+ * All transfers of a frame are queued up at once, so the pool holds one
+ * transfer per packet of a frame. They are reused for every frame, until
+ * the frame size changes.
+ */
+static int alloc_transfers(struct context *ctx, libusb_transfer_cb_fn cb,
+			   int num_transfers)
+{
+	int i;
+
+	if (!(ctx->transfers = g_try_malloc0(sizeof(struct libusb_transfer *)
+					     * num_transfers))) {
+		sr_err("hantek-dso: %s: transfers malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!(ctx->transfer_buf = g_try_malloc(num_transfers
+					       * ctx->epin_maxpacketsize))) {
+		sr_err("hantek-dso: %s: buf malloc failed", __func__);
+		g_free(ctx->transfers);
+		ctx->transfers = NULL;
+		return SR_ERR_MALLOC;
+	}
+
+	ctx->num_transfers = num_transfers;
+	for (i = 0; i < num_transfers; i++) {
+		if (!(ctx->transfers[i] = libusb_alloc_transfer(0))) {
+			sr_err("hantek-dso: %s: transfer malloc failed",
+			       __func__);
+			dso_free_transfers(ctx);
+			return SR_ERR_MALLOC;
+		}
+		libusb_fill_bulk_transfer(ctx->transfers[i], ctx->usb->devhdl,
+				DSO_EP_IN | LIBUSB_ENDPOINT_IN,
+				ctx->transfer_buf + i * ctx->epin_maxpacketsize,
+				ctx->epin_maxpacketsize, cb, ctx, 40);
+	}
+
+	return SR_OK;
+}
+
+SR_PRIV void dso_free_transfers(struct context *ctx)
+{
+	int i;
+
+	if (!ctx->transfers)
+		return;
+
+	if (ctx->transfers_pending) {
+		sr_err("hantek-dso: %s: %d transfers still pending, leaking them",
+		       __func__, ctx->transfers_pending);
+		ctx->transfers = NULL;
+		ctx->transfer_buf = NULL;
+		ctx->num_transfers = 0;
+		return;
+	}
+
+	for (i = 0; i < ctx->num_transfers; i++)
+		libusb_free_transfer(ctx->transfers[i]);
+	g_free(ctx->transfers);
+	g_free(ctx->transfer_buf);
+	ctx->transfers = NULL;
+	ctx->transfer_buf = NULL;
+	ctx->num_transfers = 0;
+}
+
+/*
+ * Cancel the pending transfers. This may be called from within a transfer
+ * callback, so the cancelled transfers are left for the session's poll
+ * loop (or dso_close()) to reap.
+ */
+SR_PRIV void dso_cancel_transfers(struct context *ctx)
+{
+	int i;
+
+	if (!ctx->transfers_pending)
+		return;
+
+	for (i = 0; i < ctx->num_transfers; i++)
+		libusb_cancel_transfer(ctx->transfers[i]);
+}
+
 SR_PRIV int dso_get_channeldata(struct context *ctx, libusb_transfer_cb_fn cb)
 {
-	struct libusb_transfer *transfer;
 	int num_transfers, ret, i;
 	uint8_t cmdstring[2];
-	unsigned char *buf;
+
+	if (ctx->transfers_pending) {
+		sr_err("hantek-dso: %s: previous frame still pending", __func__);
+		return SR_ERR;
+	}
+
+	/* TODO: dso-2xxx only */
+	num_transfers = ctx->framesize * sizeof(unsigned short) / ctx->epin_maxpacketsize;
+	if (ctx->transfers && ctx->num_transfers != num_transfers)
+		dso_free_transfers(ctx);
+	if (!ctx->transfers
+	    && (ret = alloc_transfers(ctx, cb, num_transfers)) != SR_OK)
+		return ret;
 
 	sr_dbg("hantek-dso: sending CMD_GET_CHANNELDATA");
 
@@ -717,25 +827,14 @@ SR_PRIV int dso_get_channeldata(struct context *ctx, libusb_transfer_cb_fn cb)
 		return SR_ERR;
 	}
 
-	/* TODO: dso-2xxx only */
-	num_transfers = ctx->framesize * sizeof(unsigned short) / ctx->epin_maxpacketsize;
 	sr_dbg("hantek-dso: queueing up %d transfers", num_transfers);
 	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(ctx->epin_maxpacketsize))) {
-			sr_err("hantek-dso: %s: buf malloc failed", __func__);
-			return SR_ERR_MALLOC;
-		}
-		transfer = libusb_alloc_transfer(0);
-		libusb_fill_bulk_transfer(transfer, ctx->usb->devhdl,
-				DSO_EP_IN | LIBUSB_ENDPOINT_IN, buf,
-				ctx->epin_maxpacketsize, cb, ctx, 40);
-		if ((ret = libusb_submit_transfer(transfer)) != 0) {
+		if ((ret = libusb_submit_transfer(ctx->transfers[i])) != 0) {
 			sr_err("failed to submit transfer: %d", ret);
-			/* TODO: Free them all. */
-			libusb_free_transfer(transfer);
-			g_free(buf);
+			dso_cancel_transfers(ctx);
 			return SR_ERR;
 		}
+		ctx->transfers_pending++;
 	}
 
 	return SR_OK;
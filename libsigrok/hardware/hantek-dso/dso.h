@@ -201,6 +201,17 @@ struct context {
 	unsigned int samp_buffered;
 	unsigned int trigger_offset;
 	unsigned char *framebuf;
+	unsigned int framebuf_size;
+	/* Transfers for a whole frame, reused for every frame. */
+	struct libusb_transfer **transfers;
+	unsigned char *transfer_buf;
+	int num_transfers;
+	int transfers_pending;
+	/* ADC codes of an SR_DF_ANALOG_RAW packet, for up to a whole frame. */
+	uint8_t *raw_buf;
+	/* Volts per ADC code, and volts at code 0, for CH1 and CH2. */
+	float scale[NUM_PROBES];
+	float offset[NUM_PROBES];
 };
 
 SR_PRIV int dso_open(int dev_index);
@@ -212,5 +223,7 @@ SR_PRIV int dso_get_capturestate(struct context *ctx, uint8_t *capturestate,
 		uint32_t *trigger_offset);
 SR_PRIV int dso_capture_start(struct context *ctx);
 SR_PRIV int dso_get_channeldata(struct context *ctx, libusb_transfer_cb_fn cb);
+SR_PRIV void dso_cancel_transfers(struct context *ctx);
+SR_PRIV void dso_free_transfers(struct context *ctx);
 
 #endif
@@ -692,6 +692,111 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
+/*
+ * Append a run of 'length' samples of the current sample value, merging
+ * it with the previous run if that has the same value.
+ */
+static int add_run(struct context *ctx, uint64_t length)
+{
+	unsigned char *values;
+	uint64_t *lengths;
+	unsigned int n;
+
+	n = ctx->num_runs;
+	if (n > 0 && !memcmp(ctx->rle_values + (n - 1) * 4, ctx->sample, 4)) {
+		ctx->rle_lengths[n - 1] += length;
+		return SR_OK;
+	}
+
+	/* One spare run, for splitting a run at the trigger point. */
+	if (n + 1 >= ctx->runs_allocated) {
+		ctx->runs_allocated = MAX(ctx->runs_allocated * 2, 1024);
+		values = g_try_realloc(ctx->rle_values, ctx->runs_allocated * 4);
+		if (values)
+			ctx->rle_values = values;
+		lengths = g_try_realloc(ctx->rle_lengths,
+				ctx->runs_allocated * sizeof(uint64_t));
+		if (lengths)
+			ctx->rle_lengths = lengths;
+		if (!values || !lengths) {
+			sr_err("ols: %s: run buffer malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+	}
+
+	memcpy(ctx->rle_values + n * 4, ctx->sample, 4);
+	ctx->rle_lengths[n] = length;
+	ctx->num_runs++;
+
+	return SR_OK;
+}
+
+/*
+ * The OLS sends its sample buffer backwards, so the runs were collected
+ * in reverse order. Put them in order, and split the run holding the
+ * trigger point (if any) in two, so the trigger falls between two runs.
+ *
+ * Returns the number of runs before the trigger point.
+ */
+static unsigned int order_runs(struct context *ctx)
+{
+	unsigned char value[4];
+	uint64_t length, start;
+	unsigned int i, j;
+
+	for (i = 0, j = ctx->num_runs - 1; i < j; i++, j--) {
+		memcpy(value, ctx->rle_values + i * 4, 4);
+		memcpy(ctx->rle_values + i * 4, ctx->rle_values + j * 4, 4);
+		memcpy(ctx->rle_values + j * 4, value, 4);
+		length = ctx->rle_lengths[i];
+		ctx->rle_lengths[i] = ctx->rle_lengths[j];
+		ctx->rle_lengths[j] = length;
+	}
+
+	if (ctx->trigger_at <= 0)
+		return 0;
+
+	start = 0;
+	for (i = 0; i < ctx->num_runs; i++) {
+		if ((uint64_t)ctx->trigger_at <= start)
+			return i;
+		if ((uint64_t)ctx->trigger_at < start + ctx->rle_lengths[i])
+			break;
+		start += ctx->rle_lengths[i];
+	}
+	if (i == ctx->num_runs)
+		return i;
+
+	/* The trigger is in the middle of run i. */
+	memmove(ctx->rle_values + (i + 1) * 4, ctx->rle_values + i * 4,
+		(ctx->num_runs - i) * 4);
+	memmove(ctx->rle_lengths + i + 1, ctx->rle_lengths + i,
+		(ctx->num_runs - i) * sizeof(uint64_t));
+	ctx->rle_lengths[i] = ctx->trigger_at - start;
+	ctx->rle_lengths[i + 1] -= ctx->rle_lengths[i];
+	ctx->num_runs++;
+
+	return i + 1;
+}
+
+static void send_runs(struct context *ctx, void *cb_data,
+		      unsigned int first, unsigned int num)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic_rle logic_rle;
+
+	if (num == 0)
+		return;
+
+	packet.type = SR_DF_LOGIC_RLE;
+	packet.payload = &logic_rle;
+	logic_rle.num_runs = num;
+	logic_rle.unitsize = 4;
+	logic_rle.values = ctx->rle_values + first * 4;
+	logic_rle.lengths = ctx->rle_lengths + first;
+	sr_session_send(cb_data, &packet);
+}
+
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_datafeed_packet packet;
@@ -700,6 +805,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 	struct context *ctx;
 	GSList *l;
 	int num_channels, offset, i, j;
+	unsigned int num_pretrigger;
 	unsigned char byte;
 
 	/* Find this device's ctx struct by its fd. */
@@ -725,14 +831,17 @@ static int receive_data(int fd, int revents, void *cb_data)
 		 */
 		sr_source_remove(fd);
 		sr_source_add(fd, G_IO_IN, 30, receive_data, cb_data);
-		ctx->raw_sample_buf = g_try_malloc(ctx->limit_samples * 4);
-		if (!ctx->raw_sample_buf) {
-			sr_err("ols: %s: ctx->raw_sample_buf malloc failed",
-			       __func__);
-			return FALSE;
+		/* In RLE mode, the runs are collected as they come in. */
+		if (!(ctx->flag_reg & FLAG_RLE)) {
+			ctx->raw_sample_buf = g_try_malloc(ctx->limit_samples * 4);
+			if (!ctx->raw_sample_buf) {
+				sr_err("ols: %s: ctx->raw_sample_buf malloc "
+				       "failed", __func__);
+				return FALSE;
+			}
+			/* fill with 1010... for debugging */
+			memset(ctx->raw_sample_buf, 0x82, ctx->limit_samples * 4);
 		}
-		/* fill with 1010... for debugging */
-		memset(ctx->raw_sample_buf, 0x82, ctx->limit_samples * 4);
 	}
 
 	num_channels = 0;
@@ -805,14 +914,17 @@ static int receive_data(int fd, int revents, void *cb_data)
 				sr_dbg("ols: full sample 0x%.8x", *(int *)ctx->sample);
 			}
 
-			/* the OLS sends its sample buffer backwards.
-			 * store it in reverse order here, so we can dump
-			 * this on the session bus later.
-			 */
-			offset = (ctx->limit_samples - ctx->num_samples) * 4;
-			for (i = 0; i <= ctx->rle_count; i++) {
-				memcpy(ctx->raw_sample_buf + offset + (i * 4),
-				       ctx->sample, 4);
+			if (ctx->flag_reg & FLAG_RLE) {
+				/* Keep the run as it is, it's put in order later. */
+				if (add_run(ctx, ctx->rle_count + 1) != SR_OK)
+					return FALSE;
+			} else {
+				/* the OLS sends its sample buffer backwards.
+				 * store it in reverse order here, so we can dump
+				 * this on the session bus later.
+				 */
+				offset = (ctx->limit_samples - ctx->num_samples) * 4;
+				memcpy(ctx->raw_sample_buf + offset, ctx->sample, 4);
 			}
 			memset(ctx->sample, 0, 4);
 			ctx->num_bytes = 0;
@@ -824,7 +936,23 @@ static int receive_data(int fd, int revents, void *cb_data)
 		 * we've acquired all the samples we asked for -- we're done.
 		 * Send the (properly-ordered) buffer to the frontend.
 		 */
-		if (ctx->trigger_at != -1) {
+		if (ctx->flag_reg & FLAG_RLE) {
+			num_pretrigger = 0;
+			if (ctx->num_runs > 0)
+				num_pretrigger = order_runs(ctx);
+			if (ctx->trigger_at != -1) {
+				send_runs(ctx, cb_data, 0, num_pretrigger);
+				packet.type = SR_DF_TRIGGER;
+				sr_session_send(cb_data, &packet);
+			}
+			send_runs(ctx, cb_data, num_pretrigger,
+				  ctx->num_runs - num_pretrigger);
+			g_free(ctx->rle_values);
+			g_free(ctx->rle_lengths);
+			ctx->rle_values = NULL;
+			ctx->rle_lengths = NULL;
+			ctx->num_runs = ctx->runs_allocated = 0;
+		} else if (ctx->trigger_at != -1) {
 			/* a trigger was set up, so we need to tell the frontend
 			 * about it.
 			 */
@@ -836,6 +964,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 				logic.unitsize = 4;
 				logic.data = ctx->raw_sample_buf +
 					(ctx->limit_samples - ctx->num_samples) * 4;
+				logic.buffer = NULL;
 				sr_session_send(cb_data, &packet);
 			}
 
@@ -850,6 +979,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 			logic.unitsize = 4;
 			logic.data = ctx->raw_sample_buf + ctx->trigger_at * 4 +
 				(ctx->limit_samples - ctx->num_samples) * 4;
+			logic.buffer = NULL;
 			sr_session_send(cb_data, &packet);
 		} else {
 			/* no trigger was used */
@@ -859,9 +989,11 @@ static int receive_data(int fd, int revents, void *cb_data)
 			logic.unitsize = 4;
 			logic.data = ctx->raw_sample_buf +
 				(ctx->limit_samples - ctx->num_samples) * 4;
+			logic.buffer = NULL;
 			sr_session_send(cb_data, &packet);
 		}
 		g_free(ctx->raw_sample_buf);
+		ctx->raw_sample_buf = NULL;
 
 		serial_flush(fd);
 		serial_close(fd);
@@ -989,6 +1121,7 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->flag_reg |= ~(changrp_mask << 2) & 0x3c;
 	ctx->flag_reg |= FLAG_FILTER;
 	ctx->rle_count = 0;
+	ctx->num_runs = 0;
 	data = (ctx->flag_reg << 24) | ((ctx->flag_reg << 8) & 0xff0000);
 	if (send_longcommand(ctx->serial->fd, CMD_SET_FLAGS, data) != SR_OK)
 		return SR_ERR;
@@ -88,6 +88,14 @@ struct context {
 	unsigned char sample[4];
 	unsigned char tmp_sample[4];
 	unsigned char *raw_sample_buf;
+	/*
+	 * In RLE mode, the samples are kept as runs instead: 4 bytes of
+	 * sample value and a length per run, in the order they came in.
+	 */
+	unsigned char *rle_values;
+	uint64_t *rle_lengths;
+	unsigned int num_runs;
+	unsigned int runs_allocated;
 
 	struct sr_serial_dev_inst *serial;
 };
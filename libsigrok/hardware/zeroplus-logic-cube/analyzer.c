@@ -347,6 +347,27 @@ SR_PRIV int analyzer_read_data(libusb_device_handle *devh, void *buffer,
 	return gl_read_bulk(devh, buffer, size);
 }
 
+SR_PRIV void analyzer_fill_read_start_transfer(
+					 struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 unsigned char *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data)
+{
+	gl_fill_read_bulk_start_transfer(transfer, devh, buffer, size,
+					 callback, user_data);
+}
+
+SR_PRIV void analyzer_fill_read_transfer(struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 void *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data)
+{
+	gl_fill_bulk_transfer(transfer, devh, buffer, size, callback,
+			      user_data);
+}
+
 SR_PRIV void analyzer_read_stop(libusb_device_handle *devh)
 {
 	analyzer_write_status(devh, 3, STATUS_FLAG_20);
@@ -549,6 +570,16 @@ SR_PRIV void analyzer_wait_data(libusb_device_handle *devh)
 	analyzer_wait(devh, STATUS_READY | 8, STATUS_BUSY);
 }
 
+SR_PRIV int analyzer_data_ready(libusb_device_handle *devh)
+{
+	int status;
+
+	if ((status = gl_reg_read(devh, DEV_STATUS)) < 0)
+		return status;
+
+	return (status & (STATUS_READY | 8)) && !(status & STATUS_BUSY);
+}
+
 SR_PRIV int analyzer_decompress(void *input, unsigned int input_len,
 				void *output, unsigned int output_len)
 {
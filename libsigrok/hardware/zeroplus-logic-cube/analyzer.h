@@ -98,11 +98,23 @@ SR_PRIV void analyzer_wait(libusb_device_handle *devh, int set, int unset);
 SR_PRIV void analyzer_read_start(libusb_device_handle *devh);
 SR_PRIV int analyzer_read_data(libusb_device_handle *devh, void *buffer,
 			       unsigned int size);
+SR_PRIV void analyzer_fill_read_start_transfer(
+					 struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 unsigned char *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data);
+SR_PRIV void analyzer_fill_read_transfer(struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 void *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data);
 SR_PRIV void analyzer_read_stop(libusb_device_handle *devh);
 SR_PRIV void analyzer_start(libusb_device_handle *devh);
 SR_PRIV void analyzer_configure(libusb_device_handle *devh);
 
 SR_PRIV void analyzer_wait_button(libusb_device_handle *devh);
 SR_PRIV void analyzer_wait_data(libusb_device_handle *devh);
+SR_PRIV int analyzer_data_ready(libusb_device_handle *devh);
 
 #endif
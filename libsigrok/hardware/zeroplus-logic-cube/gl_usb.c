@@ -89,19 +89,30 @@ static int gl_read_data(libusb_device_handle *devh)
 	return (ret == 1) ? packet[0] : ret;
 }
 
-SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
-			 unsigned int size)
+SR_PRIV int gl_read_bulk_start(libusb_device_handle *devh, unsigned int size)
 {
 	unsigned char packet[8] =
 	    { 0, 0, 0, 0, size & 0xff, (size & 0xff00) >> 8,
 	      (size & 0xff0000) >> 16, (size & 0xff000000) >> 24 };
-	int ret, transferred = 0;
+	int ret;
 
 	ret = libusb_control_transfer(devh, CTRL_OUT, 0x4, REQ_READBULK,
 				      0, packet, 8, TIMEOUT);
-	if (ret != 8)
+	if (ret != 8) {
 		sr_err("zp: %s: libusb_control_transfer returned %d.",
 		       __func__, ret);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
+			 unsigned int size)
+{
+	int ret, transferred = 0;
+
+	gl_read_bulk_start(devh, size);
 
 	ret = libusb_bulk_transfer(devh, EP1_BULK_IN, buffer, size,
 				   &transferred, TIMEOUT);
@@ -110,6 +121,39 @@ SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
 	return transferred;
 }
 
+/*
+ * Set up an asynchronous REQ_READBULK control transfer, which announces the
+ * next bulk read. 'buffer' must hold LIBUSB_CONTROL_SETUP_SIZE + 8 bytes,
+ * and stay valid until the transfer completes.
+ */
+SR_PRIV void gl_fill_read_bulk_start_transfer(struct libusb_transfer *transfer,
+				   libusb_device_handle *devh,
+				   unsigned char *buffer, unsigned int size,
+				   libusb_transfer_cb_fn callback,
+				   void *user_data)
+{
+	unsigned char *packet = buffer + LIBUSB_CONTROL_SETUP_SIZE;
+
+	libusb_fill_control_setup(buffer, CTRL_OUT, 0x4, REQ_READBULK, 0, 8);
+	packet[0] = packet[1] = packet[2] = packet[3] = 0;
+	packet[4] = size & 0xff;
+	packet[5] = (size & 0xff00) >> 8;
+	packet[6] = (size & 0xff0000) >> 16;
+	packet[7] = (size & 0xff000000) >> 24;
+	libusb_fill_control_transfer(transfer, devh, buffer, callback,
+				     user_data, TIMEOUT);
+}
+
+SR_PRIV void gl_fill_bulk_transfer(struct libusb_transfer *transfer,
+				   libusb_device_handle *devh, void *buffer,
+				   unsigned int size,
+				   libusb_transfer_cb_fn callback,
+				   void *user_data)
+{
+	libusb_fill_bulk_transfer(transfer, devh, EP1_BULK_IN, buffer, size,
+				  callback, user_data, TIMEOUT);
+}
+
 SR_PRIV int gl_reg_write(libusb_device_handle *devh, unsigned int reg,
 		 unsigned int val)
 {
@@ -35,8 +35,19 @@
 #include <libusb.h>
 #include "libsigrok.h"
 
+SR_PRIV int gl_read_bulk_start(libusb_device_handle *devh, unsigned int size);
 SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
 			 unsigned int size);
+SR_PRIV void gl_fill_read_bulk_start_transfer(struct libusb_transfer *transfer,
+				   libusb_device_handle *devh,
+				   unsigned char *buffer, unsigned int size,
+				   libusb_transfer_cb_fn callback,
+				   void *user_data);
+SR_PRIV void gl_fill_bulk_transfer(struct libusb_transfer *transfer,
+				   libusb_device_handle *devh, void *buffer,
+				   unsigned int size,
+				   libusb_transfer_cb_fn callback,
+				   void *user_data);
 SR_PRIV int gl_reg_write(libusb_device_handle *devh, unsigned int reg,
 			 unsigned int val);
 SR_PRIV int gl_reg_read(libusb_device_handle *devh, unsigned int reg);
@@ -43,6 +43,33 @@
 
 #define PACKET_SIZE			2048	/* ?? */
 
+/*
+ * Every bulk read of the sample memory has to be announced to the device
+ * with a REQ_READBULK request of the same size first, so it's downloaded
+ * one packet at a time. The announce of the next packet goes out while
+ * the bulk read of the one before runs, so up to NUM_READS packets are
+ * announced and not read yet; with 1, announces and reads alternate.
+ * Packets are passed on zero-copy; this many buffers are kept around for
+ * the ones frontends hold on to.
+ */
+#define NUM_READS			2
+#define NUM_BUFFERS			4
+
+/* How often to check whether the capture is done, in ms. */
+#define POLL_INTERVAL			10
+
+/* One packet of the download: its announce, and its bulk read. */
+struct read {
+	struct context *ctx;
+	struct libusb_transfer *ctrl_transfer;
+	struct libusb_transfer *bulk_transfer;
+	unsigned char ctrl_buf[LIBUSB_CONTROL_SETUP_SIZE + 8];
+	gboolean ctrl_busy;
+	gboolean bulk_busy;
+	unsigned int size;
+	struct sr_buffer *buffer;
+};
+
 typedef struct {
 	unsigned short pid;
 	char model_name[64];
@@ -154,9 +181,36 @@ struct context {
 	uint8_t trigger_value[NUM_TRIGGER_STAGES];
 	// uint8_t trigger_buffer[NUM_TRIGGER_STAGES];
 
+	void *session_dev_id;
+	int state;
+	gboolean aborted;
+	/* Time of the last device status check, in us. */
+	gint64 status_time;
+	/* Sample memory bytes which haven't been announced, or read, yet. */
+	uint64_t bytes_to_announce;
+	uint64_t bytes_left;
+	/* The reads, used in turn, and the next one to announce. */
+	struct read reads[NUM_READS];
+	unsigned int next_read;
+	/* Transfers submitted and not completed yet. */
+	unsigned int in_flight;
+	/* Set while receive_bulk() sends a packet to the session. */
+	gboolean in_callback;
+	struct sr_buffer_pool *buffer_pool;
+
 	struct sr_usb_dev_inst *usb;
 };
 
+enum {
+	STATE_IDLE,
+	/* Waiting for the device to fill its sample memory. */
+	STATE_WAITING,
+	/* Downloading the sample memory. */
+	STATE_DOWNLOADING,
+	/* The last transfer is done, the download needs to be wrapped up. */
+	STATE_DONE,
+};
+
 static int hw_dev_config_set(int dev_index, int hwcap, const void *value);
 
 static unsigned int get_memory_size(int type)
@@ -354,6 +408,13 @@ static int hw_init(const char *devinfo)
 	memset(ctx->trigger_mask, 0, NUM_TRIGGER_STAGES);
 	memset(ctx->trigger_value, 0, NUM_TRIGGER_STAGES);
 	// memset(ctx->trigger_buffer, 0, NUM_TRIGGER_STAGES);
+	ctx->state = STATE_IDLE;
+	memset(ctx->reads, 0, sizeof(ctx->reads));
+	for (i = 0; i < NUM_READS; i++)
+		ctx->reads[i].ctx = ctx;
+	ctx->in_flight = 0;
+	ctx->in_callback = FALSE;
+	ctx->buffer_pool = NULL;
 
 	if (libusb_init(&usb_context) != 0) {
 		sr_err("zp: Failed to initialize USB.");
@@ -627,18 +688,328 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	}
 }
 
+/*
+ * End the acquisition: stop the download if there was one, free its
+ * transfers and buffers, and send SR_DF_END.
+ */
+static void acquisition_end(struct context *ctx)
+{
+	struct sr_datafeed_packet packet;
+	const struct libusb_pollfd **lupfd;
+	struct read *read;
+	int i;
+
+	if (ctx->state != STATE_WAITING)
+		analyzer_read_stop(ctx->usb->devhdl);
+	if (ctx->aborted)
+		analyzer_reset(ctx->usb->devhdl);
+
+	lupfd = libusb_get_pollfds(usb_context);
+	for (i = 0; lupfd[i]; i++)
+		sr_source_remove(lupfd[i]->fd);
+	free(lupfd); /* NOT g_free()! */
+
+	/* libusb still owns transfers in flight, leaking them is all we can do. */
+	if (ctx->in_flight)
+		sr_err("zp: %s: %u transfers are still in flight.", __func__,
+		       ctx->in_flight);
+	for (i = 0; i < NUM_READS; i++) {
+		read = &ctx->reads[i];
+		if (!ctx->in_flight) {
+			libusb_free_transfer(read->ctrl_transfer);
+			libusb_free_transfer(read->bulk_transfer);
+		}
+		read->ctrl_transfer = read->bulk_transfer = NULL;
+		read->ctrl_busy = read->bulk_busy = FALSE;
+		/* Buffers frontends still hold on to stay valid. */
+		if (read->buffer)
+			sr_buffer_unref(read->buffer);
+		read->buffer = NULL;
+	}
+	ctx->in_flight = 0;
+	if (ctx->buffer_pool)
+		sr_buffer_pool_destroy(ctx->buffer_pool);
+	ctx->buffer_pool = NULL;
+	ctx->state = STATE_IDLE;
+
+	packet.type = SR_DF_END;
+	sr_session_send(ctx->session_dev_id, &packet);
+}
+
+static void receive_ctrl(struct libusb_transfer *transfer);
+static void receive_bulk(struct libusb_transfer *transfer);
+
+/*
+ * Announce the next packet to the device, receive_ctrl() then reads it.
+ * The announce goes out once the bulk read of the packet before it is
+ * submitted, and its read slot is free again.
+ */
+static int announce_next(struct context *ctx)
+{
+	struct read *read, *prev;
+
+	read = &ctx->reads[ctx->next_read];
+	prev = &ctx->reads[(ctx->next_read + NUM_READS - 1) % NUM_READS];
+	if (ctx->aborted || ctx->bytes_to_announce == 0 || prev->ctrl_busy
+	    || read->ctrl_busy || read->bulk_busy)
+		return SR_OK;
+
+	/*
+	 * If a frontend kept a reference to the buffer we sent from this
+	 * slot, read the packet into a fresh one from the pool.
+	 */
+	if (sr_buffer_reclaim(&read->buffer) != SR_OK) {
+		sr_err("zp: %s: buffer malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	read->size = MIN(ctx->bytes_to_announce, PACKET_SIZE);
+	analyzer_fill_read_start_transfer(read->ctrl_transfer, ctx->usb->devhdl,
+			read->ctrl_buf, read->size, receive_ctrl, read);
+	if (libusb_submit_transfer(read->ctrl_transfer) != 0) {
+		sr_err("zp: %s: libusb_submit_transfer failed.", __func__);
+		return SR_ERR;
+	}
+	read->ctrl_busy = TRUE;
+	ctx->in_flight++;
+	ctx->bytes_to_announce -= read->size;
+	ctx->next_read = (ctx->next_read + 1) % NUM_READS;
+
+	return SR_OK;
+}
+
+/* Cancel the transfers in flight, their callbacks still run. */
+static void cancel_transfers(struct context *ctx)
+{
+	int i;
+
+	for (i = 0; i < NUM_READS; i++) {
+		if (ctx->reads[i].ctrl_busy)
+			libusb_cancel_transfer(ctx->reads[i].ctrl_transfer);
+		if (ctx->reads[i].bulk_busy)
+			libusb_cancel_transfer(ctx->reads[i].bulk_transfer);
+	}
+}
+
+/* Cancel the transfers in flight, and wait for them to come back. */
+static void reap_transfers(struct context *ctx)
+{
+	struct timeval tv;
+
+	cancel_transfers(ctx);
+	tv.tv_sec = 0;
+	tv.tv_usec = POLL_INTERVAL * 1000;
+	while (ctx->in_flight) {
+		if (libusb_handle_events_timeout(usb_context, &tv) != 0)
+			break;
+	}
+}
+
+/*
+ * The download is over, one way or another. If it was aborted, the
+ * transfers still in flight are cancelled. Once they all came back,
+ * receive_data() wraps it up: the transfer callbacks mustn't do
+ * synchronous I/O.
+ */
+static void download_done(struct context *ctx, gboolean aborted)
+{
+	if (aborted) {
+		ctx->aborted = TRUE;
+		cancel_transfers(ctx);
+	}
+	if (ctx->in_flight == 0)
+		ctx->state = STATE_DONE;
+}
+
+static void receive_ctrl(struct libusb_transfer *transfer)
+{
+	struct read *read = transfer->user_data;
+	struct context *ctx = read->ctx;
+
+	read->ctrl_busy = FALSE;
+	ctx->in_flight--;
+
+	if (ctx->aborted) {
+		download_done(ctx, TRUE);
+		return;
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		sr_err("zp: %s: read request failed with status %d.",
+		       __func__, transfer->status);
+		download_done(ctx, TRUE);
+		return;
+	}
+
+	/* Bulk reads complete in the order they were submitted. */
+	analyzer_fill_read_transfer(read->bulk_transfer, ctx->usb->devhdl,
+			read->buffer->data, read->size, receive_bulk, read);
+	if (libusb_submit_transfer(read->bulk_transfer) != 0) {
+		sr_err("zp: %s: libusb_submit_transfer failed.", __func__);
+		download_done(ctx, TRUE);
+		return;
+	}
+	read->bulk_busy = TRUE;
+	ctx->in_flight++;
+
+	/* Announce the next packet while this one is read. */
+	if (announce_next(ctx) != SR_OK)
+		download_done(ctx, TRUE);
+}
+
+static void receive_bulk(struct libusb_transfer *transfer)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct read *read = transfer->user_data;
+	struct context *ctx = read->ctx;
+
+	read->bulk_busy = FALSE;
+	ctx->in_flight--;
+
+	if (!ctx->aborted && transfer->actual_length > 0) {
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.length = transfer->actual_length & ~3;
+		logic.unitsize = 4;
+		logic.data = transfer->buffer;
+		logic.buffer = read->buffer;
+		/* The frontend may stop the acquisition from in here. */
+		ctx->in_callback = TRUE;
+		sr_session_send(ctx->session_dev_id, &packet);
+		ctx->in_callback = FALSE;
+	}
+
+	if (!ctx->aborted && transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		sr_err("zp: %s: transfer failed with status %d.", __func__,
+		       transfer->status);
+		ctx->aborted = TRUE;
+	}
+
+	ctx->bytes_left -= transfer->length;
+	if (ctx->aborted || ctx->bytes_left == 0) {
+		download_done(ctx, ctx->aborted);
+		return;
+	}
+
+	if (announce_next(ctx) != SR_OK)
+		download_done(ctx, TRUE);
+}
+
+static int start_download(struct context *ctx)
+{
+	struct read *read;
+	int ret, i;
+
+	sr_info("zp: Stop address    = 0x%x",
+		analyzer_get_stop_address(ctx->usb->devhdl));
+	sr_info("zp: Now address     = 0x%x",
+		analyzer_get_now_address(ctx->usb->devhdl));
+	sr_info("zp: Trigger address = 0x%x",
+		analyzer_get_trigger_address(ctx->usb->devhdl));
+
+	analyzer_read_start(ctx->usb->devhdl);
+	ctx->state = STATE_DOWNLOADING;
+	ctx->bytes_left = ctx->memory_size * 4 / PACKET_SIZE * PACKET_SIZE;
+	ctx->bytes_to_announce = ctx->bytes_left;
+	ctx->next_read = 0;
+	if (ctx->bytes_left == 0) {
+		download_done(ctx, FALSE);
+		return SR_OK;
+	}
+
+	if ((ret = sr_buffer_pool_new(PACKET_SIZE, NUM_BUFFERS,
+				      &ctx->buffer_pool)) != SR_OK) {
+		sr_err("zp: %s: buffer malloc failed.", __func__);
+		download_done(ctx, TRUE);
+		return ret;
+	}
+
+	for (i = 0; i < NUM_READS; i++) {
+		read = &ctx->reads[i];
+		if ((ret = sr_buffer_new(ctx->buffer_pool,
+					 &read->buffer)) != SR_OK) {
+			sr_err("zp: %s: buffer malloc failed.", __func__);
+			download_done(ctx, TRUE);
+			return ret;
+		}
+		if (!(read->ctrl_transfer = libusb_alloc_transfer(0))
+		    || !(read->bulk_transfer = libusb_alloc_transfer(0))) {
+			sr_err("zp: %s: transfer malloc failed.", __func__);
+			download_done(ctx, TRUE);
+			return SR_ERR_MALLOC;
+		}
+	}
+
+	if ((ret = announce_next(ctx)) != SR_OK)
+		download_done(ctx, TRUE);
+
+	return ret;
+}
+
+/*
+ * While waiting, check whether the device filled its sample memory, and
+ * start the download once it did. Then handle the download's transfers.
+ */
+static int receive_data(int fd, int revents, void *cb_data)
+{
+	struct context *ctx = cb_data;
+	struct timeval tv;
+	gint64 now;
+	int ret;
+
+	/* Avoid compiler warnings. */
+	(void)fd;
+	(void)revents;
+
+	if (ctx->state == STATE_WAITING) {
+		/* Every libusb fd times out at once, only check once. */
+		now = g_get_monotonic_time();
+		if (now - ctx->status_time < POLL_INTERVAL * 1000)
+			return TRUE;
+		ctx->status_time = now;
+
+		if ((ret = analyzer_data_ready(ctx->usb->devhdl)) == 0)
+			return TRUE;
+		if (ret < 0) {
+			sr_err("zp: %s: failed to read device status.",
+			       __func__);
+			ctx->aborted = TRUE;
+			acquisition_end(ctx);
+			return TRUE;
+		}
+		start_download(ctx);
+	}
+
+	if (ctx->state == STATE_DOWNLOADING) {
+		tv.tv_sec = tv.tv_usec = 0;
+		libusb_handle_events_timeout(usb_context, &tv);
+		/*
+		 * Stopped by a frontend from within receive_bulk(): the
+		 * session loop might not run again, so reap the other
+		 * transfers in flight here.
+		 */
+		if (ctx->aborted && ctx->state == STATE_DOWNLOADING) {
+			reap_transfers(ctx);
+			ctx->state = STATE_DONE;
+		}
+	}
+
+	if (ctx->state == STATE_DONE)
+		acquisition_end(ctx);
+
+	return TRUE;
+}
+
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
 	struct sr_datafeed_header header;
 	struct sr_datafeed_meta_logic meta;
-	uint64_t samples_read;
-	int res;
-	unsigned int packet_num;
-	unsigned char *buf;
+	const struct libusb_pollfd **lupfd;
 	struct context *ctx;
+	int i;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
 		sr_err("zp: %s: sdi was NULL", __func__);
@@ -650,19 +1021,19 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR_ARG;
 	}
 
+	if (ctx->state != STATE_IDLE) {
+		sr_err("zp: %s: acquisition already running", __func__);
+		return SR_ERR;
+	}
+
+	ctx->session_dev_id = cb_data;
+	ctx->aborted = FALSE;
+
 	/* push configured settings to device */
 	analyzer_configure(ctx->usb->devhdl);
 
 	analyzer_start(ctx->usb->devhdl);
 	sr_info("zp: Waiting for data");
-	analyzer_wait_data(ctx->usb->devhdl);
-
-	sr_info("zp: Stop address    = 0x%x",
-		analyzer_get_stop_address(ctx->usb->devhdl));
-	sr_info("zp: Now address     = 0x%x",
-		analyzer_get_now_address(ctx->usb->devhdl));
-	sr_info("zp: Trigger address = 0x%x",
-		analyzer_get_trigger_address(ctx->usb->devhdl));
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = &header;
@@ -677,33 +1048,18 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	meta.num_probes = ctx->num_channels;
 	sr_session_send(cb_data, &packet);
 
-	if (!(buf = g_try_malloc(PACKET_SIZE))) {
-		sr_err("zp: %s: buf malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	samples_read = 0;
-	analyzer_read_start(ctx->usb->devhdl);
-	/* Send the incoming transfer to the session bus. */
-	for (packet_num = 0; packet_num < (ctx->memory_size * 4 / PACKET_SIZE);
-	     packet_num++) {
-		res = analyzer_read_data(ctx->usb->devhdl, buf, PACKET_SIZE);
-		sr_info("zp: Tried to read %llx bytes, actually read %x bytes",
-			PACKET_SIZE, res);
-
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = PACKET_SIZE;
-		logic.unitsize = 4;
-		logic.data = buf;
-		sr_session_send(cb_data, &packet);
-		samples_read += res / 4;
-	}
-	analyzer_read_stop(ctx->usb->devhdl);
-	g_free(buf);
-
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
+	/*
+	 * The libusb fds are polled from the start, so the session loop
+	 * times out every POLL_INTERVAL to check the device status, and
+	 * handles the download's transfers once it started.
+	 */
+	ctx->state = STATE_WAITING;
+	ctx->status_time = g_get_monotonic_time();
+	lupfd = libusb_get_pollfds(usb_context);
+	for (i = 0; lupfd[i]; i++)
+		sr_source_add(lupfd[i]->fd, lupfd[i]->events,
+			      POLL_INTERVAL, receive_data, ctx);
+	free(lupfd); /* NOT g_free()! */
 
 	return SR_OK;
 }
@@ -711,12 +1067,11 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 /* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 {
-	struct sr_datafeed_packet packet;
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
 
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
+	/* Avoid compiler warnings. */
+	(void)cb_data;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
 		sr_err("zp: %s: sdi was NULL", __func__);
@@ -728,8 +1083,25 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 		return SR_ERR_BUG;
 	}
 
-	analyzer_reset(ctx->usb->devhdl);
-	/* TODO: Need to cancel and free any queued up transfers. */
+	if (ctx->state == STATE_IDLE)
+		return SR_OK;
+
+	ctx->aborted = TRUE;
+
+	/*
+	 * Stopped by a frontend from within receive_bulk(): receive_data()
+	 * reaps the other transfers in flight, and ends the acquisition
+	 * once the callback returns.
+	 */
+	if (ctx->in_callback)
+		return SR_OK;
+
+	/*
+	 * Otherwise the session loop might not run anymore, so reap the
+	 * transfers in flight here.
+	 */
+	reap_transfers(ctx);
+	acquisition_end(ctx);
 
 	return SR_OK;
 }
@@ -45,6 +45,8 @@ SR_API struct sr_hwcap_option sr_hwcap_options[] = {
 	{SR_HWCAP_FILTER, SR_T_CHAR, "Filter targets", "filter"},
 	{SR_HWCAP_VDIV, SR_T_RATIONAL_VOLT, "Volts/div", "vdiv"},
 	{SR_HWCAP_COUPLING, SR_T_CHAR, "Coupling", "coupling"},
+	{SR_HWCAP_NUM_TRANSFERS, SR_T_UINT64, "USB transfers in flight",
+			"transfers"},
 	{SR_HWCAP_MODEL, SR_T_KEYVALUE, "Model", "model"},
 	{SR_HWCAP_CONN, SR_T_CHAR, "Connection", "connect"},
 	{SR_HWCAP_SERIALCOMM, SR_T_CHAR, "Serial communication", "serialcomm"},
@@ -26,11 +26,12 @@
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
-#define CHUNKSIZE             (512 * 1024)
+#define DEFAULT_PACKET_SIZE   (512 * 1024)
 #define DEFAULT_NUM_PROBES    8
 
 struct context {
 	uint64_t samplerate;
+	uint64_t packet_size;
 };
 
 static int format_match(const char *filename)
@@ -56,6 +57,7 @@ static int init(struct sr_input *in)
 
 	num_probes = DEFAULT_NUM_PROBES;
 	ctx->samplerate = 0;
+	ctx->packet_size = DEFAULT_PACKET_SIZE;
 
 	if(in->param) {
 		param = g_hash_table_lookup(in->param, "numprobes");
@@ -70,6 +72,13 @@ static int init(struct sr_input *in)
 			if (sr_parse_sizestring(param, &ctx->samplerate) != SR_OK)
 				return SR_ERR;
 		}
+
+		param = g_hash_table_lookup(in->param, "packetsize");
+		if (param) {
+			if (sr_parse_sizestring(param, &ctx->packet_size) != SR_OK
+			    || ctx->packet_size < 1)
+				return SR_ERR;
+		}
 	}
 
 	/* Create a virtual device. */
@@ -90,9 +99,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	struct sr_datafeed_logic logic;
-	unsigned char buffer[CHUNKSIZE];
-	int fd, size, num_probes;
+	int fd, ret, num_probes;
 	struct context *ctx;
 
 	ctx = in->internal;
@@ -116,15 +123,9 @@ static int loadfile(struct sr_input *in, const char *filename)
 	meta.num_probes = num_probes;
 	sr_session_send(in->vdev, &packet);
 
-	/* chop up the input file into chunks and feed it into the session bus */
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
-	logic.unitsize = (num_probes + 7) / 8;
-	logic.data = buffer;
-	while ((size = read(fd, buffer, CHUNKSIZE)) > 0) {
-		logic.length = size;
-		sr_session_send(in->vdev, &packet);
-	}
+	/* chop up the input file into packets and feed it into the session bus */
+	ret = sr_input_send_file(in->vdev, fd, G_MAXUINT64,
+				 (num_probes + 7) / 8, ctx->packet_size);
 	close(fd);
 
 	/* end of stream */
@@ -134,7 +135,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 	g_free(ctx);
 	in->internal = NULL;
 
-	return SR_OK;
+	return ret;
 }
 
 SR_PRIV struct sr_input_format input_binary = {
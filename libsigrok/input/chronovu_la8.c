@@ -128,9 +128,8 @@ static int loadfile(struct sr_input *in, const char *filename)
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	struct sr_datafeed_logic logic;
-	uint8_t buf[PACKET_SIZE], divcount;
-	int i, fd, size, num_probes;
+	uint8_t divcount;
+	int fd, ret, num_probes;
 	uint64_t samplerate;
 
 	/* TODO: Use glib functions! GIOChannel, g_fopen, etc. */
@@ -171,19 +170,11 @@ static int loadfile(struct sr_input *in, const char *filename)
 
 	/* Send data packets to the session bus. */
 	sr_dbg("la8 in: %s: sending SR_DF_LOGIC data packets", __func__);
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
-	logic.unitsize = (num_probes + 7) / 8;
-	logic.data = buf;
 
 	/* Send 8MB of total data to the session bus in small chunks. */
-	for (i = 0; i < NUM_PACKETS; i++) {
-		/* TODO: Handle errors, handle incomplete reads. */
-		size = read(fd, buf, PACKET_SIZE);
-		logic.length = size;
-		sr_session_send(in->vdev, &packet);
-	}
-	close(fd); /* FIXME */
+	ret = sr_input_send_file(in->vdev, fd, NUM_PACKETS * PACKET_SIZE,
+				 (num_probes + 7) / 8, PACKET_SIZE);
+	close(fd);
 
 	/* Send end packet to the session bus. */
 	sr_dbg("la8 in: %s: sending SR_DF_END", __func__);
@@ -191,7 +182,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 	packet.payload = NULL;
 	sr_session_send(in->vdev, &packet);
 
-	return SR_OK;
+	return ret;
 }
 
 SR_PRIV struct sr_input_format input_chronovu_la8 = {
@@ -17,9 +17,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h" /* First, for large file support. */
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+/*
+ * Size of the window of a file which is mapped at a time. Mapping the
+ * whole file would run out of address space on 32-bit hosts.
+ */
+#define MAP_WINDOW (64 * 1024 * 1024)
+
 extern SR_PRIV struct sr_input_format input_chronovu_la8;
 extern SR_PRIV struct sr_input_format input_binary;
 
@@ -34,3 +49,154 @@ SR_API struct sr_input_format **sr_input_list(void)
 {
 	return input_module_list;
 }
+
+static void send_logic(struct sr_dev *vdev, const uint8_t *data,
+		       uint64_t len, int unitsize, uint64_t packet_size)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	uint64_t pos;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = unitsize;
+	logic.buffer = NULL;
+	for (pos = 0; pos < len; pos += logic.length) {
+		logic.length = MIN(packet_size, len - pos);
+		logic.data = (void *)(data + pos);
+		sr_session_send(vdev, &packet);
+	}
+}
+
+/*
+ * Send the file window by window, straight out of its mapping. The
+ * number of bytes sent tells whether the file can still be read instead,
+ * should mapping fail.
+ */
+static int send_mapped(struct sr_dev *vdev, int fd, uint64_t size,
+		       int unitsize, uint64_t packet_size, uint64_t *sent)
+{
+#ifdef HAVE_SYS_MMAN_H
+	uint8_t *map;
+	uint64_t pos, off, len, avail;
+	long pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	for (pos = 0; pos < size; pos += avail, *sent = pos) {
+		/* Windows start on a page, but packets on a whole sample. */
+		off = pos - pos % pagesize;
+		len = MIN((uint64_t)MAP_WINDOW, size - off);
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, off);
+		if (map == MAP_FAILED) {
+			sr_dbg("input: %s: failed to map file: %s",
+			       __func__, g_strerror(errno));
+			return SR_ERR;
+		}
+		madvise(map, len, MADV_SEQUENTIAL);
+
+		avail = (off + len - pos) / unitsize * unitsize;
+		send_logic(vdev, map + (pos - off), avail, unitsize,
+			   packet_size);
+		munmap(map, len);
+
+		/* A trailing partial sample is dropped. */
+		if (avail == 0)
+			break;
+	}
+
+	return SR_OK;
+#else
+	(void)vdev;
+	(void)fd;
+	(void)size;
+	(void)unitsize;
+	(void)packet_size;
+	(void)sent;
+
+	return SR_ERR;
+#endif
+}
+
+static int send_read(struct sr_dev *vdev, int fd, uint64_t size,
+		     int unitsize, uint64_t packet_size)
+{
+	uint8_t *buf;
+	uint64_t pos, fill;
+	ssize_t ret;
+
+	ret = 0;
+	if (!(buf = g_try_malloc(packet_size))) {
+		sr_err("input: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	/* Partial reads are collected, so packets hold whole samples. */
+	fill = 0;
+	for (pos = 0; pos < size; pos += ret) {
+		ret = read(fd, buf + fill, MIN(packet_size - fill, size - pos));
+		if (ret <= 0)
+			break;
+		fill += ret;
+		if (fill == packet_size) {
+			send_logic(vdev, buf, fill, unitsize, packet_size);
+			fill = 0;
+		}
+	}
+	send_logic(vdev, buf, fill / unitsize * unitsize, unitsize,
+		   packet_size);
+	g_free(buf);
+
+	if (ret < 0) {
+		sr_err("input: %s: read failed: %s", __func__,
+		       g_strerror(errno));
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Send the samples in a file as SR_DF_LOGIC packets.
+ *
+ * Regular files are mapped into memory a window at a time, and the
+ * packets point straight into the mapping, so the samples are never
+ * copied on the way in. Anything else (e.g. a pipe) is read instead.
+ * The packets have no buffer, so their data is only valid during the
+ * datafeed callback.
+ *
+ * @param vdev The input's virtual device. Must not be NULL.
+ * @param fd The file, positioned at its start.
+ * @param size The maximum number of bytes to send.
+ * @param unitsize The number of bytes per sample. Must be >= 1.
+ * @param packet_size The maximum number of bytes per packet. It is
+ *                    rounded down to whole samples.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR upon errors.
+ */
+SR_PRIV int sr_input_send_file(struct sr_dev *vdev, int fd, uint64_t size,
+			       int unitsize, uint64_t packet_size)
+{
+	struct stat st;
+	uint64_t sent;
+
+	packet_size = packet_size / unitsize * unitsize;
+	if (packet_size == 0) {
+		sr_err("input: %s: packet size is below one sample", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size = MIN(size, (uint64_t)st.st_size);
+		sent = 0;
+		if (send_mapped(vdev, fd, size, unitsize, packet_size,
+				&sent) == SR_OK)
+			return SR_OK;
+		if (sent > 0) {
+			sr_err("input: %s: failed to map file", __func__);
+			return SR_ERR;
+		}
+	}
+
+	return send_read(vdev, fd, size, unitsize, packet_size);
+}
@@ -85,6 +85,8 @@ SR_PRIV void sr_hw_cleanup_all(void);
 
 SR_PRIV int sr_session_send(struct sr_dev *dev,
 			    struct sr_datafeed_packet *packet);
+SR_PRIV void sr_session_deliver(sr_datafeed_callback_t cb, struct sr_dev *dev,
+				struct sr_datafeed_packet *packet);
 
 /* Generic device instances */
 SR_PRIV struct sr_dev_inst *sr_dev_inst_new(int index, int status,
@@ -96,6 +98,88 @@ SR_PRIV int sr_source_remove(int fd);
 SR_PRIV int sr_source_add(int fd, int events, int timeout,
 			  sr_receive_data_callback_t cb, void *cb_data);
 
+/*--- session_thread.c ------------------------------------------------------*/
+
+SR_PRIV int sr_session_thread_start(void);
+SR_PRIV int sr_session_thread_stop(void);
+SR_PRIV int sr_session_thread_queue(struct sr_dev *dev,
+				    struct sr_datafeed_packet *packet);
+
+/*--- trigger.c -------------------------------------------------------------*/
+
+struct sr_trigger;
+
+SR_PRIV int sr_trigger_new(const GSList *probes, int unitsize,
+			   int max_stages, struct sr_trigger **trig);
+SR_PRIV void sr_trigger_free(struct sr_trigger *trig);
+SR_PRIV int sr_trigger_set_pretrigger(struct sr_trigger *trig,
+				      uint64_t num_samples);
+SR_PRIV void sr_trigger_reset(struct sr_trigger *trig);
+SR_PRIV gboolean sr_trigger_fired(const struct sr_trigger *trig);
+SR_PRIV int64_t sr_trigger_scan(struct sr_trigger *trig,
+				const uint8_t *samples, uint64_t num_samples);
+SR_PRIV const uint8_t *sr_trigger_match(const struct sr_trigger *trig,
+					int *num_samples);
+SR_PRIV uint64_t sr_trigger_send_pretrigger(struct sr_trigger *trig,
+					    void *cb_data);
+
+/*--- input/input.c ---------------------------------------------------------*/
+
+SR_PRIV int sr_input_send_file(struct sr_dev *vdev, int fd, uint64_t size,
+			       int unitsize, uint64_t packet_size);
+
+/*--- bitplane.c ------------------------------------------------------------*/
+
+SR_PRIV uint64_t sr_bitplane_bound(uint64_t num_samples, int unitsize);
+SR_PRIV void sr_bitplane_encode(const uint8_t *samples, uint64_t num_samples,
+				int unitsize, uint8_t *out, uint64_t *out_len);
+SR_PRIV int sr_bitplane_decode(const uint8_t *in, uint64_t in_len,
+			       int unitsize, uint8_t *samples,
+			       uint64_t max_samples, uint64_t *num_samples);
+
+/*--- session_codec.c -------------------------------------------------------*/
+
+/* A session file member to be compressed or decompressed. */
+struct sr_codec_job {
+	gboolean compress;
+	/* One of SR_SESSION_CODEC_*. */
+	int codec;
+	/* Bytes per sample, for SR_SESSION_CODEC_BITPLANE. */
+	int unitsize;
+	const uint8_t *in;
+	uint64_t in_len;
+	uint8_t *out;
+	uint64_t out_size;
+	/*
+	 * Results: the output's length, and the CRC-32 of the zip member's
+	 * uncompressed data.
+	 */
+	uint64_t out_len;
+	uint32_t crc;
+	int ret;
+	/* For the job's owner. */
+	void *priv;
+	gboolean done;
+};
+
+struct sr_codec_pipeline;
+
+/* Size of each member a session file's sample data is split into. */
+#define SESSION_MEMBER_SIZE (4 * 1024 * 1024)
+
+SR_PRIV uint64_t sr_codec_bound(int codec, uint64_t len);
+SR_PRIV const char *sr_codec_name(int codec);
+SR_PRIV int sr_codec_from_name(const char *name);
+SR_PRIV int sr_codec_run(struct sr_codec_job *job);
+SR_PRIV int sr_codec_pipeline_new(struct sr_codec_pipeline **pl);
+SR_PRIV void sr_codec_pipeline_destroy(struct sr_codec_pipeline *pl,
+				       GDestroyNotify job_free);
+SR_PRIV gboolean sr_codec_pipeline_full(const struct sr_codec_pipeline *pl);
+SR_PRIV void sr_codec_pipeline_push(struct sr_codec_pipeline *pl,
+				    struct sr_codec_job *job);
+SR_PRIV struct sr_codec_job *sr_codec_pipeline_pop(struct sr_codec_pipeline *pl,
+						   gboolean wait);
+
 /*--- hardware/common/serial.c ----------------------------------------------*/
 
 SR_PRIV GSList *list_serial_ports(void);
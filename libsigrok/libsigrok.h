@@ -55,6 +55,7 @@ extern "C" {
 #define SR_ERR_SAMPLERATE    -5 /* Incorrect samplerate */
 
 #define SR_MAX_NUM_PROBES    64 /* Limited by uint64_t. */
+#define SR_MAX_ANALOG_PROBES 8
 #define SR_MAX_PROBENAME_LEN 32
 
 /* Handy little macros */
@@ -134,6 +135,8 @@ enum {
 	SR_DF_META_ANALOG,
 	SR_DF_FRAME_BEGIN,
 	SR_DF_FRAME_END,
+	SR_DF_LOGIC_RLE,
+	SR_DF_ANALOG_RAW,
 };
 
 /* sr_datafeed_analog.mq values */
@@ -174,10 +177,47 @@ struct sr_datafeed_meta_logic {
 	uint64_t samplerate;
 };
 
+/* A pool of sample buffers, see sr_buffer_pool_new(). */
+struct sr_buffer_pool;
+
+/*
+ * A reference-counted sample buffer, handed out by a struct sr_buffer_pool.
+ * It returns to its pool when the last reference is released.
+ */
+struct sr_buffer {
+	volatile int refcount;
+	struct sr_buffer_pool *pool;
+	uint64_t size;
+	uint8_t *data;
+};
+
 struct sr_datafeed_logic {
 	uint64_t length;
 	uint16_t unitsize;
 	void *data;
+	/*
+	 * If not NULL, 'data' points into this buffer, and a datafeed
+	 * callback can keep the data beyond the callback by taking a
+	 * reference with sr_buffer_ref() instead of copying it.
+	 */
+	struct sr_buffer *buffer;
+};
+
+/*
+ * Run-length encoded logic samples: 'num_runs' runs of identical samples,
+ * the i-th of which repeats values[i] (of 'unitsize' bytes) lengths[i]
+ * times. Drivers which see long stretches without any change (or get
+ * timestamped changes from the hardware) send these instead of expanding
+ * them into SR_DF_LOGIC packets. Datafeed callbacks which weren't
+ * registered with sr_session_datafeed_callback_rle_add() get the samples
+ * expanded into SR_DF_LOGIC packets instead.
+ */
+struct sr_datafeed_logic_rle {
+	uint64_t num_runs;
+	uint16_t unitsize;
+	void *values;
+	/* Number of samples in each run, never 0. */
+	uint64_t *lengths;
 };
 
 struct sr_datafeed_meta_analog {
@@ -191,6 +231,30 @@ struct sr_datafeed_analog {
 	float *data;
 };
 
+/*
+ * Analog samples as the ADC delivered them: 'num_samples' samples of
+ * 'num_probes' interleaved codes each, every code 'unitsize' (1 or 2)
+ * bytes in host byte order. Code c of probe p stands for the value
+ * c * scale[p] + offset[p], of which 'resolution' bits are significant.
+ * Drivers send these instead of SR_DF_ANALOG packets, so callbacks which
+ * only store or forward samples don't pay for the conversion to float, see
+ * sr_analog_raw_convert(). Datafeed callbacks which weren't registered
+ * with sr_session_datafeed_callback_analog_raw_add() get the samples
+ * converted into SR_DF_ANALOG packets instead.
+ */
+struct sr_datafeed_analog_raw {
+	int num_samples;
+	int mq;
+	int unit;
+	int num_probes;
+	uint16_t unitsize;
+	gboolean is_signed;
+	int resolution;
+	float scale[SR_MAX_ANALOG_PROBES];
+	float offset[SR_MAX_ANALOG_PROBES];
+	void *data;
+};
+
 struct sr_input {
 	struct sr_input_format *format;
 	GHashTable *param;
@@ -223,13 +287,39 @@ struct sr_output_format {
 		     uint64_t *length_out);
 	int (*event) (struct sr_output *o, int event_type, uint8_t **data_out,
 		      uint64_t *length_out);
+	/*
+	 * Optional: handles SR_DF_LOGIC_RLE data without expanding it. The
+	 * values have the same unit size as the data passed to data().
+	 */
+	int (*data_rle) (struct sr_output *o,
+			 const struct sr_datafeed_logic_rle *rle,
+			 uint8_t **data_out, uint64_t *length_out);
 };
 
+/* A compiled probe filter, see sr_filter_new(). */
+struct sr_filter;
+
 struct sr_datastore {
 	/* Size in bytes of the number of units stored in this datastore */
 	int ds_unitsize;
-	unsigned int num_units; /* TODO: uint64_t */
-	GSList *chunklist;
+	uint64_t num_units;
+	/* Array of chunks, each holding DATASTORE_CHUNKSIZE units */
+	uint8_t **chunks;
+	/* Number of chunks in use, and number of slots allocated in 'chunks' */
+	unsigned int num_chunks;
+	unsigned int chunks_allocated;
+	/* The last chunk in 'chunks', and the number of bytes used in it */
+	uint8_t *tail;
+	unsigned int tail_fill;
+	/*
+	 * Backing file of a disk-backed datastore, or -1 if the chunks live
+	 * in heap memory. In a disk-backed datastore, only the chunks from
+	 * 'first_mapped' up to the tail are mapped (at most 'max_mapped'
+	 * of them), all other entries in 'chunks' are NULL.
+	 */
+	int fd;
+	unsigned int first_mapped;
+	unsigned int max_mapped;
 };
 
 /*
@@ -377,6 +467,20 @@ enum {
 	 */
 	SR_HWCAP_CONTINUOUS,
 
+
+	/*--- Later additions -----------------------------------------------*/
+
+	/*
+	 * New capabilities go here, so the values of the ones above don't
+	 * change for frontends built against an older libsigrok.
+	 */
+
+	/** The device supports specifying how the capturefile is encoded. */
+	SR_HWCAP_CAPTURE_CODEC,
+
+	/** Maximum number of USB transfers kept in flight. */
+	SR_HWCAP_NUM_TRANSFERS,
+
 };
 
 struct sr_hwcap_option {
@@ -448,6 +552,27 @@ enum {
 	SR_DI_VDIVS,
 	/* Coupling options */
 	SR_DI_COUPLING,
+	/* Transfer statistics of the last acquisition (struct sr_transfer_stats) */
+	SR_DI_TRANSFER_STATS,
+};
+
+/*
+ * Statistics a driver keeps about the USB transfers of an acquisition,
+ * to tell whether the host keeps up with the device.
+ */
+struct sr_transfer_stats {
+	/* Number of bytes received. */
+	uint64_t bytes;
+	/* Average rate at which they were received, in bytes per second. */
+	uint64_t bytes_per_sec;
+	/* Number of times no transfer was left queued to receive data. */
+	uint64_t overruns;
+	/* Time from a transfer's completion to its resubmission, in us. */
+	uint64_t resubmit_latency_avg;
+	uint64_t resubmit_latency_max;
+	/* Number of transfers, and the size they last had, in bytes. */
+	uint64_t num_transfers;
+	uint64_t transfer_size;
 };
 
 /*
@@ -481,14 +606,58 @@ struct sr_dev_driver {
 	int (*dev_acquisition_stop) (int dev_index, void *session_dev_id);
 };
 
+/* Datafeed statistics of a threaded session. */
+struct sr_session_stats {
+	/* Number of packets sent by the drivers. */
+	uint64_t packets;
+	/* Number of packets dropped because a consumer's ring was full. */
+	uint64_t dropped;
+	/* Number of times the acquisition thread waited for a consumer. */
+	uint64_t stalls;
+};
+
+/* How the sample data in a session file is compressed. */
+enum {
+	/* deflate, as zip members usually are */
+	SR_SESSION_CODEC_DEFLATE,
+	/* deflate's fastest level, for captures which must be saved quickly */
+	SR_SESSION_CODEC_DEFLATE_FAST,
+	/* no compression at all */
+	SR_SESSION_CODEC_NONE,
+	/* probes transposed into bit planes, then deflate */
+	SR_SESSION_CODEC_BITPLANE,
+};
+
+/* A session file written during capture, see sr_session_save_start(). */
+struct sr_session_save;
+
+/* A session file opened for random access, see sr_session_file_open(). */
+struct sr_session_file;
+
 struct sr_session {
 	/* List of struct sr_dev* */
 	GSList *devs;
 	/* list of sr_receive_data_callback_t */
 	GSList *datafeed_callbacks;
+	/* The datafeed callbacks which handle SR_DF_LOGIC_RLE themselves. */
+	GSList *rle_callbacks;
+	/* The datafeed callbacks which handle SR_DF_ANALOG_RAW themselves. */
+	GSList *analog_raw_callbacks;
 	GTimeVal starttime;
 	gboolean running;
 
+	/*
+	 * Threaded mode: drivers run on the thread which starts the session,
+	 * each datafeed callback runs on a thread of its own, fed through a
+	 * ring of 'ring_size' packets. See sr_session_threaded_set().
+	 */
+	gboolean threaded;
+	unsigned int ring_size;
+	gboolean ring_drop;
+	GThread *acquisition_thread;
+	volatile gint stop_requested;
+	struct sr_session_stats thread_stats;
+
 	unsigned int num_sources;
 
 	/* Both "sources" and "pollfds" are of the same size and contain pairs of
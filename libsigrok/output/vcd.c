@@ -21,25 +21,65 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <glib.h>
 #include "config.h"
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+/* VCD identifiers are made up of the printable ASCII characters. */
+#define ID_CHARS 94
+#define ID_MAX_LEN 4
+
+/* Longest timestamp line: '#', a 64-bit number and a newline. */
+#define TIMESTAMP_MAX_LEN (1 + 20 + 1)
+
 struct context {
 	int num_enabled_probes;
 	int unitsize;
 	char *probelist[SR_MAX_NUM_PROBES + 1];
-	int *prevbits;
+	char ids[SR_MAX_NUM_PROBES][ID_MAX_LEN + 1];
+	int id_len[SR_MAX_NUM_PROBES];
+	/* Bits of the enabled probes in a sample. */
+	uint64_t mask;
 	GString *header;
 	uint64_t prevsample;
 	int period;
 	uint64_t samplerate;
+	uint64_t samplecount;
+	/* Most output a single sample can produce. */
+	uint64_t max_sample_len;
+	/*
+	 * The output buffer. It's handed to the caller with each chunk of
+	 * output, and the next one is allocated at the size the last one
+	 * ended up with, so it doesn't need to grow again.
+	 */
+	char *out;
+	uint64_t out_len;
+	uint64_t out_size;
 };
 
 static const char *vcd_header_comment = "\
 $comment\n  Acquisition with %d/%d probes at %s\n$end\n";
 
+/*
+ * Make up the identifier of a probe: one character for the first 94
+ * probes, more after that.
+ */
+static int make_id(char *id, int index)
+{
+	int len;
+
+	len = 0;
+	do {
+		id[len++] = (char)('!' + index % ID_CHARS);
+		index /= ID_CHARS;
+	} while (index-- > 0 && len < ID_MAX_LEN);
+	id[len] = '\0';
+
+	return len;
+}
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
@@ -63,13 +103,16 @@ static int init(struct sr_output *o)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
 	}
-	if (ctx->num_enabled_probes > 94) {
-		sr_err("vcd out: VCD only supports 94 probes.");
-		return SR_ERR;
-	}
-
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+	ctx->mask = ctx->num_enabled_probes == 64 ? ~(uint64_t)0 :
+		    ((uint64_t)1 << ctx->num_enabled_probes) - 1;
+	ctx->max_sample_len = TIMESTAMP_MAX_LEN;
+	for (i = 0; i < ctx->num_enabled_probes; i++) {
+		ctx->id_len[i] = make_id(ctx->ids[i], i);
+		/* Value, identifier, newline. */
+		ctx->max_sample_len += 1 + ctx->id_len[i] + 1;
+	}
 	ctx->header = g_string_sized_new(512);
 	num_probes = g_slist_length(o->dev->probes);
 
@@ -118,26 +161,20 @@ static int init(struct sr_output *o)
 
 	/* Wires / channels */
 	for (i = 0; i < ctx->num_enabled_probes; i++) {
-		g_string_append_printf(ctx->header, "$var wire 1 %c %s $end\n",
-				(char)('!' + i), ctx->probelist[i]);
+		g_string_append_printf(ctx->header, "$var wire 1 %s %s $end\n",
+				ctx->ids[i], ctx->probelist[i]);
 	}
 
 	g_string_append(ctx->header, "$upscope $end\n"
 			"$enddefinitions $end\n$dumpvars\n");
 
-	if (!(ctx->prevbits = g_try_malloc0(sizeof(int) * num_probes))) {
-		g_string_free(ctx->header, TRUE);
-		g_free(ctx);
-		sr_err("vcd out: %s: ctx->prevbits malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
 	return SR_OK;
 }
 
 static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		 uint64_t *length_out)
 {
+	struct context *ctx;
 	uint8_t *outbuf;
 
 	switch (event_type) {
@@ -145,7 +182,11 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		outbuf = (uint8_t *)g_strdup("$dumpoff\n$end\n");
 		*data_out = outbuf;
 		*length_out = strlen((const char *)outbuf);
-		g_free(o->internal);
+		ctx = o->internal;
+		if (ctx->header)
+			g_string_free(ctx->header, TRUE);
+		g_free(ctx->out);
+		g_free(ctx);
 		o->internal = NULL;
 		break;
 	default:
@@ -157,61 +198,188 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 	return SR_OK;
 }
 
+/* Make sure the output buffer has room for 'len' more bytes. */
+static int out_reserve(struct context *ctx, uint64_t len)
+{
+	uint64_t size;
+	char *out;
+
+	if (ctx->out && ctx->out_len + len <= ctx->out_size)
+		return SR_OK;
+
+	size = MAX(ctx->out_size, 4096);
+	while (size < ctx->out_len + len)
+		size *= 2;
+	if (!(out = g_try_realloc(ctx->out, size))) {
+		sr_err("vcd out: %s: output buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->out = out;
+	ctx->out_size = size;
+
+	return SR_OK;
+}
+
+/*
+ * Start the output of a chunk of data: prepend the header if this is the
+ * first one, and return TRUE if so.
+ */
+static gboolean output_start(struct context *ctx)
+{
+	ctx->out_len = 0;
+	if (!ctx->header)
+		return FALSE;
+
+	/* The header is still here, this must be the first packet. */
+	if (out_reserve(ctx, ctx->header->len) == SR_OK) {
+		memcpy(ctx->out, ctx->header->str, ctx->header->len);
+		ctx->out_len = ctx->header->len;
+	}
+	g_string_free(ctx->header, TRUE);
+	ctx->header = NULL;
+
+	return TRUE;
+}
+
+/* Hand the output buffer over to the caller. */
+static void output_end(struct context *ctx, uint8_t **data_out,
+		       uint64_t *length_out)
+{
+	*data_out = (uint8_t *)ctx->out;
+	*length_out = ctx->out_len;
+	ctx->out = NULL;
+	ctx->out_len = 0;
+}
+
+static inline int lowest_bit(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int n;
+
+	for (n = 0; !(v & 1); n++)
+		v >>= 1;
+
+	return n;
+#endif
+}
+
+/*
+ * Output the signals which changed from the previous sample, all at one
+ * timestamp. The time of sample n is n sample periods, in units of the
+ * timescale, computed in integers so it stays exact on long captures.
+ */
+static int output_sample(struct context *ctx, uint64_t sample)
+{
+	uint64_t changed, t;
+	char digits[20], *p;
+	int n, probe;
+
+	if (!(changed = (sample ^ ctx->prevsample) & ctx->mask))
+		return SR_OK;
+
+	if (out_reserve(ctx, ctx->max_sample_len) != SR_OK)
+		return SR_ERR_MALLOC;
+
+	if (ctx->samplerate) {
+		t = ctx->samplecount / ctx->samplerate * ctx->period
+		    + ctx->samplecount % ctx->samplerate * ctx->period
+		    / ctx->samplerate;
+	} else {
+		t = ctx->samplecount;
+	}
+
+	p = ctx->out + ctx->out_len;
+	*p++ = '#';
+	n = 0;
+	do {
+		digits[n++] = '0' + t % 10;
+		t /= 10;
+	} while (t);
+	while (n > 0)
+		*p++ = digits[--n];
+	*p++ = '\n';
+
+	while (changed) {
+		probe = lowest_bit(changed);
+		changed &= changed - 1;
+		*p++ = (sample >> probe) & 1 ? '1' : '0';
+		memcpy(p, ctx->ids[probe], ctx->id_len[probe]);
+		p += ctx->id_len[probe];
+		*p++ = '\n';
+	}
+
+	ctx->out_len = p - ctx->out;
+	ctx->prevsample = sample;
+
+	return SR_OK;
+}
+
 static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int i;
-	int p, curbit, prevbit;
-	uint64_t sample;
-	static uint64_t samplecount = 0;
-	GString *out;
-	int first_sample = 0;
+	uint64_t i, sample;
+	int ret;
 
 	ctx = o->internal;
-	out = g_string_sized_new(512);
+	ret = SR_OK;
 
-	if (ctx->header) {
-		/* The header is still here, this must be the first packet. */
-		g_string_append(out, ctx->header->str);
-		g_string_free(ctx->header, TRUE);
-		ctx->header = NULL;
-		first_sample = 1;
+	if (output_start(ctx) && length_in >= (uint64_t)ctx->unitsize) {
+		/* First packet. We neg to make sure all signals are output. */
+		sample = 0;
+		memcpy(&sample, data_in, ctx->unitsize);
+		ctx->prevsample = ~sample;
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		samplecount++;
-
+	for (i = 0; i + ctx->unitsize <= length_in && ret == SR_OK;
+	     i += ctx->unitsize) {
+		sample = 0;
 		memcpy(&sample, data_in + i, ctx->unitsize);
+		ret = output_sample(ctx, sample);
+		ctx->samplecount++;
+	}
 
-		if (first_sample) {
-			/* First packet. We neg to make sure sample is stored. */
-			ctx->prevsample = ~sample;
-			first_sample = 0;
-		}
+	output_end(ctx, data_out, length_out);
 
-		for (p = 0; p < ctx->num_enabled_probes; p++) {
-			curbit = (sample & ((uint64_t) (1 << p))) >> p;
-			prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
+	return ret;
+}
 
-			/* VCD only contains deltas/changes of signals. */
-			if (prevbit == curbit)
-				continue;
+/*
+ * Runs of identical samples can't change any signal after their first
+ * sample, so only one sample per run needs to be looked at.
+ */
+static int data_rle(struct sr_output *o,
+		    const struct sr_datafeed_logic_rle *rle,
+		    uint8_t **data_out, uint64_t *length_out)
+{
+	struct context *ctx;
+	uint64_t run, sample;
+	const uint8_t *values;
+	int ret;
 
-			/* Output which signal changed to which value. */
-			g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
-					(uint64_t)(((float)samplecount / ctx->samplerate)
-					* ctx->period), curbit, (char)('!' + p));
-		}
+	ctx = o->internal;
+	values = rle->values;
+	ret = SR_OK;
+
+	if (output_start(ctx) && rle->num_runs > 0) {
+		/* First packet. We neg to make sure all signals are output. */
+		sample = 0;
+		memcpy(&sample, values, ctx->unitsize);
+		ctx->prevsample = ~sample;
+	}
 
-		ctx->prevsample = sample;
+	for (run = 0; run < rle->num_runs && ret == SR_OK; run++) {
+		sample = 0;
+		memcpy(&sample, values + run * ctx->unitsize, ctx->unitsize);
+		ret = output_sample(ctx, sample);
+		ctx->samplecount += rle->lengths[run];
 	}
 
-	*data_out = (uint8_t *)out->str;
-	*length_out = out->len;
-	g_string_free(out, FALSE);
+	output_end(ctx, data_out, length_out);
 
-	return SR_OK;
+	return ret;
 }
 
 struct sr_output_format output_vcd = {
@@ -221,4 +389,5 @@ struct sr_output_format output_vcd = {
 	.init = init,
 	.data = data,
 	.event = event,
+	.data_rle = data_rle,
 };
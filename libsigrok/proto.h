@@ -37,13 +37,29 @@ SR_API int sr_log_callback_set_default(void);
 SR_API int sr_log_logdomain_set(const char *logdomain);
 SR_API char *sr_log_logdomain_get(void);
 
+/*--- buffer.c --------------------------------------------------------------*/
+
+SR_API int sr_buffer_pool_new(uint64_t bufsize, unsigned int max_free,
+			      struct sr_buffer_pool **pool);
+SR_API int sr_buffer_pool_destroy(struct sr_buffer_pool *pool);
+SR_API int sr_buffer_new(struct sr_buffer_pool *pool, struct sr_buffer **buf);
+SR_API struct sr_buffer *sr_buffer_ref(struct sr_buffer *buf);
+SR_API void sr_buffer_unref(struct sr_buffer *buf);
+SR_API int sr_buffer_reclaim(struct sr_buffer **buf);
+
 /*--- datastore.c -----------------------------------------------------------*/
 
 SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds);
+SR_API int sr_datastore_new_mapped(int unitsize, uint64_t max_resident,
+				   struct sr_datastore **ds);
 SR_API int sr_datastore_destroy(struct sr_datastore *ds);
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 			    unsigned int length, int in_unitsize,
 			    const int *probelist);
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+				const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_datastore_get(const struct sr_datastore *ds, uint64_t first_unit,
+			    uint64_t count, void *buf);
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -64,10 +80,23 @@ SR_API int sr_dev_info_get(const struct sr_dev *dev, int id, const void **data);
 
 /*--- filter.c --------------------------------------------------------------*/
 
+SR_API int sr_filter_new(int in_unitsize, int out_unitsize,
+			 const int *probelist, struct sr_filter **filter);
+SR_API int sr_filter_destroy(struct sr_filter *filter);
+SR_API int sr_filter_run(const struct sr_filter *filter,
+			 const uint8_t *data_in, uint64_t length_in,
+			 uint8_t **data_out, uint64_t *length_out);
+SR_API int sr_filter_run_into(const struct sr_filter *filter,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out);
 SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    const int *probelist, const uint8_t *data_in,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out);
+SR_API int sr_filter_probes_into(int in_unitsize, int out_unitsize,
+				 const int *probelist, const uint8_t *data_in,
+				 uint64_t length_in, uint8_t *data_out,
+				 uint64_t *length_out);
 
 /*--- hwdriver.c ------------------------------------------------------------*/
 
@@ -91,6 +120,19 @@ SR_API int sr_session_dev_add(struct sr_dev *dev);
 /* Datafeed setup */
 SR_API int sr_session_datafeed_callback_remove_all(void);
 SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb);
+SR_API int sr_session_datafeed_callback_rle_add(sr_datafeed_callback_t cb);
+SR_API int sr_session_datafeed_callback_analog_raw_add(sr_datafeed_callback_t cb);
+SR_API int sr_session_threaded_set(gboolean threaded, unsigned int ring_size,
+				   gboolean drop);
+SR_API int sr_session_stats_get(struct sr_session_stats *stats);
+
+/* Datafeed helpers */
+SR_API int sr_logic_rle_expand(const struct sr_datafeed_logic_rle *rle,
+			       uint64_t *run, uint64_t *run_offset,
+			       uint8_t *buf, uint64_t bufsize,
+			       uint64_t *length);
+SR_API int sr_analog_raw_convert(const struct sr_datafeed_analog_raw *raw,
+				 float *data);
 
 /* Session control */
 SR_API int sr_session_start(void);
@@ -98,6 +140,25 @@ SR_API int sr_session_run(void);
 SR_API int sr_session_halt(void);
 SR_API int sr_session_stop(void);
 SR_API int sr_session_save(const char *filename);
+SR_API int sr_session_save_start(const char *filename, struct sr_dev *dev,
+				 int unitsize, int codec,
+				 struct sr_session_save **save);
+SR_API int sr_session_save_append(struct sr_session_save *save,
+				  const uint8_t *data, uint64_t length);
+SR_API int sr_session_save_append_rle(struct sr_session_save *save,
+				      const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_session_save_end(struct sr_session_save *save);
+SR_API int sr_session_file_open(const char *filename, int devnum,
+				struct sr_session_file **sf);
+SR_API int sr_session_file_close(struct sr_session_file *sf);
+SR_API int sr_session_file_info(const struct sr_session_file *sf,
+				int *unitsize, uint64_t *num_samples);
+SR_API int sr_session_file_read(struct sr_session_file *sf, uint64_t start,
+				uint64_t count, uint8_t *buf,
+				uint64_t *count_read);
+SR_API int sr_session_file_toggled(const struct sr_session_file *sf,
+				   uint64_t start, uint64_t count,
+				   uint64_t *toggled);
 SR_API int sr_session_source_add(int fd, int events, int timeout,
 		sr_receive_data_callback_t cb, void *cb_data);
 SR_API int sr_session_source_add_pollfd(GPollFD *pollfd, int timeout,
@@ -22,6 +22,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
@@ -36,6 +39,15 @@ struct source {
 	gintptr poll_object;
 };
 
+/* Default number of packets queued per consumer in threaded mode. */
+#define DEFAULT_RING_SIZE 64
+
+/* Longest time the acquisition thread sleeps without checking for a stop. */
+#define STOP_POLL_INTERVAL 100
+
+/* Largest SR_DF_LOGIC packet an SR_DF_LOGIC_RLE packet is expanded into. */
+#define RLE_EXPAND_SIZE (256 * 1024)
+
 /* There can only be one session at a time. */
 /* 'session' is not static, it's used elsewhere (via 'extern'). */
 struct sr_session *session;
@@ -56,6 +68,7 @@ SR_API struct sr_session *sr_session_new(void)
 	}
 
 	session->source_timeout = -1;
+	session->ring_size = DEFAULT_RING_SIZE;
 
 	return session;
 }
@@ -75,11 +88,15 @@ SR_API int sr_session_destroy(void)
 	}
 
 	sr_session_dev_remove_all();
+	sr_session_thread_stop();
 
 	/* TODO: Error checks needed? */
 
 	/* TODO: Loop over protocol decoders and free them. */
 
+	g_slist_free(session->datafeed_callbacks);
+	g_slist_free(session->rle_callbacks);
+	g_slist_free(session->analog_raw_callbacks);
 	g_free(session);
 	session = NULL;
 
@@ -175,6 +192,10 @@ SR_API int sr_session_datafeed_callback_remove_all(void)
 
 	g_slist_free(session->datafeed_callbacks);
 	session->datafeed_callbacks = NULL;
+	g_slist_free(session->rle_callbacks);
+	session->rle_callbacks = NULL;
+	g_slist_free(session->analog_raw_callbacks);
+	session->analog_raw_callbacks = NULL;
 
 	return SR_OK;
 }
@@ -205,16 +226,188 @@ SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
 	return SR_OK;
 }
 
+/**
+ * Add a datafeed callback which handles SR_DF_LOGIC_RLE packets itself to
+ * the current session.
+ *
+ * Callbacks added with sr_session_datafeed_callback_add() never see
+ * SR_DF_LOGIC_RLE packets; their samples are expanded into SR_DF_LOGIC
+ * packets for them. Callbacks added with this function get them as they
+ * were sent by the driver, and all other packets like any other callback.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_rle_add(sr_datafeed_callback_t cb)
+{
+	int ret;
+
+	if ((ret = sr_session_datafeed_callback_add(cb)) != SR_OK)
+		return ret;
+
+	session->rle_callbacks = g_slist_append(session->rle_callbacks, cb);
+
+	return SR_OK;
+}
+
+/**
+ * Add a datafeed callback which handles SR_DF_ANALOG_RAW packets itself to
+ * the current session.
+ *
+ * Callbacks added with sr_session_datafeed_callback_add() never see
+ * SR_DF_ANALOG_RAW packets; their samples are converted into SR_DF_ANALOG
+ * packets for them. Callbacks added with this function get them as they
+ * were sent by the driver, and all other packets like any other callback.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_analog_raw_add(sr_datafeed_callback_t cb)
+{
+	int ret;
+
+	if ((ret = sr_session_datafeed_callback_add(cb)) != SR_OK)
+		return ret;
+
+	session->analog_raw_callbacks =
+	    g_slist_append(session->analog_raw_callbacks, cb);
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable threaded mode for the current session.
+ *
+ * In threaded mode, the thread calling sr_session_start() and
+ * sr_session_run() only services the hardware drivers, while every
+ * datafeed callback is called from a thread of its own. Packets are
+ * queued for each callback in a ring of 'ring_size' packets, so a slow
+ * callback doesn't hold up the acquisition until its ring is full.
+ *
+ * Datafeed callbacks may call sr_session_stop() in threaded mode; the
+ * session is then stopped by the acquisition thread shortly afterwards.
+ *
+ * This must be set before the session is started.
+ *
+ * @param threaded TRUE to enable threaded mode, FALSE to disable it.
+ * @param ring_size Number of packets which can be queued for each datafeed
+ *                  callback, or 0 for the default.
+ * @param drop What to do if a callback's ring is full: if TRUE, sample
+ *             packets (SR_DF_LOGIC, SR_DF_LOGIC_RLE, SR_DF_ANALOG) are
+ *             dropped and counted, if FALSE, the acquisition thread waits
+ *             for the callback to catch up. Other packets are never dropped.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists or the
+ *         session is already running.
+ */
+SR_API int sr_session_threaded_set(gboolean threaded, unsigned int ring_size,
+				   gboolean drop)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->acquisition_thread) {
+		sr_err("session: %s: can't change threaded mode of a running "
+		       "session", __func__);
+		return SR_ERR_BUG;
+	}
+
+	session->threaded = threaded;
+	session->ring_size = ring_size ? ring_size : DEFAULT_RING_SIZE;
+	session->ring_drop = drop;
+
+	return SR_OK;
+}
+
+/**
+ * Get the datafeed statistics of the current (threaded) session.
+ *
+ * The counters are reset when a threaded session is started, and are only
+ * updated in threaded mode.
+ *
+ * @param stats Pointer to a struct which will receive the statistics.
+ *              Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_stats_get(struct sr_session_stats *stats)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!stats) {
+		sr_err("session: %s: stats was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	*stats = session->thread_stats;
+
+	return SR_OK;
+}
+
+/*
+ * In threaded mode, perform a stop which a datafeed callback asked for
+ * from its own thread. Returns TRUE if the session was stopped.
+ */
+static gboolean session_stop_requested(void)
+{
+	if (!session->threaded || !g_atomic_int_get(&session->stop_requested))
+		return FALSE;
+
+	session->stop_requested = 0;
+	sr_session_stop();
+
+	return TRUE;
+}
+
 /**
  * TODO.
  */
 static int sr_session_run_poll(void)
 {
 	unsigned int i;
-	int ret;
+	int ret, timeout;
+	gint64 last_event, elapsed;
 
+	last_event = g_get_monotonic_time();
 	while (session->running) {
-		ret = g_poll(session->pollfds, session->num_sources, session->source_timeout);
+		/*
+		 * In threaded mode, wake up regularly to check whether a
+		 * datafeed callback asked us to stop the session. The time
+		 * since the last event is tracked, so that the sources still
+		 * get their (longer) timeout.
+		 */
+		timeout = session->source_timeout;
+		if (session->threaded) {
+			if (timeout >= 0) {
+				elapsed = (g_get_monotonic_time() - last_event) / 1000;
+				timeout = MAX(timeout - elapsed, 0);
+			}
+			if (timeout < 0 || timeout > STOP_POLL_INTERVAL)
+				timeout = STOP_POLL_INTERVAL;
+		}
+
+		ret = g_poll(session->pollfds, session->num_sources, timeout);
+
+		if (session_stop_requested())
+			break;
+
+		/* Only the timeout the sources asked for counts as one. */
+		if (ret == 0 && session->threaded
+		    && (session->source_timeout < 0
+			|| g_get_monotonic_time() - last_event
+			   < (gint64)session->source_timeout * 1000))
+			continue;
+		last_event = g_get_monotonic_time();
 
 		for (i = 0; i < session->num_sources; i++) {
 			if (session->pollfds[i].revents > 0 || (ret == 0
@@ -264,6 +457,13 @@ SR_API int sr_session_start(void)
 
 	sr_info("session: starting");
 
+	/* The drivers may send packets right away, so start consumers now. */
+	if (session->threaded && (ret = sr_session_thread_start()) != SR_OK) {
+		sr_err("session: %s: could not start consumer threads (%d)",
+		       __func__, ret);
+		return ret;
+	}
+
 	for (l = session->devs; l; l = l->next) {
 		dev = l->data;
 		/* TODO: Check for dev != NULL. */
@@ -308,13 +508,17 @@ SR_API int sr_session_run(void)
 	/* Do we have real sources? */
 	if (session->num_sources == 1 && session->pollfds[0].fd == -1) {
 		/* Dummy source, freewheel over it. */
-		while (session->running)
+		while (session->running && !session_stop_requested())
 			session->sources[0].cb(-1, 0, session->sources[0].cb_data);
 	} else {
 		/* Real sources, use g_poll() main loop. */
 		sr_session_run_poll();
 	}
 
+	/* Let the consumers process everything that's still queued. */
+	if (session->threaded)
+		sr_session_thread_stop();
+
 	return SR_OK;
 }
 
@@ -350,6 +554,14 @@ SR_API int sr_session_stop(void)
 		return SR_ERR_BUG;
 	}
 
+	/* Called from a consumer thread: let the acquisition thread do it. */
+	if (session->threaded && session->acquisition_thread
+	    && g_thread_self() != session->acquisition_thread) {
+		sr_dbg("session: stop requested by consumer thread");
+		g_atomic_int_set(&session->stop_requested, 1);
+		return SR_OK;
+	}
+
 	sr_info("session: stopping");
 	session->running = FALSE;
 
@@ -373,7 +585,9 @@ SR_API int sr_session_stop(void)
 static void datafeed_dump(struct sr_datafeed_packet *packet)
 {
 	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *logic_rle;
 	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *analog_raw;
 
 	switch (packet->type) {
 	case SR_DF_HEADER:
@@ -390,6 +604,11 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 		/* TODO: Check for logic != NULL. */
 		sr_dbg("bus: received SR_DF_LOGIC %" PRIu64 " bytes", logic->length);
 		break;
+	case SR_DF_LOGIC_RLE:
+		logic_rle = packet->payload;
+		sr_dbg("bus: received SR_DF_LOGIC_RLE %" PRIu64 " runs",
+		       logic_rle->num_runs);
+		break;
 	case SR_DF_META_ANALOG:
 		sr_dbg("bus: received SR_DF_META_LOGIC");
 		break;
@@ -398,6 +617,11 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 		/* TODO: Check for analog != NULL. */
 		sr_dbg("bus: received SR_DF_ANALOG %d samples", analog->num_samples);
 		break;
+	case SR_DF_ANALOG_RAW:
+		analog_raw = packet->payload;
+		sr_dbg("bus: received SR_DF_ANALOG_RAW %d samples",
+		       analog_raw->num_samples);
+		break;
 	case SR_DF_END:
 		sr_dbg("bus: received SR_DF_END");
 		break;
@@ -413,11 +637,316 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 	}
 }
 
+/**
+ * Expand run-length encoded samples into a buffer.
+ *
+ * The position in the runs is kept in 'run' and 'run_offset', which must
+ * both be 0 for the first call. Each call fills the buffer with as many
+ * whole samples as fit, and moves the position past them, so a packet of
+ * any length can be expanded through a small buffer. Repeated samples are
+ * written with memset() if all their bytes are equal, or by doubling up
+ * memcpy() otherwise, rather than one sample at a time.
+ *
+ * @param rle The run-length encoded samples. Must not be NULL.
+ * @param run Index of the run to continue with. Must not be NULL.
+ * @param run_offset Number of samples of that run which were already
+ *                   expanded. Must not be NULL.
+ * @param buf The buffer to expand the samples into. Must not be NULL.
+ * @param bufsize Size of the buffer in bytes. Must be at least one sample.
+ * @param length Pointer to a variable which will hold the number of bytes
+ *               written to the buffer; 0 once all runs are expanded.
+ *               Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_rle_expand(const struct sr_datafeed_logic_rle *rle,
+			       uint64_t *run, uint64_t *run_offset,
+			       uint8_t *buf, uint64_t bufsize,
+			       uint64_t *length)
+{
+	const uint8_t *value;
+	uint64_t space, count, done, n;
+	unsigned int unitsize, i;
+
+	if (!rle || !run || !run_offset || !buf || !length) {
+		sr_err("session: %s: NULL argument", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle->unitsize == 0 || bufsize < rle->unitsize) {
+		sr_err("session: %s: unitsize %d doesn't fit into %" PRIu64
+		       " bytes", __func__, rle->unitsize, bufsize);
+		return SR_ERR_ARG;
+	}
+
+	unitsize = rle->unitsize;
+	space = bufsize / unitsize;
+	*length = 0;
+	while (space > 0 && *run < rle->num_runs) {
+		value = (const uint8_t *)rle->values + *run * unitsize;
+		count = MIN(rle->lengths[*run] - *run_offset, space);
+
+		for (i = 1; i < unitsize && value[i] == value[0]; i++)
+			;
+		if (i == unitsize) {
+			memset(buf, value[0], count * unitsize);
+		} else {
+			memcpy(buf, value, unitsize);
+			for (done = 1; done < count; done += n) {
+				n = MIN(done, count - done);
+				memcpy(buf + done * unitsize, buf, n * unitsize);
+			}
+		}
+
+		buf += count * unitsize;
+		*length += count * unitsize;
+		space -= count;
+		*run_offset += count;
+		if (*run_offset == rle->lengths[*run]) {
+			(*run)++;
+			*run_offset = 0;
+		}
+	}
+
+	return SR_OK;
+}
+
+#ifdef __SSE2__
+static inline void convert4(float *data, __m128i codes, __m128 scale,
+			    __m128 offset)
+{
+	_mm_storeu_ps(data, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(codes),
+						  scale), offset));
+}
+
+/* Widen 8 16-bit codes to 32 bits, and convert them. */
+static inline void convert8(float *data, __m128i codes, gboolean is_signed,
+			    __m128 scale, __m128 offset)
+{
+	if (is_signed) {
+		convert4(data, _mm_srai_epi32(_mm_unpacklo_epi16(codes, codes),
+					      16), scale, offset);
+		convert4(data + 4, _mm_srai_epi32(_mm_unpackhi_epi16(codes,
+					codes), 16), scale, offset);
+	} else {
+		convert4(data, _mm_unpacklo_epi16(codes, _mm_setzero_si128()),
+			 scale, offset);
+		convert4(data + 4, _mm_unpackhi_epi16(codes,
+					_mm_setzero_si128()), scale, offset);
+	}
+}
+
+/*
+ * Convert as many codes as fit into whole vectors, and return how many
+ * that was. Only for 1, 2 or 4 probes, so every vector of four codes
+ * starts with the first probe.
+ */
+static uint64_t analog_raw_convert_sse2(const struct sr_datafeed_analog_raw *raw,
+					uint64_t num_codes, float *data)
+{
+	const uint8_t *codes;
+	__m128 scale, offset;
+	__m128i v;
+	uint64_t i;
+	int np;
+
+	np = raw->num_probes;
+	scale = _mm_setr_ps(raw->scale[0], raw->scale[1 % np],
+			    raw->scale[2 % np], raw->scale[3 % np]);
+	offset = _mm_setr_ps(raw->offset[0], raw->offset[1 % np],
+			     raw->offset[2 % np], raw->offset[3 % np]);
+	codes = raw->data;
+
+	i = 0;
+	if (raw->unitsize == 1) {
+		for (; i + 16 <= num_codes; i += 16) {
+			v = _mm_loadu_si128((const __m128i *)(codes + i));
+			if (raw->is_signed) {
+				convert8(data + i, _mm_srai_epi16(
+					 _mm_unpacklo_epi8(v, v), 8), TRUE,
+					 scale, offset);
+				convert8(data + i + 8, _mm_srai_epi16(
+					 _mm_unpackhi_epi8(v, v), 8), TRUE,
+					 scale, offset);
+			} else {
+				convert8(data + i, _mm_unpacklo_epi8(v,
+					 _mm_setzero_si128()), FALSE,
+					 scale, offset);
+				convert8(data + i + 8, _mm_unpackhi_epi8(v,
+					 _mm_setzero_si128()), FALSE,
+					 scale, offset);
+			}
+		}
+	} else {
+		for (; i + 8 <= num_codes; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)(codes + i * 2));
+			convert8(data + i, v, raw->is_signed, scale, offset);
+		}
+	}
+
+	return i;
+}
+#endif
+
+/**
+ * Convert raw analog samples into floats.
+ *
+ * @param raw The raw samples. Must not be NULL.
+ * @param data The buffer for the converted samples, which must have room
+ *             for raw->num_samples * raw->num_probes floats. Must not be
+ *             NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_analog_raw_convert(const struct sr_datafeed_analog_raw *raw,
+				 float *data)
+{
+	const uint8_t *codes;
+	uint64_t num_codes, i;
+	int p, code;
+
+	if (!raw || !data) {
+		sr_err("session: %s: NULL argument", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (raw->num_probes < 1 || raw->num_probes > SR_MAX_ANALOG_PROBES
+	    || (raw->unitsize != 1 && raw->unitsize != 2)) {
+		sr_err("session: %s: can't convert %d probes of %d bytes",
+		       __func__, raw->num_probes, raw->unitsize);
+		return SR_ERR_ARG;
+	}
+
+	num_codes = (uint64_t)raw->num_samples * raw->num_probes;
+	codes = raw->data;
+	i = 0;
+
+#ifdef __SSE2__
+	if (4 % raw->num_probes == 0)
+		i = analog_raw_convert_sse2(raw, num_codes, data);
+#endif
+
+	for (p = i % raw->num_probes; i < num_codes; i++) {
+		if (raw->unitsize == 1)
+			code = raw->is_signed ? ((const int8_t *)codes)[i]
+					      : codes[i];
+		else
+			code = raw->is_signed ? ((const int16_t *)codes)[i]
+					      : ((const uint16_t *)codes)[i];
+		data[i] = code * raw->scale[p] + raw->offset[p];
+		if (++p == raw->num_probes)
+			p = 0;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Expand SR_DF_LOGIC_RLE packets into SR_DF_LOGIC packets of up to
+ * RLE_EXPAND_SIZE bytes.
+ */
+static void deliver_rle_expanded(sr_datafeed_callback_t cb,
+				 struct sr_dev *dev,
+				 struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet logic_packet;
+	struct sr_datafeed_logic_rle *rle;
+	struct sr_datafeed_logic logic;
+	uint64_t run, run_offset, size, total;
+	uint8_t *buf;
+
+	rle = packet->payload;
+	if (!rle || rle->num_runs == 0 || rle->unitsize == 0)
+		return;
+
+	/* Don't allocate more than the whole packet expands to. */
+	total = 0;
+	for (run = 0; run < rle->num_runs && total < RLE_EXPAND_SIZE; run++)
+		total += rle->lengths[run] * rle->unitsize;
+	size = MAX(MIN(total, RLE_EXPAND_SIZE), rle->unitsize);
+	if (!(buf = g_try_malloc(size))) {
+		sr_err("session: %s: buf malloc failed", __func__);
+		return;
+	}
+
+	logic_packet.type = SR_DF_LOGIC;
+	logic_packet.payload = &logic;
+	logic.unitsize = rle->unitsize;
+	logic.data = buf;
+	logic.buffer = NULL;
+	run = run_offset = 0;
+	while (sr_logic_rle_expand(rle, &run, &run_offset, buf, size,
+				   &logic.length) == SR_OK && logic.length > 0)
+		cb(dev, &logic_packet);
+
+	g_free(buf);
+}
+
+/* Convert SR_DF_ANALOG_RAW packets into SR_DF_ANALOG packets. */
+static void deliver_analog_converted(sr_datafeed_callback_t cb,
+				     struct sr_dev *dev,
+				     struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet analog_packet;
+	struct sr_datafeed_analog_raw *raw;
+	struct sr_datafeed_analog analog;
+
+	raw = packet->payload;
+	if (!raw || raw->num_samples <= 0 || raw->num_probes <= 0)
+		return;
+
+	if (!(analog.data = g_try_malloc((uint64_t)raw->num_samples
+					 * raw->num_probes * sizeof(float)))) {
+		sr_err("session: %s: data malloc failed", __func__);
+		return;
+	}
+
+	if (sr_analog_raw_convert(raw, analog.data) == SR_OK) {
+		analog_packet.type = SR_DF_ANALOG;
+		analog_packet.payload = &analog;
+		analog.num_samples = raw->num_samples;
+		analog.mq = raw->mq;
+		analog.unit = raw->unit;
+		cb(dev, &analog_packet);
+	}
+
+	g_free(analog.data);
+}
+
+/**
+ * Pass a packet to one datafeed callback.
+ *
+ * SR_DF_LOGIC_RLE packets are expanded into SR_DF_LOGIC packets of up to
+ * RLE_EXPAND_SIZE bytes, and SR_DF_ANALOG_RAW packets are converted into
+ * SR_DF_ANALOG packets, for callbacks which don't handle them.
+ *
+ * @param cb The callback. Must not be NULL.
+ * @param dev The device the packet comes from.
+ * @param packet The packet. Must not be NULL.
+ */
+SR_PRIV void sr_session_deliver(sr_datafeed_callback_t cb, struct sr_dev *dev,
+				struct sr_datafeed_packet *packet)
+{
+	if (packet->type == SR_DF_LOGIC_RLE
+	    && !g_slist_find(session->rle_callbacks, cb))
+		deliver_rle_expanded(cb, dev, packet);
+	else if (packet->type == SR_DF_ANALOG_RAW
+		 && !g_slist_find(session->analog_raw_callbacks, cb))
+		deliver_analog_converted(cb, dev, packet);
+	else
+		cb(dev, packet);
+}
+
 /**
  * Send a packet to whatever is listening on the datafeed bus.
  *
  * Hardware drivers use this to send a data packet to the frontend.
  *
+ * In threaded mode, the packet is queued for the datafeed callbacks'
+ * threads instead. This must then only be called from the acquisition
+ * thread, i.e. from the drivers' event source callbacks or
+ * dev_acquisition_start().
+ *
  * @param dev TODO.
  * @param packet The datafeed packet to send to the session bus.
  *
@@ -439,12 +968,18 @@ SR_PRIV int sr_session_send(struct sr_dev *dev,
 		return SR_ERR_ARG;
 	}
 
+	if (session->threaded && session->acquisition_thread) {
+		if (sr_log_loglevel_get() >= SR_LOG_DBG)
+			datafeed_dump(packet);
+		return sr_session_thread_queue(dev, packet);
+	}
+
 	for (l = session->datafeed_callbacks; l; l = l->next) {
 		if (sr_log_loglevel_get() >= SR_LOG_DBG)
 			datafeed_dump(packet);
 		cb = l->data;
 		/* TODO: Check for cb != NULL. */
-		cb(dev, packet);
+		sr_session_deliver(cb, dev, packet);
 	}
 
 	return SR_OK;
@@ -0,0 +1,422 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Parallel compression and decompression of session file members.
+ *
+ * The members of a capture file are compressed independently, so they
+ * can be (de)compressed on as many cores as there are. Members are pushed
+ * into a pipeline, which runs them on a thread pool, and popped out again
+ * in the order they were pushed, whichever finished first.
+ *
+ * The data is raw deflate, exactly what a zip file holds for a deflated
+ * member, so libzip can store it as is, and read it back without
+ * decompressing it. With SR_SESSION_CODEC_BITPLANE, the samples are
+ * transposed into bit planes (see bitplane.c) before they are deflated,
+ * and the zip member holds the planes.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Upper limit for the number of threads a pipeline runs jobs on. */
+#define CODEC_MAX_THREADS 16
+
+struct sr_codec_pipeline {
+	GThreadPool *pool;
+	GMutex *mutex;
+	GCond *cond;
+	/* Jobs which were pushed and not popped yet, oldest first. */
+	GQueue *jobs;
+	unsigned int max_jobs;
+};
+
+/*
+ * libzip can't be told to store a member without deflating it, so
+ * SR_SESSION_CODEC_NONE makes deflate's stored blocks instead.
+ */
+static int codec_level(int codec)
+{
+	switch (codec) {
+	case SR_SESSION_CODEC_DEFLATE_FAST:
+		return Z_BEST_SPEED;
+	case SR_SESSION_CODEC_NONE:
+		return Z_NO_COMPRESSION;
+	default:
+		return Z_DEFAULT_COMPRESSION;
+	}
+}
+
+/**
+ * Get the size of the buffer a compressed member may need.
+ *
+ * @param codec The codec, one of SR_SESSION_CODEC_*.
+ * @param len The size of the uncompressed member.
+ *
+ * @return The size of the buffer.
+ */
+SR_PRIV uint64_t sr_codec_bound(int codec, uint64_t len)
+{
+	/* Bit planes add a header, and pad every plane to whole bytes. */
+	if (codec == SR_SESSION_CODEC_BITPLANE)
+		len += 8 + 2 * SR_MAX_NUM_PROBES;
+
+	/* Incompressible data ends up in stored blocks of up to 64k. */
+	return len + (len >> 8) + 64;
+}
+
+/**
+ * Get the name a codec is recorded as in a session file's metadata.
+ *
+ * @param codec The codec, one of SR_SESSION_CODEC_*.
+ *
+ * @return The name, or NULL if members encoded with this codec are plain
+ *         zip members, which need no special treatment when loaded.
+ */
+SR_PRIV const char *sr_codec_name(int codec)
+{
+	if (codec == SR_SESSION_CODEC_BITPLANE)
+		return "bitplane";
+
+	return NULL;
+}
+
+/**
+ * Get a codec from the name it is recorded as in a session file.
+ *
+ * @param name The name. If NULL, the members are plain zip members.
+ *
+ * @return The codec, or -1 if the name is unknown.
+ */
+SR_PRIV int sr_codec_from_name(const char *name)
+{
+	if (!name)
+		return SR_SESSION_CODEC_DEFLATE;
+	if (!strcmp(name, "bitplane"))
+		return SR_SESSION_CODEC_BITPLANE;
+
+	return -1;
+}
+
+static uint32_t crc_run(const uint8_t *data, uint64_t len)
+{
+	uLong crc;
+	uInt n;
+
+	crc = crc32(0L, Z_NULL, 0);
+	while (len > 0) {
+		n = MIN(len, G_MAXUINT32);
+		crc = crc32(crc, data, n);
+		data += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+static int codec_compress(struct sr_codec_job *job)
+{
+	z_stream zs;
+	const uint8_t *in;
+	uint8_t *planes;
+	uint64_t in_len;
+	int ret;
+
+	in = job->in;
+	in_len = job->in_len;
+	planes = NULL;
+	if (job->codec == SR_SESSION_CODEC_BITPLANE) {
+		if (!(planes = g_try_malloc(sr_bitplane_bound(
+				job->in_len / job->unitsize, job->unitsize)))) {
+			sr_err("codec: %s: planes malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		sr_bitplane_encode(job->in, job->in_len / job->unitsize,
+				   job->unitsize, planes, &in_len);
+		in = planes;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, codec_level(job->codec), Z_DEFLATED,
+			 -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		sr_err("codec: %s: deflateInit2 failed", __func__);
+		g_free(planes);
+		return SR_ERR;
+	}
+
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = in_len;
+	zs.next_out = job->out;
+	zs.avail_out = job->out_size;
+	ret = deflate(&zs, Z_FINISH);
+	job->out_len = zs.total_out;
+	deflateEnd(&zs);
+
+	if (ret != Z_STREAM_END) {
+		sr_err("codec: %s: deflate failed: %d", __func__, ret);
+		g_free(planes);
+		return SR_ERR;
+	}
+
+	job->crc = crc_run(in, in_len);
+	g_free(planes);
+
+	return SR_OK;
+}
+
+static int codec_decompress(struct sr_codec_job *job)
+{
+	z_stream zs;
+	uint8_t *out, *planes;
+	uint64_t out_size, out_len, num_samples;
+	int ret;
+
+	if (job->codec == SR_SESSION_CODEC_NONE) {
+		/* A member which was stored as is. */
+		if (job->in_len > job->out_size) {
+			sr_err("codec: %s: member too large", __func__);
+			return SR_ERR;
+		}
+		memcpy(job->out, job->in, job->in_len);
+		job->out_len = job->in_len;
+		job->crc = crc_run(job->out, job->out_len);
+		return SR_OK;
+	}
+
+	/* Bit planes are inflated into a buffer of their own first. */
+	out = job->out;
+	out_size = job->out_size;
+	planes = NULL;
+	if (job->codec == SR_SESSION_CODEC_BITPLANE) {
+		out_size = sr_bitplane_bound(job->out_size / job->unitsize,
+					     job->unitsize);
+		if (!(planes = out = g_try_malloc(out_size))) {
+			sr_err("codec: %s: planes malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		sr_err("codec: %s: inflateInit2 failed", __func__);
+		g_free(planes);
+		return SR_ERR;
+	}
+
+	zs.next_in = (Bytef *)job->in;
+	zs.avail_in = job->in_len;
+	zs.next_out = out;
+	zs.avail_out = out_size;
+	ret = inflate(&zs, Z_FINISH);
+	out_len = zs.total_out;
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END) {
+		sr_err("codec: %s: inflate failed: %d", __func__, ret);
+		g_free(planes);
+		return SR_ERR;
+	}
+
+	job->crc = crc_run(out, out_len);
+
+	if (planes) {
+		ret = sr_bitplane_decode(planes, out_len, job->unitsize,
+					 job->out, job->out_size / job->unitsize,
+					 &num_samples);
+		g_free(planes);
+		if (ret != SR_OK)
+			return ret;
+		out_len = num_samples * job->unitsize;
+	}
+	job->out_len = out_len;
+
+	return SR_OK;
+}
+
+/**
+ * Run a job in the calling thread.
+ *
+ * @param job The job. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR if the data could not be
+ *         (de)compressed. The result is also stored in the job.
+ */
+SR_PRIV int sr_codec_run(struct sr_codec_job *job)
+{
+	if (job->compress)
+		job->ret = codec_compress(job);
+	else
+		job->ret = codec_decompress(job);
+
+	return job->ret;
+}
+
+static void codec_worker(gpointer data, gpointer user_data)
+{
+	struct sr_codec_pipeline *pl;
+	struct sr_codec_job *job;
+
+	job = data;
+	pl = user_data;
+
+	sr_codec_run(job);
+
+	g_mutex_lock(pl->mutex);
+	job->done = TRUE;
+	g_cond_broadcast(pl->cond);
+	g_mutex_unlock(pl->mutex);
+}
+
+static unsigned int num_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+		return MIN(n, CODEC_MAX_THREADS);
+#endif
+
+	return 2;
+}
+
+/**
+ * Create a pipeline, with a thread for each core.
+ *
+ * @param pl Pointer to a variable which will hold the new pipeline.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation
+ *         errors, or SR_ERR if the threads could not be created.
+ */
+SR_PRIV int sr_codec_pipeline_new(struct sr_codec_pipeline **pl)
+{
+	GError *error;
+	unsigned int n;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (!(*pl = g_try_malloc0(sizeof(struct sr_codec_pipeline)))) {
+		sr_err("codec: %s: pl malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	n = num_threads();
+	error = NULL;
+	if (!((*pl)->pool = g_thread_pool_new(codec_worker, *pl, n,
+					      FALSE, &error))) {
+		sr_err("codec: %s: failed to create thread pool: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		g_free(*pl);
+		return SR_ERR;
+	}
+	(*pl)->mutex = g_mutex_new();
+	(*pl)->cond = g_cond_new();
+	(*pl)->jobs = g_queue_new();
+	/* Keep every thread busy while the oldest job is collected. */
+	(*pl)->max_jobs = n + 2;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a pipeline. Jobs which are still running are waited for.
+ *
+ * @param pl The pipeline. Must not be NULL.
+ * @param job_free Called on every job which was pushed but not popped.
+ *                 May be NULL.
+ */
+SR_PRIV void sr_codec_pipeline_destroy(struct sr_codec_pipeline *pl,
+				       GDestroyNotify job_free)
+{
+	struct sr_codec_job *job;
+
+	g_thread_pool_free(pl->pool, FALSE, TRUE);
+	while ((job = g_queue_pop_head(pl->jobs))) {
+		if (job_free)
+			job_free(job);
+	}
+	g_queue_free(pl->jobs);
+	g_mutex_free(pl->mutex);
+	g_cond_free(pl->cond);
+	g_free(pl);
+}
+
+/**
+ * Check whether a pipeline has as many jobs in flight as it should.
+ * Jobs can still be pushed, but should rather be popped first.
+ *
+ * @param pl The pipeline. Must not be NULL.
+ *
+ * @return TRUE if the pipeline is full.
+ */
+SR_PRIV gboolean sr_codec_pipeline_full(const struct sr_codec_pipeline *pl)
+{
+	return g_queue_get_length(pl->jobs) >= pl->max_jobs;
+}
+
+/**
+ * Push a job into a pipeline, which runs it on one of its threads.
+ *
+ * @param pl The pipeline. Must not be NULL.
+ * @param job The job, which belongs to the pipeline until it is popped
+ *            again. Must not be NULL.
+ */
+SR_PRIV void sr_codec_pipeline_push(struct sr_codec_pipeline *pl,
+				    struct sr_codec_job *job)
+{
+	job->done = FALSE;
+	g_queue_push_tail(pl->jobs, job);
+	g_thread_pool_push(pl->pool, job, NULL);
+}
+
+/**
+ * Pop the oldest job out of a pipeline, once it is done.
+ *
+ * @param pl The pipeline. Must not be NULL.
+ * @param wait Whether to wait for the oldest job to be done.
+ *
+ * @return The job, or NULL if the pipeline is empty, or if the oldest job
+ *         isn't done yet and 'wait' is FALSE.
+ */
+SR_PRIV struct sr_codec_job *sr_codec_pipeline_pop(struct sr_codec_pipeline *pl,
+						   gboolean wait)
+{
+	struct sr_codec_job *job;
+	gboolean done;
+
+	if (!(job = g_queue_peek_head(pl->jobs)))
+		return NULL;
+
+	g_mutex_lock(pl->mutex);
+	while (wait && !job->done)
+		g_cond_wait(pl->cond, pl->mutex);
+	done = job->done;
+	g_mutex_unlock(pl->mutex);
+
+	if (!done)
+		return NULL;
+
+	return g_queue_pop_head(pl->jobs);
+}
@@ -29,21 +29,44 @@
 /* size of payloads sent across the session bus */
 #define CHUNKSIZE (512 * 1024)
 
+/* Number of released chunk buffers kept around for reuse. */
+#define NUM_FREE_CHUNKS 4
+
 struct session_vdev {
 	char *capturefile;
 	struct zip *archive;
 	struct zip_file *capfile;
+	/*
+	 * The members of a split capture file are decompressed on a
+	 * pipeline of threads, while the member popped out of it last is
+	 * being sent.
+	 */
+	struct sr_codec_pipeline *pipeline;
+	struct sr_buffer_pool *member_pool;
+	unsigned int next_member;
+	struct member_job *cur;
+	uint64_t cur_offset;
 	int bytes_read;
 	uint64_t samplerate;
 	int unitsize;
 	int num_probes;
+	int codec;
+};
+
+/* A member of a split capture file, being decompressed. */
+struct member_job {
+	struct sr_codec_job job;
+	struct sr_buffer *buf;
+	uint32_t crc;
 };
 
 static char *sessionfile = NULL;
 static GSList *dev_insts = NULL;
+static struct sr_buffer_pool *chunk_pool = NULL;
 static const int hwcaps[] = {
 	SR_HWCAP_CAPTUREFILE,
 	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_CODEC,
 	0,
 };
 
@@ -72,6 +95,238 @@ static struct session_vdev *get_vdev_by_index(int dev_index)
 	return vdev;
 }
 
+/*
+ * Get ready to read a capture file which was split into members named
+ * <capturefile>-1, <capturefile>-2, and so on. They are decompressed
+ * into buffers large enough for the largest of them.
+ */
+static int split_open(struct session_vdev *vdev)
+{
+	struct zip_stat zs;
+	uint64_t max_size;
+	unsigned int num;
+	char *name;
+	int ret;
+
+	max_size = 0;
+	for (num = 1; ; num++) {
+		name = g_strdup_printf("%s-%u", vdev->capturefile, num);
+		ret = zip_stat(vdev->archive, name, 0, &zs);
+		g_free(name);
+		if (ret == -1)
+			break;
+		max_size = MAX(max_size, zs.size);
+	}
+
+	if (num == 1) {
+		sr_err("session driver: Failed to check capture file '%s' in "
+		       "session file '%s'.", vdev->capturefile, sessionfile);
+		return SR_ERR;
+	}
+
+	if ((ret = sr_codec_pipeline_new(&vdev->pipeline)) != SR_OK)
+		return ret;
+
+	/* Bit planes decode to at most a full member of samples. */
+	if (vdev->codec == SR_SESSION_CODEC_BITPLANE)
+		max_size = MAX(max_size, SESSION_MEMBER_SIZE);
+
+	/* Members are sent as they are decompressed, so few come back. */
+	if ((ret = sr_buffer_pool_new(MAX(max_size, 1), NUM_FREE_CHUNKS,
+				      &vdev->member_pool)) != SR_OK)
+		return ret;
+	vdev->next_member = 1;
+
+	return SR_OK;
+}
+
+static void member_job_free(gpointer data)
+{
+	struct member_job *mj;
+
+	mj = data;
+	g_free((uint8_t *)mj->job.in);
+	if (mj->buf)
+		sr_buffer_unref(mj->buf);
+	g_free(mj);
+}
+
+static void vdev_free(struct session_vdev *vdev)
+{
+	if (vdev->capfile)
+		zip_fclose(vdev->capfile);
+	if (vdev->cur)
+		member_job_free(vdev->cur);
+	if (vdev->pipeline)
+		sr_codec_pipeline_destroy(vdev->pipeline, member_job_free);
+	if (vdev->member_pool)
+		sr_buffer_pool_destroy(vdev->member_pool);
+	g_free(vdev->capturefile);
+	g_free(vdev);
+}
+
+/*
+ * Read the next member of a split capture file as it is stored in the
+ * archive, for the pipeline to decompress. Returns NULL after the last
+ * member, or if it could not be read.
+ */
+static struct member_job *member_read(struct session_vdev *vdev)
+{
+	struct member_job *mj;
+	struct zip_stat zs;
+	struct zip_file *zf;
+	char *name;
+	int ret, flags;
+
+	name = g_strdup_printf("%s-%u", vdev->capturefile, vdev->next_member);
+	ret = zip_stat(vdev->archive, name, 0, &zs);
+	g_free(name);
+	if (ret == -1)
+		return NULL;
+
+	if (!(mj = g_try_malloc0(sizeof(struct member_job)))) {
+		sr_err("session driver: %s: mj malloc failed", __func__);
+		return NULL;
+	}
+
+	/*
+	 * Deflated members are read raw and inflated on the pipeline,
+	 * as are bit planes, which are then transposed back. Anything
+	 * else is left to libzip, and just copied.
+	 */
+	if (vdev->codec == SR_SESSION_CODEC_BITPLANE) {
+		if (zs.comp_method != ZIP_CM_DEFLATE) {
+			sr_err("session driver: %s: member %u is not "
+			       "deflated", __func__, vdev->next_member);
+			g_free(mj);
+			return NULL;
+		}
+		flags = ZIP_FL_COMPRESSED;
+		mj->job.codec = SR_SESSION_CODEC_BITPLANE;
+		mj->job.unitsize = vdev->unitsize;
+		mj->job.in_len = zs.comp_size;
+	} else if (zs.comp_method == ZIP_CM_DEFLATE) {
+		flags = ZIP_FL_COMPRESSED;
+		mj->job.codec = SR_SESSION_CODEC_DEFLATE;
+		mj->job.in_len = zs.comp_size;
+	} else {
+		flags = 0;
+		mj->job.codec = SR_SESSION_CODEC_NONE;
+		mj->job.in_len = zs.size;
+	}
+	mj->crc = zs.crc;
+
+	if (sr_buffer_new(vdev->member_pool, &mj->buf) != SR_OK
+	    || !(mj->job.in = g_try_malloc(mj->job.in_len + 1))) {
+		sr_err("session driver: %s: buf malloc failed", __func__);
+		member_job_free(mj);
+		return NULL;
+	}
+	mj->job.out = mj->buf->data;
+	mj->job.out_size = mj->buf->size;
+
+	if (!(zf = zip_fopen_index(vdev->archive, zs.index, flags))) {
+		sr_err("session driver: %s: failed to open member %u",
+		       __func__, vdev->next_member);
+		member_job_free(mj);
+		return NULL;
+	}
+	ret = zip_fread(zf, (uint8_t *)mj->job.in, mj->job.in_len);
+	zip_fclose(zf);
+	if (ret < 0 || (uint64_t)ret != mj->job.in_len) {
+		sr_err("session driver: %s: failed to read member %u",
+		       __func__, vdev->next_member);
+		member_job_free(mj);
+		return NULL;
+	}
+
+	vdev->next_member++;
+
+	return mj;
+}
+
+/* Send the next chunk of a capture file which isn't split. */
+static int receive_chunk(struct session_vdev *vdev, void *cb_data)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct sr_buffer *buf;
+	int ret;
+
+	/*
+	 * Read straight into a pool buffer, which frontends can keep
+	 * a reference to instead of copying the chunk.
+	 */
+	if (sr_buffer_new(chunk_pool, &buf) != SR_OK) {
+		sr_err("session driver: %s: buf malloc failed", __func__);
+		return -1;
+	}
+
+	ret = zip_fread(vdev->capfile, buf->data, CHUNKSIZE);
+	if (ret > 0) {
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.length = ret;
+		logic.unitsize = vdev->unitsize;
+		logic.data = buf->data;
+		logic.buffer = buf;
+		vdev->bytes_read += ret;
+		sr_session_send(cb_data, &packet);
+	}
+	sr_buffer_unref(buf);
+
+	return ret;
+}
+
+/*
+ * Send the next chunk of a split capture file. Its members come out of
+ * the pipeline in order, and are sent in pieces straight out of the
+ * buffers they were decompressed into.
+ */
+static int receive_member(struct session_vdev *vdev, void *cb_data)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct member_job *mj;
+	uint64_t len;
+
+	/* Keep all threads busy. */
+	while (!sr_codec_pipeline_full(vdev->pipeline)
+	       && (mj = member_read(vdev)))
+		sr_codec_pipeline_push(vdev->pipeline, &mj->job);
+
+	while (!vdev->cur || vdev->cur_offset == vdev->cur->job.out_len) {
+		if (vdev->cur)
+			member_job_free(vdev->cur);
+		vdev->cur = NULL;
+		if (!(mj = (struct member_job *)sr_codec_pipeline_pop(
+						vdev->pipeline, TRUE)))
+			return 0;
+		vdev->cur = mj;
+		vdev->cur_offset = 0;
+		if (mj->job.ret != SR_OK || mj->job.crc != mj->crc) {
+			sr_err("session driver: %s: capture file '%s' is "
+			       "corrupt", __func__, vdev->capturefile);
+			return -1;
+		}
+	}
+
+	mj = vdev->cur;
+	len = MIN((uint64_t)(CHUNKSIZE / vdev->unitsize * vdev->unitsize),
+		  mj->job.out_len - vdev->cur_offset);
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = len;
+	logic.unitsize = vdev->unitsize;
+	logic.data = mj->buf->data + vdev->cur_offset;
+	logic.buffer = mj->buf;
+	vdev->cur_offset += len;
+	vdev->bytes_read += len;
+	sr_session_send(cb_data, &packet);
+
+	return len;
+}
+
 /**
  * TODO.
  *
@@ -86,9 +341,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 	struct sr_dev_inst *sdi;
 	struct session_vdev *vdev;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
 	GSList *l;
-	void *buf;
 	int ret, got_data;
 
 	/* Avoid compiler warnings. */
@@ -105,27 +358,15 @@ static int receive_data(int fd, int revents, void *cb_data)
 			/* already done with this instance */
 			continue;
 
-		if (!(buf = g_try_malloc(CHUNKSIZE))) {
-			sr_err("session driver: %s: buf malloc failed",
-			       __func__);
-			return FALSE; /* TODO: SR_ERR_MALLOC */
-		}
-
-		ret = zip_fread(vdev->capfile, buf, CHUNKSIZE);
+		if (vdev->pipeline)
+			ret = receive_member(vdev, cb_data);
+		else
+			ret = receive_chunk(vdev, cb_data);
 		if (ret > 0) {
 			got_data = TRUE;
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = ret;
-			logic.unitsize = vdev->unitsize;
-			logic.data = buf;
-			vdev->bytes_read += ret;
-			sr_session_send(cb_data, &packet);
 		} else {
 			/* done with this capture file */
-			zip_fclose(vdev->capfile);
-			g_free(vdev->capturefile);
-			g_free(vdev);
+			vdev_free(vdev);
 			sdi->priv = NULL;
 		}
 	}
@@ -133,6 +374,8 @@ static int receive_data(int fd, int revents, void *cb_data)
 	if (!got_data) {
 		packet.type = SR_DF_END;
 		sr_session_send(cb_data, &packet);
+		sr_buffer_pool_destroy(chunk_pool);
+		chunk_pool = NULL;
 	}
 
 	return TRUE;
@@ -169,6 +412,11 @@ static int hw_cleanup(void)
 
 	sr_session_source_remove(-1);
 
+	if (chunk_pool) {
+		sr_buffer_pool_destroy(chunk_pool);
+		chunk_pool = NULL;
+	}
+
 	g_free(sessionfile);
 
 	return SR_OK;
@@ -259,6 +507,13 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 		tmp_u64 = value;
 		vdev->num_probes = *tmp_u64;
 		break;
+	case SR_HWCAP_CAPTURE_CODEC:
+		if ((vdev->codec = sr_codec_from_name(value)) == -1) {
+			sr_err("session driver: %s: unknown codec %s",
+			       __func__, (const char *)value);
+			return SR_ERR;
+		}
+		break;
 	default:
 		sr_err("session driver: %s: unknown capability %d requested",
 		       __func__, hwcap);
@@ -289,17 +544,21 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
-	if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
-		sr_err("session driver: Failed to check capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, sessionfile);
-		return SR_ERR;
+	if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) != -1) {
+		if (!(vdev->capfile = zip_fopen(vdev->archive,
+						vdev->capturefile, 0))) {
+			sr_err("session driver: Failed to open capture file "
+			       "'%s' in session file '%s'.", vdev->capturefile,
+			       sessionfile);
+			return SR_ERR;
+		}
+	} else if ((ret = split_open(vdev)) != SR_OK) {
+		return ret;
 	}
 
-	if (!(vdev->capfile = zip_fopen(vdev->archive, vdev->capturefile, 0))) {
-		sr_err("session driver: Failed to open capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, sessionfile);
-		return SR_ERR;
-	}
+	if (!chunk_pool && (ret = sr_buffer_pool_new(CHUNKSIZE, NUM_FREE_CHUNKS,
+						       &chunk_pool)) != SR_OK)
+		return ret;
 
 	/* freewheeling source */
 	sr_session_source_add(-1, 0, 0, receive_data, cb_data);
@@ -17,74 +17,69 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h" /* First, for large file support in the spool file. */
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <zip.h>
 #include <glib.h>
 #include <glib/gstdio.h>
-#include "config.h"
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
 extern struct sr_session *session;
 extern SR_PRIV struct sr_dev_driver session_driver;
 
-/**
- * Load the session from the specified filename.
- *
- * @param filename The name of the session file to load. Must not be NULL.
+/*
+ * Session file versions. Version 2 files have their capture files split
+ * into independently compressed members (logic-1-1, logic-1-2, ...), and
+ * an index of those in index-1.
+ */
+#define SESSION_VERSION_MIN '1'
+#define SESSION_VERSION_MAX '2'
+
+/* Size of an index entry: first sample, number of samples, toggled probes. */
+#define INDEX_ENTRY_SIZE (3 * sizeof(uint64_t))
+
+/*
+ * Check a session file's version, and read its metadata.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
- *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
- *         other errors.
+ * Returns the metadata, or NULL if this isn't a session file which can be
+ * read. The version is stored in *version if that isn't NULL.
  */
-SR_API int sr_session_load(const char *filename)
+static GKeyFile *metadata_read(struct zip *archive, char *version)
 {
 	GKeyFile *kf;
-	GPtrArray *capturefiles;
-	struct zip *archive;
 	struct zip_file *zf;
 	struct zip_stat zs;
-	struct sr_dev *dev;
-	struct sr_probe *probe;
-	int ret, probenum, devcnt, i, j;
-	uint64_t tmp_u64, total_probes, enabled_probes, p;
-	char **sections, **keys, *metafile, *val, c;
-	char probename[SR_MAX_PROBENAME_LEN + 1];
-
-	if (!filename) {
-		sr_err("session file: %s: filename was NULL", __func__);
-		return SR_ERR_ARG;
-	}
-
-	if (!(archive = zip_open(filename, 0, &ret))) {
-		sr_dbg("session file: Failed to open session file: zip "
-		       "error %d", ret);
-		return SR_ERR;
-	}
+	char *metafile, c;
+	int ret;
 
 	/* check "version" */
 	if (!(zf = zip_fopen(archive, "version", 0))) {
 		sr_dbg("session file: Not a sigrok session file.");
-		return SR_ERR;
+		return NULL;
 	}
 	ret = zip_fread(zf, &c, 1);
-	if (ret != 1 || c != '1') {
+	zip_fclose(zf);
+	if (ret != 1 || c < SESSION_VERSION_MIN || c > SESSION_VERSION_MAX) {
 		sr_dbg("session file: Not a valid sigrok session file.");
-		return SR_ERR;
+		return NULL;
 	}
-	zip_fclose(zf);
+	if (version)
+		*version = c;
 
 	/* read "metadata" */
 	if (zip_stat(archive, "metadata", 0, &zs) == -1) {
 		sr_dbg("session file: Not a valid sigrok session file.");
-		return SR_ERR;
+		return NULL;
 	}
 
 	if (!(metafile = g_try_malloc(zs.size))) {
 		sr_err("session file: %s: metafile malloc failed", __func__);
-		return SR_ERR_MALLOC;
+		return NULL;
 	}
 
 	zf = zip_fopen_index(archive, zs.index, 0);
@@ -94,9 +89,49 @@ SR_API int sr_session_load(const char *filename)
 	kf = g_key_file_new();
 	if (!g_key_file_load_from_data(kf, metafile, zs.size, 0, NULL)) {
 		sr_dbg("session file: Failed to parse metadata.");
+		g_key_file_free(kf);
+		kf = NULL;
+	}
+	g_free(metafile);
+
+	return kf;
+}
+
+/**
+ * Load the session from the specified filename.
+ *
+ * @param filename The name of the session file to load. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_load(const char *filename)
+{
+	GKeyFile *kf;
+	GPtrArray *capturefiles;
+	struct zip *archive;
+	struct sr_dev *dev;
+	struct sr_probe *probe;
+	int ret, probenum, devcnt, i, j;
+	uint64_t tmp_u64, total_probes, enabled_probes, p;
+	char **sections, **keys, *val;
+	char probename[SR_MAX_PROBENAME_LEN + 1];
+
+	if (!filename) {
+		sr_err("session file: %s: filename was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(archive = zip_open(filename, 0, &ret))) {
+		sr_dbg("session file: Failed to open session file: zip "
+		       "error %d", ret);
 		return SR_ERR;
 	}
 
+	if (!(kf = metadata_read(archive, NULL)))
+		return SR_ERR;
+
 	sr_session_new();
 
 	devcnt = 0;
@@ -124,6 +159,8 @@ SR_API int sr_session_load(const char *filename)
 				} else if (!strcmp(keys[j], "samplerate")) {
 					sr_parse_sizestring(val, &tmp_u64);
 					dev->driver->dev_config_set(devcnt, SR_HWCAP_SAMPLERATE, &tmp_u64);
+				} else if (!strcmp(keys[j], "codec")) {
+					dev->driver->dev_config_set(devcnt, SR_HWCAP_CAPTURE_CODEC, val);
 				} else if (!strcmp(keys[j], "unitsize")) {
 					tmp_u64 = strtoull(val, NULL, 10);
 					dev->driver->dev_config_set(devcnt, SR_HWCAP_CAPTURE_UNITSIZE, &tmp_u64);
@@ -158,9 +195,580 @@ SR_API int sr_session_load(const char *filename)
 	return SR_OK;
 }
 
+/*
+ * Append a device's section to a session file's metadata.
+ */
+static void meta_dev_append(GString *meta, struct sr_dev *dev, int devcnt,
+			    int unitsize, int codec)
+{
+	struct sr_probe *probe;
+	GSList *p;
+	uint64_t samplerate;
+	int probecnt;
+	char *s;
+
+	g_string_append_printf(meta, "[device %d]\n", devcnt);
+	if (dev->driver)
+		g_string_append_printf(meta, "driver = %s\n", dev->driver->name);
+
+	if (unitsize == 0)
+		return;
+
+	g_string_append_printf(meta, "capturefile = logic-%d\n", devcnt);
+	g_string_append_printf(meta, "unitsize = %d\n", unitsize);
+	if (sr_codec_name(codec))
+		g_string_append_printf(meta, "codec = %s\n",
+				       sr_codec_name(codec));
+	g_string_append_printf(meta, "total probes = %d\n",
+			       g_slist_length(dev->probes));
+	if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
+		samplerate = *((uint64_t *) dev->driver->dev_info_get(
+				dev->driver_index, SR_DI_CUR_SAMPLERATE));
+		s = sr_samplerate_string(samplerate);
+		g_string_append_printf(meta, "samplerate = %s\n", s);
+		g_free(s);
+	}
+	probecnt = 1;
+	for (p = dev->probes; p; p = p->next) {
+		probe = p->data;
+		if (probe->enabled) {
+			if (probe->name)
+				g_string_append_printf(meta, "probe%d = %s\n",
+						       probecnt, probe->name);
+			if (probe->trigger)
+				g_string_append_printf(meta, " trigger%d = %s\n",
+						       probecnt, probe->trigger);
+			probecnt++;
+		}
+	}
+}
+
+static GString *meta_new(void)
+{
+	GString *meta;
+
+	meta = g_string_sized_new(512);
+	g_string_append(meta, "[global]\n");
+	g_string_append_printf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
+	/* TODO: save protocol decoders used */
+
+	return meta;
+}
+
+/*
+ * Add a member to a zip archive, from a buffer which only needs to stay
+ * around until zip_close().
+ */
+static int zip_add_buffer(struct zip *zipfile, const char *name,
+			  const void *data, uint64_t len)
+{
+	struct zip_source *src;
+
+	if (!(src = zip_source_buffer(zipfile, data, len, 0))) {
+		sr_err("session file: failed to create source for %s: %s",
+		       name, zip_strerror(zipfile));
+		return SR_ERR;
+	}
+	if (zip_add(zipfile, name, src) == -1) {
+		sr_err("session file: error saving %s into zipfile: %s",
+		       name, zip_strerror(zipfile));
+		zip_source_free(src);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * A capture file which is being saved, either while the session is
+ * running, or from a datastore afterwards. Sample data is collected in a
+ * buffer, and whenever that is full it becomes the next member of the
+ * capture file: logic-N-1, logic-N-2, and so on. The members are
+ * compressed on a pipeline of threads, and an index entry is kept for
+ * every one of them.
+ *
+ * libzip copies the whole archive every time it is closed, so rather than
+ * adding every member as soon as it's compressed, they wait in a spool
+ * file next to the session file. When the capture file is finished, they
+ * are all added to the archive in one go, as already deflated data which
+ * libzip copies as is. Only a few members' worth of samples is ever held
+ * in memory, no matter how long the capture runs.
+ */
+struct sr_session_save {
+	char *filename;
+	int devnum;
+	int unitsize;
+	int codec;
+	uint8_t *buf;
+	uint64_t buf_size;
+	uint64_t buf_fill;
+	GByteArray *index;
+	uint64_t num_samples;
+	/* The last sample of the previous member. */
+	uint8_t prev[SR_MAX_NUM_PROBES / 8];
+	struct sr_codec_pipeline *pipeline;
+	/* Buffers for members, and for compressed members, to reuse. */
+	GSList *free_bufs;
+	GSList *free_outs;
+	char *spoolname;
+	FILE *spool;
+	/* struct spooled_member, one for every member in the spool file. */
+	GArray *members;
+	int ret;
+};
+
+/* A compressed member in a writer's spool file. */
+struct spooled_member {
+	off_t offset;
+	uint64_t size;
+	uint64_t comp_size;
+	uint32_t crc;
+};
+
+/* State of a libzip source reading a member out of a spool file. */
+struct spool_source {
+	FILE *spool;
+	struct spooled_member member;
+	uint64_t pos;
+};
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 7, v = 0; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+/*
+ * Find the probes which change value anywhere in a block of samples, or
+ * between the sample before it (if any) and its first sample.
+ */
+static uint64_t toggled_probes(const uint8_t *buf, uint64_t length,
+			       int unitsize, const uint8_t *prev)
+{
+	uint8_t acc[SR_MAX_NUM_PROBES / 8];
+	const uint8_t *p, *end;
+	uint64_t toggled;
+	int i;
+
+	memset(acc, 0, sizeof(acc));
+	if (length == 0)
+		return 0;
+
+	if (prev) {
+		for (i = 0; i < unitsize; i++)
+			acc[i] = prev[i] ^ buf[i];
+	}
+	end = buf + length;
+	for (p = buf + unitsize; p < end; p += unitsize) {
+		for (i = 0; i < unitsize; i++)
+			acc[i] |= p[i] ^ p[i - unitsize];
+	}
+
+	toggled = 0;
+	for (i = unitsize - 1; i >= 0; i--)
+		toggled = (toggled << 8) | acc[i];
+
+	return toggled;
+}
+
+/*
+ * libzip source callback for a member in a spool file. The data is raw
+ * deflate already, which the stat tells libzip, so it's copied into the
+ * archive without being compressed again.
+ */
+static zip_int64_t spool_source_cb(void *state, void *data,
+				   zip_uint64_t len, enum zip_source_cmd cmd)
+{
+	struct spool_source *ssrc;
+	struct zip_stat *st;
+	uint64_t count;
+	int *err;
+
+	ssrc = state;
+
+	switch (cmd) {
+	case ZIP_SOURCE_OPEN:
+		ssrc->pos = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		count = MIN(len, ssrc->member.comp_size - ssrc->pos);
+		if (count == 0)
+			return 0;
+		if (fseeko(ssrc->spool, ssrc->member.offset + ssrc->pos,
+			   SEEK_SET) == -1
+		    || fread(data, 1, count, ssrc->spool) != count)
+			return -1;
+		ssrc->pos += count;
+		return count;
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT:
+		if (len < sizeof(struct zip_stat))
+			return -1;
+		st = data;
+		zip_stat_init(st);
+		st->size = ssrc->member.size;
+		st->comp_size = ssrc->member.comp_size;
+		st->comp_method = ZIP_CM_DEFLATE;
+		st->crc = ssrc->member.crc;
+		st->mtime = time(NULL);
+		st->valid |= ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE
+			| ZIP_STAT_COMP_METHOD | ZIP_STAT_CRC | ZIP_STAT_MTIME;
+		return sizeof(struct zip_stat);
+	case ZIP_SOURCE_ERROR:
+		if (len < 2 * sizeof(int))
+			return -1;
+		err = data;
+		err[0] = ZIP_ER_READ;
+		err[1] = 0;
+		return 2 * sizeof(int);
+	case ZIP_SOURCE_FREE:
+		g_free(ssrc);
+		return 0;
+	}
+
+	return -1;
+}
+
+static void save_job_free(gpointer data)
+{
+	struct sr_codec_job *job;
+
+	job = data;
+	g_free((uint8_t *)job->in);
+	g_free(job->out);
+	g_free(job);
+}
+
+/* Write a compressed member to the spool file. */
+static int session_save_spool(struct sr_session_save *save,
+			      struct sr_codec_job *job)
+{
+	struct spooled_member member;
+	int ret;
+
+	ret = job->ret;
+	if (ret == SR_OK) {
+		member.offset = ftello(save->spool);
+		member.size = job->in_len;
+		member.comp_size = job->out_len;
+		member.crc = job->crc;
+		if (fwrite(job->out, 1, job->out_len, save->spool)
+		    != job->out_len) {
+			sr_err("session file: %s: failed to write to %s",
+			       __func__, save->spoolname);
+			ret = SR_ERR;
+		} else {
+			g_array_append_val(save->members, member);
+		}
+	}
+
+	save->free_bufs = g_slist_prepend(save->free_bufs, (uint8_t *)job->in);
+	save->free_outs = g_slist_prepend(save->free_outs, job->out);
+	g_free(job);
+
+	return ret;
+}
+
+static uint8_t *take_buf(GSList **list, uint64_t size)
+{
+	uint8_t *buf;
+
+	if (!*list)
+		return g_try_malloc(size);
+
+	buf = (*list)->data;
+	*list = g_slist_delete_link(*list, *list);
+
+	return buf;
+}
+
+/*
+ * Hand the buffered data to the pipeline as the next member, and continue
+ * with an empty buffer. Members which have been compressed in the
+ * meantime are written to the spool file.
+ */
+static int session_save_flush(struct sr_session_save *save)
+{
+	struct sr_codec_job *job;
+	uint8_t entry[INDEX_ENTRY_SIZE];
+	uint64_t num_samples, toggled;
+	int ret;
+
+	if (save->ret != SR_OK)
+		return save->ret;
+
+	num_samples = save->buf_fill / save->unitsize;
+	toggled = toggled_probes(save->buf, save->buf_fill, save->unitsize,
+				 save->num_samples > 0 ? save->prev : NULL);
+	put_le64(entry, save->num_samples);
+	put_le64(entry + 8, num_samples);
+	put_le64(entry + 16, toggled);
+	g_byte_array_append(save->index, entry, INDEX_ENTRY_SIZE);
+	if (num_samples > 0)
+		memcpy(save->prev, save->buf + save->buf_fill - save->unitsize,
+		       save->unitsize);
+	save->num_samples += num_samples;
+
+	if (!(job = g_try_malloc0(sizeof(struct sr_codec_job)))
+	    || !(job->out = take_buf(&save->free_outs,
+			sr_codec_bound(save->codec, save->buf_size)))) {
+		sr_err("session file: %s: job malloc failed", __func__);
+		g_free(job);
+		return save->ret = SR_ERR_MALLOC;
+	}
+	job->compress = TRUE;
+	job->codec = save->codec;
+	job->unitsize = save->unitsize;
+	job->in = save->buf;
+	job->in_len = save->buf_fill;
+	job->out_size = sr_codec_bound(save->codec, save->buf_size);
+
+	/* Don't let more members pile up than are being compressed. */
+	if (sr_codec_pipeline_full(save->pipeline)
+	    && (ret = session_save_spool(save, sr_codec_pipeline_pop(
+					save->pipeline, TRUE))) != SR_OK) {
+		save_job_free(job);
+		save->buf = NULL;
+		return save->ret = ret;
+	}
+	sr_codec_pipeline_push(save->pipeline, job);
+
+	while ((job = sr_codec_pipeline_pop(save->pipeline, FALSE))) {
+		if ((ret = session_save_spool(save, job)) != SR_OK)
+			return save->ret = ret;
+	}
+
+	save->buf_fill = 0;
+	if (!(save->buf = take_buf(&save->free_bufs, save->buf_size))) {
+		sr_err("session file: %s: buf malloc failed", __func__);
+		return save->ret = SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+static void session_save_free(struct sr_session_save *save)
+{
+	GSList *l;
+
+	if (save->pipeline)
+		sr_codec_pipeline_destroy(save->pipeline, save_job_free);
+	if (save->spool) {
+		fclose(save->spool);
+		g_unlink(save->spoolname);
+	}
+	for (l = save->free_bufs; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(save->free_bufs);
+	for (l = save->free_outs; l; l = l->next)
+		g_free(l->data);
+	g_slist_free(save->free_outs);
+	if (save->members)
+		g_array_free(save->members, TRUE);
+	if (save->index)
+		g_byte_array_free(save->index, TRUE);
+	g_free(save->spoolname);
+	g_free(save->buf);
+	g_free(save->filename);
+	g_free(save);
+}
+
+/*
+ * Create a writer for a device's capture file, which will be added to an
+ * existing session file when it's finished.
+ */
+static int session_save_new(const char *filename, int devnum, int unitsize,
+			    int codec, struct sr_session_save **save)
+{
+	int fd, ret;
+
+	if (!(*save = g_try_malloc0(sizeof(struct sr_session_save)))) {
+		sr_err("session file: %s: save malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	/* Whole samples only, so a member can be loaded on its own. */
+	(*save)->buf_size = SESSION_MEMBER_SIZE / unitsize * unitsize;
+	if (!((*save)->buf = g_try_malloc((*save)->buf_size))) {
+		sr_err("session file: %s: buf malloc failed", __func__);
+		g_free(*save);
+		return SR_ERR_MALLOC;
+	}
+	(*save)->filename = g_strdup(filename);
+	(*save)->devnum = devnum;
+	(*save)->unitsize = unitsize;
+	(*save)->codec = codec;
+	(*save)->index = g_byte_array_new();
+	(*save)->members = g_array_new(FALSE, FALSE,
+				       sizeof(struct spooled_member));
+
+	if ((ret = sr_codec_pipeline_new(&(*save)->pipeline)) != SR_OK) {
+		session_save_free(*save);
+		return ret;
+	}
+
+	(*save)->spoolname = g_strdup_printf("%s.XXXXXX", filename);
+	if ((fd = g_mkstemp((*save)->spoolname)) == -1
+	    || !((*save)->spool = fdopen(fd, "w+b"))) {
+		sr_err("session file: %s: failed to create spool file %s",
+		       __func__, (*save)->spoolname);
+		if (fd != -1) {
+			close(fd);
+			g_unlink((*save)->spoolname);
+		}
+		session_save_free(*save);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/* Add a writer's capture file and its index to the session file. */
+static int session_save_finish(struct sr_session_save *save)
+{
+	struct sr_codec_job *job;
+	struct spool_source *ssrc;
+	struct zip_source *src;
+	struct zip *zipfile;
+	unsigned int i;
+	char name[32];
+	int ret;
+
+	if (save->ret != SR_OK)
+		return save->ret;
+
+	/* Even an empty capture gets a (then empty) capture file. */
+	if (save->buf_fill > 0 || save->index->len == 0) {
+		if ((ret = session_save_flush(save)) != SR_OK)
+			return ret;
+	}
+	while ((job = sr_codec_pipeline_pop(save->pipeline, TRUE))) {
+		if ((ret = session_save_spool(save, job)) != SR_OK)
+			return ret;
+	}
+	if (fflush(save->spool) != 0) {
+		sr_err("session file: %s: failed to write to %s",
+		       __func__, save->spoolname);
+		return SR_ERR;
+	}
+
+	if (!(zipfile = zip_open(save->filename, 0, &ret))) {
+		sr_err("session file: %s: failed to open %s: zip error %d",
+		       __func__, save->filename, ret);
+		return SR_ERR;
+	}
+
+	for (i = 0; i < save->members->len; i++) {
+		if (!(ssrc = g_try_malloc(sizeof(struct spool_source)))) {
+			sr_err("session file: %s: ssrc malloc failed",
+			       __func__);
+			zip_close(zipfile);
+			return SR_ERR_MALLOC;
+		}
+		ssrc->spool = save->spool;
+		ssrc->member = g_array_index(save->members,
+					     struct spooled_member, i);
+		if (!(src = zip_source_function(zipfile, spool_source_cb,
+						ssrc))) {
+			g_free(ssrc);
+			zip_close(zipfile);
+			return SR_ERR;
+		}
+		snprintf(name, sizeof(name), "logic-%d-%u", save->devnum, i + 1);
+		if (zip_add(zipfile, name, src) == -1) {
+			sr_err("session file: error saving %s into zipfile: %s",
+			       name, zip_strerror(zipfile));
+			zip_source_free(src);
+			zip_close(zipfile);
+			return SR_ERR;
+		}
+	}
+
+	snprintf(name, sizeof(name), "index-%d", save->devnum);
+	if (zip_add_buffer(zipfile, name, save->index->data,
+			   save->index->len) != SR_OK) {
+		zip_close(zipfile);
+		return SR_ERR;
+	}
+
+	if (zip_close(zipfile) == -1) {
+		sr_err("session file: error saving zipfile: %s",
+		       zip_strerror(zipfile));
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Create a session file with only the version and metadata in it. If
+ * 'dev' is NULL, all devices in the session are described.
+ */
+static int session_file_create(const char *filename, struct sr_dev *dev,
+			       int unitsize, int codec)
+{
+	GString *meta;
+	GSList *l;
+	struct sr_dev *d;
+	struct zip *zipfile;
+	char version[1];
+	int devcnt, ret;
+
+	/* Quietly delete it first, libzip wants replace ops otherwise. */
+	unlink(filename);
+	if (!(zipfile = zip_open(filename, ZIP_CREATE, &ret))) {
+		sr_err("session file: %s: failed to create %s: zip error %d",
+		       __func__, filename, ret);
+		return SR_ERR;
+	}
+
+	meta = meta_new();
+	if (dev) {
+		meta_dev_append(meta, dev, 1, unitsize, codec);
+	} else {
+		devcnt = 1;
+		for (l = session->devs; l; l = l->next) {
+			d = l->data;
+			meta_dev_append(meta, d, devcnt++, d->datastore ?
+					d->datastore->ds_unitsize : 0, codec);
+		}
+	}
+
+	version[0] = '2';
+	ret = zip_add_buffer(zipfile, "version", version, 1);
+	if (ret == SR_OK)
+		ret = zip_add_buffer(zipfile, "metadata", meta->str, meta->len);
+	if (zip_close(zipfile) == -1 && ret == SR_OK) {
+		sr_err("session file: error saving zipfile: %s",
+		       zip_strerror(zipfile));
+		ret = SR_ERR;
+	}
+	g_string_free(meta, TRUE);
+
+	return ret;
+}
+
 /**
  * Save the current session to the specified file.
  *
+ * This saves the sample data collected in the devices' datastores after
+ * the acquisition. To save a session while it is being captured, see
+ * sr_session_save_start().
+ *
  * @param filename The name of the file where to save the current session.
  *                 Must not be NULL.
  *
@@ -169,119 +777,749 @@ SR_API int sr_session_load(const char *filename)
  */
 int sr_session_save(const char *filename)
 {
-	GSList *l, *p, *d;
-	FILE *meta;
+	GSList *l;
 	struct sr_dev *dev;
-	struct sr_probe *probe;
 	struct sr_datastore *ds;
-	struct zip *zipfile;
-	struct zip_source *versrc, *metasrc, *logicsrc;
-	int bufcnt, devcnt, tmpfile, ret, probecnt;
-	uint64_t samplerate;
-	char version[1], rawname[16], metafile[32], *buf, *s;
+	struct sr_session_save *save;
+	uint64_t unit, count;
+	int devcnt, ret;
 
 	if (!filename) {
 		sr_err("session file: %s: filename was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	/* Quietly delete it first, libzip wants replace ops otherwise. */
-	unlink(filename);
-	if (!(zipfile = zip_open(filename, ZIP_CREATE, &ret)))
-		return SR_ERR;
+	if ((ret = session_file_create(filename, NULL, 0,
+				       SR_SESSION_CODEC_BITPLANE)) != SR_OK)
+		return ret;
+
+	/* all datastores in all devices */
+	devcnt = 1;
+	for (l = session->devs; l; l = l->next, devcnt++) {
+		dev = l->data;
+		if (!(ds = dev->datastore))
+			continue;
 
-	/* "version" */
-	version[0] = '1';
-	if (!(versrc = zip_source_buffer(zipfile, version, 1, 0)))
+		ret = session_save_new(filename, devcnt, ds->ds_unitsize,
+				       SR_SESSION_CODEC_BITPLANE, &save);
+		if (ret != SR_OK)
+			return ret;
+
+		/* Copy the samples straight into the member buffers. */
+		for (unit = 0; ret == SR_OK && unit < ds->num_units; ) {
+			count = MIN((save->buf_size - save->buf_fill)
+				    / save->unitsize, ds->num_units - unit);
+			ret = sr_datastore_get(ds, unit, count,
+					       save->buf + save->buf_fill);
+			save->buf_fill += count * save->unitsize;
+			unit += count;
+			if (ret == SR_OK && save->buf_fill == save->buf_size)
+				ret = session_save_flush(save);
+		}
+		if (ret == SR_OK)
+			ret = session_save_finish(save);
+		session_save_free(save);
+		if (ret != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Start saving a session to a file while it is being captured.
+ *
+ * The file's metadata is written right away, from the device's current
+ * settings. The sample data is then passed in with sr_session_save_append()
+ * as it comes in, and the file is complete once sr_session_save_end() has
+ * been called. The data is compressed on as many threads as there are
+ * cores.
+ *
+ * @param filename The name of the file to save the session to. An existing
+ *                 file is overwritten. Must not be NULL.
+ * @param dev The device the samples come from. Must not be NULL.
+ * @param unitsize The number of bytes per sample in the data which will be
+ *                 appended. Must be between 1 and SR_MAX_NUM_PROBES / 8.
+ * @param codec How the sample data is compressed, one of SR_SESSION_CODEC_*.
+ * @param save Pointer to a variable which will hold the newly created
+ *             writer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if the
+ *         file could not be written.
+ */
+SR_API int sr_session_save_start(const char *filename, struct sr_dev *dev,
+				 int unitsize, int codec,
+				 struct sr_session_save **save)
+{
+	int ret;
+
+	if (!filename || !dev || !save) {
+		sr_err("session file: %s: filename, dev or save was NULL",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize < 1 || unitsize > SR_MAX_NUM_PROBES / 8) {
+		sr_err("session file: %s: unitsize was %d, but it must be "
+		       "between 1 and %d", __func__, unitsize,
+		       SR_MAX_NUM_PROBES / 8);
+		return SR_ERR_ARG;
+	}
+
+	if (codec < SR_SESSION_CODEC_DEFLATE
+	    || codec > SR_SESSION_CODEC_BITPLANE) {
+		sr_err("session file: %s: invalid codec %d", __func__, codec);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = session_file_create(filename, dev, unitsize,
+				       codec)) != SR_OK)
+		return ret;
+
+	return session_save_new(filename, 1, unitsize, codec, save);
+}
+
+/**
+ * Append sample data to a session file which is being written.
+ *
+ * @param save The writer, from sr_session_save_start(). Must not be NULL.
+ * @param data The sample data. Must not be NULL.
+ * @param length The length of the data, in bytes.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the file could not be written.
+ */
+SR_API int sr_session_save_append(struct sr_session_save *save,
+				  const uint8_t *data, uint64_t length)
+{
+	uint64_t size;
+	int ret;
+
+	if (!save || !data) {
+		sr_err("session file: %s: save or data was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (save->ret != SR_OK)
+		return save->ret;
+
+	while (length > 0) {
+		size = MIN(length, save->buf_size - save->buf_fill);
+		memcpy(save->buf + save->buf_fill, data, size);
+		save->buf_fill += size;
+		data += size;
+		length -= size;
+
+		if (save->buf_fill == save->buf_size
+		    && (ret = session_save_flush(save)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Append run-length encoded sample data to a session file which is being
+ * written. The runs are expanded straight into the writer's buffer.
+ *
+ * @param save The writer, from sr_session_save_start(). Must not be NULL.
+ * @param rle The samples. Their unit size must be the one the writer was
+ *            started with. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the file could not be written.
+ */
+SR_API int sr_session_save_append_rle(struct sr_session_save *save,
+				      const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t run, run_offset, length;
+	int ret;
+
+	if (!save || !rle) {
+		sr_err("session file: %s: save or rle was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (save->ret != SR_OK)
+		return save->ret;
+
+	if (rle->unitsize != save->unitsize) {
+		sr_err("session file: %s: unitsize was %d, but the file's is %d",
+		       __func__, rle->unitsize, save->unitsize);
+		return SR_ERR_ARG;
+	}
+
+	run = run_offset = 0;
+	while (run < rle->num_runs) {
+		ret = sr_logic_rle_expand(rle, &run, &run_offset,
+					  save->buf + save->buf_fill,
+					  save->buf_size - save->buf_fill,
+					  &length);
+		if (ret != SR_OK)
+			return ret;
+		save->buf_fill += length;
+
+		if (save->buf_fill == save->buf_size
+		    && (ret = session_save_flush(save)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Finish a session file which is being written, and free the writer.
+ *
+ * @param save The writer, from sr_session_save_start(). Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the file could not be written.
+ */
+SR_API int sr_session_save_end(struct sr_session_save *save)
+{
+	int ret;
+
+	if (!save) {
+		sr_err("session file: %s: save was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ret = session_save_finish(save);
+	session_save_free(save);
+
+	return ret;
+}
+
+/* A member of a session file's capture file, see struct sr_session_file. */
+struct session_chunk {
+	uint64_t first_sample;
+	uint64_t num_samples;
+	uint64_t toggled;
+};
+
+/*
+ * A session file opened for random access to one device's samples.
+ *
+ * The capture file's members are listed in chunks. For version 2 files
+ * that list comes from the index. Otherwise it's built from the members'
+ * sizes, which the zip directory has, without decompressing anything.
+ * A version 1 file then is one big chunk, so it can only be read as
+ * quickly as it could be replayed.
+ *
+ * The member last read from is kept open, so reading a capture front to
+ * back doesn't go back to the start of a member on every call. Members
+ * holding bit planes can only be decoded as a whole, so the member last
+ * decoded is kept instead.
+ */
+struct sr_session_file {
+	struct zip *archive;
+	char *capturefile;
+	/* The members are named <capturefile>-N. */
+	gboolean split;
+	int unitsize;
+	int codec;
+	uint8_t *dec_buf;
+	uint64_t dec_size;
+	/* The chunk in dec_buf, plus one, or 0 if none. */
+	unsigned int dec_chunk;
+	GArray *chunks;
+	uint64_t num_samples;
+	/* The member which is open, its chunk, and the next sample in it. */
+	struct zip_file *zf;
+	unsigned int zf_chunk;
+	uint64_t zf_sample;
+};
+
+static char *chunk_name(const struct sr_session_file *sf, unsigned int chunk)
+{
+	if (!sf->split)
+		return g_strdup(sf->capturefile);
+
+	return g_strdup_printf("%s-%u", sf->capturefile, chunk + 1);
+}
+
+/* Read the chunk list from a version 2 file's index. */
+static int chunks_from_index(struct sr_session_file *sf, const char *name)
+{
+	struct session_chunk chunk;
+	struct zip_file *zf;
+	struct zip_stat zs;
+	uint8_t *index;
+	uint64_t i, next_sample;
+
+	if (zip_stat(sf->archive, name, 0, &zs) == -1)
 		return SR_ERR;
-	if (zip_add(zipfile, "version", versrc) == -1) {
-		sr_info("session file: error saving version into zipfile: %s",
-			zip_strerror(zipfile));
+
+	if (zs.size == 0 || zs.size % INDEX_ENTRY_SIZE) {
+		sr_err("session file: %s: index %s is corrupt", __func__, name);
 		return SR_ERR;
 	}
 
-	/* init "metadata" */
-	strcpy(metafile, "sigrok-meta-XXXXXX");
-	if ((tmpfile = g_mkstemp(metafile)) == -1)
+	if (!(index = g_try_malloc(zs.size + 1))) {
+		sr_err("session file: %s: index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!(zf = zip_fopen_index(sf->archive, zs.index, 0))
+	    || zip_fread(zf, index, zs.size) != (int64_t)zs.size) {
+		sr_err("session file: %s: failed to read index %s",
+		       __func__, name);
+		if (zf)
+			zip_fclose(zf);
+		g_free(index);
 		return SR_ERR;
-	close(tmpfile);
-	meta = g_fopen(metafile, "wb");
-	fprintf(meta, "[global]\n");
-	fprintf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
-	/* TODO: save protocol decoders used */
+	}
+	zip_fclose(zf);
 
-	/* all datastores in all devices */
-	devcnt = 1;
-	for (l = session->devs; l; l = l->next) {
-		dev = l->data;
-		/* metadata */
-		fprintf(meta, "[device %d]\n", devcnt);
-		if (dev->driver)
-			fprintf(meta, "driver = %s\n", dev->driver->name);
-
-		ds = dev->datastore;
-		if (ds) {
-			/* metadata */
-			fprintf(meta, "capturefile = logic-%d\n", devcnt);
-			fprintf(meta, "unitsize = %d\n", ds->ds_unitsize);
-			fprintf(meta, "total probes = %d\n", g_slist_length(dev->probes));
-			if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
-				samplerate = *((uint64_t *) dev->driver->dev_info_get(
-						dev->driver_index, SR_DI_CUR_SAMPLERATE));
-				s = sr_samplerate_string(samplerate);
-				fprintf(meta, "samplerate = %s\n", s);
-				g_free(s);
-			}
-			probecnt = 1;
-			for (p = dev->probes; p; p = p->next) {
-				probe = p->data;
-				if (probe->enabled) {
-					if (probe->name)
-						fprintf(meta, "probe%d = %s\n", probecnt, probe->name);
-					if (probe->trigger)
-						fprintf(meta, " trigger%d = %s\n", probecnt, probe->trigger);
-					probecnt++;
-				}
-			}
+	/* chunk_find() relies on the chunks following each other. */
+	next_sample = 0;
+	for (i = 0; i < zs.size; i += INDEX_ENTRY_SIZE) {
+		chunk.first_sample = get_le64(index + i);
+		chunk.num_samples = get_le64(index + i + 8);
+		chunk.toggled = get_le64(index + i + 16);
+		if (chunk.first_sample != next_sample
+		    || chunk.num_samples > G_MAXUINT64 - next_sample) {
+			sr_err("session file: %s: index %s is corrupt",
+			       __func__, name);
+			g_free(index);
+			return SR_ERR;
+		}
+		next_sample += chunk.num_samples;
+		g_array_append_val(sf->chunks, chunk);
+	}
+	g_free(index);
 
-			/* dump datastore into logic-n */
-			buf = g_try_malloc(ds->num_units * ds->ds_unitsize +
-				   DATASTORE_CHUNKSIZE);
-			if (!buf) {
-				sr_err("session file: %s: buf malloc failed",
-				       __func__);
-				return SR_ERR_MALLOC;
-			}
+	sf->split = TRUE;
 
-			bufcnt = 0;
-			for (d = ds->chunklist; d; d = d->next) {
-				memcpy(buf + bufcnt, d->data,
-				       DATASTORE_CHUNKSIZE);
-				bufcnt += DATASTORE_CHUNKSIZE;
-			}
-			if (!(logicsrc = zip_source_buffer(zipfile, buf,
-				       ds->num_units * ds->ds_unitsize, TRUE)))
-				return SR_ERR;
-			snprintf(rawname, 15, "logic-%d", devcnt);
-			if (zip_add(zipfile, rawname, logicsrc) == -1)
-				return SR_ERR;
+	return SR_OK;
+}
+
+/*
+ * Build the chunk list from the capture file's members. Nothing is known
+ * about their contents, so any probe may toggle in any of them.
+ */
+static int chunks_from_members(struct sr_session_file *sf)
+{
+	struct session_chunk chunk;
+	struct zip_stat zs;
+	char *name;
+
+	chunk.first_sample = 0;
+	chunk.toggled = G_MAXUINT64;
+
+	if (zip_stat(sf->archive, sf->capturefile, 0, &zs) != -1) {
+		chunk.num_samples = zs.size / sf->unitsize;
+		g_array_append_val(sf->chunks, chunk);
+		return SR_OK;
+	}
+
+	sf->split = TRUE;
+	while (TRUE) {
+		name = chunk_name(sf, sf->chunks->len);
+		if (zip_stat(sf->archive, name, 0, &zs) == -1) {
+			g_free(name);
+			break;
 		}
-		devcnt++;
+		g_free(name);
+		chunk.num_samples = zs.size / sf->unitsize;
+		g_array_append_val(sf->chunks, chunk);
+		chunk.first_sample += chunk.num_samples;
 	}
-	fclose(meta);
 
-	if (!(metasrc = zip_source_file(zipfile, metafile, 0, -1)))
+	if (sf->chunks->len == 0) {
+		sr_err("session file: %s: capture file %s was not found",
+		       __func__, sf->capturefile);
 		return SR_ERR;
-	if (zip_add(zipfile, "metadata", metasrc) == -1)
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Open a session file for random access to a device's samples.
+ *
+ * Both version 1 and version 2 session files can be read, but only
+ * version 2 files, and files saved with sr_session_save_start(), can be
+ * read from any sample without decompressing all the samples before it.
+ *
+ * @param filename The name of the session file. Must not be NULL.
+ * @param devnum The number of the device in the session file, starting
+ *               at 1.
+ * @param sf Pointer to a variable which will hold the opened session file.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if the
+ *         file could not be read.
+ */
+SR_API int sr_session_file_open(const char *filename, int devnum,
+				struct sr_session_file **sf)
+{
+	GKeyFile *kf;
+	struct session_chunk *last;
+	char *section, *val, version;
+	int ret;
+
+	if (!filename || !sf) {
+		sr_err("session file: %s: filename or sf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*sf = g_try_malloc0(sizeof(struct sr_session_file)))) {
+		sr_err("session file: %s: sf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	(*sf)->chunks = g_array_new(FALSE, FALSE, sizeof(struct session_chunk));
+
+	if (!((*sf)->archive = zip_open(filename, 0, &ret))) {
+		sr_err("session file: %s: failed to open %s: zip error %d",
+		       __func__, filename, ret);
+		sr_session_file_close(*sf);
+		return SR_ERR;
+	}
+
+	if (!(kf = metadata_read((*sf)->archive, &version))) {
+		sr_session_file_close(*sf);
 		return SR_ERR;
+	}
+
+	section = g_strdup_printf("device %d", devnum);
+	(*sf)->capturefile = g_key_file_get_string(kf, section,
+						   "capturefile", NULL);
+	if ((val = g_key_file_get_string(kf, section, "unitsize", NULL)))
+		(*sf)->unitsize = strtoul(val, NULL, 10);
+	g_free(val);
+	val = g_key_file_get_string(kf, section, "codec", NULL);
+	(*sf)->codec = sr_codec_from_name(val);
+	g_free(val);
+	g_free(section);
+	g_key_file_free(kf);
+
+	if (!(*sf)->capturefile || (*sf)->unitsize < 1) {
+		sr_err("session file: %s: device %d has no samples in %s",
+		       __func__, devnum, filename);
+		sr_session_file_close(*sf);
+		return SR_ERR_ARG;
+	}
 
-	if ((ret = zip_close(zipfile)) == -1) {
-		sr_info("session file: error saving zipfile: %s",
-			zip_strerror(zipfile));
+	if ((*sf)->codec == -1) {
+		sr_err("session file: %s: device %d in %s has an unknown "
+		       "codec", __func__, devnum, filename);
+		sr_session_file_close(*sf);
 		return SR_ERR;
 	}
 
-	unlink(metafile);
+	ret = SR_ERR;
+	if (version >= '2') {
+		val = g_strdup_printf("index-%d", devnum);
+		ret = chunks_from_index(*sf, val);
+		g_free(val);
+	}
+	/* Without an index, only raw member sizes tell the samples apart. */
+	if (ret != SR_OK && (*sf)->codec != SR_SESSION_CODEC_BITPLANE) {
+		g_array_set_size((*sf)->chunks, 0);
+		ret = chunks_from_members(*sf);
+	}
+	if (ret != SR_OK) {
+		sr_session_file_close(*sf);
+		return ret;
+	}
+
+	last = &g_array_index((*sf)->chunks, struct session_chunk,
+			      (*sf)->chunks->len - 1);
+	(*sf)->num_samples = last->first_sample + last->num_samples;
+
+	return SR_OK;
+}
+
+/**
+ * Close a session file opened with sr_session_file_open().
+ *
+ * @param sf The session file. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_session_file_close(struct sr_session_file *sf)
+{
+	if (!sf) {
+		sr_err("session file: %s: sf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sf->zf)
+		zip_fclose(sf->zf);
+	if (sf->archive)
+		zip_close(sf->archive);
+	g_array_free(sf->chunks, TRUE);
+	g_free(sf->dec_buf);
+	g_free(sf->capturefile);
+	g_free(sf);
+
+	return SR_OK;
+}
+
+/**
+ * Get the unit size and the number of samples of an opened session file.
+ *
+ * @param sf The session file. Must not be NULL.
+ * @param unitsize Pointer to a variable which will hold the number of
+ *                 bytes per sample. May be NULL.
+ * @param num_samples Pointer to a variable which will hold the number of
+ *                    samples. May be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_session_file_info(const struct sr_session_file *sf,
+				int *unitsize, uint64_t *num_samples)
+{
+	if (!sf) {
+		sr_err("session file: %s: sf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize)
+		*unitsize = sf->unitsize;
+	if (num_samples)
+		*num_samples = sf->num_samples;
+
+	return SR_OK;
+}
+
+/* Find the chunk which holds a sample, which must be in the file. */
+static unsigned int chunk_find(const struct sr_session_file *sf,
+			       uint64_t sample)
+{
+	const struct session_chunk *chunks;
+	unsigned int lo, hi, mid;
+
+	chunks = (const struct session_chunk *)sf->chunks->data;
+	lo = 0;
+	hi = sf->chunks->len - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (chunks[mid].first_sample <= sample)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/* Decode a chunk whose member holds bit planes into the decode buffer. */
+static int chunk_decode(struct sr_session_file *sf, unsigned int chunk)
+{
+	const struct session_chunk *c;
+	struct zip_file *zf;
+	struct zip_stat zs;
+	uint8_t *planes, *buf;
+	uint64_t size, num_samples;
+	char *name;
+	int ret;
+
+	if (sf->dec_chunk == chunk + 1)
+		return SR_OK;
+	sf->dec_chunk = 0;
+
+	c = &g_array_index(sf->chunks, struct session_chunk, chunk);
+	size = c->num_samples * sf->unitsize;
+	if (size > sf->dec_size) {
+		if (!(buf = g_try_realloc(sf->dec_buf, size))) {
+			sr_err("session file: %s: buf malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		sf->dec_buf = buf;
+		sf->dec_size = size;
+	}
+
+	name = chunk_name(sf, chunk);
+	zf = NULL;
+	planes = NULL;
+	ret = SR_ERR;
+	if (zip_stat(sf->archive, name, 0, &zs) != -1
+	    && (planes = g_try_malloc(zs.size + 1))
+	    && (zf = zip_fopen_index(sf->archive, zs.index, 0))
+	    && zip_fread(zf, planes, zs.size) == (int64_t)zs.size)
+		ret = sr_bitplane_decode(planes, zs.size, sf->unitsize,
+					 sf->dec_buf, c->num_samples,
+					 &num_samples);
+	if (zf)
+		zip_fclose(zf);
+	g_free(planes);
+	g_free(name);
+
+	if (ret != SR_OK || num_samples != c->num_samples) {
+		sr_err("session file: %s: failed to decode chunk %u",
+		       __func__, chunk);
+		return SR_ERR;
+	}
+	sf->dec_chunk = chunk + 1;
+
+	return SR_OK;
+}
+
+/* Read samples from the chunk's member, starting at the given sample. */
+static int chunk_read(struct sr_session_file *sf, unsigned int chunk,
+		      uint64_t sample, uint8_t *buf, uint64_t count)
+{
+	const struct session_chunk *c;
+	uint8_t skipbuf[4096];
+	uint64_t len, skip;
+	int64_t ret;
+	char *name;
+
+	if (sf->codec == SR_SESSION_CODEC_BITPLANE) {
+		if ((ret = chunk_decode(sf, chunk)) != SR_OK)
+			return ret;
+		c = &g_array_index(sf->chunks, struct session_chunk, chunk);
+		memcpy(buf, sf->dec_buf + (sample - c->first_sample)
+		       * sf->unitsize, count * sf->unitsize);
+		return SR_OK;
+	}
+
+	if (sf->zf && (sf->zf_chunk != chunk || sf->zf_sample > sample)) {
+		zip_fclose(sf->zf);
+		sf->zf = NULL;
+	}
+
+	if (!sf->zf) {
+		name = chunk_name(sf, chunk);
+		sf->zf = zip_fopen(sf->archive, name, 0);
+		g_free(name);
+		if (!sf->zf) {
+			sr_err("session file: %s: failed to open chunk %u: %s",
+			       __func__, chunk, zip_strerror(sf->archive));
+			return SR_ERR;
+		}
+		sf->zf_chunk = chunk;
+		sf->zf_sample = g_array_index(sf->chunks, struct session_chunk,
+					      chunk).first_sample;
+	}
+
+	/* zip members can't seek, skip ahead by reading. */
+	skip = (sample - sf->zf_sample) * sf->unitsize;
+	while (skip > 0) {
+		len = MIN(skip, sizeof(skipbuf));
+		if ((ret = zip_fread(sf->zf, skipbuf, len)) <= 0)
+			goto err;
+		skip -= ret;
+	}
+
+	len = count * sf->unitsize;
+	while (len > 0) {
+		if ((ret = zip_fread(sf->zf, buf, len)) <= 0)
+			goto err;
+		buf += ret;
+		len -= ret;
+	}
+	sf->zf_sample = sample + count;
+
+	return SR_OK;
+
+err:
+	sr_err("session file: %s: failed to read chunk %u", __func__, chunk);
+	zip_fclose(sf->zf);
+	sf->zf = NULL;
+
+	return SR_ERR;
+}
+
+/**
+ * Read a range of samples from an opened session file.
+ *
+ * Only the members of the capture file which hold the requested samples
+ * are decompressed, and only up to the last requested sample.
+ *
+ * @param sf The session file. Must not be NULL.
+ * @param start The first sample to read.
+ * @param count The number of samples to read. Fewer are read if the file
+ *              ends before that.
+ * @param buf The buffer to read the samples into, which must have room for
+ *            count samples of the file's unit size. Must not be NULL.
+ * @param count_read Pointer to a variable which will hold the number of
+ *                   samples read. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the file could not be read.
+ */
+SR_API int sr_session_file_read(struct sr_session_file *sf, uint64_t start,
+				uint64_t count, uint8_t *buf,
+				uint64_t *count_read)
+{
+	const struct session_chunk *chunk;
+	unsigned int c;
+	uint64_t n;
+	int ret;
+
+	if (!sf || !buf || !count_read) {
+		sr_err("session file: %s: sf, buf or count_read was NULL",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	*count_read = 0;
+	if (start >= sf->num_samples)
+		return SR_OK;
+	count = MIN(count, sf->num_samples - start);
+
+	for (c = chunk_find(sf, start); count > 0; c++) {
+		chunk = &g_array_index(sf->chunks, struct session_chunk, c);
+		n = MIN(count, chunk->first_sample + chunk->num_samples - start);
+		if (n == 0)
+			continue;
+		if ((ret = chunk_read(sf, c, start, buf, n)) != SR_OK)
+			return ret;
+		buf += n * sf->unitsize;
+		start += n;
+		count -= n;
+		*count_read += n;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Find the probes which may change value within a range of samples,
+ * without reading them.
+ *
+ * This uses the summaries in a version 2 file's index, which cover whole
+ * members of the capture file, so the result may include probes which
+ * only change outside the range. A probe which isn't in it doesn't change
+ * within the range, so the range can be skipped when looking for edges on
+ * that probe. Without an index, all probes are reported.
+ *
+ * @param sf The session file. Must not be NULL.
+ * @param start The first sample of the range.
+ * @param count The number of samples in the range.
+ * @param toggled Pointer to a variable which will hold the probes, as a
+ *                bitmask in the same layout as a sample. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_session_file_toggled(const struct sr_session_file *sf,
+				   uint64_t start, uint64_t count,
+				   uint64_t *toggled)
+{
+	const struct session_chunk *chunk;
+	unsigned int c;
+
+	if (!sf || !toggled) {
+		sr_err("session file: %s: sf or toggled was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	*toggled = 0;
+	if (start >= sf->num_samples || count == 0)
+		return SR_OK;
+	count = MIN(count, sf->num_samples - start);
+
+	for (c = chunk_find(sf, start); c < sf->chunks->len; c++) {
+		chunk = &g_array_index(sf->chunks, struct session_chunk, c);
+		if (chunk->first_sample >= start + count)
+			break;
+		*toggled |= chunk->toggled;
+	}
 
 	return SR_OK;
 }
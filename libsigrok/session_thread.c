@@ -0,0 +1,452 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Threaded session mode.
+ *
+ * In this mode, the thread which starts and runs the session becomes the
+ * acquisition thread: it runs the hardware drivers' event sources, and
+ * nothing else. Every datafeed callback gets a consumer thread of its own,
+ * which is fed through a bounded single-producer/single-consumer ring.
+ *
+ * Packets are copied once when they are queued (drivers typically send
+ * packets which live on their stack), and the copy is shared by all
+ * consumers. Logic data which lives in a pool buffer isn't copied; the
+ * queued packet takes a reference to the buffer instead. A ring which is
+ * full either blocks the acquisition thread until its consumer catches up,
+ * or drops sample packets, depending on how the session was configured.
+ * Control packets (header, meta, trigger, end, frame markers) are never
+ * dropped.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+extern struct sr_session *session;
+
+/* A packet queued for the consumer threads, shared between them. */
+struct queued_packet {
+	volatile gint refcount;
+	struct sr_dev *dev;
+	struct sr_buffer *buffer;
+	struct sr_datafeed_packet packet;
+};
+
+/*
+ * Lock-free SPSC ring of packets. The mutex and condition are only used
+ * to sleep when the ring is empty (consumer) or full (producer); the
+ * 'waiting' flags tell the other side whether it needs to wake us up.
+ */
+struct ring {
+	struct queued_packet **slots;
+	guint size;
+	volatile gint head;
+	volatile gint tail;
+	volatile gint consumer_waiting;
+	volatile gint producer_waiting;
+	volatile gint closed;
+	GMutex *mutex;
+	GCond *cond;
+};
+
+struct consumer {
+	sr_datafeed_callback_t cb;
+	GThread *thread;
+	struct ring ring;
+};
+
+static GSList *consumers = NULL;
+
+/*
+ * Number of floats per sample in each device's SR_DF_ANALOG packets, as
+ * announced by its SR_DF_META_ANALOG packet. Only used from the acquisition
+ * thread.
+ */
+static GHashTable *analog_probes = NULL;
+
+static guint ring_used(struct ring *ring)
+{
+	return (guint)g_atomic_int_get(&ring->tail)
+	       - (guint)g_atomic_int_get(&ring->head);
+}
+
+static void ring_wake(struct ring *ring, volatile gint *waiting)
+{
+	if (!g_atomic_int_get(waiting))
+		return;
+
+	g_mutex_lock(ring->mutex);
+	g_cond_broadcast(ring->cond);
+	g_mutex_unlock(ring->mutex);
+}
+
+static int ring_init(struct ring *ring, guint size)
+{
+	if (!(ring->slots = g_try_malloc0(size * sizeof(struct queued_packet *)))) {
+		sr_err("session: %s: ring malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ring->size = size;
+	ring->head = ring->tail = 0;
+	ring->consumer_waiting = ring->producer_waiting = 0;
+	ring->closed = 0;
+	ring->mutex = g_mutex_new();
+	ring->cond = g_cond_new();
+
+	return SR_OK;
+}
+
+static void ring_free(struct ring *ring)
+{
+	g_mutex_free(ring->mutex);
+	g_cond_free(ring->cond);
+	g_free(ring->slots);
+}
+
+static void packet_unref(struct queued_packet *qp)
+{
+	if (!g_atomic_int_dec_and_test(&qp->refcount))
+		return;
+
+	if (qp->buffer)
+		sr_buffer_unref(qp->buffer);
+	g_free(qp);
+}
+
+/*
+ * Push a packet onto a consumer's ring. Returns FALSE if the ring was full
+ * and the packet was dropped.
+ */
+static gboolean ring_push(struct ring *ring, struct queued_packet *qp,
+			  gboolean may_drop)
+{
+	guint tail;
+
+	if (ring_used(ring) == ring->size) {
+		if (may_drop)
+			return FALSE;
+
+		session->thread_stats.stalls++;
+		g_atomic_int_set(&ring->producer_waiting, 1);
+		g_mutex_lock(ring->mutex);
+		while (ring_used(ring) == ring->size)
+			g_cond_wait(ring->cond, ring->mutex);
+		g_mutex_unlock(ring->mutex);
+		g_atomic_int_set(&ring->producer_waiting, 0);
+	}
+
+	tail = (guint)g_atomic_int_get(&ring->tail);
+	ring->slots[tail % ring->size] = qp;
+	g_atomic_int_set(&ring->tail, (gint)(tail + 1));
+	ring_wake(ring, &ring->consumer_waiting);
+
+	return TRUE;
+}
+
+/* Pop a packet off a ring, or return NULL once it's closed and empty. */
+static struct queued_packet *ring_pop(struct ring *ring)
+{
+	struct queued_packet *qp;
+	guint head;
+
+	if (ring_used(ring) == 0) {
+		g_atomic_int_set(&ring->consumer_waiting, 1);
+		g_mutex_lock(ring->mutex);
+		while (ring_used(ring) == 0 && !g_atomic_int_get(&ring->closed))
+			g_cond_wait(ring->cond, ring->mutex);
+		g_mutex_unlock(ring->mutex);
+		g_atomic_int_set(&ring->consumer_waiting, 0);
+		if (ring_used(ring) == 0)
+			return NULL;
+	}
+
+	head = (guint)g_atomic_int_get(&ring->head);
+	qp = ring->slots[head % ring->size];
+	g_atomic_int_set(&ring->head, (gint)(head + 1));
+	ring_wake(ring, &ring->producer_waiting);
+
+	return qp;
+}
+
+static gpointer consumer_thread(gpointer data)
+{
+	struct consumer *c;
+	struct queued_packet *qp;
+
+	c = data;
+	while ((qp = ring_pop(&c->ring))) {
+		sr_session_deliver(c->cb, qp->dev, &qp->packet);
+		packet_unref(qp);
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy a packet, including its payload and sample data, into one block of
+ * memory, so it can outlive the driver's stack frame.
+ */
+static struct queued_packet *packet_copy(struct sr_dev *dev,
+					 struct sr_datafeed_packet *packet)
+{
+	struct queued_packet *qp;
+	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *rle;
+	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *analog_raw;
+	uint64_t payload_size, data_size;
+	uint8_t *p;
+	int num_probes;
+
+	data_size = 0;
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		payload_size = sizeof(struct sr_datafeed_header);
+		break;
+	case SR_DF_META_LOGIC:
+		payload_size = sizeof(struct sr_datafeed_meta_logic);
+		break;
+	case SR_DF_LOGIC:
+		payload_size = sizeof(struct sr_datafeed_logic);
+		logic = packet->payload;
+		if (logic && !logic->buffer)
+			data_size = logic->length;
+		break;
+	case SR_DF_LOGIC_RLE:
+		payload_size = sizeof(struct sr_datafeed_logic_rle);
+		rle = packet->payload;
+		if (rle)
+			data_size = rle->num_runs
+				    * (sizeof(uint64_t) + rle->unitsize);
+		break;
+	case SR_DF_META_ANALOG:
+		payload_size = sizeof(struct sr_datafeed_meta_analog);
+		if (packet->payload)
+			g_hash_table_insert(analog_probes, dev, GINT_TO_POINTER(
+			    ((struct sr_datafeed_meta_analog *)
+			     packet->payload)->num_probes));
+		break;
+	case SR_DF_ANALOG:
+		payload_size = sizeof(struct sr_datafeed_analog);
+		analog = packet->payload;
+		num_probes = GPOINTER_TO_INT(g_hash_table_lookup(analog_probes,
+								 dev));
+		if (analog)
+			data_size = (uint64_t)analog->num_samples
+				    * MAX(num_probes, 1) * sizeof(float);
+		break;
+	case SR_DF_ANALOG_RAW:
+		payload_size = sizeof(struct sr_datafeed_analog_raw);
+		analog_raw = packet->payload;
+		if (analog_raw)
+			data_size = (uint64_t)analog_raw->num_samples
+				    * analog_raw->num_probes
+				    * analog_raw->unitsize;
+		break;
+	default:
+		/* Trigger, end and frame markers carry no payload. */
+		payload_size = 0;
+		break;
+	}
+	if (!packet->payload)
+		payload_size = data_size = 0;
+
+	if (!(qp = g_try_malloc(sizeof(struct queued_packet) + payload_size
+				+ data_size))) {
+		sr_err("session: %s: packet malloc failed", __func__);
+		return NULL;
+	}
+
+	qp->dev = dev;
+	qp->buffer = NULL;
+	qp->packet.type = packet->type;
+	qp->packet.payload = payload_size ? qp + 1 : NULL;
+	memcpy(qp->packet.payload, packet->payload, payload_size);
+
+	p = (uint8_t *)(qp + 1) + payload_size;
+	if (packet->type == SR_DF_LOGIC && payload_size) {
+		logic = qp->packet.payload;
+		if (logic->buffer) {
+			qp->buffer = sr_buffer_ref(logic->buffer);
+		} else {
+			memcpy(p, logic->data, data_size);
+			logic->data = p;
+		}
+	} else if (packet->type == SR_DF_LOGIC_RLE && payload_size) {
+		/* The lengths go first, they need to be aligned. */
+		rle = qp->packet.payload;
+		memcpy(p, rle->lengths, rle->num_runs * sizeof(uint64_t));
+		rle->lengths = (uint64_t *)p;
+		p += rle->num_runs * sizeof(uint64_t);
+		memcpy(p, rle->values, rle->num_runs * rle->unitsize);
+		rle->values = p;
+	} else if (packet->type == SR_DF_ANALOG && payload_size) {
+		analog = qp->packet.payload;
+		memcpy(p, analog->data, data_size);
+		analog->data = (float *)p;
+	} else if (packet->type == SR_DF_ANALOG_RAW && payload_size) {
+		analog_raw = qp->packet.payload;
+		memcpy(p, analog_raw->data, data_size);
+		analog_raw->data = p;
+	}
+
+	return qp;
+}
+
+/**
+ * Start the consumer threads of a threaded session, one per datafeed
+ * callback.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR if a thread could not be created.
+ */
+SR_PRIV int sr_session_thread_start(void)
+{
+	struct consumer *c;
+	GSList *l;
+	GError *error;
+	int ret;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	session->acquisition_thread = g_thread_self();
+	session->stop_requested = 0;
+	memset(&session->thread_stats, 0, sizeof(struct sr_session_stats));
+	analog_probes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (l = session->datafeed_callbacks; l; l = l->next) {
+		if (!(c = g_try_malloc0(sizeof(struct consumer)))) {
+			sr_err("session: %s: consumer malloc failed", __func__);
+			sr_session_thread_stop();
+			return SR_ERR_MALLOC;
+		}
+		if ((ret = ring_init(&c->ring, session->ring_size)) != SR_OK) {
+			g_free(c);
+			sr_session_thread_stop();
+			return ret;
+		}
+		c->cb = l->data;
+
+		error = NULL;
+		if (!(c->thread = g_thread_create(consumer_thread, c, TRUE,
+						  &error))) {
+			sr_err("session: %s: failed to create consumer "
+			       "thread: %s", __func__, error->message);
+			g_error_free(error);
+			ring_free(&c->ring);
+			g_free(c);
+			sr_session_thread_stop();
+			return SR_ERR;
+		}
+		consumers = g_slist_append(consumers, c);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Stop the consumer threads of a threaded session.
+ *
+ * The consumers get to process all packets which are still queued before
+ * their threads end. Calling this when no consumer threads are running
+ * is harmless.
+ *
+ * @return SR_OK.
+ */
+SR_PRIV int sr_session_thread_stop(void)
+{
+	struct consumer *c;
+	GSList *l;
+
+	for (l = consumers; l; l = l->next) {
+		c = l->data;
+		g_atomic_int_set(&c->ring.closed, 1);
+		g_mutex_lock(c->ring.mutex);
+		g_cond_broadcast(c->ring.cond);
+		g_mutex_unlock(c->ring.mutex);
+	}
+
+	for (l = consumers; l; l = l->next) {
+		c = l->data;
+		g_thread_join(c->thread);
+		ring_free(&c->ring);
+		g_free(c);
+	}
+	g_slist_free(consumers);
+	consumers = NULL;
+
+	if (analog_probes) {
+		g_hash_table_destroy(analog_probes);
+		analog_probes = NULL;
+	}
+
+	if (session)
+		session->acquisition_thread = NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Queue a packet for all consumer threads of a threaded session.
+ *
+ * This must only be called from the acquisition thread.
+ *
+ * @param dev The device the packet comes from.
+ * @param packet The packet to queue. It is copied, so it doesn't need to
+ *               stay around after this function returns.
+ *
+ * @return SR_OK upon success, or SR_ERR_MALLOC if the packet could not be
+ *         copied (in which case it is counted as dropped).
+ */
+SR_PRIV int sr_session_thread_queue(struct sr_dev *dev,
+				    struct sr_datafeed_packet *packet)
+{
+	struct queued_packet *qp;
+	gboolean may_drop;
+	GSList *l;
+
+	session->thread_stats.packets++;
+
+	if (!consumers)
+		return SR_OK;
+
+	if (!(qp = packet_copy(dev, packet))) {
+		session->thread_stats.dropped++;
+		return SR_ERR_MALLOC;
+	}
+	qp->refcount = g_slist_length(consumers);
+
+	may_drop = session->ring_drop && (packet->type == SR_DF_LOGIC
+					  || packet->type == SR_DF_LOGIC_RLE
+					  || packet->type == SR_DF_ANALOG
+					  || packet->type == SR_DF_ANALOG_RAW);
+
+	for (l = consumers; l; l = l->next) {
+		if (!ring_push(&((struct consumer *)l->data)->ring, qp,
+			       may_drop)) {
+			session->thread_stats.dropped++;
+			packet_unref(qp);
+		}
+	}
+
+	return SR_OK;
+}
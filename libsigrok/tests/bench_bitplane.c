@@ -0,0 +1,278 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare session file members stored as bit planes against plain
+ * deflate, the way session files stored them before: how small they get,
+ * and how fast they are written and read. The captures are 16 probes at
+ * 24MHz: mostly idle ones, with the activity on a few probes, or spread
+ * over all of them, and random samples, which no codec can compress.
+ */
+
+#include "../bitplane.c"
+#include "../session_codec.c"
+#include "testutil.h"
+
+#define NUM_MEMBERS 4
+#define UNITSIZE 2
+#define NUM_SAMPLES (NUM_MEMBERS * SESSION_MEMBER_SIZE / UNITSIZE)
+#define NUM_ROUNDS 3
+
+/* Best of a few rounds, in seconds. */
+#define TIME(seconds, code) \
+	do { \
+		double t; \
+		int r; \
+		seconds = 1e9; \
+		for (r = 0; r < NUM_ROUNDS; r++) { \
+			t = tu_seconds(); \
+			code; \
+			seconds = MIN(seconds, tu_seconds() - t); \
+		} \
+	} while (0)
+
+/* Sample periods at 24MHz: a UART at 115200 baud, and a 2MHz SPI clock. */
+#define UART_BIT 208
+#define SPI_HALF_CLOCK 6
+
+static void set_probe(uint16_t *samples, uint64_t i, int probe, int value)
+{
+	if (value)
+		samples[i] |= 1 << probe;
+	else
+		samples[i] &= ~(1 << probe);
+}
+
+/*
+ * A mostly idle bus:
+ *  - probe 0, a UART sending a byte every millisecond,
+ *  - probes 1-3, SPI chip select, clock and data, a 32 bit transfer every
+ *    4ms,
+ *  - probes 4-7, status lines toggling every 20ms or so,
+ *  - probes 8-15, not connected, 8-11 low and 12-15 pulled up.
+ */
+static void make_bus(uint16_t *samples)
+{
+	GRand *rand;
+	uint64_t i, t;
+	uint32_t word;
+	uint8_t byte;
+	int bit, p;
+
+	rand = g_rand_new_with_seed(1);
+
+	for (i = 0; i < NUM_SAMPLES; i++)
+		samples[i] = 0xf000 | 1 << 0 | 1 << 1;
+
+	for (t = 1000; t + 10 * UART_BIT < NUM_SAMPLES; t += 24000) {
+		byte = g_rand_int(rand);
+		for (i = 0; i < 10 * UART_BIT; i++) {
+			bit = i / UART_BIT;
+			set_probe(samples, t + i, 0, bit == 0 ? 0 :
+				  bit == 9 ? 1 : (byte >> (bit - 1)) & 1);
+		}
+	}
+
+	for (t = 5000; t + 66 * SPI_HALF_CLOCK < NUM_SAMPLES; t += 96000) {
+		word = g_rand_int(rand);
+		for (i = 0; i < 66 * SPI_HALF_CLOCK; i++) {
+			bit = i / (2 * SPI_HALF_CLOCK);
+			set_probe(samples, t + i, 1, 0);
+			set_probe(samples, t + i, 2, bit >= 1 && bit <= 32
+				  && (i / SPI_HALF_CLOCK) % 2);
+			if (bit >= 1 && bit <= 32)
+				set_probe(samples, t + i, 3,
+					  (word >> (bit - 1)) & 1);
+		}
+	}
+
+	for (p = 4; p < 8; p++) {
+		bit = 0;
+		for (i = 0; i < NUM_SAMPLES; i++) {
+			if (!g_rand_int_range(rand, 0, 480000))
+				bit ^= 1;
+			set_probe(samples, i, p, bit);
+		}
+	}
+
+	g_rand_free(rand);
+}
+
+/*
+ * Every probe toggles on its own, on average once every 'idle' samples.
+ * With 'clock' set, probe 0 is a free running clock of 12 samples instead.
+ */
+static void make_idle(uint16_t *samples, uint32_t idle, gboolean clock)
+{
+	GRand *rand;
+	uint64_t i;
+	uint16_t sample;
+	int p;
+
+	rand = g_rand_new_with_seed(idle);
+	sample = 0;
+	for (i = 0; i < NUM_SAMPLES; i++) {
+		for (p = 0; p < 16; p++) {
+			if (!g_rand_int_range(rand, 0, idle))
+				sample ^= 1 << p;
+		}
+		if (clock)
+			sample = (sample & ~1) | (i / 6) % 2;
+		samples[i] = sample;
+	}
+	g_rand_free(rand);
+}
+
+struct member {
+	struct sr_codec_job job;
+	uint8_t *buf;
+};
+
+/* Set up the members' jobs, to compress samples or to decompress them. */
+static void setup(struct member *m, int codec, gboolean compress,
+		  const uint8_t *samples)
+{
+	struct sr_codec_job *job;
+	int i;
+
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		job = &m[i].job;
+		job->compress = compress;
+		job->codec = codec;
+		job->unitsize = UNITSIZE;
+		if (compress) {
+			job->in = samples + (uint64_t)i * SESSION_MEMBER_SIZE;
+			job->in_len = SESSION_MEMBER_SIZE;
+			job->out = m[i].buf;
+			job->out_size = sr_codec_bound(codec,
+						       SESSION_MEMBER_SIZE);
+		} else {
+			job->in = m[i].buf;
+			job->in_len = job->out_len;
+			job->out = (uint8_t *)samples
+				   + (uint64_t)i * SESSION_MEMBER_SIZE;
+			job->out_size = SESSION_MEMBER_SIZE;
+		}
+	}
+}
+
+static int run(struct member *m)
+{
+	int i;
+
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		if (sr_codec_run(&m[i].job) != SR_OK)
+			return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Save a capture's members with a codec, and load them back. Return how
+ * many times smaller than the samples the members got.
+ */
+static int bench(const char *desc, int codec, const uint8_t *samples,
+		 double *ratio)
+{
+	struct member m[NUM_MEMBERS];
+	uint8_t *out;
+	uint64_t size;
+	char name[80];
+	double seconds;
+	int ret, i;
+
+	for (i = 0; i < NUM_MEMBERS; i++)
+		m[i].buf = g_malloc(sr_codec_bound(codec, SESSION_MEMBER_SIZE));
+	out = g_malloc(NUM_SAMPLES * UNITSIZE);
+
+	snprintf(name, sizeof(name), "%s, %s: save", desc,
+		 codec == SR_SESSION_CODEC_BITPLANE ? "bit planes" : "deflate");
+	setup(m, codec, TRUE, samples);
+	TIME(seconds, ret = run(m));
+	CHECK(ret == SR_OK, "%s: failed", name);
+	tu_report(name, NUM_SAMPLES, seconds);
+	size = 0;
+	for (i = 0; i < NUM_MEMBERS; i++)
+		size += m[i].job.out_len;
+	*ratio = (double)NUM_SAMPLES * UNITSIZE / size;
+
+	snprintf(name, sizeof(name), "%s, %s: load", desc,
+		 codec == SR_SESSION_CODEC_BITPLANE ? "bit planes" : "deflate");
+	setup(m, codec, FALSE, out);
+	TIME(seconds, ret = run(m));
+	CHECK(ret == SR_OK, "%s: failed", name);
+	tu_report(name, NUM_SAMPLES, seconds);
+	CHECK(!memcmp(out, samples, NUM_SAMPLES * UNITSIZE),
+	      "%s: samples differ", name);
+
+	for (i = 0; i < NUM_MEMBERS; i++)
+		g_free(m[i].buf);
+	g_free(out);
+
+	return 0;
+}
+
+/* Print how many times smaller the codecs made a capture. */
+static int ratios(const char *desc, const uint8_t *samples,
+		  double *planes_ratio)
+{
+	double deflate, planes;
+
+	if (bench(desc, SR_SESSION_CODEC_DEFLATE, samples, &deflate))
+		return 1;
+	if (bench(desc, SR_SESSION_CODEC_BITPLANE, samples, &planes))
+		return 1;
+	printf("%s: deflate %.1fx, bit planes %.1fx smaller\n",
+	       desc, deflate, planes);
+	*planes_ratio = planes;
+
+	return 0;
+}
+
+int main(void)
+{
+	uint8_t *samples;
+	double planes;
+
+	samples = g_malloc(NUM_SAMPLES * UNITSIZE);
+
+	make_bus((uint16_t *)samples);
+	if (ratios("idle bus", samples, &planes))
+		return 1;
+	/* What bit planes are for: mostly idle captures get a lot smaller. */
+	CHECK(planes >= 10, "idle bus: bit planes only %.1fx smaller",
+	      planes);
+	make_idle((uint16_t *)samples, 10000, TRUE);
+	if (ratios("clock, idle 10000", samples, &planes))
+		return 1;
+	make_idle((uint16_t *)samples, 1000, FALSE);
+	if (ratios("idle 1000", samples, &planes))
+		return 1;
+	make_idle((uint16_t *)samples, 10000, FALSE);
+	if (ratios("idle 10000", samples, &planes))
+		return 1;
+	tu_random_fill(samples, NUM_SAMPLES * UNITSIZE, 1);
+	if (ratios("random", samples, &planes))
+		return 1;
+
+	g_free(samples);
+
+	return 0;
+}
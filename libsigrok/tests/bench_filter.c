@@ -0,0 +1,177 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the filter kernels against the per-sample, per-probe loop
+ * sr_filter_probes() used to run, on 8, 16 and 32 probe devices.
+ */
+
+#include "../filter.c"
+#include "testutil.h"
+
+#define NUM_SAMPLES (4 * 1024 * 1024)
+#define NUM_ROUNDS 3
+
+/* The old sr_filter_probes() loop, minus the allocation. */
+static void old_filter(int in_unitsize, int out_unitsize,
+		       const int *probelist, const uint8_t *data_in,
+		       uint64_t length_in, uint8_t *data_out)
+{
+	unsigned int in_offset, out_offset;
+	int out_bit, i;
+	uint64_t sample_in, sample_out;
+
+	sample_in = 0;
+	in_offset = out_offset = 0;
+	while (in_offset <= length_in - in_unitsize) {
+		memcpy(&sample_in, data_in + in_offset, in_unitsize);
+		sample_out = out_bit = 0;
+		for (i = 0; probelist[i]; i++) {
+			if (sample_in & (1ULL << (probelist[i] - 1)))
+				sample_out |= (1ULL << out_bit);
+			out_bit++;
+		}
+		memcpy(data_out + out_offset, &sample_out, out_unitsize);
+		in_offset += in_unitsize;
+		out_offset += out_unitsize;
+	}
+}
+
+/* Best of a few rounds, in seconds. */
+#define TIME(seconds, code) \
+	do { \
+		double t; \
+		int r; \
+		seconds = 1e9; \
+		for (r = 0; r < NUM_ROUNDS; r++) { \
+			t = tu_seconds(); \
+			code; \
+			seconds = MIN(seconds, tu_seconds() - t); \
+		} \
+	} while (0)
+
+static int bench(int num_probes, const char *desc, const int *probelist,
+		 const uint8_t *in, uint8_t *ref, uint8_t *out)
+{
+	struct sr_filter *filter;
+	filter_kernel_t picked;
+	char name[64];
+	uint64_t length_in, length_out;
+	double seconds;
+	int in_unitsize, out_unitsize, n;
+
+	in_unitsize = num_probes / 8;
+	for (n = 0; probelist[n]; n++)
+		;
+	out_unitsize = (n + 7) / 8;
+	length_in = (uint64_t)NUM_SAMPLES * in_unitsize;
+
+	snprintf(name, sizeof(name), "%d probes, %s: old loop", num_probes, desc);
+	TIME(seconds, old_filter(in_unitsize, out_unitsize, probelist,
+				 in, length_in, ref));
+	tu_report(name, NUM_SAMPLES, seconds);
+
+	CHECK(sr_filter_new(in_unitsize, out_unitsize, probelist,
+			    &filter) == SR_OK, "new");
+
+	snprintf(name, sizeof(name), "%d probes, %s: %s (picked)",
+		 num_probes, desc,
+		 filter->kernel == kernel_lut ? "lut" :
+		 filter->kernel == kernel_bytes ? "bytes" :
+		 filter->kernel == kernel_identity ? "identity" : "pext");
+	TIME(seconds, sr_filter_run_into(filter, in, length_in, out,
+					 &length_out));
+	tu_report(name, NUM_SAMPLES, seconds);
+	CHECK(!memcmp(out, ref, length_out), "%s: wrong output", name);
+
+	/* Show the other kernels which could have been picked, too. */
+	picked = filter->kernel;
+	if (picked != kernel_lut) {
+		build_luts(filter, probelist);
+		filter->kernel = kernel_lut;
+		snprintf(name, sizeof(name), "%d probes, %s: lut",
+			 num_probes, desc);
+		TIME(seconds, sr_filter_run_into(filter, in, length_in, out,
+						 &length_out));
+		tu_report(name, NUM_SAMPLES, seconds);
+		CHECK(!memcmp(out, ref, length_out), "%s: wrong output", name);
+	}
+#ifdef HAVE_BMI2_PEXT
+	for (n = 1; probelist[n]; n++)
+		if (probelist[n] <= probelist[n - 1])
+			break;
+	if (!probelist[n] && pext_is_fast() && picked != kernel_pext) {
+		filter->kernel = kernel_pext;
+		snprintf(name, sizeof(name), "%d probes, %s: pext",
+			 num_probes, desc);
+		TIME(seconds, sr_filter_run_into(filter, in, length_in, out,
+						 &length_out));
+		tu_report(name, NUM_SAMPLES, seconds);
+		CHECK(!memcmp(out, ref, length_out), "%s: wrong output", name);
+	}
+#endif
+
+	sr_filter_destroy(filter);
+
+	return 0;
+}
+
+int main(void)
+{
+	static const int sizes[] = { 8, 16, 32 };
+	uint8_t *in, *ref, *out;
+	int probelist[33], num_probes, i, s, n;
+
+	in = g_malloc(NUM_SAMPLES * 4);
+	ref = g_malloc(NUM_SAMPLES * 4);
+	out = g_malloc(NUM_SAMPLES * 4);
+	tu_random_fill(in, NUM_SAMPLES * 4, 1);
+
+	for (s = 0; s < (int)G_N_ELEMENTS(sizes); s++) {
+		num_probes = sizes[s];
+
+		/* Every other probe, in order. */
+		for (i = n = 0; i < num_probes; i += 2)
+			probelist[n++] = i + 1;
+		probelist[n] = 0;
+		if (bench(num_probes, "every other", probelist, in, ref, out))
+			return 1;
+
+		/* The same, in reverse. */
+		for (i = n = 0; i < num_probes; i += 2)
+			probelist[n++] = num_probes - i;
+		probelist[n] = 0;
+		if (bench(num_probes, "every other reversed", probelist,
+			  in, ref, out))
+			return 1;
+
+		/* All but the first probe. */
+		for (i = n = 0; i < num_probes - 1; i++)
+			probelist[n++] = i + 2;
+		probelist[n] = 0;
+		if (bench(num_probes, "all but one", probelist, in, ref, out))
+			return 1;
+	}
+
+	g_free(in);
+	g_free(ref);
+	g_free(out);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare compressing and decompressing a session file's members on the
+ * codec pipeline against doing it one member after another in a single
+ * thread, which is what libzip did on every save and load before. The
+ * zip archive itself isn't written, only the members' sample data goes
+ * through deflate and inflate, which is where saving and loading spent
+ * their time.
+ */
+
+#include "../bitplane.c"
+#include "../session_codec.c"
+#include "testutil.h"
+
+#define NUM_MEMBERS 8
+#define UNITSIZE 2
+#define NUM_SAMPLES (NUM_MEMBERS * SESSION_MEMBER_SIZE / UNITSIZE)
+#define NUM_ROUNDS 3
+
+struct member {
+	struct sr_codec_job job;
+	uint8_t *buf;
+};
+
+/* Set up the members' jobs, to compress samples or to decompress them. */
+static void setup(struct member *m, gboolean compress, const uint8_t *samples)
+{
+	struct sr_codec_job *job;
+	int i;
+
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		job = &m[i].job;
+		job->compress = compress;
+		job->codec = SR_SESSION_CODEC_DEFLATE;
+		job->unitsize = UNITSIZE;
+		if (compress) {
+			job->in = samples + (uint64_t)i * SESSION_MEMBER_SIZE;
+			job->in_len = SESSION_MEMBER_SIZE;
+			job->out = m[i].buf;
+			job->out_size = sr_codec_bound(job->codec,
+						       SESSION_MEMBER_SIZE);
+		} else {
+			/* Inflate what was compressed, into the samples. */
+			job->in = m[i].buf;
+			job->in_len = job->out_len;
+			job->out = (uint8_t *)samples
+				   + (uint64_t)i * SESSION_MEMBER_SIZE;
+			job->out_size = SESSION_MEMBER_SIZE;
+		}
+	}
+}
+
+/* The members one after another, in the calling thread. */
+static int run_serial(struct member *m)
+{
+	int i;
+
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		if (sr_codec_run(&m[i].job) != SR_OK)
+			return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/* The members on a pipeline, the way session_file.c runs them. */
+static int run_pipeline(struct sr_codec_pipeline *pl, struct member *m)
+{
+	struct sr_codec_job *job;
+	int i, ret;
+
+	ret = SR_OK;
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		while (sr_codec_pipeline_full(pl)) {
+			job = sr_codec_pipeline_pop(pl, TRUE);
+			ret |= job->ret;
+		}
+		sr_codec_pipeline_push(pl, &m[i].job);
+	}
+	while ((job = sr_codec_pipeline_pop(pl, TRUE)))
+		ret |= job->ret;
+
+	return ret;
+}
+
+/* Best of a few rounds, in seconds. */
+#define TIME(seconds, code) \
+	do { \
+		double t; \
+		int r; \
+		seconds = 1e9; \
+		for (r = 0; r < NUM_ROUNDS; r++) { \
+			t = tu_seconds(); \
+			code; \
+			seconds = MIN(seconds, tu_seconds() - t); \
+		} \
+	} while (0)
+
+/*
+ * A 16 probe capture: a clock on probe 0, and the other probes holding
+ * their value for 64 samples on average.
+ */
+static void make_capture(uint8_t *samples)
+{
+	GRand *rand;
+	uint64_t i;
+	uint16_t sample;
+	int p;
+
+	rand = g_rand_new_with_seed(1);
+	sample = 0;
+	for (i = 0; i < NUM_SAMPLES; i++) {
+		sample ^= 1;
+		for (p = 1; p < 16; p++) {
+			if (!(g_rand_int(rand) & 63))
+				sample ^= 1 << p;
+		}
+		memcpy(samples + i * UNITSIZE, &sample, UNITSIZE);
+	}
+	g_rand_free(rand);
+}
+
+int main(void)
+{
+	struct sr_codec_pipeline *pl;
+	struct member m[NUM_MEMBERS];
+	uint8_t *samples, *orig;
+	uint32_t crc[NUM_MEMBERS];
+	uint64_t size;
+	double seconds;
+	int ret, i;
+
+	samples = g_malloc(NUM_SAMPLES * UNITSIZE);
+	orig = g_malloc(NUM_SAMPLES * UNITSIZE);
+	make_capture(orig);
+	memcpy(samples, orig, NUM_SAMPLES * UNITSIZE);
+	for (i = 0; i < NUM_MEMBERS; i++)
+		m[i].buf = g_malloc(sr_codec_bound(SR_SESSION_CODEC_DEFLATE,
+						   SESSION_MEMBER_SIZE));
+	CHECK(sr_codec_pipeline_new(&pl) == SR_OK, "pipeline_new failed");
+	printf("codec pipeline threads: %u\n", num_threads());
+
+	/* Saving. */
+	setup(m, TRUE, samples);
+	TIME(seconds, ret = run_serial(m));
+	CHECK(ret == SR_OK, "compress failed");
+	tu_report("save, deflate: one thread", NUM_SAMPLES, seconds);
+	size = 0;
+	for (i = 0; i < NUM_MEMBERS; i++) {
+		crc[i] = m[i].job.crc;
+		size += m[i].job.out_len;
+	}
+
+	TIME(seconds, ret = run_pipeline(pl, m));
+	CHECK(ret == SR_OK, "compress failed");
+	tu_report("save, deflate: codec pipeline", NUM_SAMPLES, seconds);
+	for (i = 0; i < NUM_MEMBERS; i++)
+		CHECK(m[i].job.crc == crc[i], "member %d: CRC differs", i);
+	printf("%.1f MiB compressed to %.1f MiB\n",
+	       NUM_SAMPLES * UNITSIZE / 1048576.0, size / 1048576.0);
+
+	/* Loading, into the sample buffer, which is checked afterwards. */
+	setup(m, FALSE, samples);
+	memset(samples, 0, NUM_SAMPLES * UNITSIZE);
+	TIME(seconds, ret = run_serial(m));
+	CHECK(ret == SR_OK, "decompress failed");
+	tu_report("load, deflate: one thread", NUM_SAMPLES, seconds);
+	CHECK(!memcmp(samples, orig, NUM_SAMPLES * UNITSIZE),
+	      "one thread: samples differ");
+
+	memset(samples, 0, NUM_SAMPLES * UNITSIZE);
+	TIME(seconds, ret = run_pipeline(pl, m));
+	CHECK(ret == SR_OK, "decompress failed");
+	tu_report("load, deflate: codec pipeline", NUM_SAMPLES, seconds);
+	CHECK(!memcmp(samples, orig, NUM_SAMPLES * UNITSIZE),
+	      "codec pipeline: samples differ");
+	for (i = 0; i < NUM_MEMBERS; i++)
+		CHECK(m[i].job.crc == crc[i], "member %d: CRC differs", i);
+
+	sr_codec_pipeline_destroy(pl, NULL);
+	for (i = 0; i < NUM_MEMBERS; i++)
+		g_free(m[i].buf);
+	g_free(orig);
+	g_free(samples);
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the software trigger against the per-sample loop fx2lafw used
+ * to run, which went back to stage 0 one sample after a partial match.
+ * The samples are fed in fx2lafw sized transfers, on 8 and 16 probes,
+ * with triggers which never fire, so the whole buffer is scanned.
+ */
+
+#include "../trigger.c"
+#include "testutil.h"
+
+#define NUM_SAMPLES (8 * 1024 * 1024)
+#define TRANSFER_SIZE (256 * 1024)
+#define NUM_ROUNDS 3
+#define OLD_STAGES 4
+
+/* The old trigger state from struct context. */
+struct old_trigger {
+	uint16_t mask[OLD_STAGES];
+	uint16_t value[OLD_STAGES];
+	int stage;
+	uint16_t buffer[OLD_STAGES];
+};
+
+/* The old loop from receive_transfer(), minus the packets it sent. */
+static int old_scan(struct old_trigger *t, int sample_wide,
+		    const uint8_t *cur_buf, int cur_sample_count)
+{
+	int i;
+
+	for (i = 0; i < cur_sample_count; i++) {
+		const uint16_t cur_sample = sample_wide ?
+			*((const uint16_t *)cur_buf + i) :
+			*((const uint8_t *)cur_buf + i);
+
+		if ((cur_sample & t->mask[t->stage]) == t->value[t->stage]) {
+			t->buffer[t->stage] = cur_sample;
+			t->stage++;
+			if (t->stage == OLD_STAGES || t->mask[t->stage] == 0)
+				return i + 1;
+		} else if (t->stage > 0) {
+			i -= t->stage;
+			if (i < -1)
+				i = -1;
+			t->stage = 0;
+		}
+	}
+
+	return -1;
+}
+
+/* None of the triggers fire, so nothing gets sent. */
+SR_PRIV int sr_session_send(struct sr_dev *dev,
+			    struct sr_datafeed_packet *packet)
+{
+	(void)dev;
+	(void)packet;
+
+	return SR_OK;
+}
+
+/* Best of a few rounds, in seconds. */
+#define TIME(seconds, code) \
+	do { \
+		double t; \
+		int r; \
+		seconds = 1e9; \
+		for (r = 0; r < NUM_ROUNDS; r++) { \
+			t = tu_seconds(); \
+			code; \
+			seconds = MIN(seconds, tu_seconds() - t); \
+		} \
+	} while (0)
+
+static int bench(const char *desc, int unitsize, char **triggers,
+		 const uint8_t *samples)
+{
+	struct sr_probe probes[16];
+	struct sr_trigger *trig;
+	struct old_trigger old;
+	GSList *probe_list;
+	char name[80];
+	uint64_t pos, n;
+	double seconds;
+	int i, stage, fired;
+	const char *tc;
+
+	memset(&old, 0, sizeof(old));
+	probe_list = NULL;
+	for (i = 0; triggers[i]; i++) {
+		probes[i].index = i + 1;
+		probes[i].enabled = TRUE;
+		probes[i].name = NULL;
+		probes[i].trigger = *triggers[i] ? triggers[i] : NULL;
+		probe_list = g_slist_append(probe_list, &probes[i]);
+		for (tc = triggers[i], stage = 0; *tc; tc++, stage++) {
+			old.mask[stage] |= 1 << i;
+			if (*tc == '1')
+				old.value[stage] |= 1 << i;
+		}
+	}
+
+	snprintf(name, sizeof(name), "%d probes, %s: old loop",
+		 unitsize * 8, desc);
+	fired = 0;
+	TIME(seconds,
+	     old.stage = 0;
+	     for (pos = 0; pos < NUM_SAMPLES; pos += n) {
+		n = TRANSFER_SIZE / unitsize;
+		fired |= old_scan(&old, unitsize == 2,
+				  samples + pos * unitsize, n) >= 0;
+	     });
+	tu_report(name, NUM_SAMPLES, seconds);
+	CHECK(!fired, "%s: fired", name);
+
+	CHECK(sr_trigger_new(probe_list, unitsize, OLD_STAGES,
+			     &trig) == SR_OK, "%s: new", desc);
+	snprintf(name, sizeof(name), "%d probes, %s: sr_trigger_scan()",
+		 unitsize * 8, desc);
+	TIME(seconds,
+	     sr_trigger_reset(trig);
+	     for (pos = 0; pos < NUM_SAMPLES; pos += n) {
+		n = TRANSFER_SIZE / unitsize;
+		fired |= sr_trigger_scan(trig, samples + pos * unitsize,
+					 n) >= 0;
+	     });
+	tu_report(name, NUM_SAMPLES, seconds);
+	CHECK(!fired, "%s: fired", name);
+
+	sr_trigger_free(trig);
+	g_slist_free(probe_list);
+
+	return 0;
+}
+
+int main(void)
+{
+	/*
+	 * Probe 1 never goes high, so a trigger needing it high never
+	 * fires. In front of it, probe 2 can match "0101" over and over
+	 * on random samples, which made the old loop back up a lot.
+	 */
+	static char *rare[] = { "1", "", "", "", "", "", "", "", NULL };
+	static char *rare_wide[] = { "1", "", "", "", "", "", "", "", "", "",
+				     "", "", "", "", "", "", NULL };
+	static char *partial[] = { "0001", "0101", "", "", "", "", "", "",
+				   NULL };
+	static char *partial_wide[] = { "0001", "0101", "", "", "", "", "",
+					"", "", "", "", "", "", "", "", "1100",
+					NULL };
+	uint8_t *samples;
+	uint64_t i;
+
+	samples = g_malloc(NUM_SAMPLES * 2);
+	tu_random_fill(samples, NUM_SAMPLES * 2, 1);
+
+	/* 8 probes. */
+	for (i = 0; i < NUM_SAMPLES; i++)
+		samples[i] &= ~1;
+	if (bench("one stage", 1, rare, samples))
+		return 1;
+	if (bench("four stages, partial matches", 1, partial, samples))
+		return 1;
+
+	/* 16 probes, in host order as the FX2 sends them. */
+	for (i = 0; i < NUM_SAMPLES; i++)
+		((uint16_t *)samples)[i] &= ~1;
+	if (bench("one stage", 2, rare_wide, samples))
+		return 1;
+	if (bench("four stages, partial matches", 2, partial_wide, samples))
+		return 1;
+
+	g_free(samples);
+
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the VCD writer against the per-probe loop it used to run, which
+ * printf'd a float timestamp for every probe which changed. The samples
+ * are fed in fx2lafw sized packets, on 8 and 16 probes, once with every
+ * sample changing some probes, and once with the probes mostly idle. Both
+ * have to write the same value changes.
+ */
+
+#include "../output/vcd.c"
+#include "../strutil.c"
+#include "testutil.h"
+
+#define NUM_SAMPLES (1024 * 1024ULL)
+#define PACKET_SIZE (256 * 1024)
+#define NUM_ROUNDS 3
+#define SAMPLERATE SR_MHZ(24)
+
+/* The old writer's state, from its struct context. */
+struct old_context {
+	int num_enabled_probes;
+	int unitsize;
+	uint64_t prevsample;
+	int period;
+	uint64_t samplerate;
+	uint64_t samplecount;
+};
+
+/* The old output_sample(). */
+static void old_output_sample(struct old_context *ctx, GString *out,
+			      uint64_t sample)
+{
+	int p, curbit, prevbit;
+
+	for (p = 0; p < ctx->num_enabled_probes; p++) {
+		curbit = (sample & ((uint64_t) (1 << p))) >> p;
+		prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
+
+		/* VCD only contains deltas/changes of signals. */
+		if (prevbit == curbit)
+			continue;
+
+		/* Output which signal changed to which value. */
+		g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
+				(uint64_t)(((float)ctx->samplecount / ctx->samplerate)
+				* ctx->period), curbit, (char)('!' + p));
+	}
+
+	ctx->prevsample = sample;
+}
+
+/* The old data(), minus the header. */
+static void old_data(struct old_context *ctx, const uint8_t *data_in,
+		     uint64_t length_in, uint8_t **data_out,
+		     uint64_t *length_out)
+{
+	unsigned int i;
+	uint64_t sample;
+	GString *out;
+
+	out = g_string_sized_new(512);
+	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
+		ctx->samplecount++;
+		sample = 0;
+		memcpy(&sample, data_in + i, ctx->unitsize);
+		old_output_sample(ctx, out, sample);
+	}
+
+	*data_out = (uint8_t *)out->str;
+	*length_out = out->len;
+	g_string_free(out, FALSE);
+}
+
+/* There's no driver, so nothing asks for its capabilities. */
+SR_API gboolean sr_dev_has_hwcap(const struct sr_dev *dev, int hwcap)
+{
+	(void)dev;
+	(void)hwcap;
+
+	return FALSE;
+}
+
+/* Value changes in a chunk of VCD output: the lines not timestamps. */
+static uint64_t count_changes(const uint8_t *out, uint64_t len)
+{
+	uint64_t i, n;
+	gboolean line_start;
+
+	n = 0;
+	line_start = TRUE;
+	for (i = 0; i < len; i++) {
+		if (line_start && out[i] != '#')
+			n++;
+		line_start = (out[i] == '\n');
+	}
+
+	return n;
+}
+
+/*
+ * Run the old writer over all samples, and count the value changes it
+ * writes if changes isn't NULL.
+ */
+static void run_old(int num_probes, const uint8_t *samples,
+		    uint64_t *changes)
+{
+	struct old_context old;
+	uint8_t *out;
+	uint64_t pos, len;
+
+	memset(&old, 0, sizeof(old));
+	old.num_enabled_probes = num_probes;
+	old.unitsize = (num_probes + 7) / 8;
+	old.samplerate = SAMPLERATE;
+	old.period = SR_GHZ(1);
+	/* First packet. We neg to make sure all signals are output. */
+	memcpy(&old.prevsample, samples, old.unitsize);
+	old.prevsample = ~old.prevsample;
+	for (pos = 0; pos < NUM_SAMPLES * old.unitsize; pos += PACKET_SIZE) {
+		old_data(&old, samples + pos, PACKET_SIZE, &out, &len);
+		if (changes)
+			*changes += count_changes(out, len);
+		g_free(out);
+	}
+}
+
+/* The same, for the VCD output module. */
+static int run_new(struct sr_output *o, const uint8_t *samples,
+		   uint64_t *changes)
+{
+	struct context *ctx;
+	uint8_t *out;
+	uint64_t pos, len;
+
+	if (init(o) != SR_OK)
+		return SR_ERR;
+	ctx = o->internal;
+	ctx->samplerate = SAMPLERATE;
+	ctx->period = SR_GHZ(1);
+	/* Leave the header out of the count, like for the old writer. */
+	g_string_truncate(ctx->header, 0);
+	for (pos = 0; pos < NUM_SAMPLES * ctx->unitsize; pos += PACKET_SIZE) {
+		if (data(o, samples + pos, PACKET_SIZE, &out, &len) != SR_OK)
+			return SR_ERR;
+		if (changes)
+			*changes += count_changes(out, len);
+		g_free(out);
+	}
+	event(o, SR_DF_END, &out, &len);
+	g_free(out);
+
+	return SR_OK;
+}
+
+/* Best of a few rounds, in seconds. */
+#define TIME(seconds, code) \
+	do { \
+		double t; \
+		int r; \
+		seconds = 1e9; \
+		for (r = 0; r < NUM_ROUNDS; r++) { \
+			t = tu_seconds(); \
+			code; \
+			seconds = MIN(seconds, tu_seconds() - t); \
+		} \
+	} while (0)
+
+static int bench(const char *desc, int num_probes, const uint8_t *samples)
+{
+	struct sr_probe probes[16];
+	struct sr_dev dev;
+	struct sr_output o;
+	uint64_t old_changes, changes;
+	char name[80];
+	double seconds;
+	int ret, i;
+
+	memset(&dev, 0, sizeof(dev));
+	for (i = 0; i < num_probes; i++) {
+		probes[i].index = i + 1;
+		probes[i].enabled = TRUE;
+		probes[i].name = g_strdup_printf("%d", i);
+		probes[i].trigger = NULL;
+		dev.probes = g_slist_append(dev.probes, &probes[i]);
+	}
+	memset(&o, 0, sizeof(o));
+	o.dev = &dev;
+
+	/* Both start out with every probe, so they write the same changes. */
+	old_changes = changes = 0;
+	run_old(num_probes, samples, &old_changes);
+	CHECK(run_new(&o, samples, &changes) == SR_OK, "%s: failed", desc);
+	CHECK(changes == old_changes, "%s: %" PRIu64 " changes, old writer "
+	      "%" PRIu64, desc, changes, old_changes);
+
+	snprintf(name, sizeof(name), "%d probes, %s: old writer",
+		 num_probes, desc);
+	TIME(seconds, run_old(num_probes, samples, NULL));
+	tu_report(name, NUM_SAMPLES, seconds);
+
+	snprintf(name, sizeof(name), "%d probes, %s: vcd output",
+		 num_probes, desc);
+	ret = SR_OK;
+	TIME(seconds, ret |= run_new(&o, samples, NULL));
+	tu_report(name, NUM_SAMPLES, seconds);
+	CHECK(ret == SR_OK, "%s: failed", name);
+
+	for (i = 0; i < num_probes; i++)
+		g_free(probes[i].name);
+	g_slist_free(dev.probes);
+
+	return 0;
+}
+
+/*
+ * Samples which hold their value for a while, each probe flipping with a
+ * chance of 1 in 2^idle_bits per sample.
+ */
+static void make_idle(uint8_t *samples, int unitsize, int idle_bits,
+		      guint32 seed)
+{
+	GRand *rand;
+	uint64_t i, sample;
+	int p;
+
+	rand = g_rand_new_with_seed(seed);
+	sample = 0;
+	for (i = 0; i < NUM_SAMPLES; i++) {
+		for (p = 0; p < unitsize * 8; p++) {
+			if (!(g_rand_int(rand) & ((1 << idle_bits) - 1)))
+				sample ^= (uint64_t)1 << p;
+		}
+		memcpy(samples + i * unitsize, &sample, unitsize);
+	}
+	g_rand_free(rand);
+}
+
+int main(void)
+{
+	uint8_t *samples;
+
+	samples = g_malloc(NUM_SAMPLES * 2);
+
+	tu_random_fill(samples, NUM_SAMPLES * 2, 1);
+	if (bench("busy", 8, samples))
+		return 1;
+	if (bench("busy", 16, samples))
+		return 1;
+
+	make_idle(samples, 1, 6, 2);
+	if (bench("mostly idle", 8, samples))
+		return 1;
+	make_idle(samples, 2, 6, 3);
+	if (bench("mostly idle", 16, samples))
+		return 1;
+
+	g_free(samples);
+
+	return 0;
+}
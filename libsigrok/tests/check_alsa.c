@@ -0,0 +1,314 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run the ALSA driver's capture against ALSA's null PCM, which captures
+ * silence, directly and through the plug plugin, which the driver uses by
+ * default. The session loop is a plain poll() loop over the sources the
+ * driver adds. Check the packets it sends, with a sample limit, and when
+ * a frontend stops a continuous capture, from within the datafeed and
+ * from outside it.
+ *
+ * Built only with the ALSA driver enabled. Skipped if ALSA can't open the
+ * null PCM, e.g. without its configuration files.
+ */
+
+#include "../hardware/alsa/alsa.c"
+#include "testutil.h"
+
+#define SAMPLERATE 48000
+#define MAX_SOURCES 8
+/* How long a capture may take, in ms. */
+#define TIMEOUT 5000
+
+static const char *pcms[] = { "null", "plug:null", NULL };
+
+/* The sources the driver added, polled by run(). */
+static struct {
+	int fd;
+	int events;
+	int timeout;
+	sr_receive_data_callback_t cb;
+	void *cb_data;
+} sources[MAX_SOURCES];
+static int num_sources;
+
+/* What the driver sent. */
+static struct {
+	int packets;
+	gboolean header, meta;
+	int ends;
+	/* Packets after SR_DF_END, or before the header and meta packets. */
+	int misplaced;
+	uint64_t samples;
+	int max_samples;
+	gboolean silent;
+	/* Stop from within the datafeed once this many samples came in. */
+	uint64_t stop_after;
+} feed;
+
+SR_PRIV struct sr_dev_inst *sr_dev_inst_new(int index, int status,
+		const char *vendor, const char *model, const char *version)
+{
+	struct sr_dev_inst *sdi;
+
+	sdi = g_malloc0(sizeof(struct sr_dev_inst));
+	sdi->index = index;
+	sdi->status = status;
+	sdi->vendor = g_strdup(vendor);
+	sdi->model = g_strdup(model);
+	sdi->version = g_strdup(version);
+
+	return sdi;
+}
+
+SR_PRIV struct sr_dev_inst *sr_dev_inst_get(GSList *dev_insts, int dev_index)
+{
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	for (l = dev_insts; l; l = l->next) {
+		sdi = l->data;
+		if (sdi->index == dev_index)
+			return sdi;
+	}
+
+	return NULL;
+}
+
+SR_PRIV void sr_dev_inst_free(struct sr_dev_inst *sdi)
+{
+	g_free(sdi->priv);
+	g_free(sdi->vendor);
+	g_free(sdi->model);
+	g_free(sdi->version);
+	g_free(sdi);
+}
+
+SR_PRIV int sr_source_add(int fd, int events, int timeout,
+			  sr_receive_data_callback_t cb, void *cb_data)
+{
+	if (num_sources == MAX_SOURCES)
+		return SR_ERR;
+	sources[num_sources].fd = fd;
+	sources[num_sources].events = events;
+	sources[num_sources].timeout = timeout;
+	sources[num_sources].cb = cb;
+	sources[num_sources].cb_data = cb_data;
+	num_sources++;
+
+	return SR_OK;
+}
+
+SR_PRIV int sr_source_remove(int fd)
+{
+	int i;
+
+	for (i = 0; i < num_sources; i++) {
+		if (sources[i].fd != fd)
+			continue;
+		memmove(&sources[i], &sources[i + 1],
+			(num_sources - i - 1) * sizeof(sources[0]));
+		num_sources--;
+		return SR_OK;
+	}
+
+	return SR_ERR;
+}
+
+SR_PRIV int sr_session_send(struct sr_dev *dev,
+			    struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_analog_raw *analog;
+	const int16_t *data;
+	int i;
+
+	(void)dev;
+
+	feed.packets++;
+	if (feed.ends)
+		feed.misplaced++;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		if (feed.packets != 1)
+			feed.misplaced++;
+		feed.header = TRUE;
+		break;
+	case SR_DF_META_ANALOG:
+		if (feed.packets != 2)
+			feed.misplaced++;
+		feed.meta = TRUE;
+		break;
+	case SR_DF_ANALOG_RAW:
+		if (!feed.header || !feed.meta)
+			feed.misplaced++;
+		analog = packet->payload;
+		if (analog->num_probes != NUM_PROBES
+		    || analog->unitsize != sizeof(int16_t))
+			feed.misplaced++;
+		data = analog->data;
+		for (i = 0; i < analog->num_samples * NUM_PROBES; i++) {
+			if (data[i])
+				feed.silent = FALSE;
+		}
+		feed.samples += analog->num_samples;
+		feed.max_samples = MAX(feed.max_samples, analog->num_samples);
+		if (feed.stop_after && feed.samples >= feed.stop_after)
+			hw_dev_acquisition_stop(0, NULL);
+		break;
+	case SR_DF_END:
+		feed.ends++;
+		break;
+	default:
+		feed.misplaced++;
+		break;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * The session loop: poll the sources, and call them back, until the
+ * capture ends, for at most 'ms' ms.
+ */
+static void run(int ms)
+{
+	struct pollfd fds[MAX_SOURCES];
+	gint64 end;
+	int i, n;
+
+	end = g_get_monotonic_time() + ms * 1000;
+	while (!feed.ends && num_sources > 0
+	       && g_get_monotonic_time() < end) {
+		n = num_sources;
+		for (i = 0; i < n; i++) {
+			fds[i].fd = sources[i].fd;
+			fds[i].events = sources[i].events;
+			fds[i].revents = 0;
+		}
+		poll(fds, n, sources[0].timeout);
+		for (i = 0; i < n && i < num_sources; i++)
+			sources[i].cb(fds[i].fd, fds[i].revents,
+				      sources[i].cb_data);
+	}
+}
+
+static int start(uint64_t limit_samples, uint64_t stop_after)
+{
+	uint64_t samplerate;
+
+	memset(&feed, 0, sizeof(feed));
+	feed.silent = TRUE;
+	feed.stop_after = stop_after;
+
+	samplerate = SAMPLERATE;
+	if (hw_dev_config_set(0, SR_HWCAP_SAMPLERATE, &samplerate) != SR_OK
+	    || hw_dev_config_set(0, SR_HWCAP_LIMIT_SAMPLES,
+				 &limit_samples) != SR_OK)
+		return SR_ERR;
+
+	return hw_dev_acquisition_start(0, (void *)1);
+}
+
+/* Check the packets of a capture which ended. */
+static int check_feed(const char *desc)
+{
+	struct context *ctx;
+
+	ctx = ((struct sr_dev_inst *)dev_insts->data)->priv;
+
+	CHECK(feed.header && feed.meta, "%s: no header", desc);
+	CHECK(feed.ends == 1, "%s: %d SR_DF_END packets", desc, feed.ends);
+	CHECK(!feed.misplaced, "%s: %d misplaced packets", desc,
+	      feed.misplaced);
+	CHECK(feed.silent, "%s: the null PCM isn't silent", desc);
+	CHECK(feed.max_samples <= (int)ctx->period_size,
+	      "%s: %d samples in a packet, periods are %lu", desc,
+	      feed.max_samples, ctx->period_size);
+	CHECK(num_sources == 0, "%s: %d sources left", desc, num_sources);
+	CHECK(!ctx->session_dev_id && !ctx->period_buf && !ctx->ufds,
+	      "%s: acquisition not cleaned up", desc);
+
+	return 0;
+}
+
+static int check_pcm(const char *pcm)
+{
+	char desc[80];
+	int packets;
+
+	CHECK(hw_init(pcm) == 1, "%s: init failed", pcm);
+	if (hw_dev_open(0) != SR_OK) {
+		printf("SKIP: can't open the %s PCM\n", pcm);
+		hw_cleanup();
+		return 77;
+	}
+
+	/* A sample limit which isn't a whole number of periods. */
+	snprintf(desc, sizeof(desc), "%s, limit", pcm);
+	CHECK(start(SAMPLERATE / 10 + 123, 0) == SR_OK, "%s: start", desc);
+	run(TIMEOUT);
+	if (check_feed(desc))
+		return 1;
+	CHECK(feed.samples == SAMPLERATE / 10 + 123,
+	      "%s: %" PRIu64 " samples", desc, feed.samples);
+
+	/*
+	 * Continuous, stopped from within the datafeed. Nothing may be
+	 * sent after that, even if the driver has more samples at hand.
+	 */
+	snprintf(desc, sizeof(desc), "%s, stop in datafeed", pcm);
+	CHECK(start(0, SAMPLERATE / 10) == SR_OK, "%s: start", desc);
+	run(TIMEOUT);
+	if (check_feed(desc))
+		return 1;
+	CHECK(feed.samples >= SAMPLERATE / 10, "%s: %" PRIu64 " samples",
+	      desc, feed.samples);
+
+	/* Continuous, stopped from outside, between two callbacks. */
+	snprintf(desc, sizeof(desc), "%s, stop", pcm);
+	CHECK(start(0, 0) == SR_OK, "%s: start", desc);
+	run(50);
+	CHECK(!feed.ends, "%s: ended by itself", desc);
+	packets = feed.packets;
+	CHECK(hw_dev_acquisition_stop(0, NULL) == SR_OK, "%s: stop", desc);
+	run(50);
+	if (check_feed(desc))
+		return 1;
+	CHECK(feed.packets == packets + 1, "%s: %d packets after stop", desc,
+	      feed.packets - packets - 1);
+
+	CHECK(hw_dev_close(0) == SR_OK, "%s: close failed", pcm);
+	CHECK(hw_cleanup() == SR_OK, "%s: cleanup failed", pcm);
+
+	return 0;
+}
+
+int main(void)
+{
+	int i, ret;
+
+	for (i = 0; pcms[i]; i++) {
+		if ((ret = check_pcm(pcms[i])))
+			return ret;
+	}
+
+	return 0;
+}
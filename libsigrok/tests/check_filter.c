@@ -0,0 +1,158 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check every filter kernel against a bit-by-bit reference, on random
+ * probe lists and unit sizes.
+ */
+
+#include "../filter.c"
+#include "testutil.h"
+
+#define NUM_SAMPLES 1000
+#define NUM_RUNS 5000
+
+static void reference(int in_unitsize, int out_unitsize, const int *probelist,
+		      const uint8_t *data_in, uint64_t num_samples,
+		      uint8_t *data_out)
+{
+	uint64_t i, sample_in, sample_out;
+	int j;
+
+	for (i = 0; i < num_samples; i++) {
+		sample_in = sample_out = 0;
+		memcpy(&sample_in, data_in + i * in_unitsize, in_unitsize);
+		for (j = 0; probelist[j]; j++)
+			if (sample_in & (1ULL << (probelist[j] - 1)))
+				sample_out |= 1ULL << j;
+		memcpy(data_out + i * out_unitsize, &sample_out, out_unitsize);
+	}
+}
+
+/* A random probe list: whole bytes, ascending, or in any order. */
+static void random_probelist(GRand *rand, int in_unitsize, int *probelist)
+{
+	int num_probes, kind, byte, i, j, tmp;
+
+	kind = g_rand_int_range(rand, 0, 3);
+	if (kind == 0) {
+		num_probes = 0;
+		for (byte = 0; byte < in_unitsize; byte++) {
+			if (!g_rand_boolean(rand))
+				continue;
+			for (i = 0; i < 8; i++)
+				probelist[num_probes++] = byte * 8 + i + 1;
+		}
+		if (!num_probes)
+			probelist[num_probes++] = 1;
+		probelist[num_probes] = 0;
+		return;
+	}
+
+	/* A random subset, shuffled unless it has to be ascending. */
+	num_probes = 0;
+	for (i = 0; i < in_unitsize * 8; i++)
+		if (g_rand_int_range(rand, 0, 3))
+			probelist[num_probes++] = i + 1;
+	if (!num_probes)
+		probelist[num_probes++] = g_rand_int_range(rand, 1,
+							   in_unitsize * 8 + 1);
+	probelist[num_probes] = 0;
+	if (kind == 1)
+		return;
+	for (i = num_probes - 1; i > 0; i--) {
+		j = g_rand_int_range(rand, 0, i + 1);
+		tmp = probelist[i];
+		probelist[i] = probelist[j];
+		probelist[j] = tmp;
+	}
+}
+
+int main(void)
+{
+	struct sr_filter *filter;
+	GRand *rand;
+	uint8_t in[NUM_SAMPLES * 8], ref[NUM_SAMPLES * 8], out[NUM_SAMPLES * 8];
+	int probelist[65], in_unitsize, out_unitsize, num_probes, run;
+	uint64_t length_out;
+
+	tu_random_fill(in, sizeof(in), 1);
+	rand = g_rand_new_with_seed(1);
+
+	for (run = 0; run < NUM_RUNS; run++) {
+		in_unitsize = g_rand_int_range(rand, 1, 9);
+		random_probelist(rand, in_unitsize, probelist);
+		for (num_probes = 0; probelist[num_probes]; num_probes++)
+			;
+		out_unitsize = g_rand_int_range(rand, (num_probes + 7) / 8, 9);
+		reference(in_unitsize, out_unitsize, probelist, in,
+			  NUM_SAMPLES, ref);
+
+		/* Whichever kernel the filter picks. */
+		CHECK(sr_filter_new(in_unitsize, out_unitsize, probelist,
+				    &filter) == SR_OK, "run %d: new", run);
+		memset(out, 0xaa, sizeof(out));
+		CHECK(sr_filter_run_into(filter, in, NUM_SAMPLES * in_unitsize,
+					 out, &length_out) == SR_OK,
+		      "run %d: run_into", run);
+		CHECK(length_out == (uint64_t)NUM_SAMPLES * out_unitsize,
+		      "run %d: length %" PRIu64, run, length_out);
+		CHECK(!memcmp(out, ref, length_out), "run %d: kernel", run);
+
+		/* The LUT kernel works for any probe list. */
+		build_luts(filter, probelist);
+		filter->kernel = kernel_lut;
+		memset(out, 0xaa, sizeof(out));
+		sr_filter_run_into(filter, in, NUM_SAMPLES * in_unitsize,
+				   out, &length_out);
+		CHECK(!memcmp(out, ref, length_out), "run %d: lut", run);
+
+#ifdef HAVE_BMI2_PEXT
+		/* PEXT only keeps the probe order, so it needs ascending. */
+		for (num_probes = 1; probelist[num_probes]; num_probes++)
+			if (probelist[num_probes] <= probelist[num_probes - 1])
+				break;
+		if (!probelist[num_probes] && pext_is_fast()) {
+			filter->kernel = kernel_pext;
+			memset(out, 0xaa, sizeof(out));
+			sr_filter_run_into(filter, in,
+					   NUM_SAMPLES * in_unitsize,
+					   out, &length_out);
+			CHECK(!memcmp(out, ref, length_out),
+			      "run %d: pext", run);
+		}
+#endif
+		sr_filter_destroy(filter);
+
+		/* In place, through the legacy call. */
+		if (out_unitsize <= in_unitsize) {
+			memcpy(out, in, NUM_SAMPLES * in_unitsize);
+			CHECK(sr_filter_probes_into(in_unitsize, out_unitsize,
+						    probelist, out,
+						    NUM_SAMPLES * in_unitsize,
+						    out, &length_out) == SR_OK,
+			      "run %d: in place", run);
+			CHECK(!memcmp(out, ref, length_out),
+			      "run %d: in place output", run);
+		}
+	}
+	g_rand_free(rand);
+
+	return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check fx2lafw's overrun detection and transfer sizing against a fake
+ * libusb: an FX2 streaming at 24MB/s into a queue of bulk transfers, and
+ * a host which runs an event pass every so often, handing back whatever
+ * completed and resubmitting it, the way the driver does. The fake device
+ * knows when it really ran out of transfers to fill, and when that made
+ * it drop data, which the driver has to work out from the passes alone.
+ */
+
+#include "../hardware/fx2lafw/latency.c"
+#include "testutil.h"
+
+/* 24MHz, 8 bit samples. */
+#define BYTES_PER_US 24
+#define BYTES_PER_MS (BYTES_PER_US * 1000)
+/* The FX2 buffers up to 4 bulk packets while no transfer is queued. */
+#define FIFO_SIZE (4 * 512)
+#define MAX_QUEUE 256
+
+static size_t buffer_size(int ms)
+{
+	return (ms * BYTES_PER_MS + 511) & ~511;
+}
+
+struct fake_usb {
+	/* Submitted transfers, oldest first, as a ring. */
+	size_t length[MAX_QUEUE];
+	size_t actual[MAX_QUEUE];
+	/* The oldest not handed back yet, and the one being filled. */
+	unsigned int head, fill, count;
+	uint64_t fifo;
+	gboolean dry, dropping;
+	/* Transfers handed back. */
+	uint64_t completions;
+	/* Times the device had no transfer left to fill. */
+	uint64_t dry_spells;
+	/* Times that went on for long enough to drop data. */
+	uint64_t drops;
+	/* What the old check, no transfer queued in the callback, saw. */
+	uint64_t old_overruns;
+	int64_t now;
+	struct latency lat;
+};
+
+static void fake_submit(struct fake_usb *usb, size_t length)
+{
+	unsigned int i;
+
+	i = (usb->head + usb->count++) % MAX_QUEUE;
+	usb->length[i] = length;
+	usb->actual[i] = 0;
+}
+
+/* Move what the FIFO holds into queued transfers. */
+static void fake_drain(struct fake_usb *usb)
+{
+	unsigned int i;
+	size_t n;
+
+	while (usb->fifo && usb->fill < usb->count) {
+		i = (usb->head + usb->fill) % MAX_QUEUE;
+		n = MIN(usb->fifo, usb->length[i] - usb->actual[i]);
+		usb->actual[i] += n;
+		usb->fifo -= n;
+		if (usb->actual[i] == usb->length[i])
+			usb->fill++;
+	}
+}
+
+/* The device streams for a while, dropping what doesn't fit. */
+static void fake_run(struct fake_usb *usb, int64_t until)
+{
+	for (; usb->now < until; usb->now++) {
+		usb->fifo += BYTES_PER_US;
+		fake_drain(usb);
+		if (usb->fill == usb->count) {
+			if (!usb->dry)
+				usb->dry_spells++;
+			usb->dry = TRUE;
+		} else {
+			usb->dry = FALSE;
+		}
+		if (usb->fifo > FIFO_SIZE) {
+			usb->fifo = FIFO_SIZE;
+			if (!usb->dropping)
+				usb->drops++;
+			usb->dropping = TRUE;
+		} else {
+			usb->dropping = FALSE;
+		}
+	}
+}
+
+/* What receive_data() and receive_transfer() do, minus the data. */
+static void fake_event_pass(struct fake_usb *usb)
+{
+	latency_event_pass(&usb->lat, usb->now, usb->count);
+	while (usb->fill > 0) {
+		usb->head = (usb->head + 1) % MAX_QUEUE;
+		usb->count--;
+		usb->fill--;
+		usb->completions++;
+		if (usb->count == 0)
+			usb->old_overruns++;
+		latency_transfer_done(&usb->lat);
+		fake_submit(usb, usb->lat.transfer_size);
+	}
+	fake_drain(usb);
+}
+
+static void fake_start(struct fake_usb *usb, unsigned int num_transfers)
+{
+	unsigned int i;
+
+	memset(usb, 0, sizeof(*usb));
+	latency_init(&usb->lat, BYTES_PER_MS, num_transfers, buffer_size(8),
+		     buffer_size(2), buffer_size(16));
+	for (i = 0; i < num_transfers; i++)
+		fake_submit(usb, usb->lat.transfer_size);
+}
+
+/* Run event passes every interval us, for a while. */
+static void fake_passes(struct fake_usb *usb, int64_t interval,
+			int64_t duration)
+{
+	int64_t end;
+
+	for (end = usb->now + duration; usb->now < end; ) {
+		fake_run(usb, usb->now + interval);
+		fake_event_pass(usb);
+	}
+}
+
+/* Run event passes every interval us, until n transfers came back. */
+static void fake_completions(struct fake_usb *usb, int64_t interval,
+			     uint64_t n)
+{
+	for (n += usb->completions; usb->completions < n; ) {
+		fake_run(usb, usb->now + interval);
+		fake_event_pass(usb);
+	}
+}
+
+int main(void)
+{
+	struct fake_usb *usb;
+	uint64_t dry_spells, start;
+	int64_t queue;
+	size_t size;
+	int i;
+
+	usb = g_malloc(sizeof(*usb));
+
+	/*
+	 * A host keeping up: no drops, no overruns, and transfers shrink
+	 * so data reaches the frontend sooner.
+	 */
+	fake_start(usb, 64);
+	fake_passes(usb, 500, 3000000);
+	CHECK(usb->dry_spells == 0, "steady: ran dry");
+	CHECK(usb->lat.overruns == 0, "steady: %" PRIu64 " overruns",
+	      usb->lat.overruns);
+	CHECK(usb->lat.transfer_size == buffer_size(2),
+	      "steady: transfer size %zu", usb->lat.transfer_size);
+
+	/*
+	 * One stall longer than the queue takes to fill: the device drops
+	 * data. The driver has to notice, and grow transfers at once. The
+	 * old check in the callback never saw a queue that had run dry.
+	 */
+	size = usb->lat.transfer_size;
+	fake_run(usb, usb->now + 64 * 2000 * 3 / 2);
+	fake_event_pass(usb);
+	CHECK(usb->dry_spells == 1 && usb->drops == 1,
+	      "stall: %" PRIu64 " dry, %" PRIu64 " drops", usb->dry_spells,
+	      usb->drops);
+	CHECK(usb->lat.overruns == 1, "stall: %" PRIu64 " overruns",
+	      usb->lat.overruns);
+	CHECK(usb->lat.transfer_size == 2 * size,
+	      "stall: transfer size %zu", usb->lat.transfer_size);
+	CHECK(usb->old_overruns == 0, "stall: old check saw %" PRIu64,
+	      usb->old_overruns);
+
+	/*
+	 * Stalls of 60% of the queue: nothing dropped, so no overruns, but
+	 * transfers grow to leave more headroom.
+	 */
+	fake_start(usb, 64);
+	for (i = 0; i < 10; i++) {
+		fake_passes(usb, 500, 3000000);
+		size = usb->lat.transfer_size;
+		queue = 64 * size * 1000 / BYTES_PER_MS;
+		fake_run(usb, usb->now + queue * 6 / 10);
+		/* By the time every transfer came around once, they grew. */
+		start = usb->completions;
+		fake_event_pass(usb);
+		fake_completions(usb, 500, 64 - (usb->completions - start));
+		CHECK(usb->lat.transfer_size == 2 * size,
+		      "long stall %d: transfer size %zu", i,
+		      usb->lat.transfer_size);
+	}
+	CHECK(usb->dry_spells == 0, "long stalls: ran dry");
+	CHECK(usb->lat.overruns == 0, "long stalls: %" PRIu64 " overruns",
+	      usb->lat.overruns);
+
+	/*
+	 * A queue of 32ms, and a host only coming round every 40ms: passes
+	 * hand back the whole queue. Transfers grow until the queue lasts,
+	 * and from then on it doesn't run dry again.
+	 */
+	fake_start(usb, 4);
+	fake_passes(usb, 40000, 400000);
+	CHECK(usb->drops > 0, "short queue: no drops");
+	CHECK(usb->lat.overruns == usb->dry_spells,
+	      "short queue: %" PRIu64 " overruns, ran dry %" PRIu64 " times",
+	      usb->lat.overruns, usb->dry_spells);
+	CHECK(usb->lat.transfer_size == buffer_size(16),
+	      "short queue: transfer size %zu", usb->lat.transfer_size);
+	dry_spells = usb->dry_spells;
+	fake_passes(usb, 40000, 1000000);
+	CHECK(usb->dry_spells == dry_spells, "short queue: still runs dry");
+	CHECK(usb->lat.overruns == dry_spells, "short queue: still overruns");
+
+	g_free(usb);
+
+	return 0;
+}
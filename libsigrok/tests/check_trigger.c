@@ -0,0 +1,341 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check the software trigger against a brute force search, on random
+ * triggers of up to 32 stages, fed in randomly sized blocks, so matches
+ * straddle block boundaries. Also check the pre-trigger samples it sends,
+ * and that the SSE2 skim finds the same sample as the scalar loop.
+ */
+
+#include "../trigger.c"
+#include "testutil.h"
+
+#define STREAM_LEN 20000
+#define NUM_RUNS 3000
+
+static const int unitsizes[] = { 1, 2, 3, 4, 8 };
+
+/* The logic packets sr_trigger_send_pretrigger() sent. */
+static uint8_t sent[STREAM_LEN * 8];
+static uint64_t sent_length;
+static int sent_packets;
+
+SR_PRIV int sr_session_send(struct sr_dev *dev,
+			    struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+
+	(void)dev;
+
+	if (packet->type != SR_DF_LOGIC)
+		return SR_OK;
+	logic = packet->payload;
+	memcpy(sent + sent_length, logic->data, logic->length);
+	sent_length += logic->length;
+	sent_packets++;
+
+	return SR_OK;
+}
+
+static void sample_put(uint8_t *p, int unitsize, uint64_t s)
+{
+	int i;
+
+	for (i = 0; i < unitsize; i++, s >>= 8)
+		p[i] = s & 0xff;
+}
+
+/* The index after the first run of samples matching all stages, or -1. */
+static int64_t reference(const uint64_t *mask, const uint64_t *value,
+			 int num_stages, int unitsize,
+			 const uint8_t *stream, uint64_t num_samples)
+{
+	uint64_t end, s;
+	int stage;
+
+	for (end = num_stages; end <= num_samples; end++) {
+		for (stage = 0; stage < num_stages; stage++) {
+			s = sample_get(stream + (end - num_stages + stage)
+				       * unitsize, unitsize);
+			if ((s & mask[stage]) != value[stage])
+				break;
+		}
+		if (stage == num_stages)
+			return end;
+	}
+
+	return -1;
+}
+
+/* Write the first n stages of the trigger into the stream at pos. */
+static void plant(GRand *rand, const uint64_t *mask, const uint64_t *value,
+		  int n, int unitsize, uint8_t *stream, uint64_t pos)
+{
+	uint64_t s;
+	int stage;
+
+	for (stage = 0; stage < n; stage++) {
+		s = ((uint64_t)g_rand_int(rand) << 32) | g_rand_int(rand);
+		s = (s & ~mask[stage]) | value[stage];
+		sample_put(stream + (pos + stage) * unitsize, unitsize, s);
+	}
+}
+
+static int check_run(GRand *rand, int run, uint8_t *stream)
+{
+	struct sr_probe probes[64];
+	struct sr_trigger *trig;
+	GSList *probe_list;
+	char triggers[64][MAX_STAGES + 1];
+	uint64_t mask[MAX_STAGES], value[MAX_STAGES], num_samples, pos, block;
+	uint64_t pretrigger, max_block, start, end;
+	int64_t expected, fired_at, ret;
+	const uint8_t *match;
+	int unitsize, num_stages, len, i, j, num_matched;
+
+	unitsize = unitsizes[run % G_N_ELEMENTS(unitsizes)];
+	num_stages = g_rand_int_range(rand, 1, MAX_STAGES + 1);
+	memset(mask, 0, sizeof(mask));
+	memset(value, 0, sizeof(value));
+
+	/*
+	 * A trigger on some of the probes, of any length up to num_stages,
+	 * with at least one as long. Disabled probes' triggers don't count.
+	 */
+	probe_list = NULL;
+	for (i = 0; i < unitsize * 8; i++) {
+		probes[i].index = i + 1;
+		probes[i].enabled = g_rand_int_range(rand, 0, 8) != 0;
+		probes[i].trigger = NULL;
+		if (i > 0 && g_rand_int_range(rand, 0, unitsize * 8) >= 3)
+			goto add;
+		len = i == 0 ? num_stages : g_rand_int_range(rand, 1,
+							     num_stages + 1);
+		if (i == 0)
+			probes[i].enabled = TRUE;
+		for (j = 0; j < len; j++)
+			triggers[i][j] = g_rand_boolean(rand) ? '1' : '0';
+		triggers[i][len] = '\0';
+		probes[i].trigger = triggers[i];
+		if (!probes[i].enabled)
+			goto add;
+		for (j = 0; j < len; j++) {
+			mask[j] |= 1ULL << i;
+			if (triggers[i][j] == '1')
+				value[j] |= 1ULL << i;
+		}
+add:
+		probe_list = g_slist_append(probe_list, &probes[i]);
+	}
+
+	/* Random samples, with partial matches and maybe a whole one. */
+	num_samples = g_rand_int_range(rand, 1, STREAM_LEN + 1);
+	tu_random_fill(stream, num_samples * unitsize, run);
+	for (i = g_rand_int_range(rand, 0, 20); i > 0; i--) {
+		len = g_rand_int_range(rand, 1, num_stages + 1);
+		if ((uint64_t)len > num_samples)
+			continue;
+		pos = g_rand_int_range(rand, 0, num_samples - len + 1);
+		plant(rand, mask, value, len, unitsize, stream, pos);
+	}
+	if (g_rand_boolean(rand) && (uint64_t)num_stages <= num_samples) {
+		pos = g_rand_int_range(rand, 0, num_samples - num_stages + 1);
+		plant(rand, mask, value, num_stages, unitsize, stream, pos);
+		/* A partial match running right into it. */
+		len = g_rand_int_range(rand, 1, num_stages + 1);
+		if (g_rand_boolean(rand) && (uint64_t)len <= pos)
+			plant(rand, mask, value, len, unitsize, stream,
+			      pos - len);
+	}
+	expected = reference(mask, value, num_stages, unitsize, stream,
+			     num_samples);
+
+	switch (g_rand_int_range(rand, 0, 3)) {
+	case 0:
+		pretrigger = 0;
+		break;
+	case 1:
+		pretrigger = g_rand_int_range(rand, 1, 100);
+		break;
+	default:
+		pretrigger = g_rand_int_range(rand, 1, 2 * STREAM_LEN);
+		break;
+	}
+
+	CHECK(sr_trigger_new(probe_list, unitsize, MAX_STAGES, &trig) == SR_OK,
+	      "run %d: new", run);
+	CHECK(trig->num_stages == num_stages, "run %d: %d stages, not %d",
+	      run, trig->num_stages, num_stages);
+	CHECK(sr_trigger_set_pretrigger(trig, pretrigger) == SR_OK,
+	      "run %d: pretrigger", run);
+	CHECK(trig->ring_size == pretrigger + num_stages,
+	      "run %d: ring of %" PRIu64, run, trig->ring_size);
+
+	/* Scan the same samples twice, the second time after a reset. */
+	for (j = 0; j < 2; j++) {
+		if (j)
+			sr_trigger_reset(trig);
+		max_block = 1 << g_rand_int_range(rand, 0, 14);
+		fired_at = -1;
+		for (pos = 0; pos < num_samples; pos += block) {
+			CHECK(!sr_trigger_fired(trig),
+			      "run %d: fired early", run);
+			block = g_rand_int_range(rand, 1, max_block + 1);
+			block = MIN(block, num_samples - pos);
+			ret = sr_trigger_scan(trig, stream + pos * unitsize,
+					      block);
+			if (ret >= 0) {
+				CHECK(ret > 0 && (uint64_t)ret <= block,
+				      "run %d: offset %" PRIi64 " in block of "
+				      "%" PRIu64, run, ret, block);
+				fired_at = pos + ret;
+				break;
+			}
+		}
+		CHECK(fired_at == expected, "run %d (%d bytes, %d stages): "
+		      "fired at %" PRIi64 ", not %" PRIi64, run, unitsize,
+		      num_stages, fired_at, expected);
+		if (expected < 0) {
+			CHECK(!sr_trigger_fired(trig), "run %d: fired", run);
+			CHECK(sr_trigger_send_pretrigger(trig, NULL) == 0,
+			      "run %d: sent pre-trigger samples", run);
+			continue;
+		}
+		CHECK(sr_trigger_fired(trig), "run %d: not fired", run);
+		CHECK(sr_trigger_scan(trig, stream, num_samples) == -1,
+		      "run %d: fired twice", run);
+
+		/* The samples which matched, some maybe from earlier blocks. */
+		end = expected - num_stages;
+		match = sr_trigger_match(trig, &num_matched);
+		CHECK(num_matched == num_stages, "run %d: %d matched", run,
+		      num_matched);
+		CHECK(!memcmp(match, stream + end * unitsize,
+			      num_stages * unitsize), "run %d: match", run);
+
+		/* Whatever of the pre-trigger samples came before those. */
+		start = end - MIN(end, pretrigger);
+		sent_length = sent_packets = 0;
+		CHECK(sr_trigger_send_pretrigger(trig, NULL) == end - start,
+		      "run %d: pre-trigger count", run);
+		CHECK(sent_length == (end - start) * unitsize,
+		      "run %d: sent %" PRIu64 " bytes, not %" PRIu64, run,
+		      sent_length, (end - start) * unitsize);
+		CHECK(sent_packets <= 2, "run %d: %d packets", run,
+		      sent_packets);
+		CHECK(!memcmp(sent, stream + start * unitsize, sent_length),
+		      "run %d: pre-trigger samples", run);
+	}
+
+	sr_trigger_free(trig);
+	g_slist_free(probe_list);
+
+	return 0;
+}
+
+/* Without any stages, the trigger fires straight away. */
+static int check_no_stages(void)
+{
+	struct sr_probe probe = { 1, 0, TRUE, "D0", NULL };
+	struct sr_trigger *trig;
+	GSList *probe_list;
+	uint8_t samples[16] = { 0 };
+
+	probe_list = g_slist_append(NULL, &probe);
+	CHECK(sr_trigger_new(probe_list, 1, MAX_STAGES, &trig) == SR_OK,
+	      "no stages: new");
+	CHECK(sr_trigger_set_pretrigger(trig, 1000) == SR_OK,
+	      "no stages: pretrigger");
+	CHECK(!trig->ring, "no stages: ring");
+	CHECK(sr_trigger_fired(trig), "no stages: not fired");
+	CHECK(sr_trigger_scan(trig, samples, 16) == -1, "no stages: scan");
+	CHECK(sr_trigger_send_pretrigger(trig, NULL) == 0,
+	      "no stages: sent pre-trigger samples");
+	sr_trigger_free(trig);
+	g_slist_free(probe_list);
+
+	return 0;
+}
+
+/* The SSE2 skim must stop at the same sample as the plain loop does. */
+static int check_find_first(GRand *rand, uint8_t *stream)
+{
+	struct sr_trigger trig;
+	uint64_t num_samples, i, found, off;
+	int run, unitsize, bits;
+
+	memset(&trig, 0, sizeof(trig));
+	for (run = 0; run < 20000; run++) {
+		unitsize = unitsizes[run % G_N_ELEMENTS(unitsizes)];
+		trig.unitsize = unitsize;
+		trig.num_stages = 1;
+		trig.mask[0] = ((uint64_t)g_rand_int(rand) << 32)
+			       | g_rand_int(rand);
+		/* Few bits match all the time, many hardly ever. */
+		bits = g_rand_int_range(rand, 1, unitsize * 8 + 1);
+		if (bits < 64)
+			trig.mask[0] &= (1ULL << bits) - 1;
+		trig.value[0] = trig.mask[0] & (((uint64_t)g_rand_int(rand)
+						 << 32) | g_rand_int(rand));
+
+		num_samples = g_rand_int_range(rand, 0, 200);
+		off = g_rand_int_range(rand, 0, 16);
+		tu_random_fill(stream, (num_samples + off) * unitsize, run);
+		if (num_samples && g_rand_boolean(rand))
+			plant(rand, trig.mask, trig.value, 1, unitsize,
+			      stream, off + g_rand_int_range(rand, 0,
+							     num_samples));
+
+		for (i = 0; i < num_samples; i++) {
+			if ((sample_get(stream + (off + i) * unitsize, unitsize)
+			     & trig.mask[0]) == trig.value[0])
+				break;
+		}
+		found = find_first(&trig, stream + off * unitsize,
+				   num_samples);
+		CHECK(found == i, "find_first run %d (%d bytes): %" PRIu64
+		      ", not %" PRIu64, run, unitsize, found, i);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	GRand *rand;
+	uint8_t *stream;
+	int run;
+
+	stream = g_malloc(STREAM_LEN * 8);
+	rand = g_rand_new_with_seed(1);
+
+	if (check_no_stages())
+		return 1;
+	if (check_find_first(rand, stream))
+		return 1;
+	for (run = 0; run < NUM_RUNS; run++)
+		if (check_run(rand, run, stream))
+			return 1;
+
+	g_rand_free(rand);
+	g_free(stream);
+
+	return 0;
+}
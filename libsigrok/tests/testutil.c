@@ -0,0 +1,47 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <glib.h>
+#include "testutil.h"
+
+/* The library's logging is private, the checks need their own copy. */
+#include "../log.c"
+
+void tu_random_fill(uint8_t *buf, uint64_t len, guint32 seed)
+{
+	GRand *rand;
+	uint64_t i;
+
+	rand = g_rand_new_with_seed(seed);
+	for (i = 0; i < len; i++)
+		buf[i] = g_rand_int(rand);
+	g_rand_free(rand);
+}
+
+double tu_seconds(void)
+{
+	return g_get_monotonic_time() / (double)G_USEC_PER_SEC;
+}
+
+void tu_report(const char *name, uint64_t num_samples, double seconds)
+{
+	printf("%-48s %10.1f Msamples/s\n", name,
+	       num_samples / seconds / 1000000.0);
+}
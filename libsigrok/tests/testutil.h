@@ -0,0 +1,54 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBSIGROK_TESTS_TESTUTIL_H
+#define LIBSIGROK_TESTS_TESTUTIL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <glib.h>
+
+/*
+ * The checks and benchmarks #include the libsigrok sources they test, so
+ * they can get at static functions, and link against libtestutil.la for
+ * the rest (logging, helpers below).
+ */
+
+/* Report a failed check, and return from main() with an error. */
+#define CHECK(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			return 1; \
+		} \
+	} while (0)
+
+/* Fill a buffer with pseudo-random bytes, the same for the same seed. */
+void tu_random_fill(uint8_t *buf, uint64_t len, guint32 seed);
+
+/* Seconds since some fixed point in time, for benchmarks. */
+double tu_seconds(void);
+
+/* Print one benchmark result line, in millions of samples per second. */
+void tu_report(const char *name, uint64_t num_samples, double seconds);
+
+#endif
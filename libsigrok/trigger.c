@@ -0,0 +1,502 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Software trigger matching, for drivers whose hardware can't trigger.
+ *
+ * A trigger is a sequence of stages, each of which must match one sample,
+ * on consecutive samples. Stage n of the trigger is built from the n-th
+ * character of every probe's trigger string; only '0' and '1' are
+ * supported.
+ *
+ * The stages are run as a bit-parallel state machine: bit n of the state
+ * is set if the last n + 1 samples matched stages 0..n. Every sample
+ * shifts the state up by one and masks it with the stages that sample
+ * matches, so unlike restarting the search after a partial match, each
+ * sample is only looked at once. Which stages a sample matches comes from
+ * one table per byte of the sample, so it costs the same however many
+ * stages there are. While no stage is matched, the samples are skimmed
+ * for one matching the first stage, 16 bytes at a time where SSE2 is
+ * available.
+ *
+ * The samples scanned before the trigger fires go through a ring, which
+ * holds exactly the samples which matched, plus as many pre-trigger
+ * samples as the driver asked for; a trigger without stages has none.
+ * The position written to runs freely, and is only reduced modulo the
+ * ring size when a block is pushed or read back. Only the tail of a block larger than the ring
+ * gets copied, so scanning at full USB rate costs no more than the
+ * pre-trigger history.
+ */
+
+#include <string.h>
+#include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+#define MAX_STAGES 32
+
+/*
+ * Samples stepped through between looking at whether to skim ahead with
+ * find_first(). Whether the state is empty is anyone's guess right after
+ * partial matches, so checking it on every sample costs more than a
+ * few samples stepped through for nothing.
+ */
+#define SKIM_EVERY 64
+
+struct sr_trigger {
+	int unitsize;
+	int num_stages;
+	uint64_t mask[MAX_STAGES];
+	uint64_t value[MAX_STAGES];
+	/* Bit n of lut[b][v] is set if byte b being v matches stage n. */
+	uint32_t lut[8][256];
+	uint32_t state;
+	gboolean fired;
+	/* The samples which matched the stages, once fired. */
+	uint8_t match[MAX_STAGES * 8];
+	uint64_t pretrigger;
+	uint8_t *ring;
+	/* Size of the ring in samples. */
+	uint64_t ring_size;
+	/* Number of samples ever pushed into the ring. */
+	uint64_t ring_pos;
+};
+
+static inline uint64_t sample_get(const uint8_t *p, int unitsize)
+{
+	uint64_t s;
+	int i;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		return p[0] | (p[1] << 8);
+	default:
+		for (s = 0, i = unitsize - 1; i >= 0; i--)
+			s = (s << 8) | p[i];
+		return s;
+	}
+}
+
+/* Which stages a sample matches, as a bitmask. */
+static inline uint32_t stages_matched(const struct sr_trigger *trig,
+				      const uint8_t *p)
+{
+	uint32_t matched;
+	int i;
+
+	switch (trig->unitsize) {
+	case 1:
+		return trig->lut[0][p[0]];
+	case 2:
+		return trig->lut[0][p[0]] & trig->lut[1][p[1]];
+	default:
+		matched = trig->lut[0][p[0]];
+		for (i = 1; i < trig->unitsize; i++)
+			matched &= trig->lut[i][p[i]];
+		return matched;
+	}
+}
+
+static void build_lut(struct sr_trigger *trig)
+{
+	unsigned int mask, value;
+	int byte, v, stage;
+
+	for (byte = 0; byte < trig->unitsize; byte++) {
+		for (stage = 0; stage < trig->num_stages; stage++) {
+			mask = (trig->mask[stage] >> (byte * 8)) & 0xff;
+			value = (trig->value[stage] >> (byte * 8)) & 0xff;
+			for (v = 0; v < 256; v++) {
+				if ((v & mask) == value)
+					trig->lut[byte][v] |= 1U << stage;
+			}
+		}
+	}
+}
+
+/**
+ * Create a software trigger from the trigger strings of a device's probes.
+ *
+ * @param probes The device's probes (struct sr_probe). Disabled probes
+ *               and probes without a trigger are ignored.
+ * @param unitsize The number of bytes per sample, 1-8. Probe n is bit
+ *                 n - 1 of the sample.
+ * @param max_stages The maximum number of stages the driver allows.
+ * @param trig Pointer to a variable which will hold the new trigger.
+ *             Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or
+ *         unsupported trigger strings, or SR_ERR_MALLOC upon memory
+ *         allocation errors.
+ */
+SR_PRIV int sr_trigger_new(const GSList *probes, int unitsize,
+			   int max_stages, struct sr_trigger **trig)
+{
+	const struct sr_probe *probe;
+	const GSList *l;
+	uint64_t probe_bit;
+	const char *tc;
+	int stage;
+
+	if (!trig || unitsize < 1 || unitsize > 8) {
+		sr_err("trigger: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*trig = g_try_malloc0(sizeof(struct sr_trigger)))) {
+		sr_err("trigger: %s: trig malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	(*trig)->unitsize = unitsize;
+	max_stages = MIN(max_stages, MAX_STAGES);
+
+	for (l = probes; l; l = l->next) {
+		probe = l->data;
+		if (!probe->enabled || !probe->trigger)
+			continue;
+		if (probe->index < 1 || probe->index > unitsize * 8) {
+			sr_err("trigger: %s: probe %d is out of range",
+			       __func__, probe->index);
+			g_free(*trig);
+			return SR_ERR_ARG;
+		}
+		probe_bit = 1ULL << (probe->index - 1);
+		for (tc = probe->trigger, stage = 0; *tc; tc++, stage++) {
+			if (stage >= max_stages
+			    || (*tc != '0' && *tc != '1')) {
+				sr_err("trigger: %s: unsupported trigger '%s' "
+				       "on probe %d", __func__,
+				       probe->trigger, probe->index);
+				g_free(*trig);
+				return SR_ERR_ARG;
+			}
+			(*trig)->mask[stage] |= probe_bit;
+			if (*tc == '1')
+				(*trig)->value[stage] |= probe_bit;
+		}
+		(*trig)->num_stages = MAX((*trig)->num_stages, stage);
+	}
+	build_lut(*trig);
+
+	if (sr_trigger_set_pretrigger(*trig, 0) != SR_OK) {
+		g_free(*trig);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Set the number of samples before the trigger point which are kept, to
+ * be sent with sr_trigger_send_pretrigger() once the trigger fires.
+ *
+ * This also resets the trigger. A trigger without stages fires straight
+ * away, so it keeps no samples at all.
+ *
+ * @param trig The trigger. Must not be NULL.
+ * @param num_samples The number of pre-trigger samples.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors
+ *         (in which case the previous setting is kept).
+ */
+SR_PRIV int sr_trigger_set_pretrigger(struct sr_trigger *trig,
+				      uint64_t num_samples)
+{
+	uint8_t *ring;
+	uint64_t size;
+
+	/* The ring also has room for the samples matching the stages. */
+	size = trig->num_stages ? num_samples + trig->num_stages : 0;
+
+	ring = NULL;
+	if (size && !(ring = g_try_malloc(size * trig->unitsize))) {
+		sr_err("trigger: %s: ring malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	g_free(trig->ring);
+	trig->ring = ring;
+	trig->ring_size = size;
+	trig->pretrigger = num_samples;
+	sr_trigger_reset(trig);
+
+	return SR_OK;
+}
+
+/**
+ * Free a software trigger.
+ *
+ * @param trig The trigger. May be NULL.
+ */
+SR_PRIV void sr_trigger_free(struct sr_trigger *trig)
+{
+	if (!trig)
+		return;
+
+	g_free(trig->ring);
+	g_free(trig);
+}
+
+/**
+ * Rearm a software trigger, e.g. at the start of an acquisition.
+ *
+ * @param trig The trigger. May be NULL.
+ */
+SR_PRIV void sr_trigger_reset(struct sr_trigger *trig)
+{
+	if (!trig)
+		return;
+
+	trig->state = 0;
+	trig->ring_pos = 0;
+	/* Without any stages, there's nothing to wait for. */
+	trig->fired = (trig->num_stages == 0);
+}
+
+/**
+ * Check whether a software trigger has fired.
+ *
+ * @param trig The trigger. NULL stands for no trigger at all.
+ *
+ * @return TRUE if the trigger fired (or there is nothing to wait for),
+ *         FALSE otherwise.
+ */
+SR_PRIV gboolean sr_trigger_fired(const struct sr_trigger *trig)
+{
+	return !trig || trig->fired;
+}
+
+/*
+ * Find the first sample matching the first stage, or return num_samples
+ * if there is none.
+ */
+static uint64_t find_first(const struct sr_trigger *trig,
+			   const uint8_t *samples, uint64_t num_samples)
+{
+	uint64_t i;
+	int unitsize;
+#ifdef __SSE2__
+	__m128i m, v, x;
+	unsigned int bits, step;
+#endif
+
+	unitsize = trig->unitsize;
+	i = 0;
+
+#ifdef __SSE2__
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4) {
+		if (unitsize == 1) {
+			m = _mm_set1_epi8((char)trig->mask[0]);
+			v = _mm_set1_epi8((char)trig->value[0]);
+		} else if (unitsize == 2) {
+			m = _mm_set1_epi16((short)trig->mask[0]);
+			v = _mm_set1_epi16((short)trig->value[0]);
+		} else {
+			m = _mm_set1_epi32((int)trig->mask[0]);
+			v = _mm_set1_epi32((int)trig->value[0]);
+		}
+		step = 16 / unitsize;
+		for (; i + step <= num_samples; i += step) {
+			x = _mm_and_si128(_mm_loadu_si128(
+				(const __m128i *)(samples + i * unitsize)), m);
+			if (unitsize == 1)
+				x = _mm_cmpeq_epi8(x, v);
+			else if (unitsize == 2)
+				x = _mm_cmpeq_epi16(x, v);
+			else
+				x = _mm_cmpeq_epi32(x, v);
+			/* A whole sample's bytes are set if it matches. */
+			if ((bits = _mm_movemask_epi8(x)))
+				return i + g_bit_nth_lsf(bits, -1) / unitsize;
+		}
+	}
+#endif
+
+	for (; i < num_samples; i++) {
+		if ((sample_get(samples + i * unitsize, unitsize)
+		     & trig->mask[0]) == trig->value[0])
+			break;
+	}
+
+	return i;
+}
+
+static void ring_push(struct sr_trigger *trig, const uint8_t *samples,
+		      uint64_t num_samples)
+{
+	uint64_t off, n;
+	int unitsize;
+
+	unitsize = trig->unitsize;
+	if (num_samples > trig->ring_size) {
+		samples += (num_samples - trig->ring_size) * unitsize;
+		trig->ring_pos += num_samples - trig->ring_size;
+		num_samples = trig->ring_size;
+	}
+
+	while (num_samples > 0) {
+		off = trig->ring_pos % trig->ring_size;
+		n = MIN(num_samples, trig->ring_size - off);
+		memcpy(trig->ring + off * unitsize, samples, n * unitsize);
+		samples += n * unitsize;
+		trig->ring_pos += n;
+		num_samples -= n;
+	}
+}
+
+/*
+ * Get the longest contiguous run of samples in the ring, starting at
+ * the given position, up to num_samples.
+ */
+static const uint8_t *ring_peek(const struct sr_trigger *trig, uint64_t pos,
+				uint64_t *num_samples)
+{
+	uint64_t off;
+
+	off = pos % trig->ring_size;
+	*num_samples = MIN(*num_samples, trig->ring_size - off);
+
+	return trig->ring + off * trig->unitsize;
+}
+
+/**
+ * Look for the trigger in the next samples of an acquisition.
+ *
+ * The trigger's state carries over from one call to the next, so a
+ * trigger can match across the boundary of two blocks of samples. Once
+ * the trigger has fired, the samples which matched its stages can be
+ * had from sr_trigger_match().
+ *
+ * @param trig The trigger. Must not be NULL.
+ * @param samples The samples. Must not be NULL.
+ * @param num_samples The number of samples.
+ *
+ * @return The index of the sample after the one which matched the last
+ *         stage, or -1 if the trigger didn't fire in these samples.
+ */
+SR_PRIV int64_t sr_trigger_scan(struct sr_trigger *trig,
+				const uint8_t *samples, uint64_t num_samples)
+{
+	const uint8_t *p;
+	uint64_t i, end, pos, n, len;
+	uint32_t state, done;
+	int unitsize;
+
+	if (trig->fired)
+		return -1;
+
+	unitsize = trig->unitsize;
+	done = 1U << (trig->num_stages - 1);
+
+	/* Kept in a local, the samples might alias it otherwise. */
+	state = trig->state;
+	for (i = 0; i < num_samples && !(state & done); ) {
+		if (state == 0) {
+			i += find_first(trig, samples + i * unitsize,
+					num_samples - i);
+			if (i == num_samples)
+				break;
+		}
+		for (end = MIN(num_samples, i + SKIM_EVERY); i < end; i++) {
+			state = ((state << 1) | 1)
+				& stages_matched(trig, samples + i * unitsize);
+			if (state & done)
+				break;
+		}
+	}
+	trig->state = state;
+
+	if (i == num_samples) {
+		ring_push(trig, samples, num_samples);
+		return -1;
+	}
+	ring_push(trig, samples, i + 1);
+
+	/* The last num_stages samples matched, some maybe in earlier calls. */
+	pos = trig->ring_pos - trig->num_stages;
+	for (n = 0; n < (uint64_t)trig->num_stages; n += len) {
+		len = trig->num_stages - n;
+		p = ring_peek(trig, pos + n, &len);
+		memcpy(trig->match + n * unitsize, p, len * unitsize);
+	}
+	trig->fired = TRUE;
+
+	return i + 1;
+}
+
+/**
+ * Get the samples which matched the stages of a trigger which fired.
+ *
+ * @param trig The trigger. Must not be NULL.
+ * @param num_samples Pointer to a variable which will hold the number of
+ *                    samples, one per stage. Must not be NULL.
+ *
+ * @return The samples, valid until the trigger is reset or freed.
+ */
+SR_PRIV const uint8_t *sr_trigger_match(const struct sr_trigger *trig,
+					int *num_samples)
+{
+	*num_samples = trig->fired ? trig->num_stages : 0;
+
+	return trig->match;
+}
+
+/**
+ * Send the samples before the trigger point, once the trigger fired.
+ *
+ * These are the samples which came before the ones matching the trigger's
+ * stages, up to the number set with sr_trigger_set_pretrigger(). They
+ * are sent as (at most two) SR_DF_LOGIC packets.
+ *
+ * @param trig The trigger. Must not be NULL.
+ * @param cb_data Opaque pointer passed in by the frontend, to hand to
+ *                sr_session_send().
+ *
+ * @return The number of samples sent.
+ */
+SR_PRIV uint64_t sr_trigger_send_pretrigger(struct sr_trigger *trig,
+					    void *cb_data)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	uint64_t start, pos, end, len;
+
+	if (!trig->fired)
+		return 0;
+
+	end = trig->ring_pos - trig->num_stages;
+	start = end - MIN(trig->pretrigger, end);
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = trig->unitsize;
+	logic.buffer = NULL;
+	for (pos = start; pos < end; pos += len) {
+		len = end - pos;
+		logic.data = (void *)ring_peek(trig, pos, &len);
+		logic.length = len * trig->unitsize;
+		sr_session_send(cb_data, &packet);
+	}
+
+	return end - start;
+}
@@ -0,0 +1,286 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
+#include "config.h"
+#include <glib.h>
+#include <stdlib.h>
+
+/*
+ * Annotations are collected in batches rather than handed to the frontend
+ * one by one. A batch keeps all of its annotations in one array, their
+ * string lists in another, and the strings themselves in a string chunk,
+ * where each distinct string is stored only once. Everything is released
+ * in one go when the batch has been delivered.
+ */
+struct srd_ann_batch {
+	GArray *anns;
+	/* Each annotation's strings, NULL-terminated, back to back. */
+	GPtrArray *strv;
+	GStringChunk *strings;
+};
+
+/* Number of annotations after which a batch is delivered, if possible. */
+#define ANN_BATCH_MAX 1024
+
+/* The batch annotations go to, unless the thread has one of its own. */
+static struct srd_ann_batch *main_batch = NULL;
+
+SRD_PRIV struct srd_ann_batch *srd_ann_batch_new(void)
+{
+	struct srd_ann_batch *batch;
+
+	if (!(batch = g_try_malloc(sizeof(struct srd_ann_batch)))) {
+		srd_err("Failed to g_malloc() annotation batch.");
+		return NULL;
+	}
+
+	batch->anns = g_array_sized_new(FALSE, FALSE,
+					sizeof(struct srd_proto_data),
+					ANN_BATCH_MAX);
+	batch->strv = g_ptr_array_new();
+	batch->strings = g_string_chunk_new(4096);
+
+	return batch;
+}
+
+SRD_PRIV void srd_ann_batch_free(struct srd_ann_batch *batch)
+{
+	if (!batch)
+		return;
+
+	g_array_free(batch->anns, TRUE);
+	g_ptr_array_free(batch->strv, TRUE);
+	g_string_chunk_free(batch->strings);
+	g_free(batch);
+}
+
+static void ann_batch_clear(struct srd_ann_batch *batch)
+{
+	g_array_set_size(batch->anns, 0);
+	g_ptr_array_set_size(batch->strv, 0);
+	g_string_chunk_clear(batch->strings);
+}
+
+/*
+ * While annotations are collected, their 'data' holds the index of their
+ * first string in the batch's string vector, which may still move around
+ * as it grows. Turn those into real pointers.
+ */
+static void ann_batch_fixup(struct srd_ann_batch *batch)
+{
+	struct srd_proto_data *pdata;
+	guint i;
+
+	for (i = 0; i < batch->anns->len; i++) {
+		pdata = &g_array_index(batch->anns, struct srd_proto_data, i);
+		pdata->data = &g_ptr_array_index(batch->strv,
+						 GPOINTER_TO_UINT(pdata->data));
+	}
+}
+
+/* Hand a list of annotations to the frontend's callbacks. */
+static void ann_deliver(struct srd_proto_data *anns, unsigned int num_anns)
+{
+	struct srd_pd_callback *pd_cb;
+	struct srd_pd_batch_callback *pd_batch_cb;
+	unsigned int i;
+
+	if (num_anns == 0)
+		return;
+
+	if ((pd_batch_cb = srd_pd_output_batch_callback_find(SRD_OUTPUT_ANN)))
+		pd_batch_cb->cb(anns, num_anns, pd_batch_cb->cb_data);
+
+	if ((pd_cb = srd_pd_output_callback_find(SRD_OUTPUT_ANN))) {
+		for (i = 0; i < num_anns; i++)
+			pd_cb->cb(&anns[i], pd_cb->cb_data);
+	}
+}
+
+/**
+ * Get the annotation batch of the calling thread.
+ *
+ * @return The batch annotations should be added to, or NULL if it could
+ *         not be allocated.
+ */
+SRD_PRIV struct srd_ann_batch *srd_ann_batch_get(void)
+{
+	struct srd_ann_batch *batch;
+
+	if ((batch = srd_ann_queue_get()))
+		return batch;
+
+	if (!main_batch)
+		main_batch = srd_ann_batch_new();
+
+	return main_batch;
+}
+
+/**
+ * Add an annotation to a batch.
+ *
+ * If this is the main batch and it is full, it is delivered first.
+ *
+ * @param batch The batch. Must not be NULL.
+ * @param pdo The output the annotation was put on.
+ * @param start_sample The annotation's first sample.
+ * @param end_sample The annotation's last sample.
+ * @param ann_format The annotation format.
+ * @param py_strlist The Python list of annotation strings.
+ *
+ * @return SRD_OK upon success, SRD_ERR_PYTHON if a string could not be
+ *         converted.
+ */
+SRD_PRIV int srd_ann_batch_add(struct srd_ann_batch *batch,
+			       struct srd_pd_output *pdo, uint64_t start_sample,
+			       uint64_t end_sample, int ann_format,
+			       PyObject *py_strlist)
+{
+	struct srd_proto_data pdata;
+	PyObject *py_str;
+	Py_ssize_t list_len, i;
+	guint first;
+	char *str;
+
+	if (batch == main_batch && batch->anns->len >= ANN_BATCH_MAX)
+		srd_ann_batch_flush(batch);
+
+	first = batch->strv->len;
+	list_len = PyList_Size(py_strlist);
+	for (i = 0; i < list_len; i++) {
+		if (!(py_str = PyUnicode_AsEncodedString(
+		    PyList_GetItem(py_strlist, i), "utf-8", NULL))) {
+			g_ptr_array_set_size(batch->strv, first);
+			return SRD_ERR_PYTHON;
+		}
+		str = PyBytes_AS_STRING(py_str);
+		g_ptr_array_add(batch->strv,
+				g_string_chunk_insert_const(batch->strings, str));
+		Py_DecRef(py_str);
+	}
+	g_ptr_array_add(batch->strv, NULL);
+
+	pdata.start_sample = start_sample;
+	pdata.end_sample = end_sample;
+	pdata.pdo = pdo;
+	pdata.ann_format = ann_format;
+	pdata.data = GUINT_TO_POINTER(first);
+	g_array_append_val(batch->anns, pdata);
+
+	return SRD_OK;
+}
+
+/**
+ * Deliver all annotations in a batch to the frontend, and empty it.
+ *
+ * @param batch The batch. If NULL, the main batch is flushed.
+ */
+SRD_PRIV void srd_ann_batch_flush(struct srd_ann_batch *batch)
+{
+	if (!batch && !(batch = main_batch))
+		return;
+
+	ann_batch_fixup(batch);
+	ann_deliver((struct srd_proto_data *)batch->anns->data,
+		    batch->anns->len);
+	ann_batch_clear(batch);
+}
+
+/* Position of an annotation across several batches, for sorting. */
+struct merged_ann {
+	struct srd_proto_data *pdata;
+	unsigned int batch;
+	unsigned int seq;
+};
+
+static int merged_ann_cmp(const void *a, const void *b)
+{
+	const struct merged_ann *ma = a, *mb = b;
+
+	if (ma->pdata->start_sample != mb->pdata->start_sample)
+		return ma->pdata->start_sample < mb->pdata->start_sample ? -1 : 1;
+	if (ma->batch != mb->batch)
+		return ma->batch < mb->batch ? -1 : 1;
+
+	return ma->seq < mb->seq ? -1 : (ma->seq > mb->seq);
+}
+
+/**
+ * Deliver the annotations of several batches, ordered by start sample,
+ * and empty them.
+ *
+ * Ties go by batch order and then by the order in which the annotations
+ * were added, so the result doesn't depend on the order in which the
+ * batches were filled.
+ *
+ * @param batches The batches. Must not be NULL.
+ * @param num_batches The number of batches.
+ */
+SRD_PRIV void srd_ann_batch_flush_merged(struct srd_ann_batch **batches,
+					 unsigned int num_batches)
+{
+	struct merged_ann *merged;
+	struct srd_proto_data *anns;
+	unsigned int i, j, n;
+
+	n = 0;
+	for (i = 0; i < num_batches; i++) {
+		ann_batch_fixup(batches[i]);
+		n += batches[i]->anns->len;
+	}
+
+	if (n > 0) {
+		merged = g_try_malloc(n * sizeof(struct merged_ann));
+		anns = g_try_malloc(n * sizeof(struct srd_proto_data));
+		if (!merged || !anns) {
+			srd_err("Failed to g_malloc() merged annotations.");
+		} else {
+			n = 0;
+			for (i = 0; i < num_batches; i++) {
+				for (j = 0; j < batches[i]->anns->len; j++) {
+					merged[n].pdata = &g_array_index(
+						batches[i]->anns,
+						struct srd_proto_data, j);
+					merged[n].batch = i;
+					merged[n].seq = j;
+					n++;
+				}
+			}
+			qsort(merged, n, sizeof(struct merged_ann),
+			      merged_ann_cmp);
+			for (i = 0; i < n; i++)
+				anns[i] = *merged[i].pdata;
+			ann_deliver(anns, n);
+		}
+		g_free(merged);
+		g_free(anns);
+	}
+
+	for (i = 0; i < num_batches; i++)
+		ann_batch_clear(batches[i]);
+}
+
+/* Release the main batch, when libsigrokdecode shuts down. */
+SRD_PRIV void srd_ann_batch_cleanup(void)
+{
+	srd_ann_batch_free(main_batch);
+	main_batch = NULL;
+}
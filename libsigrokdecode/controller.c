@@ -24,16 +24,41 @@
 #include <glib.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* List of decoder instances. */
 static GSList *di_list = NULL;
 
+/*
+ * While decoder stacks run in parallel, each thread collects the
+ * annotations of its stack in its own queue, see srd_session_send().
+ */
+static GPrivate *ann_queue_key = NULL;
+static GPtrArray *stack_batches = NULL;
+
+/*
+ * Worker threads which decode all stacks but the first one, started by
+ * srd_session_start(), and the count of jobs they still have to finish.
+ */
+static GThreadPool *decode_pool = NULL;
+static GMutex *decode_mutex = NULL;
+static GCond *decode_cond = NULL;
+static unsigned int decode_pending = 0;
+
 /* List of frontend callbacks to receive decoder output. */
 static GSList *callbacks = NULL;
 
+/* List of frontend callbacks to receive decoder output in batches. */
+static GSList *batch_callbacks = NULL;
+
+/* Whether any (batch) callback for annotations was registered. */
+static gboolean ann_callback_registered = FALSE;
+
 /* decoder.c */
 extern SRD_PRIV GSList *pd_list;
 
+static void decode_job_thread(gpointer data, gpointer user_data);
+
 /* module_sigrokdecode.c */
 /* FIXME: SRD_PRIV causes issues on MinGW. Investigate. */
 extern PyMODINIT_FUNC PyInit_sigrokdecode(void);
@@ -79,6 +104,19 @@ SRD_API int srd_init(const char *path)
 	/* Initialize the Python interpreter. */
 	Py_Initialize();
 
+	/* Independent decoder stacks may decode in threads of their own. */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#if PY_VERSION_HEX < 0x03070000
+	/* Python 3.7 and later set up the GIL in Py_Initialize() already. */
+	PyEval_InitThreads();
+#endif
+	if (!ann_queue_key)
+		ann_queue_key = g_private_new(NULL);
+	stack_batches = g_ptr_array_new();
+	decode_mutex = g_mutex_new();
+	decode_cond = g_cond_new();
+
 	/* Installed decoders. */
 	if ((ret = srd_decoder_searchpath_add(DECODERS_DIR)) != SRD_OK) {
 		Py_Finalize();
@@ -118,12 +156,29 @@ SRD_API int srd_init(const char *path)
  */
 SRD_API int srd_exit(void)
 {
+	unsigned int i;
+
 	srd_dbg("Exiting libsigrokdecode.");
 
 	srd_decoder_unload_all();
 	g_slist_free(pd_list);
 	pd_list = NULL;
 
+	if (decode_pool) {
+		g_thread_pool_free(decode_pool, FALSE, TRUE);
+		decode_pool = NULL;
+	}
+	g_cond_free(decode_cond);
+	decode_cond = NULL;
+	g_mutex_free(decode_mutex);
+	decode_mutex = NULL;
+
+	for (i = 0; i < stack_batches->len; i++)
+		srd_ann_batch_free(g_ptr_array_index(stack_batches, i));
+	g_ptr_array_free(stack_batches, TRUE);
+	stack_batches = NULL;
+	srd_ann_batch_cleanup();
+
 	/* Py_Finalize() returns void, any finalization errors are ignored. */
 	Py_Finalize();
 
@@ -239,7 +294,14 @@ SRD_API int srd_inst_option_set(struct srd_decoder_inst *di,
 	/* All of these are synthesized objects, so they're good. */
 	py_dec_optkeys = PyDict_Keys(py_dec_options);
 	num_optkeys = PyList_Size(py_dec_optkeys);
-	if (!(py_di_options = PyObject_GetAttrString(di->py_inst, "options")))
+	/*
+	 * 'options' is a class attribute. Give the instance a dict of its own,
+	 * so that setting options doesn't change them for every other instance
+	 * of the decoder (or the defaults in the class).
+	 */
+	if (!(py_di_options = PyDict_New()))
+		goto err_out;
+	if (PyObject_SetAttrString(di->py_inst, "options", py_di_options) == -1)
 		goto err_out;
 	for (i = 0; i < num_optkeys; i++) {
 		/* Get the default class value for this option. */
@@ -301,12 +363,15 @@ SRD_API int srd_inst_option_set(struct srd_decoder_inst *di,
 		 */
 		if (PyDict_SetItemString(py_di_options, key, py_optval) == -1)
 			goto err_out;
+		Py_DECREF(py_optval);
+		py_optval = NULL;
 	}
 
 	ret = SRD_OK;
 
 err_out:
-	Py_XDECREF(py_optlist);
+	/* py_optlist and py_classval are borrowed references. */
+	Py_XDECREF(py_optval);
 	Py_XDECREF(py_di_options);
 	Py_XDECREF(py_dec_optkeys);
 	Py_XDECREF(py_dec_options);
@@ -622,16 +687,19 @@ SRD_PRIV int srd_inst_start(struct srd_decoder_inst *di, PyObject *args)
  * @param di The decoder instance to call. Must not be NULL.
  * @param inbuf The buffer to decode. Must not be NULL.
  * @param inbuflen Length of the buffer. Must be > 0.
+ * @param runs If not NULL, the buffer holds one sample per run of identical
+ *             samples, and this the number of samples in each run.
  *
  * @return SRD_OK upon success, a (negative) error code otherwise.
  */
 SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
-			     const struct srd_decoder_inst *di,
-			     const uint8_t *inbuf, uint64_t inbuflen)
+			     struct srd_decoder_inst *di,
+			     const uint8_t *inbuf, uint64_t inbuflen,
+			     const uint64_t *runs)
 {
 	PyObject *py_res;
 	srd_logic *logic;
-	uint64_t end_samplenum;
+	uint64_t num_units, num_samples, i;
 
 	srd_dbg("Calling decode() on instance %s with %d bytes starting "
 		"at sample %d.", di->inst_id, inbuflen, start_samplenum);
@@ -652,23 +720,66 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 
 	/*
 	 * Create new srd_logic object. Each iteration around the PD's loop
-	 * will fill one sample into this object.
+	 * will fill one sample into this object. PDs which handle whole
+	 * chunks at once read the raw samples through its buffer interface.
 	 */
-	logic = PyObject_New(srd_logic, &srd_logic_type);
-	Py_INCREF(logic);
-	logic->di = (struct srd_decoder_inst *)di;
+	if (!(logic = PyObject_New(srd_logic, &srd_logic_type))) {
+		srd_exception_catch("Protocol decoder instance %s: ",
+				    di->inst_id);
+		return SRD_ERR_PYTHON;
+	}
+	logic->di = di;
 	logic->start_samplenum = start_samplenum;
 	logic->itercnt = 0;
 	logic->inbuf = (uint8_t *)inbuf;
 	logic->inbuflen = inbuflen;
+	logic->runs = runs;
+	logic->run = 0;
+	logic->run_start = 0;
 	logic->sample = PyList_New(2);
-	Py_INCREF(logic->sample);
+	logic->py_inbuf = NULL;
+	logic->exports = 0;
+	di->py_logic = (PyObject *)logic;
+
+	num_units = inbuflen / di->data_unitsize;
+	if (runs) {
+		num_samples = 0;
+		for (i = 0; i < num_units; i++)
+			num_samples += runs[i];
+	} else {
+		num_samples = num_units;
+	}
+	logic->num_samples = num_samples;
 
 	Py_IncRef(di->py_inst);
-	end_samplenum = start_samplenum + inbuflen / di->data_unitsize;
-	if (!(py_res = PyObject_CallMethod(di->py_inst, "decode",
-					   "KKO", logic->start_samplenum,
-					   end_samplenum, logic))) {
+	py_res = PyObject_CallMethod(di->py_inst, "decode", "KKO",
+				     logic->start_samplenum,
+				     start_samplenum + num_samples, logic);
+
+	/*
+	 * The input buffer belongs to the caller; make sure a PD which kept
+	 * the object around doesn't get to see it after we return. Views the
+	 * PD still holds point to the object's own copy of the chunk, which
+	 * is dropped once the last of them is released.
+	 */
+	logic->inbuf = NULL;
+	logic->inbuflen = 0;
+	logic->runs = NULL;
+	logic->num_samples = 0;
+	if (!logic->exports)
+		Py_CLEAR(logic->py_inbuf);
+	Py_DecRef((PyObject *)logic);
+	di->py_logic = NULL;
+
+	/* Decoder.wait() needs this to find edges at the next chunk's start. */
+	if (num_units > 0) {
+		di->last_sample = 0;
+		memcpy(&di->last_sample, inbuf + inbuflen - di->data_unitsize,
+		       di->data_unitsize);
+		di->last_sample_valid = TRUE;
+	}
+
+	if (!py_res) {
 		srd_exception_catch("Protocol decoder instance %s: ",
 				    di->inst_id);
 		return SRD_ERR_PYTHON; /* TODO: More specific error? */
@@ -731,11 +842,34 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 	PyObject *args;
 	GSList *d;
 	struct srd_decoder_inst *di;
+	GError *error;
+	unsigned int num_stacks;
 	int ret;
 
 	srd_dbg("Calling start() on all instances with %d probes, "
 		"unitsize %d samplerate %d.", num_probes, unitsize, samplerate);
 
+	/*
+	 * Start a worker thread for every stack but the first, which is
+	 * decoded in the caller's thread. The threads stay around for the
+	 * whole session, so srd_session_send() only needs to hand them jobs.
+	 */
+	if (decode_pool) {
+		g_thread_pool_free(decode_pool, FALSE, TRUE);
+		decode_pool = NULL;
+	}
+	if ((num_stacks = g_slist_length(di_list)) > 1) {
+		error = NULL;
+		decode_pool = g_thread_pool_new(decode_job_thread, NULL,
+						num_stacks - 1, TRUE, &error);
+		if (!decode_pool) {
+			/* Not fatal, the stacks are decoded one by one. */
+			srd_warn("Failed to start decoder threads: %s",
+				 error->message);
+			g_error_free(error);
+		}
+	}
+
 	/*
 	 * Currently only one item of metadata is passed along to decoders,
 	 * samplerate. This can be extended as needed.
@@ -751,6 +885,8 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 		di->data_num_probes = num_probes;
 		di->data_unitsize = unitsize;
 		di->data_samplerate = samplerate;
+		di->last_sample = 0;
+		di->last_sample_valid = FALSE;
 		if ((ret = srd_inst_start(di, args)) != SRD_OK)
 			break;
 	}
@@ -760,9 +896,161 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 	return ret;
 }
 
+/* One decoder stack's share of a chunk, when decoding in parallel. */
+struct decode_job {
+	struct srd_decoder_inst *di;
+	uint64_t start_samplenum;
+	const uint8_t *inbuf;
+	uint64_t inbuflen;
+	const uint64_t *runs;
+	/* Where the stack's annotations go until the chunk is done. */
+	struct srd_ann_batch *batch;
+	int ret;
+};
+
+/**
+ * Get the annotation batch of the calling thread, if it has one.
+ *
+ * @return The batch of the decoder stack this thread is decoding in
+ *         parallel with other stacks, or NULL.
+ */
+SRD_PRIV struct srd_ann_batch *srd_ann_queue_get(void)
+{
+	return ann_queue_key ? g_private_get(ann_queue_key) : NULL;
+}
+
+static void decode_job_run(struct decode_job *job)
+{
+	PyGILState_STATE gstate;
+
+	g_private_set(ann_queue_key, job->batch);
+	gstate = PyGILState_Ensure();
+	job->ret = srd_inst_decode(job->start_samplenum, job->di,
+				   job->inbuf, job->inbuflen, job->runs);
+	PyGILState_Release(gstate);
+	g_private_set(ann_queue_key, NULL);
+}
+
+static void decode_job_thread(gpointer data, gpointer user_data)
+{
+	(void)user_data;
+
+	decode_job_run(data);
+
+	g_mutex_lock(decode_mutex);
+	if (--decode_pending == 0)
+		g_cond_signal(decode_cond);
+	g_mutex_unlock(decode_mutex);
+}
+
+/*
+ * Decode a chunk with every top-level decoder stack in a thread of its
+ * own, using the worker threads started by srd_session_start(). The stacks
+ * only run Python code one at a time, but anything which releases the GIL
+ * (such as the sample scan in Decoder.wait()) runs in parallel with the
+ * other stacks. Unless one of the PDs uses wait(), the threads would just
+ * take turns, so the stacks are then decoded one after the other instead.
+ * Either way, their annotations are passed on in sample order.
+ */
+static int session_send_parallel(uint64_t start_samplenum,
+				 const uint8_t *inbuf, uint64_t inbuflen,
+				 const uint64_t *runs, unsigned int num_jobs)
+{
+	struct decode_job *jobs;
+	struct srd_ann_batch *batch, **batches;
+	PyThreadState *tstate;
+	GSList *d;
+	unsigned int i;
+	int ret;
+	gboolean threads;
+
+	/* The batches are kept around, so their memory is reused. */
+	while (stack_batches->len < num_jobs) {
+		if (!(batch = srd_ann_batch_new()))
+			return SRD_ERR_MALLOC;
+		g_ptr_array_add(stack_batches, batch);
+	}
+	batches = (struct srd_ann_batch **)stack_batches->pdata;
+
+	if (!(jobs = g_try_malloc0(num_jobs * sizeof(struct decode_job)))) {
+		srd_err("Failed to g_malloc() decode jobs.");
+		return SRD_ERR_MALLOC;
+	}
+
+	threads = FALSE;
+	for (d = di_list, i = 0; d; d = d->next, i++) {
+		jobs[i].di = d->data;
+		if (jobs[i].di->uses_wait)
+			threads = TRUE;
+		jobs[i].start_samplenum = start_samplenum;
+		jobs[i].inbuf = inbuf;
+		jobs[i].inbuflen = inbuflen;
+		jobs[i].runs = runs;
+		jobs[i].batch = batches[i];
+	}
+
+	/* Annotations from before this chunk go first. */
+	srd_ann_batch_flush(NULL);
+
+	tstate = PyEval_SaveThread();
+
+	/* The first stack is decoded in this thread. */
+	if (decode_pool && threads) {
+		decode_pending = num_jobs - 1;
+		for (i = 1; i < num_jobs; i++)
+			g_thread_pool_push(decode_pool, &jobs[i], NULL);
+		decode_job_run(&jobs[0]);
+		g_mutex_lock(decode_mutex);
+		while (decode_pending)
+			g_cond_wait(decode_cond, decode_mutex);
+		g_mutex_unlock(decode_mutex);
+	} else {
+		for (i = 0; i < num_jobs; i++)
+			decode_job_run(&jobs[i]);
+	}
+
+	PyEval_RestoreThread(tstate);
+
+	srd_ann_batch_flush_merged(batches, num_jobs);
+
+	ret = SRD_OK;
+	for (i = 0; i < num_jobs && ret == SRD_OK; i++)
+		ret = jobs[i].ret;
+	g_free(jobs);
+
+	return ret;
+}
+
+static int session_send(uint64_t start_samplenum, const uint8_t *inbuf,
+			uint64_t inbuflen, const uint64_t *runs)
+{
+	GSList *d;
+	unsigned int num_stacks;
+	int ret;
+
+	if ((num_stacks = g_slist_length(di_list)) > 1)
+		return session_send_parallel(start_samplenum, inbuf, inbuflen,
+					     runs, num_stacks);
+
+	ret = SRD_OK;
+	for (d = di_list; d && ret == SRD_OK; d = d->next)
+		ret = srd_inst_decode(start_samplenum, d->data, inbuf, inbuflen,
+				      runs);
+
+	/* Hand the chunk's annotations to the frontend. */
+	srd_ann_batch_flush(NULL);
+
+	return ret;
+}
+
 /**
  * Send a chunk of logic sample data to a running decoder session.
  *
+ * If more than one decoder stack receives the logic data, their annotations
+ * are passed to the frontend once the whole chunk has been decoded, in
+ * sample order. The stacks decode the chunk in parallel if any of their
+ * PDs use Decoder.wait(), which can scan samples without holding the GIL.
+ *
  * @param start_samplenum The sample number of the first sample in this chunk.
  * @param inbuf Pointer to sample data.
  * @param inbuflen Length in bytes of the buffer.
@@ -772,20 +1060,52 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 SRD_API int srd_session_send(uint64_t start_samplenum, const uint8_t *inbuf,
 			     uint64_t inbuflen)
 {
-	GSList *d;
-	int ret;
-
 	srd_dbg("Calling decode() on all instances with starting sample "
 		"number %" PRIu64 ", %" PRIu64 " bytes at 0x%p",
 		start_samplenum, inbuflen, inbuf);
 
-	for (d = di_list; d; d = d->next) {
-		if ((ret = srd_inst_decode(start_samplenum, d->data, inbuf,
-					   inbuflen)) != SRD_OK)
-			return ret;
+	return session_send(start_samplenum, inbuf, inbuflen, NULL);
+}
+
+/**
+ * Send a chunk of run-length encoded logic sample data to a running
+ * decoder session.
+ *
+ * This works like srd_session_send(), but the chunk consists of runs of
+ * identical samples, so long stretches without any change don't need to
+ * be expanded. Decoders which iterate over their input, or skip through
+ * it with wait(), see the same samples either way; wait() only looks at
+ * each run once.
+ *
+ * @param start_samplenum The sample number of the first sample in this chunk.
+ * @param values Pointer to one sample (of the session's unit size) per run.
+ * @param lengths Pointer to the number of samples in each run, none of
+ *                which may be 0.
+ * @param num_runs The number of runs.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_session_send_rle(uint64_t start_samplenum,
+				 const uint8_t *values, const uint64_t *lengths,
+				 uint64_t num_runs)
+{
+	struct srd_decoder_inst *di;
+
+	srd_dbg("Calling decode() on all instances with starting sample "
+		"number %" PRIu64 ", %" PRIu64 " runs at 0x%p",
+		start_samplenum, num_runs, values);
+
+	if (!lengths) {
+		srd_dbg("NULL run lengths pointer");
+		return SRD_ERR_ARG;
 	}
 
-	return SRD_OK;
+	if (!di_list)
+		return SRD_OK;
+	di = di_list->data;
+
+	return session_send(start_samplenum, values,
+			    num_runs * di->data_unitsize, lengths);
 }
 
 /**
@@ -795,6 +1115,9 @@ SRD_API int srd_session_send(uint64_t start_samplenum, const uint8_t *inbuf,
  * to the PD controller (except for Python objects, which only go up the
  * stack).
  *
+ * The annotation strings are only valid until the callback returns. For
+ * chatty decoders, srd_pd_output_batch_callback_add() is more efficient.
+ *
  * @param output_type The output type this callback will receive. Only one
  *                    callback per output type can be registered.
  * @param cb The function to call. Must not be NULL.
@@ -816,26 +1139,96 @@ SRD_API int srd_pd_output_callback_add(int output_type,
 	pd_cb->cb = cb;
 	pd_cb->cb_data = cb_data;
 	callbacks = g_slist_append(callbacks, pd_cb);
+	if (output_type == SRD_OUTPUT_ANN)
+		ann_callback_registered = TRUE;
+
+	return SRD_OK;
+}
+
+/**
+ * Register/add a decoder output callback function, which receives the
+ * output in batches.
+ *
+ * Instead of being called for every single annotation, the function is
+ * called with all annotations which were collected since the last call,
+ * at least once for every chunk of samples passed to srd_session_send().
+ * Only SRD_OUTPUT_ANN is currently supported.
+ *
+ * The annotations, and the strings they point to, are only valid until
+ * the callback returns.
+ *
+ * @param output_type The output type this callback will receive. Only one
+ *                    batch callback per output type can be registered.
+ * @param cb The function to call. Must not be NULL.
+ * @param cb_data Private data for the callback function. Can be NULL.
+ */
+SRD_API int srd_pd_output_batch_callback_add(int output_type,
+				srd_pd_output_batch_callback_t cb, void *cb_data)
+{
+	struct srd_pd_batch_callback *pd_cb;
+
+	srd_dbg("Registering new batch callback for output type %d.",
+		output_type);
+
+	if (output_type != SRD_OUTPUT_ANN) {
+		srd_err("Batch callbacks only support annotation output.");
+		return SRD_ERR_ARG;
+	}
+
+	if (!(pd_cb = g_try_malloc(sizeof(struct srd_pd_batch_callback)))) {
+		srd_err("Failed to g_malloc() struct srd_pd_batch_callback.");
+		return SRD_ERR_MALLOC;
+	}
+
+	pd_cb->output_type = output_type;
+	pd_cb->cb = cb;
+	pd_cb->cb_data = cb_data;
+	batch_callbacks = g_slist_append(batch_callbacks, pd_cb);
+	ann_callback_registered = TRUE;
 
 	return SRD_OK;
 }
 
-SRD_PRIV void *srd_pd_output_callback_find(int output_type)
+/**
+ * Check whether the frontend wants annotations at all.
+ *
+ * This is called for every annotation a PD puts, so it doesn't look
+ * through the callback lists.
+ *
+ * @return TRUE if an annotation (batch) callback is registered.
+ */
+SRD_PRIV gboolean srd_pd_output_ann_wanted(void)
+{
+	return ann_callback_registered;
+}
+
+SRD_PRIV struct srd_pd_callback *srd_pd_output_callback_find(int output_type)
 {
 	GSList *l;
 	struct srd_pd_callback *pd_cb;
-	void *(cb);
 
-	cb = NULL;
 	for (l = callbacks; l; l = l->next) {
 		pd_cb = l->data;
-		if (pd_cb->output_type == output_type) {
-			cb = pd_cb->cb;
-			break;
-		}
+		if (pd_cb->output_type == output_type)
+			return pd_cb;
+	}
+
+	return NULL;
+}
+
+SRD_PRIV struct srd_pd_batch_callback *srd_pd_output_batch_callback_find(
+		int output_type)
+{
+	GSList *l;
+	struct srd_pd_batch_callback *pd_cb;
+
+	for (l = batch_callbacks; l; l = l->next) {
+		pd_cb = l->data;
+		if (pd_cb->output_type == output_type)
+			return pd_cb;
 	}
 
-	return cb;
+	return NULL;
 }
 
 /* This is the backend function to Python sigrokdecode.add() call. */
@@ -21,6 +21,7 @@
 
 # SPI protocol decoder
 
+import sys
 import sigrokdecode as srd
 
 # Key: (CPOL, CPHA). Value: SPI mode.
@@ -36,6 +37,10 @@ spi_mode = {
 # Annotation formats
 ANN_HEX = 0
 
+# Key: Unit size (bytes per sample). Value: memoryview format to read
+# whole samples with.
+sample_formats = {1: 'B', 2: 'H', 4: 'I', 8: 'Q'}
+
 class Decoder(srd.Decoder):
     api_version = 1
     id = 'spi'
@@ -75,6 +80,7 @@ class Decoder(srd.Decoder):
         self.cs_was_deasserted_during_data_word = 0
         self.oldcs = -1
         self.oldpins = None
+        self.oldsample = None
 
     def start(self, metadata):
         self.out_proto = self.add(srd.OUTPUT_PROTO, 'spi')
@@ -83,84 +89,116 @@ class Decoder(srd.Decoder):
     def report(self):
         return 'SPI: %d bytes received' % self.bytesreceived
 
-    def decode(self, ss, es, data):
-        # TODO: Either MISO or MOSI could be optional. CS# is optional.
-        for (self.samplenum, pins) in data:
-
-            # Ignore identical samples early on (for performance reasons).
-            if self.oldpins == pins:
-                continue
-            self.oldpins, (miso, mosi, sck, cs) = pins, pins
-
-            if self.oldcs != cs:
-                # Send all CS# pin value changes.
-                self.put(self.samplenum, self.samplenum, self.out_proto,
-                         ['CS-CHANGE', self.oldcs, cs])
-                self.put(self.samplenum, self.samplenum, self.out_ann,
-                         [0, ['CS-CHANGE: %d->%d' % (self.oldcs, cs)]])
-                self.oldcs = cs
-
-            # Ignore sample if the clock pin hasn't changed.
-            if sck == self.oldsck:
-                continue
-
-            self.oldsck = sck
-
-            # Sample data on rising/falling clock edge (depends on mode).
-            mode = spi_mode[self.options['cpol'], self.options['cpha']]
-            if mode == 0 and sck == 0:   # Sample on rising clock edge
-                    continue
-            elif mode == 1 and sck == 1: # Sample on falling clock edge
-                    continue
-            elif mode == 2 and sck == 1: # Sample on falling clock edge
-                    continue
-            elif mode == 3 and sck == 0: # Sample on rising clock edge
-                    continue
-
-            # If this is the first bit, save its sample number.
-            if self.bitcount == 0:
-                self.start_sample = self.samplenum
-                active_low = (self.options['cs_polarity'] == 'active-low')
-                deasserted = cs if active_low else not cs
-                if deasserted:
-                    self.cs_was_deasserted_during_data_word = 1
-
-            ws = self.options['wordsize']
-
-            # Receive MOSI bit into our shift register.
-            if self.options['bitorder'] == 'msb-first':
-                self.mosidata |= mosi << (ws - 1 - self.bitcount)
-            else:
-                self.mosidata |= mosi << self.bitcount
-
-            # Receive MISO bit into our shift register.
-            if self.options['bitorder'] == 'msb-first':
-                self.misodata |= miso << (ws - 1 - self.bitcount)
-            else:
-                self.misodata |= miso << self.bitcount
-
-            self.bitcount += 1
-
-            # Continue to receive if not enough bits were received, yet.
-            if self.bitcount != ws:
-                continue
-
-            self.put(self.start_sample, self.samplenum, self.out_proto,
-                     ['DATA', self.mosidata, self.misodata])
+    # Handle a sample, given the values of the probes in it.
+    def handle_pins(self, miso, mosi, sck, cs):
+        if self.oldcs != cs:
+            # Send all CS# pin value changes.
+            self.put(self.samplenum, self.samplenum, self.out_proto,
+                     ['CS-CHANGE', self.oldcs, cs])
+            self.put(self.samplenum, self.samplenum, self.out_ann,
+                     [0, ['CS-CHANGE: %d->%d' % (self.oldcs, cs)]])
+            self.oldcs = cs
+
+        # Ignore sample if the clock pin hasn't changed.
+        if sck == self.oldsck:
+            return
+
+        self.oldsck = sck
+
+        # Sample data on rising/falling clock edge (depends on mode).
+        mode = spi_mode[self.options['cpol'], self.options['cpha']]
+        if mode == 0 and sck == 0:   # Sample on rising clock edge
+                return
+        elif mode == 1 and sck == 1: # Sample on falling clock edge
+                return
+        elif mode == 2 and sck == 1: # Sample on falling clock edge
+                return
+        elif mode == 3 and sck == 0: # Sample on rising clock edge
+                return
+
+        # If this is the first bit, save its sample number.
+        if self.bitcount == 0:
+            self.start_sample = self.samplenum
+            active_low = (self.options['cs_polarity'] == 'active-low')
+            deasserted = cs if active_low else not cs
+            if deasserted:
+                self.cs_was_deasserted_during_data_word = 1
+
+        ws = self.options['wordsize']
+
+        # Receive MOSI bit into our shift register.
+        if self.options['bitorder'] == 'msb-first':
+            self.mosidata |= mosi << (ws - 1 - self.bitcount)
+        else:
+            self.mosidata |= mosi << self.bitcount
+
+        # Receive MISO bit into our shift register.
+        if self.options['bitorder'] == 'msb-first':
+            self.misodata |= miso << (ws - 1 - self.bitcount)
+        else:
+            self.misodata |= miso << self.bitcount
+
+        self.bitcount += 1
+
+        # Continue to receive if not enough bits were received, yet.
+        if self.bitcount != ws:
+            return
+
+        self.put(self.start_sample, self.samplenum, self.out_proto,
+                 ['DATA', self.mosidata, self.misodata])
+        self.put(self.start_sample, self.samplenum, self.out_ann,
+                 [ANN_HEX, ['MOSI: 0x%02x, MISO: 0x%02x' % (self.mosidata,
+                 self.misodata)]])
+
+        if self.cs_was_deasserted_during_data_word:
             self.put(self.start_sample, self.samplenum, self.out_ann,
-                     [ANN_HEX, ['MOSI: 0x%02x, MISO: 0x%02x' % (self.mosidata,
-                     self.misodata)]])
+                     [ANN_HEX, ['WARNING: CS# was deasserted during this '
+                     'SPI data byte!']])
 
-            if self.cs_was_deasserted_during_data_word:
-                self.put(self.start_sample, self.samplenum, self.out_ann,
-                         [ANN_HEX, ['WARNING: CS# was deasserted during this '
-                         'SPI data byte!']])
+        # Reset decoder state.
+        self.mosidata = 0
+        self.misodata = 0
+        self.bitcount = 0
 
-            # Reset decoder state.
-            self.mosidata = 0
-            self.misodata = 0
-            self.bitcount = 0
+        # Keep stats for summary.
+        self.bytesreceived += 1
+
+    # The chunk as a sequence of integers, one per sample, if it can be
+    # read that way: raw (not run-length encoded) samples of a unit size
+    # Python has an integer type for, on a little-endian host.
+    def raw_samples(self, data):
+        fmt = sample_formats.get(data.unitsize)
+        if fmt is None or sys.byteorder != 'little' or \
+           not hasattr(memoryview, 'cast'):
+            return None
+        try:
+            return memoryview(data).cast(fmt)
+        except BufferError:
+            return None
 
-            # Keep stats for summary.
-            self.bytesreceived += 1
+    def decode(self, ss, es, data):
+        # TODO: Either MISO or MOSI could be optional. CS# is optional.
+        samples = self.raw_samples(data)
+        if samples is None:
+            for (self.samplenum, pins) in data:
 
+                # Ignore identical samples early on (for performance reasons).
+                if self.oldpins == pins:
+                    continue
+                self.oldpins = pins
+                self.handle_pins(*pins)
+            return
+
+        # Much faster than iterating over data: skip identical samples with
+        # a plain integer compare, and only pick the pins out of the others.
+        miso, mosi, sck, cs = data.probes
+        start = data.samplenum
+        oldsample = self.oldsample
+        for (i, sample) in enumerate(samples):
+            if sample == oldsample:
+                continue
+            oldsample = sample
+            self.samplenum = start + i
+            self.handle_pins((sample >> miso) & 1, (sample >> mosi) & 1,
+                             (sample >> sck) & 1, (sample >> cs) & 1)
+        self.oldsample = oldsample
@@ -20,6 +20,7 @@
 
 # UART protocol decoder
 
+import math
 import sigrokdecode as srd
 
 # Used for differentiating between the two data directions.
@@ -103,7 +104,6 @@ class Decoder(srd.Decoder):
         self.startsample = [-1, -1]
         self.state = ['WAIT FOR START BIT', 'WAIT FOR START BIT']
         self.oldbit = [None, None]
-        self.oldpins = None
 
     def start(self, metadata):
         self.samplerate = metadata['samplerate']
@@ -117,17 +117,47 @@ class Decoder(srd.Decoder):
     def report(self):
         pass
 
-    # Return true if we reached the middle of the desired bit, false otherwise.
-    def reached_bit(self, rxtx, bitnum):
-        # bitpos is the samplenumber which is in the middle of the
-        # specified UART bit (0 = start bit, 1..x = data, x+1 = parity bit
-        # (if used) or the first stop bit, and so on).
+    # Return the samplenumber which is in the middle of the specified UART
+    # bit (0 = start bit, 1..x = data, x+1 = parity bit (if used) or the
+    # first stop bit, and so on).
+    def bit_pos(self, rxtx, bitnum):
         bitpos = self.frame_start[rxtx] + (self.bit_width / 2.0)
         bitpos += bitnum * self.bit_width
-        if self.samplenum >= bitpos:
+        return bitpos
+
+    # Return true if we reached the middle of the desired bit, false otherwise.
+    def reached_bit(self, rxtx, bitnum):
+        if self.samplenum >= self.bit_pos(rxtx, bitnum):
             return True
         return False
 
+    # Return the number of the bit the current state waits for.
+    def next_bit(self, rxtx):
+        if self.state[rxtx] == 'GET START BIT':
+            return 0
+        elif self.state[rxtx] == 'GET DATA BITS':
+            return self.cur_data_bit[rxtx] + 1
+        elif self.state[rxtx] == 'GET PARITY BIT':
+            # Without parity, this is the stop bit (see get_parity_bit()).
+            return self.options['num_data_bits'] + 1
+        elif self.state[rxtx] == 'GET STOP BITS':
+            skip_parity = 0 if self.options['parity_type'] == 'none' else 1
+            return self.options['num_data_bits'] + 1 + skip_parity
+        else:
+            raise Exception('Invalid state: %s' % self.state[rxtx])
+
+    # Return the wait() condition for the next sample the state machine of
+    # the given line needs to see.
+    def condition(self, rxtx):
+        if self.state[rxtx] == 'WAIT FOR START BIT':
+            # The start bit begins with a falling edge. If the line is low
+            # (e.g. a break), wait for it to go high first, so that every
+            # falling edge is seen.
+            return {rxtx: 'f' if self.oldbit[rxtx] == 1 else 'r'}
+        # Skip right to the middle of the next bit.
+        bitpos = self.bit_pos(rxtx, self.next_bit(rxtx))
+        return {'samplenum': int(math.ceil(bitpos))}
+
     def reached_bit_last(self, rxtx, bitnum):
         bitpos = self.frame_start[rxtx] + ((bitnum + 1) * self.bit_width)
         if self.samplenum >= bitpos:
@@ -215,6 +245,7 @@ class Decoder(srd.Decoder):
         # If no parity is used/configured, skip to the next state immediately.
         if self.options['parity_type'] == 'none':
             self.state[rxtx] = 'GET STOP BITS'
+            self.get_stop_bits(rxtx, signal)
             return
 
         # Skip samples until we're in the middle of the parity bit.
@@ -265,25 +296,32 @@ class Decoder(srd.Decoder):
                  [ANN_ASCII, ['Stop bit', 'Stop', 'P']])
 
     def decode(self, ss, es, data):
-        # TODO: Either RX or TX could be omitted (optional probe).
-        for (self.samplenum, pins) in data:
-
-            # Ignore identical samples early on (for performance reasons).
-            if self.oldpins == pins:
-                continue
-            self.oldpins, (rx, tx) = pins, pins
-
-            # First sample: Save RX/TX value.
-            if self.oldbit[RX] == None:
-                self.oldbit[RX] = rx
-                continue
-            if self.oldbit[TX] == None:
-                self.oldbit[TX] = tx
-                continue
+        # Either RX or TX could be omitted (unused probe).
+        lines = [rxtx for rxtx in (RX, TX) if data.probes[rxtx] != -1]
+        if not lines:
+            return
+
+        # First sample: Save RX/TX values.
+        if self.oldbit[lines[0]] == None:
+            s = self.wait()
+            if s == None:
+                return
+            (self.samplenum, pins) = s
+            for rxtx in lines:
+                self.oldbit[rxtx] = pins[rxtx]
+
+        while True:
+            # Skip to the next sample any of the state machines needs.
+            # Samples in between don't matter: they are neither a start
+            # bit edge nor the middle of a bit.
+            s = self.wait([self.condition(rxtx) for rxtx in lines])
+            if s == None:
+                return
+            (self.samplenum, pins) = s
 
             # State machine.
-            for rxtx in (RX, TX):
-                signal = rx if (rxtx == RX) else tx
+            for rxtx in lines:
+                signal = pins[rxtx]
 
                 if self.state[rxtx] == 'WAIT FOR START BIT':
                     self.wait_for_start_bit(rxtx, self.oldbit[rxtx], signal)
@@ -24,21 +24,42 @@
 
 #include "sigrokdecode.h"
 
+/*--- annotation.c ----------------------------------------------------------*/
+
+struct srd_ann_batch;
+
+SRD_PRIV struct srd_ann_batch *srd_ann_batch_new(void);
+SRD_PRIV void srd_ann_batch_free(struct srd_ann_batch *batch);
+SRD_PRIV struct srd_ann_batch *srd_ann_batch_get(void);
+SRD_PRIV int srd_ann_batch_add(struct srd_ann_batch *batch,
+			       struct srd_pd_output *pdo, uint64_t start_sample,
+			       uint64_t end_sample, int ann_format,
+			       PyObject *py_strlist);
+SRD_PRIV void srd_ann_batch_flush(struct srd_ann_batch *batch);
+SRD_PRIV void srd_ann_batch_flush_merged(struct srd_ann_batch **batches,
+					 unsigned int num_batches);
+SRD_PRIV void srd_ann_batch_cleanup(void);
+
 /*--- controller.c ----------------------------------------------------------*/
 
 SRD_PRIV int srd_decoder_searchpath_add(const char *path);
 SRD_PRIV int srd_inst_start(struct srd_decoder_inst *di, PyObject *args);
 SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
-			     const struct srd_decoder_inst *dec,
-			     const uint8_t *inbuf, uint64_t inbuflen);
+			     struct srd_decoder_inst *dec,
+			     const uint8_t *inbuf, uint64_t inbuflen,
+			     const uint64_t *runs);
 SRD_PRIV void srd_inst_free(struct srd_decoder_inst *di);
 SRD_PRIV void srd_inst_free_all(GSList *stack);
 SRD_PRIV int srd_inst_pd_output_add(struct srd_decoder_inst *di,
 				    int output_type, const char *output_id);
+SRD_PRIV struct srd_ann_batch *srd_ann_queue_get(void);
 
 /*--- decoder.c -------------------------------------------------------------*/
 
-SRD_PRIV void *srd_pd_output_callback_find(int output_type);
+SRD_PRIV gboolean srd_pd_output_ann_wanted(void);
+SRD_PRIV struct srd_pd_callback *srd_pd_output_callback_find(int output_type);
+SRD_PRIV struct srd_pd_batch_callback *srd_pd_output_batch_callback_find(
+		int output_type);
 
 /*--- exception.c -----------------------------------------------------------*/
 
@@ -53,6 +74,11 @@ SRD_PRIV int srd_info(const char *format, ...);
 SRD_PRIV int srd_warn(const char *format, ...);
 SRD_PRIV int srd_err(const char *format, ...);
 
+/*--- type_logic.c ----------------------------------------------------------*/
+
+SRD_PRIV uint64_t srd_logic_value(srd_logic *logic, uint64_t index);
+SRD_PRIV PyObject *srd_logic_sample(srd_logic *logic, uint64_t index);
+
 /*--- util.c ----------------------------------------------------------------*/
 
 SRD_PRIV int py_attr_as_str(const PyObject *py_obj, const char *attr,
@@ -0,0 +1,499 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run the spi, i2c and uart decoders over generated captures, through the
+ * public API the way a frontend does, and report their throughput.
+ *
+ * Every case also prints the number of annotations and a hash over them,
+ * so runs before and after a change to a decoder or to the decoding core
+ * can be checked for identical output. The uart cases additionally count
+ * how many of the bytes sent on RX came out of the decoder correctly.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <glib.h>
+
+#define SAMPLERATE 1000000
+#define NUM_SAMPLES (4 * 1024 * 1024)
+#define CHUNK_SIZE (256 * 1024)
+
+/* Probe assignment in the generated captures (unit size 1). */
+#define SPI_MISO 0
+#define SPI_MOSI 1
+#define SPI_SCK 2
+#define SPI_CS 3
+#define I2C_SCL 4
+#define I2C_SDA 5
+#define UART_RX 6
+#define UART_TX 7
+
+/* Samples per half SPI clock, and per quarter I2C clock. */
+#define SPI_HALF 4
+#define I2C_QUARTER 4
+
+#define UART_BAUDRATE 115200
+
+struct stack {
+	const char *decoder;
+	/* "probe=num,..." and "option=value,...", as sigrok-cli takes them. */
+	const char *probes;
+	const char *options;
+};
+
+struct bench_case {
+	const char *name;
+	const uint8_t *buf;
+	int rle;
+	struct stack stacks[4];
+	/* Bytes sent on the uart RX line, to check the decoder against. */
+	const GByteArray *sent;
+};
+
+struct result {
+	uint64_t num_ann;
+	uint64_t hash;
+	/* Bytes the uart decoder reported on RX, in order. */
+	GByteArray *rx_bytes;
+};
+
+/* Set or clear one probe in samples [start, end). */
+static void set_level(uint8_t *buf, uint64_t start, uint64_t end,
+		      int probe, int level)
+{
+	uint64_t i;
+
+	for (i = start; i < end && i < NUM_SAMPLES; i++) {
+		if (level)
+			buf[i] |= 1 << probe;
+		else
+			buf[i] &= ~(1 << probe);
+	}
+}
+
+/* SPI mode 0 transfers of 1-8 bytes each, with idle gaps in between. */
+static void gen_spi(uint8_t *buf, GRand *rand)
+{
+	uint64_t s, gap;
+	int n, bit, byte_mosi, byte_miso;
+
+	s = 0;
+	while (s < NUM_SAMPLES) {
+		gap = g_rand_int_range(rand, 16, 400);
+		set_level(buf, s, s + gap, SPI_CS, 1);
+		s += gap + SPI_HALF;
+		for (n = g_rand_int_range(rand, 1, 9); n > 0; n--) {
+			byte_mosi = g_rand_int_range(rand, 0, 256);
+			byte_miso = g_rand_int_range(rand, 0, 256);
+			for (bit = 7; bit >= 0; bit--) {
+				set_level(buf, s, s + 2 * SPI_HALF, SPI_MOSI,
+					  byte_mosi & (1 << bit));
+				set_level(buf, s, s + 2 * SPI_HALF, SPI_MISO,
+					  byte_miso & (1 << bit));
+				set_level(buf, s + SPI_HALF, s + 2 * SPI_HALF,
+					  SPI_SCK, 1);
+				s += 2 * SPI_HALF;
+			}
+		}
+		s += SPI_HALF;
+	}
+}
+
+/* One I2C bit: SDA settles while SCL is low, then SCL pulses high. */
+static uint64_t i2c_bit(uint8_t *buf, uint64_t s, int level)
+{
+	set_level(buf, s, s + 4 * I2C_QUARTER, I2C_SDA, level);
+	set_level(buf, s + I2C_QUARTER, s + 3 * I2C_QUARTER, I2C_SCL, 1);
+	return s + 4 * I2C_QUARTER;
+}
+
+/* I2C writes of an address and 1-4 data bytes, each acknowledged. */
+static void gen_i2c(uint8_t *buf, GRand *rand)
+{
+	uint64_t s, gap;
+	int n, bit, byte;
+
+	s = 0;
+	while (s < NUM_SAMPLES) {
+		/* Idle bus, then a start condition: SDA falls before SCL. */
+		gap = g_rand_int_range(rand, 32, 600);
+		set_level(buf, s, s + gap + I2C_QUARTER, I2C_SCL, 1);
+		set_level(buf, s, s + gap, I2C_SDA, 1);
+		s += gap + 2 * I2C_QUARTER;
+		for (n = g_rand_int_range(rand, 2, 6); n > 0; n--) {
+			byte = g_rand_int_range(rand, 0, 256);
+			for (bit = 7; bit >= 0; bit--)
+				s = i2c_bit(buf, s, byte & (1 << bit));
+			s = i2c_bit(buf, s, 0);
+		}
+		/* Stop condition: SCL rises, then SDA. */
+		set_level(buf, s + I2C_QUARTER, s + 3 * I2C_QUARTER, I2C_SCL, 1);
+		set_level(buf, s + 2 * I2C_QUARTER, s + 3 * I2C_QUARTER,
+			  I2C_SDA, 1);
+		s += 3 * I2C_QUARTER;
+	}
+}
+
+/*
+ * 8N1 frames on one UART line, with idle gaps of up to max_gap samples.
+ * Returns the bytes sent.
+ */
+static GByteArray *gen_uart_line(uint8_t *buf, GRand *rand, int probe,
+				 int max_gap)
+{
+	GByteArray *sent;
+	double bit_width, start;
+	uint64_t s, e;
+	uint8_t byte;
+	int bit, level;
+
+	sent = g_byte_array_new();
+	bit_width = (double)SAMPLERATE / UART_BAUDRATE;
+	set_level(buf, 0, NUM_SAMPLES, probe, 1);
+	start = 16;
+	while (start + 11 * bit_width < NUM_SAMPLES) {
+		byte = g_rand_int_range(rand, 0, 256);
+		g_byte_array_append(sent, &byte, 1);
+		for (bit = 0; bit < 10; bit++) {
+			if (bit == 0)
+				level = 0;
+			else if (bit == 9)
+				level = 1;
+			else
+				level = byte & (1 << (bit - 1));
+			s = (uint64_t)(start + bit * bit_width + 0.5);
+			e = (uint64_t)(start + (bit + 1) * bit_width + 0.5);
+			set_level(buf, s, e, probe, level);
+		}
+		start += 10 * bit_width + g_rand_int_range(rand, 0, max_gap);
+	}
+
+	return sent;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p;
+	size_t i;
+
+	for (p = data, i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Where the annotations of the running case go. */
+static struct result *cur_result;
+
+static void ann_batch(struct srd_proto_data *pdata, unsigned int num_pdata,
+		      void *cb_data)
+{
+	struct result *res;
+	char **ann, *end;
+	unsigned long byte;
+	unsigned int i;
+	int j;
+
+	(void)cb_data;
+
+	res = cur_result;
+	for (i = 0; i < num_pdata; i++) {
+		res->num_ann++;
+		res->hash = fnv1a(res->hash, &pdata[i].start_sample,
+				  sizeof(uint64_t));
+		res->hash = fnv1a(res->hash, &pdata[i].end_sample,
+				  sizeof(uint64_t));
+		res->hash = fnv1a(res->hash, &pdata[i].ann_format,
+				  sizeof(int));
+		ann = pdata[i].data;
+		for (j = 0; ann[j]; j++)
+			res->hash = fnv1a(res->hash, ann[j], strlen(ann[j]) + 1);
+
+		/* The uart decoder's hex annotation, e.g. "RX: 0x41". */
+		if (!strcmp(pdata[i].pdo->proto_id, "uart")
+		    && pdata[i].ann_format == 2
+		    && g_str_has_prefix(ann[0], "RX: 0x")) {
+			byte = strtoul(ann[0] + 6, &end, 16);
+			g_byte_array_append(res->rx_bytes,
+					    (uint8_t[]){ byte }, 1);
+		}
+	}
+}
+
+/* Turn "key=value,..." into a hash table, the way sigrok-cli does. */
+static GHashTable *parse_args(const char *args)
+{
+	GHashTable *hash;
+	char **pairs, **kv;
+	int i;
+
+	hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	pairs = g_strsplit(args, ",", 0);
+	for (i = 0; pairs[i]; i++) {
+		if (!*pairs[i])
+			continue;
+		kv = g_strsplit(pairs[i], "=", 2);
+		g_hash_table_insert(hash, g_strdup(kv[0]), g_strdup(kv[1]));
+		g_strfreev(kv);
+	}
+	g_strfreev(pairs);
+
+	return hash;
+}
+
+/* Send the capture in chunks, either as is or as runs of equal samples. */
+static int send_capture(const uint8_t *buf, int rle)
+{
+	uint64_t *lengths, start, end, i;
+	uint8_t *values;
+	int num_runs, ret;
+
+	if (!rle) {
+		for (start = 0; start < NUM_SAMPLES; start += CHUNK_SIZE) {
+			ret = srd_session_send(start, buf + start, CHUNK_SIZE);
+			if (ret != SRD_OK)
+				return ret;
+		}
+		return SRD_OK;
+	}
+
+	values = g_malloc(CHUNK_SIZE);
+	lengths = g_malloc(CHUNK_SIZE * sizeof(uint64_t));
+	ret = SRD_OK;
+	for (start = 0; start < NUM_SAMPLES && ret == SRD_OK;
+	     start += CHUNK_SIZE) {
+		end = start + CHUNK_SIZE;
+		num_runs = 0;
+		for (i = start; i < end; i++) {
+			if (num_runs && values[num_runs - 1] == buf[i]) {
+				lengths[num_runs - 1]++;
+			} else {
+				values[num_runs] = buf[i];
+				lengths[num_runs++] = 1;
+			}
+		}
+		ret = srd_session_send_rle(start, values, lengths, num_runs);
+	}
+	g_free(values);
+	g_free(lengths);
+
+	return ret;
+}
+
+/* How many bytes the decoder got right, in order, out of those sent. */
+static void report_uart(const char *name, const GByteArray *sent,
+			const GByteArray *decoded)
+{
+	unsigned int i, ok;
+
+	for (i = ok = 0; i < sent->len && i < decoded->len; i++)
+		ok += sent->data[i] == decoded->data[i];
+	printf("%-40s %u of %u RX bytes decoded correctly (%u reported)\n",
+	       name, ok, sent->len, decoded->len);
+}
+
+/*
+ * Decode one case and print its results. Every case runs in a process of
+ * its own, as libsigrokdecode can't be shut down and started again in the
+ * same process reliably.
+ */
+static int run_case(const struct bench_case *bc)
+{
+	struct srd_decoder_inst *di;
+	struct result res;
+	GHashTable *options, *probes;
+	char id[32];
+	double t;
+	int i, ret;
+
+	if (srd_init(DECODERS_SRCDIR) != SRD_OK)
+		return 1;
+
+	memset(&res, 0, sizeof(res));
+	res.hash = 0xcbf29ce484222325ULL;
+	res.rx_bytes = g_byte_array_new();
+	cur_result = &res;
+	srd_pd_output_batch_callback_add(SRD_OUTPUT_ANN, ann_batch, NULL);
+
+	ret = 1;
+	for (i = 0; i < 4 && bc->stacks[i].decoder; i++) {
+		if (!srd_decoder_get_by_id(bc->stacks[i].decoder)
+		    && srd_decoder_load(bc->stacks[i].decoder) != SRD_OK)
+			goto out;
+		options = parse_args(bc->stacks[i].options);
+		snprintf(id, sizeof(id), "%s-%d", bc->stacks[i].decoder, i);
+		g_hash_table_insert(options, g_strdup("id"), g_strdup(id));
+		di = srd_inst_new(bc->stacks[i].decoder, options);
+		g_hash_table_destroy(options);
+		if (!di)
+			goto out;
+		probes = parse_args(bc->stacks[i].probes);
+		ret = srd_inst_probe_set_all(di, probes);
+		g_hash_table_destroy(probes);
+		if (ret != SRD_OK) {
+			ret = 1;
+			goto out;
+		}
+		ret = 1;
+	}
+
+	if (srd_session_start(8, 1, SAMPLERATE) != SRD_OK)
+		goto out;
+
+	t = g_get_monotonic_time() / 1000000.0;
+	if (send_capture(bc->buf, bc->rle) != SRD_OK)
+		goto out;
+	t = g_get_monotonic_time() / 1000000.0 - t;
+
+	printf("%-40s %8.2f Msamples/s %8" PRIu64 " ann  hash %016"
+	       PRIx64 "\n", bc->name, NUM_SAMPLES / t / 1000000,
+	       res.num_ann, res.hash);
+	if (bc->sent)
+		report_uart(bc->name, bc->sent, res.rx_bytes);
+	ret = 0;
+
+out:
+	if (ret)
+		printf("%-40s FAILED\n", bc->name);
+	g_byte_array_free(res.rx_bytes, TRUE);
+	srd_exit();
+
+	return ret;
+}
+
+#define SPI_PROBES "miso=0,mosi=1,sck=2,cs=3"
+#define I2C_PROBES "scl=4,sda=5"
+#define UART_PROBES "rx=6,tx=7"
+
+#define NUM_CASES 8
+
+int main(int argc, char **argv)
+{
+	struct bench_case cases[NUM_CASES];
+	uint8_t *spi, *i2c, *uart, *uart_idle, *all;
+	GByteArray *sent, *sent_idle;
+	GRand *rand;
+	GError *error;
+	char *args[3], num[16], *out[NUM_CASES];
+	const char *hash_raw, *hash_rle;
+	unsigned int i;
+	int ret, status;
+
+	spi = g_malloc0(NUM_SAMPLES);
+	i2c = g_malloc0(NUM_SAMPLES);
+	uart = g_malloc0(NUM_SAMPLES);
+	uart_idle = g_malloc0(NUM_SAMPLES);
+	all = g_malloc0(NUM_SAMPLES);
+	rand = g_rand_new_with_seed(1);
+	gen_spi(spi, rand);
+	gen_i2c(i2c, rand);
+	sent = gen_uart_line(uart, rand, UART_RX, 400);
+	g_byte_array_free(gen_uart_line(uart, rand, UART_TX, 4000), TRUE);
+	sent_idle = gen_uart_line(uart_idle, rand, UART_RX, 40000);
+	set_level(uart_idle, 0, NUM_SAMPLES, UART_TX, 1);
+	g_rand_free(rand);
+	for (i = 0; i < NUM_SAMPLES; i++)
+		all[i] = spi[i] | i2c[i] | uart[i];
+
+	memset(cases, 0, sizeof(cases));
+	cases[0] = (struct bench_case){ "spi", spi, 0,
+		{ { "spi", SPI_PROBES, "" } } };
+	cases[1] = (struct bench_case){ "i2c", i2c, 0,
+		{ { "i2c", I2C_PROBES, "" } } };
+	cases[2] = (struct bench_case){ "uart", uart, 0,
+		{ { "uart", UART_PROBES, "" } }, sent };
+	cases[3] = (struct bench_case){ "uart (run-length encoded)", uart, 1,
+		{ { "uart", UART_PROBES, "" } }, sent };
+	cases[4] = (struct bench_case){ "uart (mostly idle)", uart_idle, 0,
+		{ { "uart", UART_PROBES, "" } }, sent_idle };
+	cases[5] = (struct bench_case){ "spi, spi, i2c (3 stacks)", all, 0,
+		{ { "spi", SPI_PROBES, "" },
+		  { "spi", SPI_PROBES, "cpha=1" },
+		  { "i2c", I2C_PROBES, "" } } };
+	cases[6] = (struct bench_case){ "spi, spi, i2c, uart (4 stacks)", all, 0,
+		{ { "spi", SPI_PROBES, "" },
+		  { "spi", SPI_PROBES, "cpha=1" },
+		  { "i2c", I2C_PROBES, "" },
+		  { "uart", UART_PROBES, "" } } };
+	cases[7] = (struct bench_case){ "uart, uart (2 stacks, mostly idle)",
+		uart_idle, 0,
+		{ { "uart", UART_PROBES, "" },
+		  { "uart", UART_PROBES, "" } } };
+
+	/* Child: run the one case asked for. */
+	if (argc == 2) {
+		i = strtoul(argv[1], NULL, 10);
+		ret = i < NUM_CASES ? run_case(&cases[i]) : 1;
+		goto out;
+	}
+
+	ret = 0;
+	for (i = 0; i < NUM_CASES; i++) {
+		snprintf(num, sizeof(num), "%u", i);
+		args[0] = argv[0];
+		args[1] = num;
+		args[2] = NULL;
+		error = NULL;
+		out[i] = NULL;
+		if (!g_spawn_sync(NULL, args, NULL, 0, NULL, NULL, &out[i],
+				  NULL, &status, &error)) {
+			printf("Failed to run %s: %s\n", argv[0],
+			       error->message);
+			g_error_free(error);
+			ret = 1;
+			continue;
+		}
+		fputs(out[i], stdout);
+		fflush(stdout);
+		if (status)
+			ret = 1;
+	}
+
+	/* The uart decoder must not care how its input was encoded. */
+	if (!ret) {
+		hash_raw = strstr(out[2], "hash ");
+		hash_rle = strstr(out[3], "hash ");
+		if (!hash_raw || !hash_rle
+		    || strncmp(hash_raw, hash_rle, strlen("hash ") + 16)) {
+			printf("uart: run-length encoded input decoded "
+			       "differently\n");
+			ret = 1;
+		}
+	}
+
+	for (i = 0; i < NUM_CASES; i++)
+		g_free(out[i]);
+
+out:
+	g_byte_array_free(sent, TRUE);
+	g_byte_array_free(sent_idle, TRUE);
+	g_free(spi);
+	g_free(i2c);
+	g_free(uart);
+	g_free(uart_idle);
+	g_free(all);
+
+	return ret;
+}
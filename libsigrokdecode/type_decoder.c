@@ -21,6 +21,7 @@
 #include "sigrokdecode-internal.h"
 #include "config.h"
 #include <inttypes.h>
+#include <string.h>
 
 /* This is only used for nicer srd_dbg() output. */
 static const char *OUTPUT_TYPES[] = {
@@ -30,7 +31,7 @@ static const char *OUTPUT_TYPES[] = {
 };
 
 static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
-			 int *ann_format, char ***ann)
+			 int *ann_format, PyObject **ann)
 {
 	PyObject *py_tmp;
 	struct srd_pd_output *pdo;
@@ -77,11 +78,7 @@ static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
 			"second element was not a list.", di->decoder->name);
 		return SRD_ERR_PYTHON;
 	}
-	if (py_strlist_to_char(py_tmp, ann) != SRD_OK) {
-		srd_err("Protocol decoder %s submitted annotation list, but "
-			"second element was malformed.", di->decoder->name);
-		return SRD_ERR_PYTHON;
-	}
+	*ann = py_tmp;
 
 	return SRD_OK;
 }
@@ -91,11 +88,11 @@ static PyObject *Decoder_put(PyObject *self, PyObject *args)
 	GSList *l;
 	PyObject *data, *py_res;
 	struct srd_decoder_inst *di, *next_di;
+	PyObject *py_strlist;
 	struct srd_pd_output *pdo;
-	struct srd_proto_data *pdata;
+	struct srd_ann_batch *batch;
 	uint64_t start_sample, end_sample;
-	int output_id;
-	void (*cb)();
+	int output_id, ann_format;
 
 	if (!(di = srd_inst_find_by_obj(NULL, self))) {
 		/* Shouldn't happen. */
@@ -124,25 +121,24 @@ static PyObject *Decoder_put(PyObject *self, PyObject *args)
 		 di->inst_id, start_sample, end_sample,
 		 OUTPUT_TYPES[pdo->output_type], output_id);
 
-	if (!(pdata = g_try_malloc0(sizeof(struct srd_proto_data)))) {
-		srd_err("Failed to g_malloc() struct srd_proto_data.");
-		return NULL;
-	}
-	pdata->start_sample = start_sample;
-	pdata->end_sample = end_sample;
-	pdata->pdo = pdo;
-
 	switch (pdo->output_type) {
 	case SRD_OUTPUT_ANN:
 		/* Annotations are only fed to callbacks. */
-		if ((cb = srd_pd_output_callback_find(pdo->output_type))) {
-			/* Annotations need converting from PyObject. */
-			if (convert_pyobj(di, data, &pdata->ann_format,
-					  (char ***)&pdata->data) != SRD_OK) {
-				/* An error was already logged. */
-				break;
-			}
-			cb(pdata);
+		if (!srd_pd_output_ann_wanted())
+			break;
+		if (convert_pyobj(di, data, &ann_format, &py_strlist) != SRD_OK) {
+			/* An error was already logged. */
+			break;
+		}
+		/* They are collected, and delivered in batches. */
+		if (!(batch = srd_ann_batch_get()))
+			break;
+		if (srd_ann_batch_add(batch, pdo, start_sample, end_sample,
+				      ann_format, py_strlist) != SRD_OK) {
+			srd_err("Protocol decoder %s submitted annotation "
+				"list, but second element was malformed.",
+				di->decoder->name);
+			return NULL;
 		}
 		break;
 	case SRD_OUTPUT_PROTO:
@@ -171,8 +167,6 @@ static PyObject *Decoder_put(PyObject *self, PyObject *args)
 		break;
 	}
 
-	g_free(pdata);
-
 	Py_RETURN_NONE;
 }
 
@@ -202,10 +196,347 @@ static PyObject *Decoder_add(PyObject *self, PyObject *args)
 	return ret;
 }
 
+/* Maximum number of alternative conditions a PD can pass to wait(). */
+#define MAX_WAIT_TERMS 16
+
+/* Scans at least this many samples long are done without holding the GIL. */
+#define WAIT_UNLOCKED_MIN 4096
+
+/*
+ * One condition of a wait() call, in terms of the raw sample bits. All of
+ * its parts must match for the condition to match.
+ */
+struct wait_term {
+	uint64_t level_mask;
+	uint64_t level_value;
+	/* Bits which must change; rising/falling edges are a subset. */
+	uint64_t edge_mask;
+	uint64_t rise_mask;
+	uint64_t fall_mask;
+	/* Match at this absolute sample number, if has_samplenum is set. */
+	uint64_t samplenum;
+	gboolean has_samplenum;
+};
+
+static int parse_wait_term(struct srd_decoder_inst *di, PyObject *py_dict,
+			   struct wait_term *term)
+{
+	PyObject *py_key, *py_value;
+	Py_ssize_t pos;
+	const char *key, *cond;
+	uint64_t bit;
+	long probe;
+
+	if (!PyDict_Check(py_dict)) {
+		PyErr_SetString(PyExc_TypeError, "wait() conditions must be "
+				"a dict or a list of dicts");
+		return SRD_ERR_ARG;
+	}
+
+	memset(term, 0, sizeof(struct wait_term));
+	pos = 0;
+	while (PyDict_Next(py_dict, &pos, &py_key, &py_value)) {
+		if (PyUnicode_Check(py_key)) {
+			key = PyUnicode_AsUTF8(py_key);
+			if (!key || strcmp(key, "samplenum")
+			    || !PyLong_Check(py_value)) {
+				PyErr_SetString(PyExc_ValueError, "invalid "
+						"wait() condition key");
+				return SRD_ERR_ARG;
+			}
+			term->samplenum = PyLong_AsUnsignedLongLong(py_value);
+			term->has_samplenum = TRUE;
+			continue;
+		}
+
+		probe = PyLong_Check(py_key) ? PyLong_AsLong(py_key) : -1;
+		if (probe < 0 || probe >= di->dec_num_probes
+		    || di->dec_probemap[probe] == -1) {
+			PyErr_SetString(PyExc_ValueError, "wait() condition "
+					"on invalid or unused probe");
+			return SRD_ERR_ARG;
+		}
+		bit = (uint64_t)1 << di->dec_probemap[probe];
+
+		cond = PyUnicode_Check(py_value) ? PyUnicode_AsUTF8(py_value)
+						 : NULL;
+		if (!cond || strlen(cond) != 1) {
+			PyErr_SetString(PyExc_ValueError, "wait() probe "
+					"condition must be one of 'l', 'h', "
+					"'r', 'f', 'e'");
+			return SRD_ERR_ARG;
+		}
+		switch (cond[0]) {
+		case 'l':
+			term->level_mask |= bit;
+			break;
+		case 'h':
+			term->level_mask |= bit;
+			term->level_value |= bit;
+			break;
+		case 'r':
+			term->edge_mask |= bit;
+			term->rise_mask |= bit;
+			break;
+		case 'f':
+			term->edge_mask |= bit;
+			term->fall_mask |= bit;
+			break;
+		case 'e':
+			term->edge_mask |= bit;
+			break;
+		default:
+			PyErr_SetString(PyExc_ValueError, "wait() probe "
+					"condition must be one of 'l', 'h', "
+					"'r', 'f', 'e'");
+			return SRD_ERR_ARG;
+		}
+	}
+
+	return SRD_OK;
+}
+
+static inline uint64_t load_sample(const uint8_t *buf, uint64_t index,
+				   int unitsize)
+{
+	uint64_t sample;
+
+	sample = 0;
+	memcpy(&sample, buf + index * unitsize, unitsize);
+
+	return sample;
+}
+
+/*
+ * Return the index of the first sample in [i, end) which differs from
+ * 'prev' in any of the bits in 'mask', or 'end' if there is none. For unit
+ * sizes which pack evenly into a 64-bit word, whole words of samples are
+ * compared at once.
+ */
+static uint64_t skip_unchanged(const uint8_t *buf, uint64_t i, uint64_t end,
+			       int unitsize, uint64_t prev, uint64_t mask)
+{
+	uint64_t word, lanes, wmask, wvalue;
+	int per_word;
+
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4) {
+		per_word = 8 / unitsize;
+		lanes = unitsize == 1 ? 0x0101010101010101ULL :
+			unitsize == 2 ? 0x0001000100010001ULL :
+					0x0000000100000001ULL;
+		wmask = mask * lanes;
+		wvalue = (prev & mask) * lanes;
+		while (i + per_word <= end) {
+			memcpy(&word, buf + i * unitsize, 8);
+			if ((word & wmask) != wvalue)
+				break;
+			i += per_word;
+		}
+	}
+
+	while (i < end && !((load_sample(buf, i, unitsize) ^ prev) & mask))
+		i++;
+
+	return i;
+}
+
+static gboolean term_matches(const struct wait_term *term, uint64_t cur,
+			     uint64_t prev)
+{
+	return (cur & term->level_mask) == term->level_value
+	       && ((cur ^ prev) & term->edge_mask) == term->edge_mask
+	       && (cur & term->rise_mask) == term->rise_mask
+	       && (cur & term->fall_mask) == 0;
+}
+
+/*
+ * Find the first sample in [i, limit) matching any of the conditions, or
+ * return 'limit'. If 'edges' is non-zero, every condition needs a change
+ * in one of those bits, so unchanged samples are skipped.
+ */
+static uint64_t wait_scan(const uint8_t *buf, uint64_t i, uint64_t limit,
+			  int unitsize, uint64_t prev,
+			  const struct wait_term *terms, int num_terms,
+			  uint64_t edges)
+{
+	uint64_t cur;
+	int t;
+
+	while (i < limit) {
+		if (edges) {
+			i = skip_unchanged(buf, i, limit, unitsize, prev, edges);
+			if (i == limit)
+				break;
+		}
+		cur = load_sample(buf, i, unitsize);
+		for (t = 0; t < num_terms; t++) {
+			if (!terms[t].has_samplenum
+			    && term_matches(&terms[t], cur, prev))
+				return i;
+		}
+		prev = cur;
+		i++;
+	}
+
+	return limit;
+}
+
+/*
+ * Like wait_scan(), for run-length encoded input. Nothing changes within
+ * a run, so only its first sample (and its second one, for conditions
+ * which don't need an edge) has to be checked.
+ */
+static uint64_t wait_scan_rle(srd_logic *logic, uint64_t i, uint64_t limit,
+			      uint64_t prev, const struct wait_term *terms,
+			      int num_terms)
+{
+	uint64_t cur, run_end;
+	int t;
+
+	while (i < limit) {
+		cur = srd_logic_value(logic, i);
+		run_end = logic->run_start + logic->runs[logic->run];
+		for (t = 0; t < num_terms; t++) {
+			if (!terms[t].has_samplenum
+			    && term_matches(&terms[t], cur, prev))
+				return i;
+		}
+		if (i + 1 < MIN(run_end, limit)) {
+			for (t = 0; t < num_terms; t++) {
+				if (!terms[t].has_samplenum
+				    && term_matches(&terms[t], cur, cur))
+					return i + 1;
+			}
+		}
+		prev = cur;
+		i = run_end;
+	}
+
+	return limit;
+}
+
+static PyObject *Decoder_wait(PyObject *self, PyObject *args)
+{
+	PyObject *py_conds, *py_term;
+	struct srd_decoder_inst *di;
+	struct wait_term terms[MAX_WAIT_TERMS];
+	srd_logic *logic;
+	uint64_t i, end, limit, idx, prev, edges;
+	int num_terms, unitsize, t;
+	gboolean edges_only;
+
+	if (!(di = srd_inst_find_by_obj(NULL, self))) {
+		PyErr_SetString(PyExc_Exception, "decoder instance not found");
+		return NULL;
+	}
+
+	if (!(logic = (srd_logic *)di->py_logic)) {
+		PyErr_SetString(PyExc_Exception, "wait() can only be called "
+				"from decode() on logic input");
+		return NULL;
+	}
+	di->uses_wait = TRUE;
+
+	py_conds = NULL;
+	if (!PyArg_ParseTuple(args, "|O", &py_conds))
+		return NULL;
+
+	/* A dict is a single condition, a list holds alternatives. */
+	num_terms = 0;
+	if (py_conds && PyList_Check(py_conds)) {
+		if (PyList_Size(py_conds) > MAX_WAIT_TERMS) {
+			PyErr_SetString(PyExc_ValueError, "too many wait() "
+					"conditions");
+			return NULL;
+		}
+		for (t = 0; t < PyList_Size(py_conds); t++) {
+			py_term = PyList_GetItem(py_conds, t);
+			if (parse_wait_term(di, py_term, &terms[t]) != SRD_OK)
+				return NULL;
+		}
+		num_terms = t;
+	} else if (py_conds && py_conds != Py_None) {
+		if (parse_wait_term(di, py_conds, &terms[0]) != SRD_OK)
+			return NULL;
+		num_terms = 1;
+	}
+
+	unitsize = di->data_unitsize;
+	i = logic->itercnt;
+	end = logic->num_samples;
+	if (i >= end)
+		Py_RETURN_NONE;
+
+	/* No conditions: just the next sample, like iterating. */
+	if (num_terms == 0)
+		return srd_logic_sample(logic, i);
+
+	/*
+	 * Sample number conditions end the scan early. If every other
+	 * condition needs an edge, only samples where something changed
+	 * need to be looked at.
+	 */
+	limit = end;
+	edges = 0;
+	edges_only = TRUE;
+	for (t = 0; t < num_terms; t++) {
+		if (terms[t].has_samplenum) {
+			idx = terms[t].samplenum > logic->start_samplenum + i ?
+			      terms[t].samplenum - logic->start_samplenum : i;
+			limit = MIN(limit, idx);
+			continue;
+		}
+		if (!terms[t].edge_mask)
+			edges_only = FALSE;
+		edges |= terms[t].edge_mask;
+	}
+
+	if (i > 0)
+		prev = srd_logic_value(logic, i - 1);
+	else if (di->last_sample_valid)
+		prev = di->last_sample;
+	else
+		prev = srd_logic_value(logic, i);
+
+	/*
+	 * The scan doesn't touch any Python objects, so let other decoder
+	 * stacks run Python code meanwhile, if it's worth the switch.
+	 */
+	if (edges_only && !edges) {
+		/* Only sample number conditions. */
+		i = limit;
+	} else if (logic->runs) {
+		i = wait_scan_rle(logic, i, limit, prev, terms, num_terms);
+	} else if (limit - i >= WAIT_UNLOCKED_MIN) {
+		Py_BEGIN_ALLOW_THREADS
+		i = wait_scan(logic->inbuf, i, limit, unitsize, prev, terms,
+			      num_terms, edges_only ? edges : 0);
+		Py_END_ALLOW_THREADS
+	} else {
+		i = wait_scan(logic->inbuf, i, limit, unitsize, prev, terms,
+			      num_terms, edges_only ? edges : 0);
+	}
+
+	/* A condition matched, or a sample number was reached. */
+	if (i < end)
+		return srd_logic_sample(logic, i);
+
+	/* Nothing matched in this chunk. */
+	logic->itercnt = end;
+	Py_RETURN_NONE;
+}
+
 static PyMethodDef Decoder_methods[] = {
 	{"put", Decoder_put, METH_VARARGS,
 	 "Accepts a dictionary with the following keys: startsample, endsample, data"},
 	{"add", Decoder_add, METH_VARARGS, "Create a new output stream"},
+	{"wait", Decoder_wait, METH_VARARGS,
+	 "Skip to the next sample in the logic input matching the conditions, "
+	 "and return it as [samplenum, samples]. Conditions are a dict or a "
+	 "list of alternative dicts, mapping probe numbers to 'l' (low), "
+	 "'h' (high), 'r' (rising edge), 'f' (falling edge) or 'e' (either "
+	 "edge), and/or 'samplenum' to an absolute sample number. Returns "
+	 "None if nothing matches in the rest of the current chunk."},
 	{NULL, NULL, 0, NULL}
 };
 
@@ -24,32 +24,70 @@
 
 static PyObject *srd_logic_iter(PyObject *self)
 {
+	/* The iterator is the object itself, returned as a new reference. */
+	Py_INCREF(self);
+
 	return self;
 }
 
-static PyObject *srd_logic_iternext(PyObject *self)
+/**
+ * Get the probe bits of one sample of a logic chunk.
+ *
+ * In a run-length encoded chunk, the run holding the sample is searched
+ * for from the run of the previous lookup, so going through the samples
+ * in order costs no more than going through the runs.
+ *
+ * @param logic The chunk. Must not be NULL.
+ * @param index The index of the sample in the chunk. Must be in range.
+ *
+ * @return The sample.
+ */
+SRD_PRIV uint64_t srd_logic_value(srd_logic *logic, uint64_t index)
+{
+	uint64_t sample;
+
+	if (logic->runs) {
+		if (index < logic->run_start) {
+			logic->run = 0;
+			logic->run_start = 0;
+		}
+		while (index >= logic->run_start + logic->runs[logic->run]) {
+			logic->run_start += logic->runs[logic->run];
+			logic->run++;
+		}
+		index = logic->run;
+	}
+
+	sample = 0;
+	memcpy(&sample, logic->inbuf + index * logic->di->data_unitsize,
+	       logic->di->data_unitsize);
+
+	return sample;
+}
+
+/**
+ * Prepare the sample list for one sample of a logic chunk, and move the
+ * chunk's iteration position past it.
+ *
+ * @param logic The chunk. Must not be NULL.
+ * @param index The index of the sample in the chunk. Must be in range.
+ *
+ * @return A new reference to the [samplenum, samples] list.
+ */
+SRD_PRIV PyObject *srd_logic_sample(srd_logic *logic, uint64_t index)
 {
 	int i;
 	PyObject *py_samplenum, *py_samples;
-	srd_logic *logic;
 	uint64_t sample;
 	uint8_t probe_samples[SRD_MAX_NUM_PROBES + 1];
 
-	logic = (srd_logic *)self;
-	if (logic->itercnt >= logic->inbuflen / logic->di->data_unitsize) {
-		/* End iteration loop. */
-		return NULL;
-	}
-
 	/*
 	 * Convert the bit-packed sample to an array of bytes, with only 0x01
 	 * and 0x00 values, so the PD doesn't need to do any bitshifting.
 	 */
 
 	/* Get probe bits into the 'sample' variable. */
-	memcpy(&sample,
-	       logic->inbuf + logic->itercnt * logic->di->data_unitsize,
-	       logic->di->data_unitsize);
+	sample = srd_logic_value(logic, index);
 
 	/* All probe values (required + optional) are pre-set to 42. */
 	memset(probe_samples, 42, logic->di->dec_num_probes);
@@ -63,29 +101,169 @@ static PyObject *srd_logic_iternext(PyObject *self)
 		/* A probemap value of -1 means "unused optional probe". */
 		if (logic->di->dec_probemap[i] == -1)
 			continue;
-		probe_samples[i] = sample & (1 << logic->di->dec_probemap[i]) ? 1 : 0;
+		probe_samples[i] = sample & ((uint64_t)1 << logic->di->dec_probemap[i]) ? 1 : 0;
 	}
 
 	/* Prepare the next samplenum/sample list in this iteration. */
 	py_samplenum =
-	    PyLong_FromUnsignedLongLong(logic->start_samplenum +
-					logic->itercnt);
+	    PyLong_FromUnsignedLongLong(logic->start_samplenum + index);
 	PyList_SetItem(logic->sample, 0, py_samplenum);
 	py_samples = PyBytes_FromStringAndSize((const char *)probe_samples,
 					       logic->di->dec_num_probes);
 	PyList_SetItem(logic->sample, 1, py_samples);
 	Py_INCREF(logic->sample);
-	logic->itercnt++;
+	logic->itercnt = index + 1;
 
 	return logic->sample;
 }
 
+static PyObject *srd_logic_iternext(PyObject *self)
+{
+	srd_logic *logic;
+
+	logic = (srd_logic *)self;
+	if (logic->itercnt >= logic->num_samples) {
+		/* End iteration loop. */
+		return NULL;
+	}
+
+	return srd_logic_sample(logic, logic->itercnt);
+}
+
+static void srd_logic_dealloc(PyObject *self)
+{
+	srd_logic *logic;
+
+	logic = (srd_logic *)self;
+	Py_XDECREF(logic->sample);
+	Py_XDECREF(logic->py_inbuf);
+	PyObject_Del(self);
+}
+
+/*
+ * Bulk input: besides iterating over it sample by sample, a PD can access
+ * the whole chunk of raw samples at once through the buffer protocol, e.g.
+ * with memoryview(data). Each sample is 'unitsize' bytes (little-endian),
+ * and 'probes' maps the PD's probes (in order) to bit numbers in a sample,
+ * with -1 for unused optional probes. The input buffer belongs to the
+ * caller of srd_session_send(), so the first export copies the chunk into
+ * a bytes object owned by this object; views a PD keeps after decode()
+ * returns stay valid that way. Run-length encoded chunks can't be accessed
+ * this way; PDs need to iterate over them (or use wait()).
+ */
+static int srd_logic_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+	srd_logic *logic;
+
+	logic = (srd_logic *)self;
+	if (logic->runs) {
+		PyErr_SetString(PyExc_BufferError, "run-length encoded logic "
+				"input has no sample buffer");
+		view->obj = NULL;
+		return -1;
+	}
+
+	if (!logic->py_inbuf) {
+		if (!logic->inbuf) {
+			PyErr_SetString(PyExc_BufferError, "logic input is "
+					"only available during decode()");
+			view->obj = NULL;
+			return -1;
+		}
+		logic->py_inbuf = PyBytes_FromStringAndSize(
+		    (const char *)logic->inbuf, (Py_ssize_t)logic->inbuflen);
+		if (!logic->py_inbuf) {
+			view->obj = NULL;
+			return -1;
+		}
+	}
+
+	if (PyBuffer_FillInfo(view, self, PyBytes_AS_STRING(logic->py_inbuf),
+			      PyBytes_GET_SIZE(logic->py_inbuf), 1, flags) < 0)
+		return -1;
+	logic->exports++;
+
+	return 0;
+}
+
+static void srd_logic_releasebuffer(PyObject *self, Py_buffer *view)
+{
+	srd_logic *logic;
+
+	(void)view;
+
+	logic = (srd_logic *)self;
+	logic->exports--;
+
+	/* Once decode() is done, the copy is only kept for live views. */
+	if (!logic->exports && !logic->inbuf)
+		Py_CLEAR(logic->py_inbuf);
+}
+
+static PyObject *srd_logic_get_unitsize(PyObject *self, void *closure)
+{
+	srd_logic *logic;
+
+	(void)closure;
+
+	logic = (srd_logic *)self;
+
+	return PyLong_FromLong(logic->di->data_unitsize);
+}
+
+static PyObject *srd_logic_get_samplenum(PyObject *self, void *closure)
+{
+	srd_logic *logic;
+
+	(void)closure;
+
+	logic = (srd_logic *)self;
+
+	return PyLong_FromUnsignedLongLong(logic->start_samplenum);
+}
+
+static PyObject *srd_logic_get_probes(PyObject *self, void *closure)
+{
+	PyObject *py_probes;
+	srd_logic *logic;
+	int i;
+
+	(void)closure;
+
+	logic = (srd_logic *)self;
+	if (!(py_probes = PyTuple_New(logic->di->dec_num_probes)))
+		return NULL;
+	for (i = 0; i < logic->di->dec_num_probes; i++)
+		PyTuple_SET_ITEM(py_probes, i,
+				 PyLong_FromLong(logic->di->dec_probemap[i]));
+
+	return py_probes;
+}
+
+static PyBufferProcs srd_logic_as_buffer = {
+	.bf_getbuffer = srd_logic_getbuffer,
+	.bf_releasebuffer = srd_logic_releasebuffer,
+};
+
+static PyGetSetDef srd_logic_getset[] = {
+	{"unitsize", srd_logic_get_unitsize, NULL,
+	 "Number of bytes per sample", NULL},
+	{"samplenum", srd_logic_get_samplenum, NULL,
+	 "Sample number of the first sample in the buffer", NULL},
+	{"probes", srd_logic_get_probes, NULL,
+	 "Bit number of each of the PD's probes, -1 if unused", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
 SRD_PRIV PyTypeObject srd_logic_type = {
 	PyVarObject_HEAD_INIT(NULL, 0)
 	.tp_name = "srd_logic",
 	.tp_basicsize = sizeof(srd_logic),
+	.tp_dealloc = srd_logic_dealloc,
+	.tp_as_buffer = &srd_logic_as_buffer,
 	.tp_flags = Py_TPFLAGS_DEFAULT,
 	.tp_doc = "Sigrokdecode logic sample object",
 	.tp_iter = srd_logic_iter,
 	.tp_iternext = srd_logic_iternext,
+	.tp_getset = srd_logic_getset,
 };
@@ -36,6 +36,9 @@
 
 #define DEFAULT_OUTPUT_FORMAT "bits:width=64"
 
+/* Run-length encoded samples are expanded in chunks of this size. */
+#define RLE_EXPAND_SIZE (64 * 1024)
+
 extern struct sr_hwcap_option sr_hwcap_options[];
 
 static uint64_t limit_samples = 0;
@@ -44,6 +47,8 @@ static struct sr_output_format *output_format = NULL;
 static int default_output_format = FALSE;
 static char *output_format_param = NULL;
 static GHashTable *pd_ann_visible = NULL;
+/* The session file being written, if the output is in session format. */
+static struct sr_session_save *save = NULL;
 
 static gboolean opt_version = FALSE;
 static gint opt_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
@@ -419,11 +424,76 @@ static void show_pd_detail(void)
 	g_strfreev(pdtokens);
 }
 
+/*
+ * Pass run-length encoded samples to an output module, expanding them
+ * first if the module can't handle them as they are.
+ */
+static void output_logic_rle(struct sr_output *o,
+			     const struct sr_datafeed_logic_rle *rle,
+			     FILE *outfile)
+{
+	uint64_t run, run_offset, length, output_len;
+	uint8_t *buf, *output_buf;
+
+	if (o->format->data_rle) {
+		output_buf = NULL;
+		o->format->data_rle(o, rle, &output_buf, &output_len);
+		if (output_buf) {
+			fwrite(output_buf, 1, output_len, outfile);
+			fflush(outfile);
+			g_free(output_buf);
+		}
+		return;
+	}
+
+	if (!o->format->data)
+		return;
+
+	if (!(buf = g_try_malloc(RLE_EXPAND_SIZE))) {
+		g_critical("Sample buffer malloc failed.");
+		return;
+	}
+
+	run = run_offset = 0;
+	while (sr_logic_rle_expand(rle, &run, &run_offset, buf,
+				   RLE_EXPAND_SIZE, &length) == SR_OK
+	       && length > 0) {
+		output_buf = NULL;
+		o->format->data(o, buf, length, &output_buf, &output_len);
+		if (output_buf) {
+			fwrite(output_buf, 1, output_len, outfile);
+			g_free(output_buf);
+		}
+	}
+	fflush(outfile);
+
+	g_free(buf);
+}
+
+/*
+ * Finish the session file, if one is still being written. This normally
+ * happens on SR_DF_END, but the session file is also finished if a run
+ * ended without one.
+ */
+static void save_session_end(void)
+{
+	if (!save)
+		return;
+
+	if (sr_session_save_end(save) != SR_OK)
+		g_critical("Failed to save session.");
+	save = NULL;
+}
+
 static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 {
 	static struct sr_output *o = NULL;
-	static int logic_probelist[SR_MAX_NUM_PROBES] = { 0 };
+	static int logic_probelist[SR_MAX_NUM_PROBES + 1] = { 0 };
 	static struct sr_probe *analog_probelist[SR_MAX_NUM_PROBES];
+	static struct sr_filter *filter = NULL;
+	static int filter_unitsize = 0;
+	static uint8_t *filter_out = NULL;
+	static uint64_t filter_out_size = 0;
 	static uint64_t received_samples = 0;
 	static int unitsize = 0;
 	static int triggered = 0;
@@ -431,13 +501,16 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 	static int num_analog_probes = 0;
 	struct sr_probe *probe;
 	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *logic_rle, rle;
 	struct sr_datafeed_meta_logic *meta_logic;
 	struct sr_datafeed_analog *analog;
 	struct sr_datafeed_meta_analog *meta_analog;
+	const struct sr_transfer_stats *stats;
 	static int num_enabled_analog_probes = 0;
 	int num_enabled_probes, sample_size, ret, i;
-	uint64_t output_len, filter_out_len;
-	uint8_t *output_buf, *filter_out;
+	uint64_t output_len, filter_out_len, num_samples, run, n;
+	uint64_t *lengths;
+	uint8_t *output_buf, *buf;
 
 	/* If the first packet to come in isn't a header, don't even try. */
 	if (packet->type != SR_DF_HEADER && o == NULL)
@@ -484,11 +557,24 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (opt_continuous)
 			g_warning("Device stopped after %" PRIu64 " samples.",
 			       received_samples);
+		if (sr_dev_info_get(dev, SR_DI_TRANSFER_STATS,
+				    (const void **)&stats) == SR_OK)
+			g_debug("cli: Received %" PRIu64 " bytes at %" PRIu64
+				" bytes/s, %" PRIu64 " overruns.", stats->bytes,
+				stats->bytes_per_sec, stats->overruns);
 		sr_session_stop();
+		save_session_end();
 		if (outfile && outfile != stdout)
 			fclose(outfile);
 		g_free(o);
 		o = NULL;
+		if (filter) {
+			sr_filter_destroy(filter);
+			filter = NULL;
+		}
+		g_free(filter_out);
+		filter_out = NULL;
+		filter_out_size = 0;
 		break;
 
 	case SR_DF_TRIGGER:
@@ -508,19 +594,26 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 			if (probe->enabled)
 				logic_probelist[num_enabled_probes++] = probe->index;
 		}
+		logic_probelist[num_enabled_probes] = 0;
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
+		/* The filter is compiled when the first logic packet arrives. */
+		if (filter) {
+			sr_filter_destroy(filter);
+			filter = NULL;
+		}
 
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* output file is in session format, which is
+				 * written out as the samples come in. */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
+				ret = sr_session_save_start(opt_output_file, dev,
+						unitsize, SR_SESSION_CODEC_BITPLANE,
+						&save);
 				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
+					printf("Failed to save session.\n");
 					exit(1);
 				}
 			} else {
@@ -548,9 +641,29 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (limit_samples && received_samples >= limit_samples)
 			break;
 
-		ret = sr_filter_probes(sample_size, unitsize, logic_probelist,
-					   logic->data, logic->length,
-					   &filter_out, &filter_out_len);
+		if (!filter || filter_unitsize != sample_size) {
+			if (filter)
+				sr_filter_destroy(filter);
+			filter = NULL;
+			if (sr_filter_new(sample_size, unitsize, logic_probelist,
+					  &filter) != SR_OK)
+				break;
+			filter_unitsize = sample_size;
+		}
+
+		/* One scratch buffer, grown as needed, for the whole session. */
+		filter_out_len = logic->length / sample_size * unitsize;
+		if (filter_out_len > filter_out_size) {
+			if (!(buf = g_try_realloc(filter_out, filter_out_len))) {
+				g_critical("Filter buffer malloc failed.");
+				break;
+			}
+			filter_out = buf;
+			filter_out_size = filter_out_len;
+		}
+
+		ret = sr_filter_run_into(filter, logic->data, logic->length,
+					 filter_out, &filter_out_len);
 		if (ret != SR_OK)
 			break;
 
@@ -563,14 +676,14 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 				limit_samples * sample_size))
 			filter_out_len = limit_samples * sample_size - received_samples;
 
-		if (dev->datastore)
-			sr_datastore_put(dev->datastore, filter_out,
-					 filter_out_len, sample_size, logic_probelist);
-
-		if (opt_output_file && default_output_format)
+		if (save) {
 			/* saving to a session file, don't need to do anything else
 			 * to this data for now. */
+			if (sr_session_save_append(save, filter_out,
+						   filter_out_len) != SR_OK)
+				sr_session_stop();
 			goto cleanup;
+		}
 
 		if (opt_pds) {
 			if (srd_session_send(received_samples, (uint8_t*)filter_out,
@@ -588,10 +701,93 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 
 		cleanup:
-		g_free(filter_out);
 		received_samples += logic->length / sample_size;
 		break;
 
+	case SR_DF_LOGIC_RLE:
+		logic_rle = packet->payload;
+		g_message("cli: received SR_DF_LOGIC_RLE, %"PRIu64" runs",
+			  logic_rle->num_runs);
+		sample_size = logic_rle->unitsize;
+		if (logic_rle->num_runs == 0)
+			break;
+
+		/* Don't store any samples until triggered. */
+		if (opt_wait_trigger && !triggered)
+			break;
+
+		if (limit_samples && received_samples >= limit_samples)
+			break;
+
+		if (!filter || filter_unitsize != sample_size) {
+			if (filter)
+				sr_filter_destroy(filter);
+			filter = NULL;
+			if (sr_filter_new(sample_size, unitsize, logic_probelist,
+					  &filter) != SR_OK)
+				break;
+			filter_unitsize = sample_size;
+		}
+
+		/* Only the runs' values need filtering, not every sample. */
+		filter_out_len = logic_rle->num_runs * unitsize;
+		if (filter_out_len > filter_out_size) {
+			if (!(buf = g_try_realloc(filter_out, filter_out_len))) {
+				g_critical("Filter buffer malloc failed.");
+				break;
+			}
+			filter_out = buf;
+			filter_out_size = filter_out_len;
+		}
+
+		ret = sr_filter_run_into(filter, logic_rle->values,
+					 logic_rle->num_runs * sample_size,
+					 filter_out, &filter_out_len);
+		if (ret != SR_OK)
+			break;
+
+		rle.num_runs = logic_rle->num_runs;
+		rle.unitsize = unitsize;
+		rle.values = filter_out;
+		rle.lengths = logic_rle->lengths;
+
+		num_samples = 0;
+		for (run = 0; run < rle.num_runs; run++)
+			num_samples += rle.lengths[run];
+
+		/* Cut off the runs past the sample limit, if any. */
+		lengths = NULL;
+		if (limit_samples && received_samples + num_samples > limit_samples) {
+			num_samples = limit_samples - received_samples;
+			for (run = 0, n = 0; n + rle.lengths[run] < num_samples; run++)
+				n += rle.lengths[run];
+			if (!(lengths = g_try_malloc((run + 1) * sizeof(uint64_t)))) {
+				g_critical("Run length buffer malloc failed.");
+				break;
+			}
+			memcpy(lengths, rle.lengths, run * sizeof(uint64_t));
+			lengths[run] = num_samples - n;
+			rle.num_runs = run + 1;
+			rle.lengths = lengths;
+		}
+
+		if (save) {
+			/* saving to a session file, don't need to do anything else
+			 * to this data for now. */
+			if (sr_session_save_append_rle(save, &rle) != SR_OK)
+				sr_session_stop();
+		} else if (opt_pds) {
+			if (srd_session_send_rle(received_samples, rle.values,
+					rle.lengths, rle.num_runs) != SRD_OK)
+				sr_session_stop();
+		} else if (o->format->df_type == SR_DF_LOGIC) {
+			output_logic_rle(o, &rle, outfile);
+		}
+
+		g_free(lengths);
+		received_samples += num_samples;
+		break;
+
 	case SR_DF_META_ANALOG:
 		g_message("cli: Received SR_DF_META_ANALOG");
 		meta_analog = packet->payload;
@@ -606,13 +802,14 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* output file is in session format, which is
+				 * written out as the samples come in. */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
+				ret = sr_session_save_start(opt_output_file, dev,
+						unitsize, SR_SESSION_CODEC_BITPLANE,
+						&save);
 				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
+					printf("Failed to save session.\n");
 					exit(1);
 				}
 			} else {
@@ -898,9 +1095,10 @@ int setup_output_format(void)
 	return 0;
 }
 
-void show_pd_annotations(struct srd_proto_data *pdata, void *cb_data)
+void show_pd_annotations(struct srd_proto_data *pdata, unsigned int num_pdata,
+			 void *cb_data)
 {
-	int i;
+	unsigned int i, j;
 	char **annotations;
 	gpointer ann_format;
 
@@ -910,22 +1108,25 @@ void show_pd_annotations(struct srd_proto_data *pdata, void *cb_data)
 	if (!pd_ann_visible)
 		return;
 
-	if (!g_hash_table_lookup_extended(pd_ann_visible, pdata->pdo->di->inst_id,
-			NULL, &ann_format))
-		/* Not in the list of PDs whose annotations we're showing. */
-		return;
+	for (i = 0; i < num_pdata; i++) {
+		if (!g_hash_table_lookup_extended(pd_ann_visible,
+				pdata[i].pdo->di->inst_id, NULL, &ann_format))
+			/* Not in the list of PDs whose annotations we're showing. */
+			continue;
 
-	if (pdata->ann_format != GPOINTER_TO_INT(ann_format))
-		/* We don't want this particular format from the PD. */
-		return;
+		if (pdata[i].ann_format != GPOINTER_TO_INT(ann_format))
+			/* We don't want this particular format from the PD. */
+			continue;
 
-	annotations = pdata->data;
-	if (opt_loglevel > SR_LOG_WARN)
-		printf("%"PRIu64"-%"PRIu64" ", pdata->start_sample, pdata->end_sample);
-	printf("%s: ", pdata->pdo->proto_id);
-	for (i = 0; annotations[i]; i++)
-		printf("\"%s\" ", annotations[i]);
-	printf("\n");
+		annotations = pdata[i].data;
+		if (opt_loglevel > SR_LOG_WARN)
+			printf("%"PRIu64"-%"PRIu64" ", pdata[i].start_sample,
+			       pdata[i].end_sample);
+		printf("%s: ", pdata[i].pdo->proto_id);
+		for (j = 0; annotations[j]; j++)
+			printf("\"%s\" ", annotations[j]);
+		printf("\n");
+	}
 	fflush(stdout);
 }
 
@@ -1067,7 +1268,7 @@ static void load_input_file_format(void)
             return;
 
 	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_datafeed_callback_rle_add(datafeed_in);
 	if (sr_session_dev_add(in->vdev) != SR_OK) {
 		g_critical("Failed to use device.");
 		sr_session_destroy();
@@ -1075,10 +1276,7 @@ static void load_input_file_format(void)
 	}
 
 	input_format->loadfile(in, opt_input_file);
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	save_session_end();
 	sr_session_destroy();
 
 	if (fmtargs)
@@ -1090,10 +1288,11 @@ static void load_input_file(void)
 
 	if (sr_session_load(opt_input_file) == SR_OK) {
 		/* sigrok session file */
-		sr_session_datafeed_callback_add(datafeed_in);
+		sr_session_datafeed_callback_rle_add(datafeed_in);
 		sr_session_start();
 		sr_session_run();
 		sr_session_stop();
+		save_session_end();
 	}
 	else {
 		/* fall back on input modules */
@@ -1233,7 +1432,7 @@ static void run_session(void)
 	}
 
 	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_datafeed_callback_rle_add(datafeed_in);
 
 	if (sr_session_dev_add(dev) != SR_OK) {
 		g_critical("Failed to use device.");
@@ -1361,10 +1560,7 @@ static void run_session(void)
 	if (opt_continuous)
 		clear_anykey();
 
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	save_session_end();
 	sr_session_destroy();
 }
 
@@ -1418,7 +1614,7 @@ int main(int argc, char **argv)
 			return 1;
 		if (register_pds(NULL, opt_pds) != 0)
 			return 1;
-		if (srd_pd_output_callback_add(SRD_OUTPUT_ANN,
+		if (srd_pd_output_batch_callback_add(SRD_OUTPUT_ANN,
 				show_pd_annotations, NULL) != SRD_OK)
 			return 1;
 		if (setup_pd_stack() != 0)
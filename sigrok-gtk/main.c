@@ -38,12 +38,16 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 {
 	static int logic_probelist[SR_MAX_NUM_PROBES + 1] = { 0 };
 	static int unitsize = 0;
+	static struct sr_filter *filter = NULL;
+	static int filter_unitsize = 0;
+	static uint8_t *filter_out = NULL;
+	static uint64_t filter_out_size = 0;
 	struct sr_probe *probe;
 	struct sr_datafeed_logic *logic = NULL;
 	struct sr_datafeed_meta_logic *meta_logic;
 	int num_enabled_probes, sample_size, i;
 	uint64_t filter_out_len;
-	uint8_t *filter_out;
+	uint8_t *buf;
 	GArray *data;
 
 	switch (packet->type) {
@@ -54,6 +58,13 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		sigview_zoom(sigview, 1, 0);
 		g_message("fe: Received SR_DF_END");
 		sr_session_stop();
+		if (filter) {
+			sr_filter_destroy(filter);
+			filter = NULL;
+		}
+		g_free(filter_out);
+		filter_out = NULL;
+		filter_out_size = 0;
 		break;
 	case SR_DF_TRIGGER:
 		g_message("fe: received SR_DF_TRIGGER");
@@ -76,8 +87,14 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 						-1);
 			}
 		}
+		logic_probelist[num_enabled_probes] = 0;
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
+		/* The filter is compiled when the first logic packet arrives. */
+		if (filter) {
+			sr_filter_destroy(filter);
+			filter = NULL;
+		}
 		data = g_array_new(FALSE, FALSE, unitsize);
 		g_object_set_data(G_OBJECT(siglist), "sampledata", data);
 		break;
@@ -89,17 +106,33 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (!logic)
 			break;
 
-		if (sr_filter_probes(sample_size, unitsize, logic_probelist,
-					   logic->data, logic->length,
-					   &filter_out, &filter_out_len) != SR_OK)
+		if (!filter || filter_unitsize != sample_size) {
+			if (filter)
+				sr_filter_destroy(filter);
+			filter = NULL;
+			if (sr_filter_new(sample_size, unitsize, logic_probelist,
+					  &filter) != SR_OK)
+				break;
+			filter_unitsize = sample_size;
+		}
+
+		/* One scratch buffer, grown as needed, for the whole session. */
+		filter_out_len = logic->length / sample_size * unitsize;
+		if (filter_out_len > filter_out_size) {
+			if (!(buf = g_try_realloc(filter_out, filter_out_len)))
+				break;
+			filter_out = buf;
+			filter_out_size = filter_out_len;
+		}
+
+		if (sr_filter_run_into(filter, logic->data, logic->length,
+				       filter_out, &filter_out_len) != SR_OK)
 			break;
 
 		data = g_object_get_data(G_OBJECT(siglist), "sampledata");
 		g_return_if_fail(data != NULL);
 
 		g_array_append_vals(data, filter_out, filter_out_len/unitsize);
-
-		g_free(filter_out);
 		break;
 	default:
 		g_message("fw: received unknown packet type %d", packet->type);